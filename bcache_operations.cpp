@@ -1,4 +1,5 @@
 #include "bcache_operations.h"
+#include "maintboot_operations.h"
 #include <iostream>
 #include <memory>
 #include <string>
@@ -12,6 +13,23 @@
 
 namespace blocks {
 
+BCacheConversion bcache_conversion(BlockDevice& device) {
+    if (device.has_bcache_superblock()) {
+        return BCacheConversion::AlreadyBCache;
+    } else if (device.is_partition()) {
+        return BCacheConversion::Partition;
+    } else if (device.is_lv()) {
+        return BCacheConversion::LogicalVolume;
+    } else if (device.superblock_type() == "crypto_LUKS") {
+        return BCacheConversion::LUKS;
+    }
+    return BCacheConversion::Unsupported;
+}
+
+bool luks_has_room_for_bsb(const LUKS& luks) {
+    return luks.sb_end + LUKS_BSB_SIZE <= luks.offset;
+}
+
 std::unique_ptr<SyntheticDevice> make_bcache_sb(uint64_t bsb_size, uint64_t data_size, const std::string& join) {
     auto synth_device_ctx = blocks::synth_device(bsb_size, data_size);
     
@@ -32,58 +50,33 @@ std::unique_ptr<SyntheticDevice> make_bcache_sb(uint64_t bsb_size, uint64_t data
     
     assert(bcache_backing.offset == bsb_size);
     
-    // Create a copy of the synthetic device to return
-    auto result = std::make_unique<SyntheticDevice>((*synth_device_ctx)->devpath);
-    result->data = (*synth_device_ctx)->data;
-    result->writable_hdr_size = (*synth_device_ctx)->writable_hdr_size;
-    result->rz_size = (*synth_device_ctx)->rz_size;
-    result->writable_end_size = (*synth_device_ctx)->writable_end_size;
-    
-    return result;
+    // The data is only read back once the devices are gone
+    return synth_device_ctx->release();
 }
 
 int lv_to_bcache(BlockDevice device, bool debug, ProgressListener& progress, const std::string& join) {
-    // Get PE size from LVM
-    std::vector<std::string> cmd = {"lvm", "lvs", "--noheadings", "--rows", "--units=b", 
-                                   "--nosuffix", "-o", "vg_extent_size", "--"};
-    cmd.push_back(device.devpath);
-    
-    std::string output;
-    FILE* pipe = popen(cmd[0].c_str(), "r");
-    if (!pipe) {
-        std::cerr << "Error executing command" << std::endl;
-        return 1;
-    }
-    
-    char buffer[128];
-    while (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
-        output += buffer;
-    }
-    pclose(pipe);
-    
-    // Trim whitespace
-    output.erase(0, output.find_first_not_of(" \n\r\t"));
-    output.erase(output.find_last_not_of(" \n\r\t") + 1);
-    
-    uint64_t pe_size = std::stoull(output);
+    uint64_t pe_size = lvm_extent_size("lvs", device.devpath);
     
     assert(device.size() % pe_size == 0);
     uint64_t data_size = device.size() - pe_size;
     
     BlockStack block_stack = get_block_stack(device, progress);
     block_stack.read_superblocks();
+    block_stack.record_layer_sizes("before");
     block_stack.stack_reserve_end_area(data_size, progress);
+    block_stack.record_layer_sizes("after");
+    // The data comes back as a bcache device once the conversion is done
+    ScopedTimer offline(Metrics::instance().offline_seconds);
     block_stack.deactivate();
     
     auto fd = device.open_excl_ctx();
     auto synth_bdev = make_bcache_sb(pe_size, data_size, join);
     
-    std::cout << "Copying the bcache superblock... ";
-    std::cout.flush();
+    log_progress() << "Copying the bcache superblock... ";
     
     synth_bdev->copy_to_physical(fd, -pe_size);
     
-    std::cout << "ok" << std::endl;
+    log_info() << "ok";
     
     // Rotate LV
     std::vector<std::string> rotate_cmd = {"lvm", "lvs", "--noheadings", "--rows", "--units=b", 
@@ -91,12 +84,14 @@ int lv_to_bcache(BlockDevice device, bool debug, ProgressListener& progress, con
     rotate_cmd.push_back(device.devpath);
     
     std::string lv_info;
-    pipe = popen(rotate_cmd[0].c_str(), "r");
+    SubprocessTimer rotate_timer(rotate_cmd[0]);
+    FILE* pipe = popen(rotate_cmd[0].c_str(), "r");
     if (!pipe) {
-        std::cerr << "Error executing command" << std::endl;
+        log_error() << "Error executing command";
         return 1;
     }
     
+    char buffer[128];
     while (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
         lv_info += buffer;
     }
@@ -119,24 +114,22 @@ int lv_to_bcache(BlockDevice device, bool debug, ProgressListener& progress, con
     char temp_dir[] = "/tmp/blocks.XXXXXX";
     char* temp_dir_path = mkdtemp(temp_dir);
     if (!temp_dir_path) {
-        std::cerr << "Failed to create temporary directory" << std::endl;
+        log_error() << "Failed to create temporary directory";
         return 1;
     }
     
     std::string vgcfgname = std::string(temp_dir_path) + "/vg.cfg";
     
-    std::cout << "Loading LVM metadata... ";
-    std::cout.flush();
+    log_progress() << "Loading LVM metadata... ";
     
     quiet_call({"lvm", "vgcfgbackup", "--file", vgcfgname, "--", vgname});
     
     // We would need to implement the Augeas functionality here
     // For now, we'll use a direct approach with LVM commands
     
-    std::cout << "ok" << std::endl;
+    log_info() << "ok";
     
-    std::cout << "Rotating the last extent to be the first... ";
-    std::cout.flush();
+    log_progress() << "Rotating the last extent to be the first... ";
     
     // Use lvresize to achieve the rotation effect
     quiet_call({"lvm", "lvchange", "--refresh", "--", vgname + "/" + lvname});
@@ -145,7 +138,7 @@ int lv_to_bcache(BlockDevice device, bool debug, ProgressListener& progress, con
         quiet_call({"lvm", "lvchange", "-ay", "--", vgname + "/" + lvname});
     }
     
-    std::cout << "ok" << std::endl;
+    log_info() << "ok";
     
     // Clean up
     std::filesystem::remove_all(temp_dir_path);
@@ -155,43 +148,42 @@ int lv_to_bcache(BlockDevice device, bool debug, ProgressListener& progress, con
 
 int luks_to_bcache(BlockDevice device, bool debug, ProgressListener& progress, const std::string& join) {
     LUKS luks(device);
+    ScopedTimer offline(Metrics::instance().offline_seconds);
     luks.deactivate();
     
     auto dev_fd = device.open_excl();
     luks.read_superblock();
     luks.read_superblock_ll(dev_fd);
     
-    // The smallest and most compatible bcache offset
-    uint64_t shift_by = 512 * 16;
-    assert(luks.sb_end + shift_by <= luks.offset);
+    uint64_t shift_by = LUKS_BSB_SIZE;
+    if (!luks_has_room_for_bsb(luks)) {
+        close(dev_fd);
+        log_error() << "No room between the LUKS superblock and its payload on " << device.devpath;
+        return 1;
+    }
     
     uint64_t data_size = device.size() - shift_by;
     auto synth_bdev = make_bcache_sb(shift_by, data_size, join);
     
     // XXX not atomic
-    std::cout << "Shifting and editing the LUKS superblock... ";
-    std::cout.flush();
+    log_progress() << "Shifting and editing the LUKS superblock... ";
     
     luks.shift_sb(dev_fd, shift_by);
     
-    std::cout << "ok" << std::endl;
+    log_info() << "ok";
     
-    std::cout << "Copying the bcache superblock... ";
-    std::cout.flush();
+    log_progress() << "Copying the bcache superblock... ";
     
     synth_bdev->copy_to_physical(dev_fd);
     close(dev_fd);
     
-    std::cout << "ok" << std::endl;
+    log_info() << "ok";
     
     return 0;
 }
 
 int part_to_bcache(BlockDevice device, bool debug, ProgressListener& progress, const std::string& join) {
-    // Detect the alignment parted would use?
-    // I don't think it can be greater than 1MiB, in which case
-    // there is no need.
-    uint64_t bsb_size = 1024 * 1024;
+    uint64_t bsb_size = PART_BSB_SIZE;
     uint64_t data_size = device.size();
     
     auto [ptable, part_start] = device.ptable_context();
@@ -204,7 +196,7 @@ int part_to_bcache(BlockDevice device, bool debug, ProgressListener& progress, c
     }
     
     if (!parted_part) {
-        std::cerr << "Failed to get partition information" << std::endl;
+        log_error() << "Failed to get partition information";
         return 1;
     }
     
@@ -223,7 +215,7 @@ int part_to_bcache(BlockDevice device, bool debug, ProgressListener& progress, c
     }
     
     if (!write_part) {
-        std::cerr << "Failed to get partition at new start position" << std::endl;
+        log_error() << "Failed to get partition at new start position";
         return 1;
     }
     
@@ -236,24 +228,22 @@ int part_to_bcache(BlockDevice device, bool debug, ProgressListener& progress, c
     
     auto synth_bdev = make_bcache_sb(bsb_size, data_size, join);
     
-    std::cout << "Copying the bcache superblock... ";
-    std::cout.flush();
+    log_progress() << "Copying the bcache superblock... ";
     
     synth_bdev->copy_to_physical(dev_fd, write_offset, 0, true);
     close(dev_fd);
     
-    std::cout << "ok" << std::endl;
+    log_info() << "ok";
     
     // Check the partition we're about to convert isn't in use either,
     // otherwise the partition table couldn't be reloaded.
     auto fd = device.open_excl_ctx();
     
-    std::cout << "Shifting partition to start on the bcache superblock... ";
-    std::cout.flush();
+    log_progress() << "Shifting partition to start on the bcache superblock... ";
     
     ptable.shift_left(part_start, part_start1);
     
-    std::cout << "ok" << std::endl;
+    log_info() << "ok";
     device.reset_size();
     
     return 0;
@@ -261,7 +251,7 @@ int part_to_bcache(BlockDevice device, bool debug, ProgressListener& progress, c
 
 int cmd_to_bcache(int argc, char* argv[]) {
     if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " to-bcache [options] device" << std::endl;
+        log_error() << "Usage: " << argv[0] << " to-bcache [options] device";
         return 1;
     }
     
@@ -285,34 +275,48 @@ int cmd_to_bcache(int argc, char* argv[]) {
     }
     
     if (device_path.empty()) {
-        std::cerr << "No device specified" << std::endl;
+        log_error() << "No device specified";
         return 1;
     }
     
-    BlockDevice device(device_path);
+    CommandArgs args;
+    args.device = device_path;
+    args.debug = debug;
+    args.join = join;
+    args.maintboot = maintboot;
+    return cmd_to_bcache(args);
+}
+
+int cmd_to_bcache(const CommandArgs& args) {
+    BlockDevice device(args.device);
     CLIProgressHandler progress;
-    
-    if (device.has_bcache_superblock()) {
-        std::cerr << "Device " << device_path << " already has a bcache super block." << std::endl;
+
+    BCacheConversion conversion = bcache_conversion(device);
+    if (conversion == BCacheConversion::AlreadyBCache) {
+        log_error() << "Device " << device.devpath << " already has a bcache super block.";
         return 1;
     }
-    
+
     BCacheReq::require(progress);
-    
-    int result = 1;
-    
-    if (device.is_partition()) {
-        result = part_to_bcache(device, debug, progress, join);
-    } else if (device.is_lv()) {
-        result = lv_to_bcache(device, debug, progress, join);
-    } else if (device.superblock_type() == "crypto_LUKS") {
-        result = luks_to_bcache(device, debug, progress, join);
-    } else {
-        std::cerr << "Device " << device_path << " is not a partition, a logical volume, or a LUKS volume" << std::endl;
-        return 1;
+
+    if (args.maintboot) {
+        return call_maintboot(device, "to-bcache", {
+                {"debug", args.debug ? "true" : "false"},
+                {"join", args.join}
+        });
+    }
+    switch (conversion) {
+        case BCacheConversion::Partition:
+            return part_to_bcache(device, args.debug, progress, args.join);
+        case BCacheConversion::LogicalVolume:
+            return lv_to_bcache(device, args.debug, progress, args.join);
+        case BCacheConversion::LUKS:
+            return luks_to_bcache(device, args.debug, progress, args.join);
+        default:
+            log_error() << "Device " << device.devpath
+                      << " is not a partition, a logical volume, or a LUKS volume";
+            return 1;
     }
-    
-    return result;
 }
 
 } // namespace blocks
@@ -6,11 +6,32 @@
 #include "block_stack.h"
 #include "synthetic_device.h"
 #include "container.h"
+#include "lvm_operations.h"
 #include <memory>
 #include <string>
 
 namespace blocks {
 
+// How to-bcache makes room for a bcache superblock in front of the
+// data, decided the same way for the command and its plan
+enum class BCacheConversion {
+    AlreadyBCache,
+    Partition,      // Moves the partition start back by PART_BSB_SIZE
+    LogicalVolume,  // Rotates the last extent to be the first
+    LUKS,           // Shifts the LUKS superblock by LUKS_BSB_SIZE
+    Unsupported,
+};
+BCacheConversion bcache_conversion(BlockDevice& device);
+
+// Partitions are aligned to 1MiB at most, so this keeps them aligned
+constexpr uint64_t PART_BSB_SIZE = 1024 * 1024;
+// The smallest and most compatible bcache offset
+constexpr uint64_t LUKS_BSB_SIZE = 512 * 16;
+
+// Whether the LUKS superblock can move by LUKS_BSB_SIZE without
+// running into the payload; needs read_superblock_ll
+bool luks_has_room_for_bsb(const LUKS& luks);
+
 // Create a bcache superblock with the specified parameters
 std::unique_ptr<SyntheticDevice> make_bcache_sb(uint64_t bsb_size, uint64_t data_size, const std::string& join);
 
@@ -25,6 +46,7 @@ int part_to_bcache(BlockDevice device, bool debug, ProgressListener& progress, c
 
 // Command handler for bcache conversion
 int cmd_to_bcache(int argc, char* argv[]);
+int cmd_to_bcache(const CommandArgs& args);
 
 } // namespace blocks
 
@@ -0,0 +1,284 @@
+// Measures what blocks itself costs per command: wall time and the
+// number of processes it starts, against image files in a fake /sys,
+// /proc and /dev with the stand-in tools from tools/standin. Needs no
+// root and no devices, only mke2fs and mkswap to build the images.
+//
+//   orchestration_bench --blocks build/blocks [--iterations N]
+//                       [--baseline bench/process_counts.json] [--json]
+//
+// With a baseline, exits 1 when a scenario starts more processes than
+// the baseline allows, so CI catches a probe that stopped being cached.
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+#ifndef BLOCKS_SOURCE_DIR
+#define BLOCKS_SOURCE_DIR "."
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+
+struct Scenario {
+    std::string name;
+    // Alternated between iterations, so resizes go back and forth
+    std::vector<std::vector<std::string>> argvs;
+};
+
+struct Result {
+    std::string name;
+    std::vector<double> millis;
+    uint64_t processes = 0;  // Per run, from the metrics file
+    bool failed = false;
+};
+
+void write_file(const fs::path& path, const std::string& content) {
+    fs::create_directories(path.parent_path());
+    std::ofstream out(path);
+    out << content;
+    if (!out) {
+        throw std::runtime_error("Failed to write " + path.string());
+    }
+}
+
+// Runs argv with stdout and stderr discarded, returns the exit status
+int run(const std::vector<std::string>& argv, const std::vector<std::string>& env = {}) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw std::runtime_error(std::string("fork failed: ") + std::strerror(errno));
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_RDWR);
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        for (const auto& assignment : env) {
+            auto eq = assignment.find('=');
+            setenv(assignment.substr(0, eq).c_str(), assignment.substr(eq + 1).c_str(), 1);
+        }
+        std::vector<char*> args;
+        for (const auto& arg : argv) {
+            args.push_back(const_cast<char*>(arg.c_str()));
+        }
+        args.push_back(nullptr);
+        execvp(args[0], args.data());
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            throw std::runtime_error(std::string("waitpid failed: ") + std::strerror(errno));
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+void require(const std::vector<std::string>& argv) {
+    if (run(argv) != 0) {
+        throw std::runtime_error("Failed to run " + argv[0]);
+    }
+}
+
+// A device in the fake sysfs: <sys>/class/block/<name> with its number,
+// and the /sys/dev/block link to it
+void add_sysfs_device(const fs::path& sys, const std::string& name, const std::string& devnum,
+                      const std::string& parent = "", uint64_t start_sector = 0) {
+    fs::path dir = parent.empty() ? sys / "class/block" / name : sys / "class/block" / parent / name;
+    write_file(dir / "dev", devnum + "\n");
+    write_file(dir / "uevent", "DEVNAME=" + name + "\n");
+    if (!parent.empty()) {
+        write_file(dir / "partition", "1\n");
+        write_file(dir / "start", std::to_string(start_sector) + "\n");
+        fs::create_directory_symlink(fs::path(parent) / name, sys / "class/block" / name);
+    }
+    fs::create_directories(sys / "dev/block");
+    fs::create_directory_symlink(fs::relative(dir, sys / "dev/block"), sys / "dev/block" / devnum);
+}
+
+// Images with fixed UUIDs and timestamps, so every run sees the same bytes
+void make_images(const fs::path& dev) {
+    fs::create_directories(dev);
+    setenv("E2FSPROGS_FAKE_TIME", "1700000000", 1);
+    require({"mke2fs", "-q", "-F", "-t", "ext4", "-L", "bench", "-U", "6c1e0a52-3a37-4c4b-9f3f-2b1d6f3e9a10",
+             "-E", "hash_seed=6c1e0a52-3a37-4c4b-9f3f-2b1d6f3e9a10", (dev / "sdb").string(), "48M"});
+    require({"mke2fs", "-q", "-F", "-t", "ext4", "-L", "part", "-U", "0b5e7c1d-8d7e-4a59-a1f2-9c4e3d2b1a00",
+             "-E", "hash_seed=0b5e7c1d-8d7e-4a59-a1f2-9c4e3d2b1a00", (dev / "sdc1").string(), "64M"});
+    require({"truncate", "-s", "32M", (dev / "sdd").string()});
+    require({"mkswap", "-L", "benchswap", "-U", "3eb3a5d6-6b27-43e7-ae9e-ba45710b5cb7", (dev / "sdd").string()});
+    // The disk around sdc1; blocks only reads its partition table type
+    require({"truncate", "-s", "65M", (dev / "sdc").string()});
+}
+
+fs::path make_root() {
+    char pattern[] = "/tmp/blocks-bench.XXXXXX";
+    if (!mkdtemp(pattern)) {
+        throw std::runtime_error(std::string("mkdtemp failed: ") + std::strerror(errno));
+    }
+    fs::path root = pattern;
+    fs::path sys = root / "sys";
+    add_sysfs_device(sys, "sdb", "8:16");
+    add_sysfs_device(sys, "sdc", "8:32");
+    add_sysfs_device(sys, "sdc1", "8:33", "sdc", 2048);
+    add_sysfs_device(sys, "sdd", "8:48");
+    write_file(root / "proc/self/mountinfo", "");
+    write_file(root / "proc/swaps", "Filename\t\t\t\tType\t\tSize\t\tUsed\t\tPriority\n");
+    make_images(root / "dev");
+    return root;
+}
+
+std::vector<Scenario> scenarios(const fs::path& dev) {
+    std::string sdb = (dev / "sdb").string();
+    std::string sdc1 = (dev / "sdc1").string();
+    std::string sdd = (dev / "sdd").string();
+    return {
+        {"plan-resize-ext4", {{"--plan", "resize", sdb, "40m"}}},
+        {"plan-to-lvm", {{"--plan", "to-lvm", sdc1}}},
+        {"plan-to-bcache", {{"--plan", "to-bcache", sdc1}}},
+        {"resize-swap", {{"resize", sdd, "16m"}, {"resize", sdd, "32m"}}},
+        // Includes resize2fs's own time, the only real tool run here
+        {"resize-ext4", {{"resize", sdb, "40m"}, {"resize", sdb, "48m"}}},
+    };
+}
+
+Result run_scenario(const Scenario& scenario, const std::string& blocks, const fs::path& root, int iterations) {
+    Result result;
+    result.name = scenario.name;
+    fs::path metrics = root / ("metrics-" + scenario.name + ".json");
+    std::vector<std::string> env = {
+        "BLOCKS_SYSFS_ROOT=" + (root / "sys").string(),
+        "BLOCKS_PROC_ROOT=" + (root / "proc").string(),
+        "BLOCKS_DEV_ROOT=" + (root / "dev").string(),
+        "BLOCKS_TOOL_DIR=" BLOCKS_SOURCE_DIR "/tools/standin",
+    };
+
+    for (int i = 0; i < iterations; ++i) {
+        std::vector<std::string> argv = {blocks, "--metrics-file", metrics.string()};
+        const auto& args = scenario.argvs[i % scenario.argvs.size()];
+        argv.insert(argv.end(), args.begin(), args.end());
+
+        auto start = std::chrono::steady_clock::now();
+        int status = run(argv, env);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        if (status != 0) {
+            result.failed = true;
+            return result;
+        }
+        result.millis.push_back(std::chrono::duration<double, std::milli>(elapsed).count());
+
+        auto report = nlohmann::json::parse(std::ifstream(metrics));
+        uint64_t processes = 0;
+        for (const auto& [tool, histogram] : report["subprocesses"].items()) {
+            processes += histogram["count"].get<uint64_t>();
+        }
+        // Resizes alternate between two directions that may differ
+        result.processes = std::max(result.processes, processes);
+    }
+    return result;
+}
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t index = std::min(values.size() - 1, static_cast<size_t>(p * (values.size() - 1) + 0.5));
+    return values[index];
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string blocks = "./blocks";
+    std::string baseline_path;
+    int iterations = 20;
+    bool json = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--blocks" && i + 1 < argc) {
+            blocks = argv[++i];
+        } else if (arg == "--iterations" && i + 1 < argc) {
+            iterations = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--baseline" && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (arg == "--json") {
+            json = true;
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--blocks PATH] [--iterations N] [--baseline FILE] [--json]" << std::endl;
+            return 2;
+        }
+    }
+    blocks = fs::absolute(blocks).string();
+
+    nlohmann::json baseline = nlohmann::json::object();
+    if (!baseline_path.empty()) {
+        baseline = nlohmann::json::parse(std::ifstream(baseline_path));
+    }
+
+    fs::path root;
+    std::vector<Result> results;
+    try {
+        root = make_root();
+        for (const auto& scenario : scenarios(root / "dev")) {
+            results.push_back(run_scenario(scenario, blocks, root, iterations));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        if (!root.empty()) {
+            fs::remove_all(root);
+        }
+        return 2;
+    }
+    fs::remove_all(root);
+
+    int status = 0;
+    nlohmann::json report = nlohmann::json::array();
+    if (!json) {
+        std::cout << std::left << std::setw(20) << "scenario" << std::right << std::setw(12) << "median ms"
+                  << std::setw(12) << "p90 ms" << std::setw(12) << "processes" << std::endl;
+    }
+    for (const auto& result : results) {
+        bool regressed = baseline.contains(result.name) && result.processes > baseline[result.name].get<uint64_t>();
+        if (result.failed || regressed) {
+            status = 1;
+        }
+        if (json) {
+            report.push_back({{"scenario", result.name}, {"failed", result.failed},
+                              {"median_ms", percentile(result.millis, 0.5)},
+                              {"p90_ms", percentile(result.millis, 0.9)},
+                              {"processes", result.processes}, {"regressed", regressed}});
+            continue;
+        }
+        std::cout << std::left << std::setw(20) << result.name << std::right << std::fixed << std::setprecision(2);
+        if (result.failed) {
+            std::cout << std::setw(36) << "FAILED" << std::endl;
+            continue;
+        }
+        std::cout << std::setw(12) << percentile(result.millis, 0.5) << std::setw(12)
+                  << percentile(result.millis, 0.9) << std::setw(12) << result.processes;
+        if (regressed) {
+            std::cout << "  (baseline " << baseline[result.name].get<uint64_t>() << ")";
+        }
+        std::cout << std::endl;
+    }
+    if (json) {
+        std::cout << report.dump(2) << std::endl;
+    }
+    return status;
+}
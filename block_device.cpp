@@ -1,4 +1,7 @@
 #include "block_device.h"
+#include "layer_types.h"
+#include "probe_cache.h"
+#include "uuid_index.h"
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -10,44 +13,129 @@
 #include <array>
 #include <memory>
 #include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 namespace blocks {
 
     BlockDevice::BlockDevice(const std::string& devpath) :
             devpath(devpath),
-            _ptable_type(&BlockDevice::ptable_type, "ptable_type"),
-            _superblock_type(&BlockDevice::superblock_type, "superblock_type"),
-            _has_bcache_superblock(&BlockDevice::has_bcache_superblock, "has_bcache_superblock"),
-            _size(&BlockDevice::size, "size"),
-            _is_dm(&BlockDevice::is_dm, "is_dm"),
-            _is_lv(&BlockDevice::is_lv, "is_lv"),
-            _is_partition(&BlockDevice::is_partition, "is_partition")
+            state(DeviceRegistry::instance().state_for(devpath)),
+            _ptable_type(&BlockDevice::probe_ptable_type, "ptable_type"),
+            _superblock_type(&BlockDevice::probe_superblock_type, "superblock_type"),
+            _has_bcache_superblock(&BlockDevice::probe_bcache_superblock, "has_bcache_superblock"),
+            _size(&BlockDevice::probe_size, "size"),
+            _is_dm(&BlockDevice::probe_is_dm, "is_dm"),
+            _is_lv(&BlockDevice::probe_is_lv, "is_lv"),
+            _dm_table(&BlockDevice::probe_dm_table, "dm_table"),
+            _is_partition(&BlockDevice::probe_is_partition, "is_partition"),
+            _probe_window(&BlockDevice::read_probe_window, "probe_window")
     {
-        assert(std::filesystem::exists(devpath));
+        // An empty devpath stands for "no device", see LUKS::snoop_activated
+        assert(devpath.empty() || std::filesystem::exists(devpath));
     }
 
-BlockDevice BlockDevice::by_uuid(const std::string& uuid) {
-    std::array<char, 256> buffer;
-    std::string cmd = "blkid -U " + uuid;
-    
-    FILE* pipe = popen(cmd.c_str(), "r");
-    if (!pipe) {
-        throw std::runtime_error("Failed to execute blkid command");
+void DeviceState::clear() {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    memoized_strings.clear();
+    memoized_uint64.clear();
+    memoized_bools.clear();
+    memoized_buffers.clear();
+    window_hash = 0;
+}
+
+DeviceRegistry& DeviceRegistry::instance() {
+    static DeviceRegistry registry;
+    return registry;
+}
+
+std::shared_ptr<DeviceState> DeviceRegistry::state_for(const std::string& devpath) {
+    // stat follows /dev/mapper and /dev/disk/by-* symlinks
+    struct stat st;
+    if (devpath.empty() || ::stat(devpath.c_str(), &st) != 0) {
+        return std::make_shared<DeviceState>();
     }
-    
-    std::string result;
-    while (fgets(buffer.data(), buffer.size(), pipe) != nullptr) {
-        result += buffer.data();
+
+    std::string key;
+    if (S_ISBLK(st.st_mode)) {
+        key = std::to_string(major(st.st_rdev)) + ":" + std::to_string(minor(st.st_rdev));
+        // Partitions share their disk's sequence number
+        std::string sysdir = sys_path("dev/block/" + key);
+        std::ifstream diskseq(sysdir + "/diskseq");
+        if (!diskseq) {
+            diskseq.open(sysdir + "/../diskseq");
+        }
+        std::string seq;
+        if (std::getline(diskseq, seq)) {
+            key += "@" + seq;
+        }
+    } else {
+        // Image files
+        key = "file:" + std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino);
     }
-    
-    pclose(pipe);
-    
-    // Remove trailing newline if present
-    if (!result.empty() && result.back() == '\n') {
-        result.pop_back();
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto& state = states[key];
+    if (!state) {
+        state = std::make_shared<DeviceState>();
+        state->dev = S_ISBLK(st.st_mode) ? st.st_rdev : 0;
+        state->key = key;
+        state->devpath = devpath;
+        ProbeCache::instance().restore(key, *state);
     }
-    
-    return BlockDevice(result);
+    return state;
+}
+
+std::vector<std::shared_ptr<DeviceState>> DeviceRegistry::states_snapshot() {
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<std::shared_ptr<DeviceState>> snapshot;
+    for (const auto& [key, state] : states) {
+        snapshot.push_back(state);
+    }
+    return snapshot;
+}
+
+void DeviceRegistry::invalidate(dev_t dev) {
+    std::vector<std::string> keys;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto it = states.begin(); it != states.end();) {
+            if (it->second->dev == dev) {
+                it->second->clear();
+                keys.push_back(it->first);
+                it = states.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    // Not under the registry lock, save takes the two the other way round
+    for (const auto& key : keys) {
+        ProbeCache::instance().forget(key);
+    }
+}
+
+void DeviceRegistry::invalidate_all() {
+    std::vector<std::string> keys;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto& [key, state] : states) {
+            state->clear();
+            keys.push_back(key);
+        }
+        states.clear();
+    }
+    for (const auto& key : keys) {
+        ProbeCache::instance().forget(key);
+    }
+}
+
+BlockDevice BlockDevice::by_uuid(const std::string& uuid) {
+    auto devpath = UuidIndex::instance().find(uuid);
+    if (!devpath) {
+        throw std::runtime_error("No block device with UUID " + uuid);
+    }
+    return BlockDevice(*devpath);
 }
 
 int BlockDevice::open_excl() {
@@ -67,6 +155,10 @@ BlockDevice::ExclusiveFileDescriptor BlockDevice::open_excl_ctx() {
 }
 
 std::string BlockDevice::ptable_type() {
+    return _ptable_type.get(this, state->memoized_strings, state->lock);
+}
+
+std::string BlockDevice::probe_ptable_type() {
     // TODO: also detect an MBR other than protective,
     // and refuse to edit that.
     std::vector<std::string> cmd = {"blkid", "-p", "-o", "value", "-s", "PTTYPE", "--", devpath};
@@ -74,6 +166,7 @@ std::string BlockDevice::ptable_type() {
     std::array<char, 256> buffer;
     std::string result;
     
+    SubprocessTimer timer("blkid -p -o value -s PTTYPE -- " + devpath);
     FILE* pipe = popen(("blkid -p -o value -s PTTYPE -- " + devpath).c_str(), "r");
     if (!pipe) {
         throw std::runtime_error("Failed to execute blkid command");
@@ -92,12 +185,22 @@ std::string BlockDevice::ptable_type() {
 }
 
 std::string BlockDevice::superblock_type() {
+    return _superblock_type.get(this, state->memoized_strings, state->lock);
+}
+
+std::string BlockDevice::probe_superblock_type() {
+    std::optional<FsIdentity> identity;
+    if (const LayerType* type = match_layer_type(*probe_window(), &identity)) {
+        return identity ? identity->type : std::string(type->name);
+    }
+    // Anything LAYER_TYPES doesn't know, for the error messages
     return superblock_at(0);
 }
 
 std::string BlockDevice::superblock_at(uint64_t offset) {
     std::string cmd = "blkid -p -o value -s TYPE -O " + std::to_string(offset) + " -- " + devpath;
     
+    SubprocessTimer timer(cmd);
     FILE* pipe = popen(cmd.c_str(), "r");
     if (!pipe) {
         throw std::runtime_error("Failed to execute blkid command");
@@ -124,72 +227,102 @@ std::string BlockDevice::superblock_at(uint64_t offset) {
 }
 
 bool BlockDevice::has_bcache_superblock() {
-    // blkid doesn't detect bcache, so special-case it.
+    return _has_bcache_superblock.get(this, state->memoized_bools, state->lock);
+}
+
+bool BlockDevice::probe_bcache_superblock() {
+    // Older blkid doesn't detect bcache, so don't rely on superblock_type.
     // To keep dependencies light, don't use bcache-tools for detection,
     // only require the tools after a successful detection.
     if (size() <= 8192) {
         return false;
     }
-    
-    int sbfd = ::open(devpath.c_str(), O_RDONLY);
-    if (sbfd < 0) {
-        throw std::runtime_error("Failed to open device for bcache detection");
-    }
-    
-    std::array<uint8_t, 16> magic;
-    ssize_t bytes_read = ::pread(sbfd, magic.data(), magic.size(), 4096 + 24);
-    ::close(sbfd);
-    
-    if (bytes_read != static_cast<ssize_t>(magic.size())) {
-        return false;
-    }
-    
-    return std::memcmp(magic.data(), BCACHE_MAGIC.data(), magic.size()) == 0;
+    return signature_matches(*find_layer_type("bcache"), *probe_window());
 }
 
 uint64_t BlockDevice::size() {
-    std::string cmd = "blockdev --getsize64 " + devpath;
-    
-    FILE* pipe = popen(cmd.c_str(), "r");
-    if (!pipe) {
-        throw std::runtime_error("Failed to execute blockdev command");
+    return _size.get(this, state->memoized_uint64, state->lock);
+}
+
+uint64_t BlockDevice::probe_size() {
+    // BLKGETSIZE64 rather than blockdev, which the maintenance image lacks
+    int fd = ::open(devpath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open " + devpath + ": " + std::strerror(errno));
     }
-    
-    std::array<char, 256> buffer;
-    std::string result;
-    
-    if (fgets(buffer.data(), buffer.size(), pipe) != nullptr) {
-        result = buffer.data();
-        // Remove trailing newline if present
-        if (!result.empty() && result.back() == '\n') {
-            result.pop_back();
-        }
+
+    uint64_t size_value = 0;
+    struct stat st;
+    int ret = ::fstat(fd, &st);
+    if (ret == 0 && S_ISREG(st.st_mode)) {
+        // Image files stand in for devices under BLOCKS_DEV_ROOT
+        size_value = st.st_size;
+    } else if (ret == 0) {
+        ret = ioctl(fd, BLKGETSIZE64, &size_value);
+    }
+    int err = errno;
+    ::close(fd);
+
+    if (ret != 0) {
+        throw std::runtime_error("Failed to get the size of " + devpath + ": " + std::strerror(err));
     }
-    
-    pclose(pipe);
-    
-    uint64_t size_value = std::stoull(result);
     assert(size_value % 512 == 0);
     return size_value;
 }
 
 void BlockDevice::reset_size() {
-    _size.reset(this, memoized_uint64);
+    _size.reset(this, state->memoized_uint64, state->lock);
 }
 
-std::string BlockDevice::sysfspath() {
-    // pyudev would also work
-    struct stat st;
-    if (::stat(devpath.c_str(), &st) != 0) {
-        throw std::runtime_error("Failed to stat device " + devpath);
+ProbeWindow BlockDevice::probe_window() {
+    return _probe_window.get(this, state->memoized_buffers, state->lock);
+}
+
+void BlockDevice::reset_probe_window() {
+    _probe_window.reset(this, state->memoized_buffers, state->lock);
+}
+
+ProbeWindow BlockDevice::read_probe_window() {
+    int fd = ::open(devpath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open " + devpath + ": " + std::strerror(errno));
     }
-    
-    if (!S_ISBLK(st.st_mode)) {
-        throw std::runtime_error(devpath + " is not a block device");
+
+    // Small devices just get a shorter window
+    std::vector<uint8_t> window(PROBE_WINDOW_SIZE);
+    size_t filled = 0;
+    while (filled < window.size()) {
+        ssize_t len = pread(fd, window.data() + filled, window.size() - filled, filled);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            break;
+        }
+        filled += len;
     }
-    
+    ::close(fd);
+    Metrics::instance().bytes_read.add(filled);
+
+    window.resize(filled);
+
+    // Memos restored from the probe cache belong to the window it saw
+    if (state->window_hash) {
+        if (fnv1a_64(window.data(), window.size()) != state->window_hash) {
+            log_debug() << "Probe window of " << devpath << " changed, dropping cached probes";
+            state->memoized_strings.clear();
+            state->memoized_uint64.clear();
+            state->memoized_bools.clear();
+        }
+        state->window_hash = 0;
+    }
+    return std::make_shared<const std::vector<uint8_t>>(std::move(window));
+}
+
+std::string BlockDevice::sysfspath() {
+    // pyudev would also work
     auto [major, minor] = devnum();
-    return "/sys/dev/block/" + std::to_string(major) + ":" + std::to_string(minor);
+    return sys_path("dev/block/" + std::to_string(major) + ":" + std::to_string(minor));
 }
 
 std::pair<int, int> BlockDevice::devnum() {
@@ -199,6 +332,17 @@ std::pair<int, int> BlockDevice::devnum() {
     }
     
     if (!S_ISBLK(st.st_mode)) {
+        // An image file standing in for a device of a fake /dev,
+        // numbered by the fake sysfs
+        if (S_ISREG(st.st_mode) && HostPaths::instance().is_fake()) {
+            std::string name = std::filesystem::path(devpath).filename().string();
+            std::ifstream dev_file(sys_path("class/block/" + name + "/dev"));
+            int major_num, minor_num;
+            char colon;
+            if (dev_file >> major_num >> colon >> minor_num && colon == ':') {
+                return {major_num, minor_num};
+            }
+        }
         throw std::runtime_error(devpath + " is not a block device");
     }
     
@@ -214,17 +358,25 @@ std::vector<BlockDevice> BlockDevice::iter_holders() {
     }
     
     for (const auto& entry : std::filesystem::directory_iterator(holders_path)) {
-        holders.emplace_back("/dev/" + entry.path().filename().string());
+        holders.emplace_back(dev_path(entry.path().filename().string()));
     }
     
     return holders;
 }
 
 bool BlockDevice::is_dm() {
+    return _is_dm.get(this, state->memoized_bools, state->lock);
+}
+
+bool BlockDevice::probe_is_dm() {
     return std::filesystem::exists(sysfspath() + "/dm");
 }
 
 bool BlockDevice::is_lv() {
+    return _is_lv.get(this, state->memoized_bools, state->lock);
+}
+
+bool BlockDevice::probe_is_lv() {
     if (!is_dm()) {
         return false;
     }
@@ -233,6 +385,7 @@ bool BlockDevice::is_lv() {
         std::string cmd = "lvm lvs --noheadings --rows --units=b --nosuffix "
                           "-o vg_extent_size -- " + devpath;
         
+        SubprocessTimer timer(cmd);
         FILE* pipe = popen(cmd.c_str(), "r");
         if (!pipe) {
             return false;
@@ -263,8 +416,17 @@ bool BlockDevice::is_lv() {
 }
 
 std::string BlockDevice::dm_table() {
+    return _dm_table.get(this, state->memoized_strings, state->lock);
+}
+
+void BlockDevice::reset_dm_table() {
+    _dm_table.reset(this, state->memoized_strings, state->lock);
+}
+
+std::string BlockDevice::probe_dm_table() {
     std::string cmd = "dmsetup table -- " + devpath;
     
+    SubprocessTimer timer(cmd);
     FILE* pipe = popen(cmd.c_str(), "r");
     if (!pipe) {
         throw std::runtime_error("Failed to execute dmsetup command");
@@ -284,6 +446,7 @@ std::string BlockDevice::dm_table() {
 void BlockDevice::dm_deactivate() {
     std::vector<std::string> cmd = {"dmsetup", "remove", "--", devpath};
     quiet_call(cmd);
+    state->clear();
 }
 
 void BlockDevice::dm_setup(const std::string& table, bool readonly) {
@@ -293,9 +456,14 @@ void BlockDevice::dm_setup(const std::string& table, bool readonly) {
     }
     
     quiet_call(cmd, table);
+    state->clear();
 }
 
 bool BlockDevice::is_partition() {
+    return _is_partition.get(this, state->memoized_bools, state->lock);
+}
+
+bool BlockDevice::probe_is_partition() {
     std::string partition_path = sysfspath() + "/partition";
     if (!std::filesystem::exists(partition_path)) {
         return false;
@@ -8,9 +8,65 @@
 #include <functional>
 #include <unordered_map>
 #include <optional>
+#include <mutex>
+#include <sys/types.h>
 
 namespace blocks {
 
+// The start of a device as read once, shared rather than copied by
+// every decoder that looks at it
+using ProbeWindow = std::shared_ptr<const std::vector<uint8_t>>;
+
+// Memoized probes of one physical device, shared by every BlockDevice
+// handle on it, see DeviceRegistry
+struct DeviceState {
+    dev_t dev = 0;
+    // The registry's key and the path it was first reached by
+    std::string key;
+    std::string devpath;
+    // From ProbeCache: the probe window the memos were taken from
+    uint64_t window_hash = 0;
+
+    // Handles on several threads share a state; a probe that reads
+    // another (superblock_type reads probe_window) takes it again
+    std::recursive_mutex lock;
+    std::unordered_map<std::string, std::string> memoized_strings;
+    std::unordered_map<std::string, uint64_t> memoized_uint64;
+    std::unordered_map<std::string, bool> memoized_bools;
+    std::unordered_map<std::string, ProbeWindow> memoized_buffers;
+
+    void clear();
+};
+
+// Process-wide: interns device state by identity rather than by path,
+// so /dev/dm-3, /dev/mapper/vg-lv and /dev/disk/by-uuid/... resolve to
+// one memo cache, and every handle constructed during a run shares it.
+// Block devices are keyed by dev_t and, where the kernel has it, diskseq,
+// so a reused dm minor doesn't inherit a removed device's probes.
+class DeviceRegistry {
+public:
+    static DeviceRegistry& instance();
+
+    // A private, empty state for paths that don't exist
+    std::shared_ptr<DeviceState> state_for(const std::string& devpath);
+
+    // Forget a device, on a uevent or after changing it behind
+    // the registry's back; existing handles see empty caches
+    void invalidate(dev_t dev);
+    void invalidate_all();
+
+    std::vector<std::shared_ptr<DeviceState>> states_snapshot();
+
+    DeviceRegistry(const DeviceRegistry&) = delete;
+    DeviceRegistry& operator=(const DeviceRegistry&) = delete;
+
+private:
+    DeviceRegistry() = default;
+
+    std::mutex lock;
+    std::unordered_map<std::string, std::shared_ptr<DeviceState>> states;
+};
+
 class BlockDevice {
 public:
     BlockDevice(const std::string& devpath);
@@ -36,6 +92,13 @@ public:
     bool has_bcache_superblock();
     uint64_t size();
     void reset_size();
+
+    // The start of the device, read once and shared by the
+    // in-process superblock decoders. btrfs and reiserfs 3.6
+    // superblocks sit at 64k.
+    static constexpr size_t PROBE_WINDOW_SIZE = 68 * 1024;
+    ProbeWindow probe_window();
+    void reset_probe_window();
     
     std::string sysfspath();
     std::pair<int, int> devnum();
@@ -45,6 +108,8 @@ public:
     bool is_lv();
     
     std::string dm_table();
+    // After loading a new table into the device
+    void reset_dm_table();
     void dm_deactivate();
     void dm_setup(const std::string& table, bool readonly);
     
@@ -56,9 +121,17 @@ public:
     std::string devpath;
     
 private:
-    std::unordered_map<std::string, std::string> memoized_strings;
-    std::unordered_map<std::string, uint64_t> memoized_uint64;
-    std::unordered_map<std::string, bool> memoized_bools;
+    std::string probe_ptable_type();
+    std::string probe_superblock_type();
+    bool probe_bcache_superblock();
+    uint64_t probe_size();
+    bool probe_is_dm();
+    bool probe_is_lv();
+    std::string probe_dm_table();
+    bool probe_is_partition();
+    ProbeWindow read_probe_window();
+
+    std::shared_ptr<DeviceState> state;
 
     memoized_property<std::string, BlockDevice> _ptable_type;
     memoized_property<std::string, BlockDevice> _superblock_type;
@@ -66,7 +139,9 @@ private:
     memoized_property<uint64_t, BlockDevice> _size;
     memoized_property<bool, BlockDevice> _is_dm;
     memoized_property<bool, BlockDevice> _is_lv;
+    memoized_property<std::string, BlockDevice> _dm_table;
     memoized_property<bool, BlockDevice> _is_partition;
+    memoized_property<ProbeWindow, BlockDevice> _probe_window;
 };
 
 class PartitionedDevice : public BlockDevice {
@@ -105,7 +180,7 @@ public:
 
 class BlockStack;
 
-BlockStack get_block_stack(BlockDevice device, ProgressListener& progress);
+BlockStack get_block_stack(BlockDevice device, ProgressListener& progress, bool activate);
 
 } // namespace blocks
 
@@ -1,58 +1,64 @@
 #include "block_stack.h"
+#include "layer_types.h"
 #include <algorithm>
 #include <iostream>
 
 namespace blocks {
 
-    BlockStack::BlockStack(std::vector<std::shared_ptr<BlockData>> stack)
-            : stack(std::move(stack)) {
+    BlockStack::BlockStack(LayerVector layers)
+            : layers(std::move(layers)) {
     }
 
-    std::vector<std::shared_ptr<BlockData>> BlockStack::wrappers() {
-        if (stack.empty()) return {};
-        return std::vector<std::shared_ptr<BlockData>>(stack.begin(), stack.end() - 1);
+    LayerRange BlockStack::wrappers() {
+        if (layers.empty()) return {layers.begin(), layers.begin()};
+        return {layers.begin(), layers.end() - 1};
     }
 
     uint64_t BlockStack::overhead() {
         uint64_t total_offset = 0;
-        for (auto& wrapper : wrappers()) {
-            if (auto container = std::dynamic_pointer_cast<SimpleContainer>(wrapper)) {
+        for (Layer& wrapper : wrappers()) {
+            if (SimpleContainer* container = as_container(wrapper)) {
                 total_offset += container->offset;
             }
         }
         return total_offset;
     }
 
-    std::shared_ptr<BlockData> BlockStack::topmost() {
-        if (stack.empty()) return nullptr;
-        return stack.back();
+    Layer* BlockStack::topmost() {
+        if (layers.empty()) return nullptr;
+        return &layers.back();
+    }
+
+    Filesystem* BlockStack::filesystem() {
+        Layer* top = topmost();
+        return top ? as_filesystem(*top) : nullptr;
     }
 
     std::string BlockStack::fsuuid() {
-        if (auto fs = std::dynamic_pointer_cast<Filesystem>(topmost())) {
+        if (Filesystem* fs = filesystem()) {
             return fs->fsuuid();
         }
         return "";
     }
 
     std::string BlockStack::fslabel() {
-        if (auto fs = std::dynamic_pointer_cast<Filesystem>(topmost())) {
+        if (Filesystem* fs = filesystem()) {
             return fs->fslabel();
         }
         return "";
     }
 
-    std::vector<std::pair<uint64_t, std::shared_ptr<BlockData>>> BlockStack::iter_pos(uint64_t pos) {
-        std::vector<std::pair<uint64_t, std::shared_ptr<BlockData>>> result;
+    BlockStack::Positions BlockStack::iter_pos(uint64_t pos) {
+        Positions result;
 
-        for (auto& block_data : wrappers()) {
-            result.emplace_back(pos, block_data);
-            if (auto container = std::dynamic_pointer_cast<SimpleContainer>(block_data)) {
+        for (Layer& wrapper : wrappers()) {
+            result.emplace_back(pos, &wrapper);
+            if (SimpleContainer* container = as_container(wrapper)) {
                 pos -= container->offset;
             }
         }
 
-        if (auto top = topmost()) {
+        if (Layer* top = topmost()) {
             result.emplace_back(pos, top);
         }
         return result;
@@ -60,7 +66,7 @@ namespace blocks {
 
     uint64_t BlockStack::total_data_size() {
         uint64_t fs_size = 0;
-        if (auto fs = std::dynamic_pointer_cast<Filesystem>(topmost())) {
+        if (Filesystem* fs = filesystem()) {
             fs_size = fs->fssize();
         }
         return fs_size + overhead();
@@ -77,24 +83,21 @@ namespace blocks {
     void BlockStack::stack_grow(uint64_t newsize, ProgressListener& progress) {
         uint64_t current_size = newsize;
 
-        for (auto& block_data : wrappers()) {
-            if (auto container = std::dynamic_pointer_cast<SimpleContainer>(block_data)) {
-                if (auto luks = std::dynamic_pointer_cast<LUKS>(block_data)) {
-                    current_size = luks->grow_nonrec(current_size);
-                } else if (auto bcache = std::dynamic_pointer_cast<BCacheBacking>(block_data)) {
-                    current_size = bcache->grow_nonrec(current_size);
-                }
-                current_size -= container->offset;
-            }
+        for (Layer& wrapper : wrappers()) {
+            std::visit(overloaded{
+                    [&](LUKS& luks) { current_size = luks.grow_nonrec(current_size) - luks.offset; },
+                    [&](BCacheBacking& bcache) { current_size = bcache.grow_nonrec(current_size) - bcache.offset; },
+                    [](Filesystem&) {},
+            }, wrapper);
         }
 
-        if (auto fs = std::dynamic_pointer_cast<Filesystem>(topmost())) {
+        if (Filesystem* fs = filesystem()) {
             fs->grow_nonrec(current_size);
         }
     }
 
     void BlockStack::stack_reserve_end_area(uint64_t pos, ProgressListener& progress) {
-        auto fs = std::dynamic_pointer_cast<Filesystem>(topmost());
+        Filesystem* fs = filesystem();
         if (!fs) {
             progress.bail("Topmost layer is not a filesystem", std::runtime_error("Invalid stack"));
             return;
@@ -122,94 +125,108 @@ namespace blocks {
         auto positions = iter_pos(pos);
         std::reverse(positions.begin(), positions.end());
 
-        for (auto& [inner_pos, block_data] : positions) {
-            if (auto fs_ptr = std::dynamic_pointer_cast<Filesystem>(block_data)) {
-                fs_ptr->reserve_end_area_nonrec(inner_pos);
-            } else if (auto luks = std::dynamic_pointer_cast<LUKS>(block_data)) {
-                luks->reserve_end_area_nonrec(inner_pos);
-            }
+        for (auto& [inner_pos, layer] : positions) {
+            uint64_t layer_pos = inner_pos;
+            std::visit(overloaded{
+                    [&](Filesystem& fs_layer) { fs_layer.reserve_end_area_nonrec(layer_pos); },
+                    [&](LUKS& luks) { luks.reserve_end_area_nonrec(layer_pos); },
+                    [](BCacheBacking&) {},
+            }, *layer);
         }
     }
 
     void BlockStack::read_superblocks() {
-        for (auto& wrapper : wrappers()) {
-            if (auto luks = std::dynamic_pointer_cast<LUKS>(wrapper)) {
-                luks->read_superblock();
-            } else if (auto bcache = std::dynamic_pointer_cast<BCacheBacking>(wrapper)) {
-                bcache->read_superblock();
-            }
+        for (Layer& wrapper : wrappers()) {
+            std::visit([](auto& data) { data.read_superblock(); }, wrapper);
         }
 
-        if (auto fs = std::dynamic_pointer_cast<Filesystem>(topmost())) {
+        if (Filesystem* fs = filesystem()) {
             fs->read_superblock();
         }
     }
 
+    void BlockStack::record_layer_sizes(const std::string& phase) {
+        for (size_t depth = 0; depth < layers.size(); ++depth) {
+            Layer& layer = layers[depth];
+            BlockData& data = layer_data(layer);
+            Filesystem* fs = as_filesystem(layer);
+            uint64_t bytes = fs ? fs->fssize() : data.device.size();
+            Metrics::instance().layer_size(depth, data.device.superblock_type(), phase, bytes);
+        }
+    }
+
+    void BlockStack::release_mounts() {
+        if (Filesystem* fs = filesystem()) {
+            MountPool::instance().release(fs->devno());
+        }
+    }
+
     void BlockStack::deactivate() {
+        // Pooled mounts would keep the devices busy
+        release_mounts();
+
         // Deactivate in reverse order
-        for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
-            if (auto luks = std::dynamic_pointer_cast<LUKS>(*it)) {
-                luks->deactivate();
-            } else if (auto bcache = std::dynamic_pointer_cast<BCacheBacking>(*it)) {
-                bcache->deactivate();
-            }
+        for (auto it = std::make_reverse_iterator(layers.end()); it != std::make_reverse_iterator(layers.begin()); ++it) {
+            std::visit(overloaded{
+                    [](LUKS& luks) { luks.deactivate(); },
+                    [](BCacheBacking& bcache) { bcache.deactivate(); },
+                    [](Filesystem&) {},
+            }, *it);
         }
 
         // Salt the earth, our devpaths are obsolete now
-        stack.clear();
+        layers.clear();
     }
 
-    BlockStack get_block_stack(BlockDevice device, ProgressListener& progress) {
-        std::vector<std::shared_ptr<BlockData>> stack;
+    BlockStack get_block_stack(BlockDevice device, ProgressListener& progress, bool activate) {
+        LayerVector stack;
 
         while (true) {
             std::string superblock_type = device.superblock_type();
-
-            if (superblock_type == "crypto_LUKS") {
-                auto wrapper = std::make_shared<LUKS>(device);
-                stack.push_back(wrapper);
-                device = wrapper->cleartext_device();
+            const LayerType* layer_type = find_layer_type(superblock_type);
+
+            if (layer_type && layer_type->kind == LayerKind::Luks) {
+                auto& wrapper = std::get<LUKS>(stack.emplace_back(layer_type->make_layer(device)));
+                if (!activate) {
+                    // Without activating, we only see through open LUKS volumes
+                    device = wrapper.snoop_activated();
+                    if (device.devpath.empty()) {
+                        break;
+                    }
+                    continue;
+                }
+                device = wrapper.cleartext_device();
                 continue;
             } else if (device.has_bcache_superblock()) {
-                auto wrapper = std::make_shared<BCacheBacking>(device);
-                wrapper->read_superblock();
-                if (!wrapper->is_backing()) {
+                auto& wrapper = std::get<BCacheBacking>(
+                        stack.emplace_back(find_layer_type("bcache")->make_layer(device)));
+                wrapper.read_superblock();
+                if (!wrapper.is_backing()) {
                     progress.bail("BCache device isn't a backing device",
                                   UnsupportedSuperblock(device.devpath));
                 }
-                stack.push_back(wrapper);
-                device = wrapper->cached_device();
+                if (!activate && !wrapper.is_activated()) {
+                    break;
+                }
+                device = wrapper.cached_device();
                 continue;
             }
 
-            std::shared_ptr<Filesystem> fs;
-
-            if (superblock_type == "ext2" || superblock_type == "ext3" || superblock_type == "ext4") {
-                fs = std::make_shared<ExtFS>(device);
-            } else if (superblock_type == "reiserfs") {
-                fs = std::make_shared<ReiserFS>(device);
-            } else if (superblock_type == "btrfs") {
-                fs = std::make_shared<BtrFS>(device);
-            } else if (superblock_type == "nilfs2") {
-                fs = std::make_shared<NilFS>(device);
-            } else if (superblock_type == "xfs") {
-                fs = std::make_shared<XFS>(device);
-            } else if (superblock_type == "swap") {
-                fs = std::make_shared<Swap>(device);
-            } else {
+            if (!layer_type || layer_type->kind != LayerKind::Filesystem) {
                 if (superblock_type.empty()) {
                     progress.bail("Unrecognised superblock", UnsupportedSuperblock(device.devpath));
                 } else {
                     progress.bail("Unsupported superblock type: " + superblock_type,
                                   UnsupportedSuperblock(device.devpath));
                 }
+                break;
             }
 
-            stack.push_back(fs);
+            stack.emplace_back(layer_type->make_layer(device));
             break;  // Exit loop after adding filesystem
         }
 
-        return BlockStack(stack);
+        return BlockStack(std::move(stack));
     }
 
 } // namespace blocks
\ No newline at end of file
@@ -5,37 +5,96 @@
 #include "block_device.h"
 #include "filesystem.h"
 #include "container.h"
-#include <vector>
-#include <memory>
+#include <utility>
+#include <variant>
 
 namespace blocks {
 
+// One layer of a stack, held by value. Operations dispatch on the
+// alternative with std::visit instead of trying casts.
+using Layer = std::variant<LUKS, BCacheBacking, ExtFS, XFS, BtrFS, NilFS, ReiserFS, Swap>;
+
+// LUKS over bcache under a filesystem is about as deep as stacks get
+constexpr size_t INLINE_LAYERS = 3;
+using LayerVector = SmallVector<Layer, INLINE_LAYERS>;
+
+inline BlockData& layer_data(Layer& layer) {
+    return std::visit([](auto& data) -> BlockData& { return data; }, layer);
+}
+
+// nullptr when the layer is a container
+inline Filesystem* as_filesystem(Layer& layer) {
+    return std::visit([](auto& data) -> Filesystem* {
+        if constexpr (std::is_base_of_v<Filesystem, std::decay_t<decltype(data)>>) {
+            return &data;
+        } else {
+            return nullptr;
+        }
+    }, layer);
+}
+
+// nullptr when the layer is a filesystem
+inline SimpleContainer* as_container(Layer& layer) {
+    return std::visit([](auto& data) -> SimpleContainer* {
+        if constexpr (std::is_base_of_v<SimpleContainer, std::decay_t<decltype(data)>>) {
+            return &data;
+        } else {
+            return nullptr;
+        }
+    }, layer);
+}
+
+// A view of consecutive layers
+struct LayerRange {
+    Layer* first;
+    Layer* last;
+
+    Layer* begin() const { return first; }
+    Layer* end() const { return last; }
+    size_t size() const { return last - first; }
+    bool empty() const { return first == last; }
+};
+
 class BlockStack {
 public:
-    BlockStack(std::vector<std::shared_ptr<BlockData>> stack);
+    // Each layer with the position of the end of the stack in its own
+    // coordinates, outermost first
+    using Positions = SmallVector<std::pair<uint64_t, Layer*>, INLINE_LAYERS>;
+
+    explicit BlockStack(LayerVector layers);
 
-    std::vector<std::shared_ptr<BlockData>> wrappers();
+    // Every layer but the topmost
+    LayerRange wrappers();
     uint64_t overhead();
-    std::shared_ptr<BlockData> topmost();
+    Layer* topmost();
+    // The topmost layer, if it's a filesystem
+    Filesystem* filesystem();
     std::string fsuuid();
     std::string fslabel();
-    
-    std::vector<std::pair<uint64_t, std::shared_ptr<BlockData>>> iter_pos(uint64_t pos);
-    
+
+    Positions iter_pos(uint64_t pos);
+
     uint64_t total_data_size();
-    
+
     void stack_resize(uint64_t pos, bool shrink, ProgressListener& progress);
     void stack_grow(uint64_t newsize, ProgressListener& progress);
     void stack_reserve_end_area(uint64_t pos, ProgressListener& progress);
-    
+
     void read_superblocks();
+    // Exports each layer's size to the run's metrics; phase is "before"
+    // or "after"
+    void record_layer_sizes(const std::string& phase);
+    void release_mounts();
     void deactivate();
-    
+
 private:
-    std::vector<std::shared_ptr<BlockData>> stack;
+    LayerVector layers;
 };
 
-BlockStack get_block_stack(BlockDevice device, ProgressListener& progress);
+// With activate=false the stack stops at the first inactive LUKS or
+// bcache layer rather than activating it, so the topmost layer may be
+// a container.
+BlockStack get_block_stack(BlockDevice device, ProgressListener& progress, bool activate = true);
 
 } // namespace blocks
 
@@ -15,12 +15,15 @@
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <optional>
 #include <regex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <type_traits>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -29,6 +32,9 @@
 #include <vector>
 #include <sys/wait.h>
 #include <pcrecpp.h>
+#include "host_paths.h"
+#include "log.h"
+#include "metrics.h"
 
 namespace blocks {
 
@@ -71,6 +77,33 @@ inline uint64_t align(uint64_t size, uint64_t align) {
     return (size / align) * align;
 }
 
+// On-disk integer decoding, for superblocks read into a byte buffer
+inline uint16_t le16_at(const uint8_t* buf, size_t off) {
+    return static_cast<uint16_t>(buf[off] | (buf[off + 1] << 8));
+}
+
+inline uint32_t le32_at(const uint8_t* buf, size_t off) {
+    return static_cast<uint32_t>(le16_at(buf, off)) |
+           (static_cast<uint32_t>(le16_at(buf, off + 2)) << 16);
+}
+
+inline uint64_t le64_at(const uint8_t* buf, size_t off) {
+    return static_cast<uint64_t>(le32_at(buf, off)) |
+           (static_cast<uint64_t>(le32_at(buf, off + 4)) << 32);
+}
+
+inline uint32_t be32_at(const uint8_t* buf, size_t off) {
+    return (static_cast<uint32_t>(buf[off]) << 24) |
+           (static_cast<uint32_t>(buf[off + 1]) << 16) |
+           (static_cast<uint32_t>(buf[off + 2]) << 8) |
+           static_cast<uint32_t>(buf[off + 3]);
+}
+
+inline uint64_t be64_at(const uint8_t* buf, size_t off) {
+    return (static_cast<uint64_t>(be32_at(buf, off)) << 32) |
+           static_cast<uint64_t>(be32_at(buf, off + 4));
+}
+
 class UnsupportedSuperblock : public std::exception {
 public:
     std::string device;
@@ -103,6 +136,16 @@ public:
     }
 };
 
+// Raised by CLIProgressHandler::bail once the reason has been logged.
+// Unwinding (rather than exiting on the spot) lets destructors remove
+// dm devices, loop devices and mounts; main exits with EXIT_STATUS.
+class Bail : public std::runtime_error {
+public:
+    static constexpr int EXIT_STATUS = 2;
+
+    explicit Bail(const std::string& msg) : std::runtime_error(msg) {}
+};
+
 class OverlappingPartition : public std::exception {
 public:
     const char* what() const noexcept override {
@@ -123,6 +166,7 @@ public:
         memoized_property(getter_type fget, const std::string& name, const std::string& doc = "")
                 : fget(fget), name(name), doc(doc) {}
 
+        // For a cache only this object uses
         T& get(Class* obj, std::unordered_map<std::string, T>& cache) {
             auto it = cache.find(name);
             if (it == cache.end()) {
@@ -136,11 +180,129 @@ public:
         void reset(Class* obj, std::unordered_map<std::string, T>& cache) {
             cache.erase(name);
         }
+
+        // For a cache shared with other threads: returns a copy, and holds
+        // the lock while probing, so a value is only probed once
+        T get(Class* obj, std::unordered_map<std::string, T>& cache, std::recursive_mutex& lock) {
+            std::lock_guard<std::recursive_mutex> guard(lock);
+            return get(obj, cache);
+        }
+
+        void reset(Class* obj, std::unordered_map<std::string, T>& cache, std::recursive_mutex& lock) {
+            std::lock_guard<std::recursive_mutex> guard(lock);
+            reset(obj, cache);
+        }
     };
 
+    // A vector whose first N elements live inline, for short lists that
+    // get built and dropped often; spills to the heap past N
+    template <typename T, size_t N>
+    class SmallVector {
+    public:
+        SmallVector() = default;
+        SmallVector(const SmallVector& other) { append(other); }
+        SmallVector(SmallVector&& other) noexcept(std::is_nothrow_move_constructible_v<T>) { take(std::move(other)); }
+        ~SmallVector() { clear(); }
+
+        SmallVector& operator=(const SmallVector& other) {
+            if (this != &other) {
+                clear();
+                append(other);
+            }
+            return *this;
+        }
+
+        SmallVector& operator=(SmallVector&& other) {
+            if (this != &other) {
+                clear();
+                take(std::move(other));
+            }
+            return *this;
+        }
+
+        template <typename... Args>
+        T& emplace_back(Args&&... args) {
+            if (!spilled && count < N) {
+                T* slot = new (inline_data() + count) T(std::forward<Args>(args)...);
+                ++count;
+                return *slot;
+            }
+            if (!spilled) {
+                spill();
+            }
+            return heap.emplace_back(std::forward<Args>(args)...);
+        }
+
+        void push_back(T value) { emplace_back(std::move(value)); }
+
+        void clear() {
+            std::destroy_n(inline_data(), count);
+            count = 0;
+            heap.clear();
+            spilled = false;
+        }
+
+        size_t size() const { return spilled ? heap.size() : count; }
+        bool empty() const { return size() == 0; }
+
+        T* begin() { return spilled ? heap.data() : inline_data(); }
+        T* end() { return begin() + size(); }
+        const T* begin() const { return spilled ? heap.data() : inline_data(); }
+        const T* end() const { return begin() + size(); }
+
+        T& operator[](size_t i) { return begin()[i]; }
+        T& back() { return end()[-1]; }
+
+    private:
+        T* inline_data() { return std::launder(reinterpret_cast<T*>(storage)); }
+        const T* inline_data() const { return std::launder(reinterpret_cast<const T*>(storage)); }
+
+        void spill() {
+            heap.reserve(N * 2);
+            for (size_t i = 0; i < count; ++i) {
+                heap.push_back(std::move(inline_data()[i]));
+            }
+            std::destroy_n(inline_data(), count);
+            count = 0;
+            spilled = true;
+        }
+
+        void append(const SmallVector& other) {
+            for (const T& value : other) {
+                emplace_back(value);
+            }
+        }
+
+        void take(SmallVector&& other) {
+            if (other.spilled) {
+                heap = std::move(other.heap);
+                spilled = true;
+            } else {
+                for (T& value : other) {
+                    emplace_back(std::move(value));
+                }
+            }
+            other.clear();
+        }
+
+        alignas(T) unsigned char storage[N * sizeof(T)];
+        size_t count = 0;  // Inline elements
+        bool spilled = false;
+        std::vector<T> heap;
+    };
+
+    // Lambdas as one std::visit visitor
+    template <typename... Ts>
+    struct overloaded : Ts... {
+        using Ts::operator()...;
+    };
+    template <typename... Ts>
+    overloaded(Ts...) -> overloaded<Ts...>;
+
     inline std::string exec_command(const std::string& cmd) {
         std::array<char, 128> buffer;
         std::string result;
+        SubprocessTimer timer(cmd);
         std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd.c_str(), "r"), pclose);
         if (!pipe) throw std::runtime_error("popen failed: " + cmd);
         while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
@@ -158,19 +320,22 @@ public:
     }
     inline void quiet_call(const std::vector<std::string>& cmd, const std::string& table = "") {
         std::string full_cmd = join_cmd(cmd);
-        std::cout << "Executing: " << full_cmd << "\n"; // Debug
-        if (!table.empty()) std::cout << "Table:\n" << table << "\n"; // Debug
+        log_debug() << "Executing: " << full_cmd;
+        if (!table.empty()) log_debug() << "Table:\n" << table;
 
+        // The command shares our terminal, keep what we logged ahead of its output
+        Logger::instance().flush();
+        SubprocessTimer timer(cmd);
         FILE* pipe = popen(full_cmd.c_str(), "w");
         if (!pipe) {
-            std::cerr << "popen failed: " << full_cmd << "\n";
+            log_error() << "popen failed: " << full_cmd;
             throw std::runtime_error("popen failed: " + full_cmd);
         }
 
         if (!table.empty()) {
             if (fputs(table.c_str(), pipe) == EOF) {
                 pclose(pipe);
-                std::cerr << "Failed to write table to " << full_cmd << "\n";
+                log_error() << "Failed to write table to " << full_cmd;
                 throw std::runtime_error("Failed to write table to " + full_cmd);
             }
         }
@@ -178,7 +343,7 @@ public:
         int status = pclose(pipe);
         if (status != 0) {
             std::string stderr_output = exec_command("dmesg | tail -n 5"); // Rough stderr approximation
-            std::cerr << "Command failed with status " << status << "\nStderr:\n" << stderr_output << "\n";
+            log_error() << "Command failed with status " << status << "\nStderr:\n" << stderr_output;
             throw std::runtime_error("Command failed: " + full_cmd);
         }
     }
@@ -289,7 +454,7 @@ public:
         try {
             quiet_call(cmd, table);
         } catch (const std::exception& e) {
-            std::cerr << "Initial dmsetup failed: " << e.what() << "\nTrying fallback...\n";
+            log_warning() << "Initial dmsetup failed: " << e.what() << "\nTrying fallback...";
             needs_udev_fallback = true;
             cmd = {"dmsetup", "create", "--verifyudev"}; // Reset cmd
             if (readonly) {
@@ -309,7 +474,7 @@ public:
             try {
                 quiet_call(remove_cmd);
             } catch (const std::exception& e) {
-                std::cerr << "Warning: Failed to remove device: " << e.what() << "\n";
+                log_warning() << "Warning: Failed to remove device: " << e.what();
             }
         };
     }
@@ -326,12 +491,35 @@ inline std::string aftersep(const std::string& line, const std::string& sep) {
     return result;
 }
 
+inline std::string trimmed(const std::string& s) {
+    auto begin = s.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    return s.substr(begin, s.find_last_not_of(" \t\r\n") - begin + 1);
+}
+
+// The trimmed fields of an LVM report line printed with --separator
+inline std::vector<std::string> split_fields(const std::string& line, char sep) {
+    std::vector<std::string> fields;
+    std::istringstream iss(line);
+    std::string field;
+    while (std::getline(iss, field, sep)) {
+        fields.push_back(trimmed(field));
+    }
+    // getline drops a trailing empty field
+    if (!line.empty() && line.back() == sep) {
+        fields.emplace_back();
+    }
+    return fields;
+}
+
 inline std::string devpath_from_sysdir(const std::string& sd) {
     std::ifstream uevent(sd + "/uevent");
     std::string line;
     while (std::getline(uevent, line)) {
         if (line.find("DEVNAME=") == 0) {
-            return "/dev/" + aftersep(line, "=");
+            return dev_path(aftersep(line, "="));
         }
     }
     return "";
@@ -347,11 +535,11 @@ public:
 class DefaultProgressHandler : public ProgressListener {
 public:
     void notify(const std::string& msg) override {
-        std::cout << "[INFO] " << msg << std::endl;
+        log_info() << "[INFO] " << msg;
     }
 
     void bail(const std::string& msg, const std::exception& err) override {
-        std::cerr << "[ERROR] " << msg << std::endl;
+        log_error() << "[ERROR] " << msg;
         throw err;
     }
 };
@@ -359,12 +547,12 @@ public:
 class CLIProgressHandler : public ProgressListener {
 public:
     void notify(const std::string& msg) override {
-        std::cout << msg << std::endl;
+        log_info() << msg;
     }
 
     void bail(const std::string& msg, const std::exception& err) override {
-        std::cerr << msg << std::endl;
-        exit(2);
+        log_error() << msg;
+        throw Bail(msg);
     }
 };
 
@@ -415,6 +603,16 @@ inline bool starts_with_word(const std::string& line, const std::string& word) {
         }
     };
 
+    class MdadmReq : public Requirement {
+    public:
+        static constexpr const char* cmd = "mdadm";
+        static constexpr const char* pkg = "mdadm";
+
+        static void require(ProgressListener& progress) {
+            Requirement::require(cmd, pkg, progress);
+        }
+    };
+
 } // namespace blocks
 
 #endif // BLOCKS_TYPES_H
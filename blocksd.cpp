@@ -0,0 +1,109 @@
+#include <iostream>
+#include <string>
+#include <csignal>
+#include <getopt.h>
+
+#include "blocks_types.h"
+#include "daemon.h"
+
+namespace blocks {
+    Daemon* running_daemon = nullptr;
+
+    void print_help() {
+        std::cout << "Usage: blocksd [--socket PATH]" << std::endl;
+        std::cout << "       blocksd [--socket PATH] --call METHOD [PARAMS]" << std::endl;
+        std::cout << std::endl;
+        std::cout << "Serves JSON-RPC 2.0 requests on a unix socket, one per line." << std::endl;
+        std::cout << std::endl;
+        std::cout << "Methods:" << std::endl;
+        std::cout << "  scan              Block devices, their superblocks, mounts and LVs" << std::endl;
+        std::cout << "  plan              {\"command\": ..., plus that command's parameters}" << std::endl;
+        std::cout << "  resize            {\"device\", \"size\", \"resize_device\"}" << std::endl;
+        std::cout << "  to-lvm            {\"device\", \"vg_name\", \"join\"}" << std::endl;
+        std::cout << "  to-bcache         {\"device\", \"join\"}" << std::endl;
+        std::cout << std::endl;
+        std::cout << "Options:" << std::endl;
+        std::cout << "  --socket PATH     Socket to listen on or connect to (default " << BLOCKSD_SOCKET << ")" << std::endl;
+        std::cout << "  --call METHOD     Send one request to a running daemon and print the reply;" << std::endl;
+        std::cout << "                    PARAMS is a JSON object" << std::endl;
+        std::cout << "  --log-format FMT  terminal (default), json or syslog" << std::endl;
+    }
+
+    void handle_stop_signal(int) {
+        if (running_daemon) {
+            running_daemon->stop();
+        }
+    }
+
+    int main(int argc, char* argv[]) {
+        // Before any tool runs, so a BLOCKS_TOOL_DIR override is on PATH
+        HostPaths::instance();
+
+        std::string socket_path = BLOCKSD_SOCKET;
+        std::string call;
+        int c;
+
+        static struct option long_options[] = {
+                {"socket", required_argument, 0, 's'},
+                {"call", required_argument, 0, 'c'},
+                {"log-format", required_argument, 0, 'l'},
+                {"help", no_argument, 0, 'h'},
+                {0, 0, 0, 0}
+        };
+
+        while ((c = getopt_long(argc, argv, "s:c:l:h", long_options, nullptr)) != -1) {
+            switch (c) {
+                case 's':
+                    socket_path = optarg;
+                    break;
+                case 'c':
+                    call = optarg;
+                    break;
+                case 'l':
+                    try {
+                        Logger::instance().configure(parse_log_format(optarg), LogLevel::Info);
+                    } catch (const std::invalid_argument& e) {
+                        log_error() << e.what();
+                        return 1;
+                    }
+                    break;
+                case 'h':
+                    print_help();
+                    return 0;
+                default:
+                    return 1;
+            }
+        }
+
+        try {
+            if (!call.empty()) {
+                nlohmann::json params = nlohmann::json::object();
+                if (optind < argc) {
+                    params = nlohmann::json::parse(argv[optind++]);
+                }
+                nlohmann::json reply = rpc_call(socket_path, call, params);
+                std::cout << reply.dump(2) << std::endl;
+                return reply.contains("error") ? 1 : 0;
+            }
+
+            Daemon daemon(socket_path);
+            running_daemon = &daemon;
+            std::signal(SIGPIPE, SIG_IGN);
+            std::signal(SIGTERM, handle_stop_signal);
+            std::signal(SIGINT, handle_stop_signal);
+
+            log_info() << "Listening on " << socket_path;
+            daemon.serve();
+            running_daemon = nullptr;
+        } catch (const std::exception& e) {
+            log_error() << e.what();
+            return 1;
+        }
+        return 0;
+    }
+
+} // namespace blocks
+
+int main(int argc, char* argv[]) {
+    return blocks::main(argc, argv);
+}
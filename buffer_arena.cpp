@@ -0,0 +1,113 @@
+#include "buffer_arena.h"
+#include "log.h"
+#include "metrics.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <utility>
+
+namespace blocks {
+
+IoBuffer::IoBuffer(IoBuffer&& other) noexcept
+    : arena(std::exchange(other.arena, nullptr)), data_(std::exchange(other.data_, nullptr)),
+      size_(std::exchange(other.size_, 0)), capacity(std::exchange(other.capacity, 0)) {}
+
+IoBuffer& IoBuffer::operator=(IoBuffer&& other) noexcept {
+    if (this != &other) {
+        release();
+        arena = std::exchange(other.arena, nullptr);
+        data_ = std::exchange(other.data_, nullptr);
+        size_ = std::exchange(other.size_, 0);
+        capacity = std::exchange(other.capacity, 0);
+    }
+    return *this;
+}
+
+IoBuffer::~IoBuffer() {
+    release();
+}
+
+void IoBuffer::release() {
+    if (arena) {
+        arena->give_back(data_, capacity);
+    }
+    arena = nullptr;
+    data_ = nullptr;
+    size_ = 0;
+    capacity = 0;
+}
+
+BufferArena& BufferArena::instance() {
+    static BufferArena arena;
+    return arena;
+}
+
+BufferArena::~BufferArena() {
+    for (const auto& [data, capacity] : blocks) {
+        munmap(data, capacity);
+    }
+}
+
+void BufferArena::set_hugepages(bool enable) {
+    std::lock_guard<std::mutex> guard(mutex);
+    hugepages = enable;
+}
+
+uint64_t BufferArena::mapped_bytes() const {
+    std::lock_guard<std::mutex> guard(mutex);
+    return mapped;
+}
+
+IoBuffer BufferArena::acquire(size_t size, bool zeroed) {
+    if (!size) {
+        return IoBuffer();
+    }
+    std::lock_guard<std::mutex> guard(mutex);
+
+    auto it = free_blocks.lower_bound(size);
+    if (it != free_blocks.end()) {
+        uint8_t* data = it->second;
+        size_t capacity = it->first;
+        free_blocks.erase(it);
+        if (zeroed) {
+            std::memset(data, 0, size);
+        }
+        return IoBuffer(this, data, size, capacity);
+    }
+
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    bool huge = hugepages && size >= HUGE_PAGE_SIZE;
+    size_t align = huge ? HUGE_PAGE_SIZE : page_size;
+    size_t capacity = (size + align - 1) / align * align;
+
+    void* data = MAP_FAILED;
+    if (huge) {
+        data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (data == MAP_FAILED) {
+        data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED) {
+            log_error() << "Failed to map " << capacity << " bytes of I/O buffers: " << std::strerror(errno);
+            throw std::bad_alloc();
+        }
+        if (huge) {
+            // Advisory; a kernel without THP just ignores it
+            madvise(data, capacity, MADV_HUGEPAGE);
+        }
+    }
+
+    blocks[static_cast<uint8_t*>(data)] = capacity;
+    mapped += capacity;
+    Metrics::instance().io_buffer_bytes.update(mapped);
+    log_debug() << "Mapped " << capacity << " bytes of I/O buffers, " << mapped << " in all";
+    return IoBuffer(this, static_cast<uint8_t*>(data), size, capacity);
+}
+
+void BufferArena::give_back(uint8_t* data, size_t capacity) {
+    std::lock_guard<std::mutex> guard(mutex);
+    free_blocks.emplace(capacity, data);
+}
+
+} // namespace blocks
@@ -0,0 +1,86 @@
+#ifndef BUFFER_ARENA_H
+#define BUFFER_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+namespace blocks {
+
+class BufferArena;
+
+// A page-aligned span from the arena, given back to it when it goes out
+// of scope (or on release). Aligned for O_DIRECT on any device.
+class IoBuffer {
+public:
+    IoBuffer() = default;
+    IoBuffer(IoBuffer&& other) noexcept;
+    IoBuffer& operator=(IoBuffer&& other) noexcept;
+    ~IoBuffer();
+
+    IoBuffer(const IoBuffer&) = delete;
+    IoBuffer& operator=(const IoBuffer&) = delete;
+
+    uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    uint8_t* begin() const { return data_; }
+    uint8_t* end() const { return data_ + size_; }
+    uint8_t& operator[](size_t i) const { return data_[i]; }
+
+    // Gives the memory back before the end of the scope
+    void release();
+
+private:
+    friend class BufferArena;
+    IoBuffer(BufferArena* arena, uint8_t* data, size_t size, size_t capacity)
+        : arena(arena), data_(data), size_(size), capacity(capacity) {}
+
+    BufferArena* arena = nullptr;
+    uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    size_t capacity = 0;
+};
+
+// The I/O buffers of a run. Memory given back is kept and handed out
+// again, so the copy, verify and header steps of a conversion share the
+// same pages instead of each faulting in fresh ones. The most mapped at
+// once goes to Metrics::io_buffer_bytes.
+class BufferArena {
+public:
+    static BufferArena& instance();
+
+    static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    // Zeroed if asked; fresh memory always is
+    IoBuffer acquire(size_t size, bool zeroed = false);
+
+    // Back buffers of HUGE_PAGE_SIZE and up with hugetlbfs pages when the
+    // system has some reserved, else with transparent hugepages
+    void set_hugepages(bool enable);
+
+    // Mapped in all, whether in use or not
+    uint64_t mapped_bytes() const;
+
+    BufferArena(const BufferArena&) = delete;
+    BufferArena& operator=(const BufferArena&) = delete;
+
+private:
+    friend class IoBuffer;
+    BufferArena() = default;
+    ~BufferArena();
+
+    void give_back(uint8_t* data, size_t capacity);
+
+    mutable std::mutex mutex;
+    // By capacity, for best fit
+    std::multimap<size_t, uint8_t*> free_blocks;
+    std::map<uint8_t*, size_t> blocks;
+    uint64_t mapped = 0;
+    bool hugepages = false;
+};
+
+} // namespace blocks
+
+#endif // BUFFER_ARENA_H
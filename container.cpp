@@ -1,4 +1,5 @@
 #include "container.h"
+#include "buffer_arena.h"
 #include <iostream>
 #include <regex>
 #include <fstream>
@@ -22,6 +23,7 @@ void BCacheBacking::read_superblock() {
 
     std::vector<std::string> cmd = {"bcache-super-show", "--", device.devpath};
     
+    SubprocessTimer timer(cmd);
     FILE* pipe = popen((cmd[0] + " " + cmd[1] + " " + cmd[2]).c_str(), "r");
     if (!pipe) {
         throw std::runtime_error("Failed to execute bcache-super-show");
@@ -60,7 +62,7 @@ bool BCacheBacking::is_activated() {
 BlockDevice BCacheBacking::cached_device() {
     if (!is_activated()) {
         // XXX How synchronous is this?
-        std::ofstream register_file("/sys/fs/bcache/register");
+        std::ofstream register_file(sys_path("fs/bcache/register"));
         if (!register_file) {
             throw std::runtime_error("Failed to open bcache register file");
         }
@@ -164,7 +166,7 @@ BlockDevice LUKS::cleartext_device() {
         
         std::string dmname = "cleartext-" + std::string(uuid_str);
         activate(dmname);
-        dev = BlockDevice("/dev/mapper/" + dmname);
+        dev = BlockDevice(dev_path("mapper/" + dmname));
     }
     return dev;
 }
@@ -175,6 +177,7 @@ void LUKS::read_superblock() {
 
     std::vector<std::string> cmd = {"cryptsetup", "luksDump", "--", device.devpath};
     
+    SubprocessTimer timer(cmd);
     FILE* pipe = popen((cmd[0] + " " + cmd[1] + " " + cmd[2] + " " + cmd[3]).c_str(), "r");
     if (!pipe) {
         throw std::runtime_error("Failed to execute cryptsetup luksDump");
@@ -278,11 +281,13 @@ void LUKS::shift_sb(int fd, uint64_t shift_by) {
         throw std::runtime_error("Not enough space to shift LUKS superblock");
     }
 
-    // Read the superblock
-    std::vector<char> sb(sb_end);
-    if (pread(fd, sb.data(), sb_end, 0) != static_cast<ssize_t>(sb_end)) {
+    // The shifted, edited superblock behind shift_by zeros, read in place
+    IoBuffer combined = BufferArena::instance().acquire(shift_by + sb_end, true);
+    uint8_t* sb = combined.data() + shift_by;
+    if (pread(fd, sb, sb_end, 0) != static_cast<ssize_t>(sb_end)) {
         throw std::runtime_error("Failed to read LUKS superblock for shifting");
     }
+    Metrics::instance().bytes_read.add(sb_end);
 
     // Edit the sb
     uint32_t offset_sectors = offset / 512;
@@ -292,21 +297,14 @@ void LUKS::shift_sb(int fd, uint64_t shift_by) {
     new_offset_sectors = htobe32(new_offset_sectors);
     
     // Update the offset in the superblock
-    std::memcpy(sb.data() + 104, &new_offset_sectors, 4);
-
-    // Create a buffer with zeros for the shift
-    std::vector<char> zeros(shift_by, 0);
-    
-    // Combine zeros and shifted superblock
-    std::vector<char> combined(shift_by + sb_end);
-    std::memcpy(combined.data(), zeros.data(), shift_by);
-    std::memcpy(combined.data() + shift_by, sb.data(), sb_end);
+    std::memcpy(sb + 104, &new_offset_sectors, 4);
 
     // Write the shifted, edited superblock
     ssize_t wr_len = pwrite(fd, combined.data(), combined.size(), 0);
     if (wr_len != static_cast<ssize_t>(combined.size())) {
         throw std::runtime_error("Failed to write shifted LUKS superblock");
     }
+    Metrics::instance().bytes_written.add(combined.size());
 
     // Wipe the results of read_superblock_ll
     // Keep self.offset for now
@@ -0,0 +1,810 @@
+#include "daemon.h"
+#include "bcache_operations.h"
+#include "block_device.h"
+#include "filesystem.h"
+#include "lvm_operations.h"
+#include "mount_table.h"
+#include "plan.h"
+#include "resize_operations.h"
+#include "uuid_index.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+namespace blocks {
+
+namespace {
+
+namespace fs = std::filesystem;
+
+const fs::path SYS_CLASS_BLOCK = sys_path("class/block");
+
+// Far more than any request needs
+constexpr size_t MAX_REQUEST_LINE = 1024 * 1024;
+
+struct RpcError : std::runtime_error {
+    RpcError(int code, const std::string& message, nlohmann::json data = nullptr)
+        : std::runtime_error(message), code(code), data(std::move(data)) {}
+    int code;
+    nlohmann::json data;
+};
+
+std::string read_sysfs(const fs::path& path) {
+    std::ifstream file(path);
+    std::string value;
+    std::getline(file, value);
+    return value;
+}
+
+std::vector<std::string> list_dir(const fs::path& path) {
+    std::vector<std::string> names;
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(path, ec)) {
+        names.push_back(entry.path().filename().string());
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+void disks_of(const std::string& name, std::set<std::string>& disks) {
+    fs::path dir = SYS_CLASS_BLOCK / name;
+    if (fs::exists(dir / "partition")) {
+        disks.insert(fs::canonical(dir).parent_path().filename().string());
+        return;
+    }
+    auto slaves = list_dir(dir / "slaves");
+    if (slaves.empty()) {
+        disks.insert(name);
+        return;
+    }
+    for (const auto& slave : slaves) {
+        disks_of(slave, disks);
+    }
+}
+
+std::string kernel_name(dev_t dev) {
+    fs::path link = sys_path("dev/block/" + std::to_string(major(dev)) + ":" + std::to_string(minor(dev)));
+    return fs::canonical(link).filename().string();
+}
+
+const nlohmann::json& require(const nlohmann::json& params, const char* key) {
+    if (!params.is_object() || !params.contains(key)) {
+        throw RpcError(RPC_INVALID_PARAMS, std::string("Missing parameter: ") + key);
+    }
+    return params.at(key);
+}
+
+std::string require_string(const nlohmann::json& params, const char* key) {
+    const auto& value = require(params, key);
+    if (!value.is_string()) {
+        throw RpcError(RPC_INVALID_PARAMS, std::string("Parameter must be a string: ") + key);
+    }
+    return value.get<std::string>();
+}
+
+// Sizes are either byte counts or strings with a bkmgtpe suffix
+uint64_t require_size(const nlohmann::json& params, const char* key) {
+    const auto& value = require(params, key);
+    if (value.is_number_unsigned()) {
+        return value.get<uint64_t>();
+    }
+    if (value.is_string()) {
+        try {
+            return parse_size_arg(value.get<std::string>());
+        } catch (const std::invalid_argument& e) {
+            throw RpcError(RPC_INVALID_PARAMS, e.what());
+        }
+    }
+    throw RpcError(RPC_INVALID_PARAMS, std::string("Parameter must be a size: ") + key);
+}
+
+CommandArgs command_args(const std::string& command, const nlohmann::json& params) {
+    CommandArgs args;
+    args.command = command;
+    args.device = require_string(params, "device");
+    args.vgname = params.value("vg_name", "");
+    args.join = params.value("join", "");
+    args.debug = params.value("debug", false);
+    return args;
+}
+
+ResizeArgs resize_args(const nlohmann::json& params) {
+    ResizeArgs args;
+    args.device = require_string(params, "device");
+    args.newsize = require_size(params, "size");
+    args.resize_device = params.value("resize_device", false);
+    args.debug = params.value("debug", false);
+    return args;
+}
+
+bool write_all(int fd, const std::string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+} // namespace
+
+std::set<std::string> underlying_disks(const std::string& devpath) {
+    struct stat st;
+    if (::stat(devpath.c_str(), &st) != 0 || !S_ISBLK(st.st_mode)) {
+        throw std::runtime_error("Not a block device: " + devpath);
+    }
+    std::set<std::string> disks;
+    disks_of(kernel_name(st.st_rdev), disks);
+    return disks;
+}
+
+Daemon::Daemon(std::string socket_path) : socket_path(std::move(socket_path)) {
+}
+
+Daemon::~Daemon() {
+    reap_connections(true);
+    uevents.reset();
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(socket_path.c_str());
+    }
+}
+
+void Daemon::serve() {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Socket path too long: " + socket_path);
+    }
+    std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        throw std::runtime_error(std::string("socket failed: ") + std::strerror(errno));
+    }
+    unlink(socket_path.c_str());
+    // Root only, like the commands themselves
+    mode_t old_umask = umask(0077);
+    int ret = ::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    umask(old_umask);
+    if (ret != 0 || ::listen(listen_fd, SOMAXCONN) != 0) {
+        throw std::runtime_error("Failed to listen on " + socket_path + ": " + std::strerror(errno));
+    }
+
+    try {
+        uevents = std::make_unique<UeventListener>();
+        uevents->subscribe([this](const Uevent& event) { on_uevent(event); });
+        uevents->start();
+    } catch (const std::exception& e) {
+        log_warning() << e.what() << ", device state will be probed again on every scan";
+    }
+
+    while (!stopping) {
+        int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (stopping) {
+                break;
+            }
+            throw std::runtime_error(std::string("accept failed: ") + std::strerror(errno));
+        }
+        reap_connections(false);
+        std::lock_guard<std::mutex> lock(connections_lock);
+        Connection& connection = connections.emplace_back();
+        connection.fd = fd;
+        connection.thread = std::thread(&Daemon::serve_connection, this, std::ref(connection));
+    }
+    reap_connections(true);
+}
+
+void Daemon::reap_connections(bool all) {
+    std::list<Connection> finished;
+    {
+        std::lock_guard<std::mutex> lock(connections_lock);
+        for (auto it = connections.begin(); it != connections.end();) {
+            auto next = std::next(it);
+            if (all || it->done) {
+                if (!it->done) {
+                    // A request in progress still runs to its end
+                    ::shutdown(it->fd, SHUT_RDWR);
+                }
+                finished.splice(finished.end(), connections, it);
+            }
+            it = next;
+        }
+    }
+    for (auto& connection : finished) {
+        connection.thread.join();
+        close(connection.fd);
+    }
+}
+
+void Daemon::stop() {
+    stopping = true;
+    if (listen_fd >= 0) {
+        ::shutdown(listen_fd, SHUT_RDWR);
+    }
+}
+
+void Daemon::serve_connection(Connection& connection) {
+    int fd = connection.fd;
+    bool open = true;
+    std::string buffer;
+    char chunk[4096];
+
+    while (true) {
+        size_t newline;
+        while ((newline = buffer.find('\n')) != std::string::npos) {
+            std::string line = buffer.substr(0, newline);
+            buffer.erase(0, newline + 1);
+            if (line.empty()) {
+                continue;
+            }
+
+            nlohmann::json reply;
+            try {
+                reply = handle(nlohmann::json::parse(line));
+            } catch (const nlohmann::json::parse_error& e) {
+                reply = {{"jsonrpc", "2.0"}, {"id", nullptr},
+                         {"error", {{"code", RPC_PARSE_ERROR}, {"message", e.what()}}}};
+            }
+            // Notifications get no reply
+            if (!reply.is_null() && !write_all(fd, reply.dump() + "\n")) {
+                open = false;
+                break;
+            }
+        }
+        if (!open) {
+            break;
+        }
+        if (buffer.size() > MAX_REQUEST_LINE) {
+            // No way to find the next request, drop the connection
+            nlohmann::json reply = {{"jsonrpc", "2.0"}, {"id", nullptr},
+                                    {"error", {{"code", RPC_INVALID_REQUEST}, {"message", "Request too long"}}}};
+            write_all(fd, reply.dump() + "\n");
+            break;
+        }
+
+        ssize_t n = ::read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        buffer.append(chunk, n);
+    }
+    // The peer sees the end now, the fd is closed once joined
+    ::shutdown(fd, SHUT_RDWR);
+    std::lock_guard<std::mutex> lock(connections_lock);
+    connection.done = true;
+}
+
+nlohmann::json Daemon::handle(const nlohmann::json& request) {
+    nlohmann::json id = nullptr;
+    nlohmann::json reply = {{"jsonrpc", "2.0"}};
+
+    try {
+        if (!request.is_object() || request.value("jsonrpc", "") != "2.0" ||
+            !request.contains("method") || !request["method"].is_string()) {
+            throw RpcError(RPC_INVALID_REQUEST, "Invalid request");
+        }
+        id = request.value("id", nlohmann::json());
+        nlohmann::json params = request.value("params", nlohmann::json::object());
+        reply["result"] = run_method(request["method"].get<std::string>(), params);
+    } catch (const RpcError& e) {
+        reply["error"] = {{"code", e.code}, {"message", e.what()}};
+        if (!e.data.is_null()) {
+            reply["error"]["data"] = e.data;
+        }
+    } catch (const std::exception& e) {
+        reply["error"] = {{"code", RPC_COMMAND_FAILED}, {"message", e.what()}};
+    }
+
+    if (request.is_object() && request.contains("method") && !request.contains("id")) {
+        return nullptr;
+    }
+    reply["id"] = id;
+    return reply;
+}
+
+nlohmann::json Daemon::run_method(const std::string& method, const nlohmann::json& params) {
+    if (method == "scan") {
+        return scan();
+    }
+
+    std::function<int(nlohmann::json&)> fn;
+    std::string device;
+    bool mutates = true;
+
+    if (method == "plan") {
+        std::string command = require_string(params, "command");
+        mutates = false;
+        if (command == "resize") {
+            ResizeArgs args = resize_args(params);
+            device = args.device;
+            fn = [args](nlohmann::json& result) { result = plan_resize(args).to_json(); return 0; };
+        } else if (command == "to-lvm" || command == "to-bcache") {
+            CommandArgs args = command_args(command, params);
+            device = args.device;
+            fn = [args](nlohmann::json& result) {
+                result = (args.command == "to-lvm" ? plan_to_lvm(args) : plan_to_bcache(args)).to_json();
+                return 0;
+            };
+        } else {
+            throw RpcError(RPC_INVALID_PARAMS, "Can't plan " + command);
+        }
+    } else if (method == "resize") {
+        ResizeArgs args = resize_args(params);
+        device = args.device;
+        fn = [args](nlohmann::json&) { return cmd_resize(args); };
+    } else if (method == "to-lvm") {
+        CommandArgs args = command_args(method, params);
+        device = args.device;
+        fn = [args](nlohmann::json&) { return cmd_to_lvm(args); };
+    } else if (method == "to-bcache") {
+        // --maintboot reboots the host, it has no place here
+        CommandArgs args = command_args(method, params);
+        device = args.device;
+        fn = [args](nlohmann::json&) { return cmd_to_bcache(args); };
+    } else {
+        throw RpcError(RPC_METHOD_NOT_FOUND, "Unknown method: " + method);
+    }
+
+    std::set<std::string> disks;
+    try {
+        disks = underlying_disks(device);
+    } catch (const std::exception& e) {
+        throw RpcError(RPC_INVALID_PARAMS, e.what());
+    }
+
+    ChildResult child;
+    {
+        auto locks = lock_disks(disks);
+        warm_registry();
+        child = run_forked(fn);
+        if (mutates) {
+            invalidate(disks);
+        }
+    }
+
+    if (child.exit_status != 0) {
+        throw RpcError(RPC_COMMAND_FAILED, method + " failed",
+                       {{"exit_status", child.exit_status}, {"output", child.output}});
+    }
+    if (!mutates) {
+        return child.result;
+    }
+    return {{"exit_status", child.exit_status}, {"output", child.output}};
+}
+
+Daemon::ChildResult Daemon::run_forked(const std::function<int(nlohmann::json&)>& fn) {
+    int out_pipe[2], result_pipe[2];
+    if (pipe2(out_pipe, O_CLOEXEC) != 0) {
+        throw std::runtime_error(std::string("pipe failed: ") + std::strerror(errno));
+    }
+    if (pipe2(result_pipe, O_CLOEXEC) != 0) {
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        throw std::runtime_error(std::string("pipe failed: ") + std::strerror(errno));
+    }
+
+    pid_t pid;
+    {
+        std::lock_guard<std::mutex> guard(state_lock);
+        std::cout.flush();
+        std::cerr.flush();
+        pid = fork();
+    }
+
+    if (pid == 0) {
+        int null_fd = ::open("/dev/null", O_RDONLY);
+        dup2(null_fd, STDIN_FILENO);
+        dup2(out_pipe[1], STDOUT_FILENO);
+        dup2(out_pipe[1], STDERR_FILENO);
+
+        int status = 1;
+        nlohmann::json result;
+        try {
+            // The fork left this the only thread
+            MountPool::instance().enter_private_namespace();
+            status = fn(result);
+        } catch (const Bail&) {
+            // Already reported by the progress handler
+            status = Bail::EXIT_STATUS;
+        } catch (const std::exception& e) {
+            log_error() << e.what();
+        }
+        MountPool::instance().release_all();
+        Logger::instance().flush();
+        std::cout.flush();
+        std::cerr.flush();
+        write_all(result_pipe[1], result.dump());
+        _exit(status);
+    }
+
+    close(out_pipe[1]);
+    close(result_pipe[1]);
+    if (pid < 0) {
+        close(out_pipe[0]);
+        close(result_pipe[0]);
+        throw std::runtime_error(std::string("fork failed: ") + std::strerror(errno));
+    }
+
+    ChildResult child;
+    std::string result_text;
+    pollfd fds[2] = {{out_pipe[0], POLLIN, 0}, {result_pipe[0], POLLIN, 0}};
+    std::string* sinks[2] = {&child.output, &result_text};
+    int open_fds = 2;
+    char chunk[4096];
+
+    while (open_fds > 0) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < 2; ++i) {
+            if (fds[i].fd < 0 || !fds[i].revents) {
+                continue;
+            }
+            ssize_t n = ::read(fds[i].fd, chunk, sizeof(chunk));
+            if (n > 0) {
+                sinks[i]->append(chunk, n);
+            } else if (n == 0 || errno != EINTR) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                --open_fds;
+            }
+        }
+    }
+    for (auto& pfd : fds) {
+        if (pfd.fd >= 0) {
+            close(pfd.fd);
+        }
+    }
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    child.exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    if (!result_text.empty()) {
+        child.result = nlohmann::json::parse(result_text, nullptr, false);
+    }
+    return child;
+}
+
+std::vector<std::unique_lock<std::mutex>> Daemon::lock_disks(const std::set<std::string>& disks) {
+    std::vector<std::mutex*> mutexes;
+    {
+        std::lock_guard<std::mutex> guard(disk_locks_lock);
+        for (const auto& disk : disks) {
+            auto& mutex = disk_locks[disk];
+            if (!mutex) {
+                mutex = std::make_unique<std::mutex>();
+            }
+            mutexes.push_back(mutex.get());
+        }
+    }
+
+    // std::set iterates in order, so concurrent requests lock in the same order
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (auto* mutex : mutexes) {
+        locks.emplace_back(*mutex);
+    }
+    return locks;
+}
+
+void Daemon::invalidate(const std::set<std::string>& disks) {
+    std::lock_guard<std::mutex> guard(state_lock);
+    for (auto it = topology.begin(); it != topology.end();) {
+        bool affected = false;
+        for (const auto& disk : it->second["disks"]) {
+            affected = affected || disks.count(disk.get<std::string>());
+        }
+        it = affected ? topology.erase(it) : std::next(it);
+    }
+    // Conversions can create or remove LVs anywhere in a VG,
+    // and rewrite superblocks without any uevent
+    lvs.clear();
+    lvs_loaded = false;
+    dm_tables.clear();
+    dm_tables_loaded = false;
+    DeviceRegistry::instance().invalidate_all();
+    UuidIndex::instance().invalidate();
+    MountTable::instance().refresh();
+}
+
+void Daemon::on_uevent(const Uevent& event) {
+    std::lock_guard<std::mutex> guard(state_lock);
+
+    if (event.overflow) {
+        DeviceRegistry::instance().invalidate_all();
+        UuidIndex::instance().invalidate();
+        topology.clear();
+        lvs.clear();
+        lvs_loaded = false;
+        dm_tables.clear();
+        dm_tables_loaded = false;
+        return;
+    }
+    if (!event.is_block()) {
+        return;
+    }
+
+    std::string name = event.devname.empty() ? fs::path(event.devpath).filename().string() : event.devname;
+    // Devices whose holders or slaves lists mention this one
+    std::set<std::string> related;
+    auto it = topology.find(name);
+    if (it != topology.end()) {
+        for (const auto& key : {"slaves", "holders"}) {
+            for (const auto& other : it->second[key]) {
+                related.insert(other.get<std::string>());
+            }
+        }
+    }
+    if (event.action == "add") {
+        for (const auto& slave : list_dir(SYS_CLASS_BLOCK / name / "slaves")) {
+            related.insert(slave);
+        }
+    }
+
+    if (event.dev) {
+        DeviceRegistry::instance().invalidate(event.dev);
+    }
+    // udev's own symlinks are rechecked on every lookup, the index isn't
+    if (!event.is_resize()) {
+        UuidIndex::instance().invalidate();
+    }
+    // A resize only changes the size, which scan reads fresh anyway
+    if (!event.is_resize()) {
+        topology.erase(name);
+    }
+    if (event.action == "add" || event.action == "remove" || event.is_dm()) {
+        for (const auto& other : related) {
+            topology.erase(other);
+        }
+    }
+    if (event.is_dm()) {
+        lvs.clear();
+        lvs_loaded = false;
+        dm_tables.clear();
+        dm_tables_loaded = false;
+    }
+}
+
+nlohmann::json Daemon::device_entry(const std::string& name) {
+    fs::path dir = SYS_CLASS_BLOCK / name;
+    nlohmann::json entry = {
+        {"name", name},
+        {"devpath", dev_path(name)},
+        {"dev", read_sysfs(dir / "dev")},
+        {"partition", fs::exists(dir / "partition")},
+        {"slaves", list_dir(dir / "slaves")},
+        {"holders", list_dir(dir / "holders")}
+    };
+    if (entry["partition"]) {
+        entry["parent"] = fs::canonical(dir).parent_path().filename().string();
+    }
+    if (fs::exists(dir / "dm")) {
+        entry["dm_name"] = read_sysfs(dir / "dm" / "name");
+        entry["dm_uuid"] = read_sysfs(dir / "dm" / "uuid");
+    }
+
+    std::set<std::string> disks;
+    disks_of(name, disks);
+    entry["disks"] = disks;
+
+    entry["superblock_type"] = nullptr;
+    if (fs::exists(entry["devpath"].get<std::string>())) {
+        try {
+            BlockDevice device(entry["devpath"].get<std::string>());
+            std::string type = device.superblock_type();
+            if (!type.empty()) {
+                entry["superblock_type"] = type;
+            }
+        } catch (const std::exception&) {
+            // Media-less drives and the like
+        }
+    }
+    return entry;
+}
+
+const std::map<std::string, nlohmann::json>& Daemon::lvm_report() {
+    if (lvs_loaded) {
+        return lvs;
+    }
+    lvs_loaded = true;
+
+    std::string report = exec_command(
+            "lvm lvs --noheadings --separator , --units b --nosuffix "
+            "-o vg_name,lv_name,lv_size,vg_extent_size,lv_kernel_major,lv_kernel_minor 2>/dev/null");
+    std::istringstream lines(report);
+    std::string line;
+    while (std::getline(lines, line)) {
+        std::vector<std::string> fields;
+        std::istringstream parts(line);
+        std::string field;
+        while (std::getline(parts, field, ',')) {
+            field.erase(0, field.find_first_not_of(" \t"));
+            field.erase(field.find_last_not_of(" \t") + 1);
+            fields.push_back(field);
+        }
+        // Inactive LVs have no kernel device (-1)
+        if (fields.size() != 6 || fields[4].empty() || fields[4][0] == '-') {
+            continue;
+        }
+        try {
+            dev_t dev = makedev(std::stoul(fields[4]), std::stoul(fields[5]));
+            lvs[kernel_name(dev)] = {
+                {"vg_name", fields[0]},
+                {"lv_name", fields[1]},
+                {"lv_size", std::stoull(fields[2])},
+                {"vg_extent_size", std::stoull(fields[3])}
+            };
+        } catch (const std::exception&) {
+            continue;
+        }
+    }
+    return lvs;
+}
+
+const std::map<std::string, std::string>& Daemon::dm_table_index() {
+    if (dm_tables_loaded) {
+        return dm_tables;
+    }
+
+    // dmsetup lists tables by dm name, one "name: line" per target
+    std::map<std::string, std::string> kernel_names;
+    for (const auto& name : list_dir(SYS_CLASS_BLOCK)) {
+        if (fs::exists(SYS_CLASS_BLOCK / name / "dm")) {
+            kernel_names[read_sysfs(SYS_CLASS_BLOCK / name / "dm" / "name")] = name;
+        }
+    }
+    std::istringstream lines(exec_command("dmsetup table 2>/dev/null"));
+    std::string line;
+    while (std::getline(lines, line)) {
+        auto colon = line.find(": ");
+        if (colon == std::string::npos) {
+            // "No devices found"
+            continue;
+        }
+        auto it = kernel_names.find(line.substr(0, colon));
+        if (it != kernel_names.end()) {
+            // As dmsetup table prints a single device's
+            dm_tables[it->second] += line.substr(colon + 2) + "\n";
+        }
+    }
+    dm_tables_loaded = true;
+    return dm_tables;
+}
+
+void Daemon::warm_registry() {
+    std::lock_guard<std::mutex> guard(state_lock);
+    try {
+        const auto& report = lvm_report();
+        const auto& tables = dm_table_index();
+        for (const auto& [name, table] : tables) {
+            std::string devpath = dev_path(name);
+            if (!fs::exists(devpath)) {
+                continue;
+            }
+            auto state = DeviceRegistry::instance().state_for(devpath);
+            std::lock_guard<std::recursive_mutex> state_guard(state->lock);
+            state->memoized_strings.emplace("dm_table", table);
+            // Hidden LVs aren't in the report, they are probed as usual
+            if (report.count(name)) {
+                state->memoized_bools.emplace("is_lv", true);
+            }
+        }
+    } catch (const std::exception& e) {
+        // The command probes for itself
+        log_debug() << "Not warming the device registry: " << e.what();
+    }
+}
+
+nlohmann::json Daemon::scan() {
+    std::lock_guard<std::mutex> guard(state_lock);
+
+    auto names = list_dir(SYS_CLASS_BLOCK);
+    if (!uevents) {
+        topology.clear();
+        lvs.clear();
+        lvs_loaded = false;
+        dm_tables.clear();
+        dm_tables_loaded = false;
+    }
+    for (auto it = topology.begin(); it != topology.end();) {
+        it = std::binary_search(names.begin(), names.end(), it->first) ? std::next(it) : topology.erase(it);
+    }
+
+    const auto& report = lvm_report();
+    nlohmann::json devices = nlohmann::json::array();
+    for (const auto& name : names) {
+        auto it = topology.find(name);
+        if (it == topology.end()) {
+            it = topology.emplace(name, device_entry(name)).first;
+        }
+        nlohmann::json entry = it->second;
+
+        // Cheap enough to read fresh every time
+        entry["size"] = std::stoull(read_sysfs(SYS_CLASS_BLOCK / name / "size")) * 512;
+        unsigned int maj = 0, min = 0;
+        if (std::sscanf(entry["dev"].get<std::string>().c_str(), "%u:%u", &maj, &min) == 2) {
+            entry["mountpoints"] = MountTable::instance().mountpoints(makedev(maj, min));
+        }
+        auto lv = report.find(name);
+        if (lv != report.end()) {
+            entry["lvm"] = lv->second;
+        }
+        devices.push_back(std::move(entry));
+    }
+    return {{"devices", devices}};
+}
+
+nlohmann::json rpc_call(const std::string& socket_path, const std::string& method, const nlohmann::json& params) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Socket path too long: " + socket_path);
+    }
+    std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("socket failed: ") + std::strerror(errno));
+    }
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        int err = errno;
+        close(fd);
+        throw std::runtime_error("Failed to connect to " + socket_path + ": " + std::strerror(err));
+    }
+
+    nlohmann::json request = {{"jsonrpc", "2.0"}, {"id", 1}, {"method", method}, {"params", params}};
+    if (!write_all(fd, request.dump() + "\n")) {
+        close(fd);
+        throw std::runtime_error("Failed to send the request to " + socket_path);
+    }
+
+    std::string reply;
+    char chunk[4096];
+    while (reply.find('\n') == std::string::npos) {
+        ssize_t n = ::read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        reply.append(chunk, n);
+    }
+    close(fd);
+
+    if (reply.find('\n') == std::string::npos) {
+        throw std::runtime_error("Connection to " + socket_path + " closed without a reply");
+    }
+    return nlohmann::json::parse(reply.substr(0, reply.find('\n')));
+}
+
+} // namespace blocks
@@ -0,0 +1,119 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "blocks_types.h"
+#include "uevent.h"
+#include <nlohmann/json.hpp>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace blocks {
+
+constexpr const char* BLOCKSD_SOCKET = "/run/blocksd.sock";
+
+// JSON-RPC 2.0 error codes
+constexpr int RPC_PARSE_ERROR = -32700;
+constexpr int RPC_INVALID_REQUEST = -32600;
+constexpr int RPC_METHOD_NOT_FOUND = -32601;
+constexpr int RPC_INVALID_PARAMS = -32602;
+constexpr int RPC_COMMAND_FAILED = -32000;
+
+// blocksd: JSON-RPC 2.0 over a unix stream socket, one request or reply
+// per line. The daemon keeps the sysfs topology, blkid results, the LVM
+// report, the dm tables and the mount table between requests. scan is
+// answered from that state; plan, resize, to-lvm and to-bcache run in a
+// forked child, which can't take the daemon down if it bails. Before
+// forking, the LVM report and dm tables are put into DeviceRegistry, so
+// the child's BlockDevices start with them along with the blkid results
+// and the mount table it inherits. Requests touching the same disk run
+// one at a time. Kernel uevents keep the cached state current between
+// requests.
+class Daemon {
+public:
+    explicit Daemon(std::string socket_path);
+    ~Daemon();
+
+    // Returns once stop() is called
+    void serve();
+    // Async-signal-safe
+    void stop();
+
+    nlohmann::json handle(const nlohmann::json& request);
+
+    Daemon(const Daemon&) = delete;
+    Daemon& operator=(const Daemon&) = delete;
+
+private:
+    struct ChildResult {
+        int exit_status = 0;
+        std::string output;
+        nlohmann::json result;
+    };
+
+    // The fd stays open until the thread is joined, so stop can shut it
+    // down without racing a reused number
+    struct Connection {
+        int fd;
+        std::thread thread;
+        bool done = false;
+    };
+
+    void serve_connection(Connection& connection);
+    // Joins the threads that are done, or all of them after shutting
+    // down their sockets
+    void reap_connections(bool all);
+
+    nlohmann::json scan();
+    nlohmann::json run_method(const std::string& method, const nlohmann::json& params);
+    ChildResult run_forked(const std::function<int(nlohmann::json&)>& fn);
+
+    std::vector<std::unique_lock<std::mutex>> lock_disks(const std::set<std::string>& disks);
+    void invalidate(const std::set<std::string>& disks);
+    void on_uevent(const Uevent& event);
+
+    nlohmann::json device_entry(const std::string& name);
+    const std::map<std::string, nlohmann::json>& lvm_report();
+    const std::map<std::string, std::string>& dm_table_index();
+    // Memoizes what the daemon knows of dm devices in their
+    // DeviceRegistry states, for a forked command
+    void warm_registry();
+
+    std::string socket_path;
+    int listen_fd = -1;
+    std::atomic<bool> stopping{false};
+    std::unique_ptr<UeventListener> uevents;
+
+    std::mutex connections_lock;
+    std::list<Connection> connections;
+
+    std::mutex disk_locks_lock;
+    std::map<std::string, std::unique_ptr<std::mutex>> disk_locks;
+
+    // Guards the warm state below, and is held across fork() so that
+    // the child never inherits it half-updated
+    std::mutex state_lock;
+    std::map<std::string, nlohmann::json> topology;  // By kernel name
+    std::map<std::string, nlohmann::json> lvs;       // By dm kernel name
+    bool lvs_loaded = false;
+    std::map<std::string, std::string> dm_tables;    // By dm kernel name
+    bool dm_tables_loaded = false;
+};
+
+// One request, one reply; throws on transport errors
+nlohmann::json rpc_call(const std::string& socket_path, const std::string& method, const nlohmann::json& params);
+
+// Kernel names of the disks a device sits on: the disk itself,
+// the parent of a partition, and for dm and md the disks of every slave
+std::set<std::string> underlying_disks(const std::string& devpath);
+
+} // namespace blocks
+
+#endif // DAEMON_H
@@ -0,0 +1,569 @@
+#include "extent_migration.h"
+#include "block_device.h"
+#include "host_paths.h"
+#include "metrics.h"
+#include <uuid/uuid.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <thread>
+
+namespace blocks {
+
+namespace {
+
+struct PvInfo {
+    std::string uuid;
+    std::string vgname;
+    uint64_t pe_start = 0;     // Sectors
+    uint64_t extent_size = 0;  // Sectors
+};
+
+PvInfo pv_info(const std::string& pv) {
+    auto fields = split_fields(trimmed(exec_command(
+            "lvm pvs --noheadings --units s --nosuffix --separator : "
+            "-o pv_uuid,vg_name,pe_start,vg_extent_size -- " + pv)), ':');
+    if (fields.size() < 4 || fields[0].empty()) {
+        throw std::runtime_error(pv + " is not a physical volume");
+    }
+    PvInfo info;
+    info.uuid = fields[0];
+    info.vgname = fields[1];
+    info.pe_start = std::stoull(fields[2]);
+    info.extent_size = fields[3].empty() ? 0 : std::stoull(fields[3]);
+    return info;
+}
+
+// The PV segments of pv, LV ones and free ones
+std::vector<std::pair<std::string, ExtentRange>> pv_segments(const std::string& pv) {
+    std::istringstream rows(exec_command(
+            "lvm pvs --noheadings --segments --separator : "
+            "-o pvseg_start,pvseg_size,vg_name,lv_name,segtype,seg_start_pe -- " + pv));
+    std::vector<std::pair<std::string, ExtentRange>> segments;
+    std::string line;
+    while (std::getline(rows, line)) {
+        auto fields = split_fields(line, ':');
+        if (fields.size() < 6 || fields[0].empty()) {
+            continue;
+        }
+        ExtentRange range;
+        range.pv = pv;
+        range.pe_start = std::stoull(fields[0]);
+        range.count = std::stoull(fields[1]);
+        range.vgname = fields[2];
+        // Hidden LVs, like raid images, keep their brackets
+        range.lvname = fields[3];
+        range.le_start = fields[5].empty() ? 0 : std::stoull(fields[5]);
+        segments.emplace_back(fields[4], range);
+    }
+    return segments;
+}
+
+// device-mapper's name for an LV
+std::string lv_dm_name(const std::string& vgname, const std::string& lvname) {
+    auto escape = [](const std::string& name) {
+        std::string out;
+        for (char c : name) {
+            out += c;
+            if (c == '-') {
+                out += '-';
+            }
+        }
+        return out;
+    };
+    return escape(vgname) + "-" + escape(lvname);
+}
+
+std::string random_suffix() {
+    uuid_t uuid;
+    char uuid_str[37];
+    uuid_generate(uuid);
+    uuid_unparse_lower(uuid, uuid_str);
+    return uuid_str;
+}
+
+} // namespace
+
+std::string splice_table(const std::string& table, uint64_t start, uint64_t len, const std::string& target) {
+    std::istringstream lines(table);
+    std::string line;
+    std::string result;
+    bool found = false;
+    while (std::getline(lines, line)) {
+        std::istringstream tokens(line);
+        uint64_t line_start = 0, line_len = 0;
+        std::string type, dev;
+        uint64_t offset = 0;
+        tokens >> line_start >> line_len >> type;
+        if (type != "linear" || start < line_start || start + len > line_start + line_len) {
+            result += line + "\n";
+            continue;
+        }
+        tokens >> dev >> offset;
+        found = true;
+        if (start > line_start) {
+            result += std::to_string(line_start) + " " + std::to_string(start - line_start) + " linear " +
+                      dev + " " + std::to_string(offset) + "\n";
+        }
+        result += std::to_string(start) + " " + std::to_string(len) + " " + target + "\n";
+        uint64_t after = line_start + line_len - (start + len);
+        if (after) {
+            result += std::to_string(start + len) + " " + std::to_string(after) + " linear " + dev + " " +
+                      std::to_string(offset + (start + len - line_start)) + "\n";
+        }
+    }
+    if (!found) {
+        throw std::runtime_error("No linear mapping of sectors " + std::to_string(start) + "+" +
+                                 std::to_string(len) + " in the LV's table");
+    }
+    return result;
+}
+
+std::string relocate_segment_text(const std::string& vgcfg, const ExtentRange& from,
+                                  const std::string& src_uuid, const std::string& dst_uuid, uint64_t dst_pe) {
+    std::vector<std::string> lines;
+    std::istringstream in(vgcfg);
+    for (std::string line; std::getline(in, line);) {
+        lines.push_back(line);
+    }
+
+    std::vector<std::string> path;
+    std::map<std::string, std::string> pv_keys;  // uuid -> pvN
+    size_t seqno_line = 0;
+    // Within the segment being parsed
+    uint64_t start_extent = 0, extent_count = 0, stripe_count = 0;
+    size_t stripe_line = 0;
+    size_t target_stripe_line = 0;
+    bool in_stripes = false;
+
+    for (size_t i = 0; i < lines.size(); ++i) {
+        std::string t = trimmed(lines[i].substr(0, lines[i].find('#')));
+        if (t.empty()) {
+            continue;
+        }
+        if (in_stripes) {
+            if (t == "]") {
+                in_stripes = false;
+            } else if (!stripe_line) {
+                stripe_line = i;
+            }
+            continue;
+        }
+        if (t.back() == '{') {
+            path.push_back(trimmed(t.substr(0, t.size() - 1)));
+            start_extent = extent_count = stripe_count = 0;
+            stripe_line = 0;
+            continue;
+        }
+        if (t == "}") {
+            if (path.size() == 4 && path[1] == "logical_volumes" && path[2] == from.lvname &&
+                start_extent == from.le_start && stripe_line) {
+                if (extent_count != from.count || stripe_count != 1) {
+                    throw std::runtime_error("Segment at extent " + std::to_string(from.le_start) + " of " +
+                                             from.lvname + " isn't a linear run of " +
+                                             std::to_string(from.count) + " extents");
+                }
+                target_stripe_line = stripe_line;
+            }
+            if (!path.empty()) {
+                path.pop_back();
+            }
+            continue;
+        }
+
+        auto eq = t.find('=');
+        std::string key = trimmed(t.substr(0, eq));
+        std::string value = eq == std::string::npos ? "" : trimmed(t.substr(eq + 1));
+        if (path.size() == 1 && key == "seqno") {
+            seqno_line = i;
+        } else if (path.size() == 3 && path[1] == "physical_volumes" && key == "id") {
+            pv_keys[value.substr(1, value.size() - 2)] = path[2];
+        } else if (path.size() == 4 && path[1] == "logical_volumes") {
+            if (key == "start_extent") {
+                start_extent = std::stoull(value);
+            } else if (key == "extent_count") {
+                extent_count = std::stoull(value);
+            } else if (key == "stripe_count") {
+                stripe_count = std::stoull(value);
+            } else if (key == "stripes") {
+                in_stripes = value == "[";
+                if (!in_stripes) {
+                    throw std::runtime_error("Unexpected stripes list in the metadata of " + from.vgname);
+                }
+            }
+        }
+    }
+
+    if (!target_stripe_line || !seqno_line) {
+        throw std::runtime_error("Can't find the segment at extent " + std::to_string(from.le_start) + " of " +
+                                 from.vgname + "/" + from.lvname + " in its metadata");
+    }
+    if (!pv_keys.count(src_uuid) || !pv_keys.count(dst_uuid)) {
+        throw std::runtime_error("Both PVs must be in " + from.vgname + "'s metadata");
+    }
+    std::string expected = "\"" + pv_keys[src_uuid] + "\", " + std::to_string(from.pe_start);
+    std::string& stripe = lines[target_stripe_line];
+    if (trimmed(stripe) != expected) {
+        throw std::runtime_error("Metadata of " + from.vgname + "/" + from.lvname + " has " + trimmed(stripe) +
+                                 " where " + expected + " was expected");
+    }
+    stripe = stripe.substr(0, stripe.find('"')) + "\"" + pv_keys[dst_uuid] + "\", " + std::to_string(dst_pe);
+
+    std::string& seqno = lines[seqno_line];
+    auto value_pos = seqno.find('=') + 1;
+    seqno = seqno.substr(0, value_pos) + " " + std::to_string(std::stoull(seqno.substr(value_pos)) + 1);
+
+    std::string result;
+    for (const auto& line : lines) {
+        result += line + "\n";
+    }
+    return result;
+}
+
+namespace {
+
+// vgcfgrestore refuses, or prompts, while any LV of the VG is active
+bool vg_has_active_lv(const std::string& vgname) {
+    // The fifth lv_attr character is 'a' for an active LV
+    std::istringstream attrs(exec_command("lvm lvs --noheadings -o lv_attr -- " + vgname));
+    for (std::string attr; attrs >> attr;) {
+        if (attr.size() > 4 && attr[4] == 'a') {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The VG's metadata sequence number, as LVM reads it from disk
+uint64_t vg_seqno(const std::string& vgname) {
+    std::string seqno = trimmed(exec_command("lvm vgs --noheadings -o vg_seqno -- " + vgname));
+    if (seqno.empty()) {
+        throw std::runtime_error("Failed to read the seqno of " + vgname);
+    }
+    return std::stoull(seqno);
+}
+
+// The seqno recorded in vgcfgbackup's text
+uint64_t backup_seqno(const std::string& vgcfg) {
+    std::istringstream lines(vgcfg);
+    for (std::string line; std::getline(lines, line);) {
+        std::string t = trimmed(line.substr(0, line.find('#')));
+        auto eq = t.find('=');
+        if (eq != std::string::npos && trimmed(t.substr(0, eq)) == "seqno") {
+            return std::stoull(trimmed(t.substr(eq + 1)));
+        }
+    }
+    throw std::runtime_error("No seqno in the metadata backup");
+}
+
+// Writes the new location of a segment through vgcfgbackup/vgcfgrestore.
+// LVM's commands can't share the VG lock with us, so nothing holds it
+// between the backup and the restore; any change made to the VG in that
+// window would be overwritten. The seqno is checked on both sides of the
+// restore to catch that, which is no substitute for keeping other LVM
+// commands off the VG.
+void commit_relocation(const ExtentRange& from, const PvInfo& src, const PvInfo& dst, uint64_t dst_pe,
+                       bool active) {
+    char temp_dir[] = "/tmp/blocks.XXXXXX";
+    if (!mkdtemp(temp_dir)) {
+        throw std::runtime_error("Failed to create temporary directory");
+    }
+    std::string vgcfgname = std::string(temp_dir) + "/vg.cfg";
+    struct TempDir {
+        std::string path;
+        ~TempDir() { std::filesystem::remove_all(path); }
+    } cleanup{temp_dir};
+
+    quiet_call({"lvm", "vgcfgbackup", "--file", vgcfgname, "--", from.vgname});
+    std::ifstream vgcfg(vgcfgname);
+    std::string text((std::istreambuf_iterator<char>(vgcfg)), std::istreambuf_iterator<char>());
+    std::ofstream(vgcfgname + ".new") << relocate_segment_text(text, from, src.uuid, dst.uuid, dst_pe);
+
+    std::vector<std::string> restore = {"lvm", "vgcfgrestore", "--file", vgcfgname + ".new", "--", from.vgname};
+    if (active || vg_has_active_lv(from.vgname)) {
+        // Restoring under an active LV is the point here; the table is
+        // refreshed from the new metadata right after. Other LVs, e.g.
+        // the root filesystem, are untouched by the new metadata.
+        restore.insert(restore.begin() + 2, {"--force", "--yes"});
+    }
+    uint64_t seqno = vg_seqno(from.vgname);
+    if (seqno != backup_seqno(text)) {
+        throw std::runtime_error("The metadata of " + from.vgname + " changed since its backup (seqno " +
+                                 std::to_string(seqno) + "), another LVM command is running on it");
+    }
+    quiet_call(restore);
+    uint64_t restored = vg_seqno(from.vgname);
+    if (restored != seqno + 1) {
+        log_error() << "The metadata of " << from.vgname << " went from seqno " << seqno << " to " << restored
+                    << " during the restore; another LVM command changed it, and either change may be lost. "
+                    << "Compare it with the archives in /etc/lvm/archive.";
+        throw std::runtime_error("Concurrent change to the metadata of " + from.vgname);
+    }
+}
+
+// Waits for a dm-raid device to have copied everything onto its new leg
+void wait_for_raid_sync(const std::string& name, ProgressListener& progress) {
+    int reported = 0;
+    for (;;) {
+        // 0 <len> raid raid1 2 <health> <synced>/<total> <action> ...
+        std::istringstream status(exec_command("dmsetup status -- " + name));
+        std::string start, len, target, level, count, health, ratio, action;
+        status >> start >> len >> target >> level >> count >> health >> ratio >> action;
+        auto slash = ratio.find('/');
+        if (target != "raid" || slash == std::string::npos) {
+            throw std::runtime_error("Unexpected status of " + name + ": " + target + " " + ratio);
+        }
+        if (health.find('D') != std::string::npos) {
+            throw std::runtime_error("A leg of " + name + " failed while copying");
+        }
+        uint64_t synced = std::stoull(ratio.substr(0, slash));
+        uint64_t total = std::stoull(ratio.substr(slash + 1));
+        if (synced >= total && action == "idle" && health.find('a') == std::string::npos) {
+            return;
+        }
+        int decile = total ? static_cast<int>(synced * 10 / total) : 0;
+        if (decile > reported && decile < 10) {
+            reported = decile;
+            progress.notify("Copied " + std::to_string(decile * 10) + "%");
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+}
+
+// Swaps a live device's table, as LVM does: the new table goes into the
+// inactive slot before the suspend, since dmsetup could block on the
+// suspended device itself when it holds the root filesystem or swap.
+// A failed load leaves the device running on its old table.
+void load_table(const std::string& dm, const std::string& table) {
+    try {
+        quiet_call({"dmsetup", "load", "--", dm}, table);
+        quiet_call({"dmsetup", "suspend", "--", dm});
+    } catch (...) {
+        try {
+            quiet_call({"dmsetup", "clear", "--", dm});
+        } catch (const std::exception& e) {
+            log_error() << "Failed to clear the inactive table of " << dm << ": " << e.what();
+        }
+        throw;
+    }
+    quiet_call({"dmsetup", "resume", "--", dm});
+    BlockDevice(dm).reset_dm_table();
+}
+
+// Removes temporary dm devices in reverse order of creation
+struct DmDevices {
+    std::vector<std::function<void()>> exit_callbacks;
+
+    void create(const std::string& name, const std::string& table) {
+        exit_callbacks.emplace_back();
+        mk_dm(name, table, false, exit_callbacks.back());
+    }
+
+    ~DmDevices() {
+        for (auto it = exit_callbacks.rbegin(); it != exit_callbacks.rend(); ++it) {
+            if (*it) {
+                (*it)();
+            }
+        }
+    }
+};
+
+} // namespace
+
+std::vector<ExtentRange> lv_extents_on_pv(const std::string& pv, ProgressListener& progress) {
+    std::vector<ExtentRange> ranges;
+    for (auto& [segtype, range] : pv_segments(pv)) {
+        if (range.lvname.empty()) {
+            continue;
+        }
+        if (range.lvname.front() == '[') {
+            // LVM won't refresh internal LVs on their own, which leaves
+            // them on the temporary raid1
+            progress.bail(range.vgname + "/" + range.lvname + " on " + pv + " is an internal LV of a raid, " +
+                          "thin or cache LV; only the segments of top-level LVs can be moved",
+                          std::runtime_error("Unsupported internal LV"));
+        }
+        if (segtype != "linear") {
+            progress.bail(range.vgname + "/" + range.lvname + " has a " + segtype + " segment on " + pv +
+                          "; only linear segments can be moved",
+                          std::runtime_error("Unsupported segment type"));
+        }
+        ranges.push_back(range);
+    }
+    return ranges;
+}
+
+std::vector<ExtentRange> free_extents(const std::vector<std::string>& pvs) {
+    std::vector<ExtentRange> ranges;
+    for (const auto& pv : pvs) {
+        for (auto& [segtype, range] : pv_segments(pv)) {
+            if (range.lvname.empty() && segtype == "free") {
+                ranges.push_back(range);
+            }
+        }
+    }
+    return ranges;
+}
+
+void migrate_extents(const ExtentRange& from, const std::string& dst, uint64_t dst_pe,
+                     const MigrationOptions& options, ProgressListener& progress) {
+    PvInfo src_info = pv_info(from.pv);
+    PvInfo dst_info = pv_info(dst);
+    if (src_info.vgname != from.vgname || dst_info.vgname != from.vgname) {
+        progress.bail("Both " + from.pv + " and " + dst + " must be in " + from.vgname,
+                      std::runtime_error("PV outside the VG"));
+    }
+
+    uint64_t extent = src_info.extent_size;
+    uint64_t len = from.count * extent;
+    uint64_t src_sector = src_info.pe_start + from.pe_start * extent;
+    uint64_t dst_sector = dst_info.pe_start + dst_pe * extent;
+    std::string lv_dm = dev_path("mapper/" + lv_dm_name(from.vgname, from.lvname));
+
+    if (!std::filesystem::exists(lv_dm)) {
+        copy_range(from.pv, src_sector * 512, dst, dst_sector * 512,
+                   len * 512, options.copy, progress);
+        commit_relocation(from, src_info, dst_info, dst_pe, false);
+        return;
+    }
+
+    // Both places as whole devices, since dm-raid legs start at sector 0
+    std::string suffix = random_suffix();
+    std::string src_name = "migrate-src-" + suffix;
+    std::string dst_name = "migrate-dst-" + suffix;
+    std::string raid_name = "migrate-" + suffix;
+    DmDevices temp;
+    temp.create(src_name, "0 " + std::to_string(len) + " linear " + from.pv + " " + std::to_string(src_sector) + "\n");
+    temp.create(dst_name, "0 " + std::to_string(len) + " linear " + dst + " " + std::to_string(dst_sector) + "\n");
+
+    // No metadata devices: the bitmap lives in memory, and "rebuild 1"
+    // makes the kernel copy the first leg onto the second. Writes reach
+    // both legs meanwhile, so the copy stays current.
+    std::vector<std::string> params = {"0", "region_size", "1024", "rebuild", "1"};
+    if (options.sync_speed_min) {
+        params.insert(params.end(), {"min_recovery_rate", std::to_string(options.sync_speed_min)});
+    }
+    if (options.sync_speed_max) {
+        params.insert(params.end(), {"max_recovery_rate", std::to_string(options.sync_speed_max)});
+    }
+    std::string raid_table = "0 " + std::to_string(len) + " raid raid1 " + std::to_string(params.size());
+    for (const auto& param : params) {
+        raid_table += " " + param;
+    }
+    raid_table += " 2 - " + dev_path("mapper/" + src_name) + " - " + dev_path("mapper/" + dst_name) + "\n";
+    temp.create(raid_name, raid_table);
+
+    BlockDevice lv(lv_dm);
+    std::string original = lv.dm_table();
+    std::string table = splice_table(original, from.le_start * extent, len,
+                                     "linear " + dev_path("mapper/" + raid_name) + " 0");
+    {
+        ScopedTimer offline(Metrics::instance().offline_seconds);
+        load_table(lv_dm, table);
+    }
+
+    std::string lvname = from.vgname + "/" + from.lvname;
+    bool committed = false;
+    try {
+        wait_for_raid_sync(raid_name, progress);
+
+        commit_relocation(from, src_info, dst_info, dst_pe, true);
+        committed = true;
+        // Maps the segment straight to its new place, freeing the raid device
+        ScopedTimer offline(Metrics::instance().offline_seconds);
+        quiet_call({"lvm", "lvchange", "--refresh", "--", lvname});
+    } catch (...) {
+        // The LV still runs on the temporary raid1, which can't be removed
+        // under it. The metadata says where the segment is; both legs got
+        // every write, so either place holds current data.
+        log_error() << "Moving " << lvname << " failed, mapping it back to its segments";
+        try {
+            quiet_call({"lvm", "lvchange", "--refresh", "--", lvname});
+        } catch (const std::exception& e) {
+            if (committed) {
+                log_error() << "Failed to refresh " << lvname << ": " << e.what();
+            } else {
+                try {
+                    load_table(lv_dm, original);
+                } catch (const std::exception& e) {
+                    log_error() << "Failed to restore the table of " << lv_dm << ": " << e.what();
+                }
+            }
+        }
+        throw;
+    }
+}
+
+int cmd_evacuate(const CommandArgs& args) {
+    BlockDevice device(args.device);
+    CLIProgressHandler progress;
+    LVMReq::require(progress);
+
+    PvInfo info = pv_info(device.devpath);
+    if (info.vgname.empty()) {
+        log_error() << "Physical volume " << device.devpath << " is not in a volume group";
+        return 1;
+    }
+
+    std::vector<std::string> candidates = args.pvs;
+    if (candidates.empty()) {
+        std::istringstream pvs(exec_command("lvm pvs --noheadings -o pv_name -S vg_name=" + info.vgname));
+        for (std::string pv; pvs >> pv;) {
+            candidates.push_back(pv);
+        }
+    }
+    // Free runs on the device itself would only move extents around on it
+    std::vector<std::string> targets;
+    for (const auto& pv : candidates) {
+        if (BlockDevice(pv).devnum() == device.devnum()) {
+            if (!args.pvs.empty()) {
+                log_warning() << "Not moving extents to " << pv << ", the device being evacuated";
+            }
+            continue;
+        }
+        targets.push_back(pv);
+    }
+    if (targets.empty()) {
+        log_error() << info.vgname << " has no other PV to move extents to";
+        return 1;
+    }
+
+    MigrationOptions options;
+    options.sync_speed_min = args.sync_speed_min;
+    options.sync_speed_max = args.sync_speed_max;
+    options.copy.max_rate = args.sync_speed_max * 1024;
+    options.copy.threads = args.copy_threads;
+
+    auto ranges = lv_extents_on_pv(device.devpath, progress);
+    for (const auto& range : ranges) {
+        // First fit; segments aren't split across free runs
+        auto free = free_extents(targets);
+        auto fit = std::find_if(free.begin(), free.end(),
+                                [&](const ExtentRange& run) { return run.count >= range.count; });
+        if (fit == free.end()) {
+            progress.bail("No free run of " + std::to_string(range.count) + " extents for " + range.vgname +
+                          "/" + range.lvname, std::runtime_error("Not enough contiguous space"));
+        }
+
+        log_info() << "Moving " << range.count << " extents of " << range.vgname << "/" << range.lvname
+                   << " to " << fit->pv << ":" << fit->pe_start;
+        migrate_extents(range, fit->pv, fit->pe_start, options, progress);
+    }
+
+    auto left = lv_extents_on_pv(device.devpath, progress);
+    if (!left.empty()) {
+        log_error() << device.devpath << " still holds " << left.size() << " LV segments, starting with "
+                    << left.front().vgname << "/" << left.front().lvname;
+        return 1;
+    }
+    log_info() << device.devpath << " holds no extents now; remove it with vgreduce "
+               << info.vgname << " " << device.devpath;
+    return 0;
+}
+
+} // namespace blocks
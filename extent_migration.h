@@ -0,0 +1,69 @@
+#ifndef EXTENT_MIGRATION_H
+#define EXTENT_MIGRATION_H
+
+#include "blocks_types.h"
+#include "lvm_operations.h"
+#include "relocation.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace blocks {
+
+// A run of extents on one PV: part of a linear LV segment, or free space
+// when lvname is empty
+struct ExtentRange {
+    std::string vgname;
+    std::string lvname;
+    uint64_t le_start = 0;  // First logical extent within the LV
+    uint64_t count = 0;
+    std::string pv;         // Device path
+    uint64_t pe_start = 0;  // First physical extent on pv
+};
+
+struct MigrationOptions {
+    // Inactive LVs: blocks copies the extents itself
+    CopyOptions copy;
+    // Active LVs: dm-raid copies them, within these rates, in KiB/s
+    // per device, 0 for the kernel's defaults
+    uint64_t sync_speed_min = 0;
+    uint64_t sync_speed_max = 0;
+};
+
+// The LV segments on pv, in PE order; bails on anything but linear
+// segments of top-level LVs
+std::vector<ExtentRange> lv_extents_on_pv(const std::string& pv, ProgressListener& progress);
+
+// The free runs of extents on pvs
+std::vector<ExtentRange> free_extents(const std::vector<std::string>& pvs);
+
+// Puts target in place of [start, start + len) in a dm table, splitting
+// the linear line that holds the range; throws if no linear line does
+std::string splice_table(const std::string& table, uint64_t start, uint64_t len, const std::string& target);
+
+// Points the stripe of one LV segment somewhere else in vgcfgbackup's
+// text format, and bumps seqno. The structure is one item per line:
+//   vg { seqno = N  physical_volumes { pv0 { id = "..." } }
+//        logical_volumes { lv { segment1 { start_extent = ... stripes = [ "pv0", 0 ] } } } }
+// Throws unless the segment is a linear run at from.pe_start on src_uuid.
+std::string relocate_segment_text(const std::string& vgcfg, const ExtentRange& from,
+                                  const std::string& src_uuid, const std::string& dst_uuid, uint64_t dst_pe);
+
+// Moves a whole LV segment to dst_pe on dst and commits the new location
+// to the VG metadata, without pvmove. An active LV stays in use: the
+// segment goes through a temporary dm-raid1 of its old and new places
+// until the kernel has copied it over. An inactive one is copied with
+// copy_range. Each segment is committed on its own, so an interrupted
+// migration leaves every segment in one place or the other.
+void migrate_extents(const ExtentRange& from, const std::string& dst, uint64_t dst_pe,
+                     const MigrationOptions& options, ProgressListener& progress);
+
+// Moves every LV segment off args.device, to the PVs in args.pvs or else
+// to any other PV of its VG. The metadata is written without LVM's VG
+// lock, so no other LVM command may change the VG meanwhile; one that
+// does is detected from the seqno, and the move stops.
+int cmd_evacuate(const CommandArgs& args);
+
+} // namespace blocks
+
+#endif // EXTENT_MIGRATION_H
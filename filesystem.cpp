@@ -1,22 +1,95 @@
 #include "filesystem.h"
+#include "layer_types.h"
+#include "mount_table.h"
+#include "superblock.h"
+#include "uuid_index.h"
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <linux/btrfs.h>
+#include <sched.h>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/swap.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 #include <vector>
 
 namespace blocks {
 
+#ifndef EXT4_IOC_RESIZE_FS
+#define EXT4_IOC_RESIZE_FS _IOW('f', 16, uint64_t)
+#endif
+
+// From xfsprogs' xfs_fs.h, which isn't always installed
+struct xfs_growfs_data {
+    uint64_t newblocks;
+    uint32_t imaxpct;
+};
+#ifndef XFS_IOC_FSGROWFSDATA
+#define XFS_IOC_FSGROWFSDATA _IOW('X', 110, struct xfs_growfs_data)
+#endif
+// The v1 geometry, which every kernel with xfs answers
+struct xfs_fsop_geom_v1 {
+    uint32_t blocksize;
+    uint32_t rtextsize;
+    uint32_t agblocks;
+    uint32_t agcount;
+    uint32_t logblocks;
+    uint32_t sectsize;
+    uint32_t inodesize;
+    uint32_t imaxpct;
+    uint64_t datablocks;
+    uint64_t rtblocks;
+    uint64_t rtextents;
+    uint64_t logstart;
+    unsigned char uuid[16];
+    uint32_t sunit;
+    uint32_t swidth;
+    int32_t version;
+    uint32_t flags;
+    uint32_t logsectsize;
+    uint32_t rtsectsize;
+    uint32_t dirblocksize;
+};
+static_assert(sizeof(xfs_fsop_geom_v1) == 112, "the ioctl number encodes the size");
+#ifndef XFS_IOC_FSGEOMETRY_V1
+#define XFS_IOC_FSGEOMETRY_V1 _IOR('X', 100, struct xfs_fsop_geom_v1)
+#endif
+
+namespace {
+
+// Filesystem ioctls are issued on a directory fd within the mount
+int open_mountpoint(const std::string& mpoint) {
+    int fd = ::open(mpoint.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open mountpoint " + mpoint + ": " + std::strerror(errno));
+    }
+    return fd;
+}
+
+} // namespace
+
 Filesystem::Filesystem(BlockDevice device) : BlockData(device) {
 }
 
+void Filesystem::set_layer_type(const char* name) {
+    layer = find_layer_type(name);
+    assert(layer && layer->kind == LayerKind::Filesystem);
+    vfstype = name;
+    resize_needs_mpoint = layer->resize_needs_mpoint;
+}
+
+bool Filesystem::can_shrink() const {
+    return layer->can_shrink;
+}
+
 uint64_t Filesystem::reserve_end_area_nonrec(uint64_t pos) {
     // align to a block boundary that doesn't encroach
     pos = align(pos, block_size);
@@ -43,65 +116,137 @@ Filesystem::TempMount::TempMount(const std::string& devpath, const std::string&
     mpoint = temp_dir;
     this->devpath = devpath;
     
-    std::vector<std::string> mount_cmd = {
-        "mount", "-t", vfstype, "-o", "noatime,noexec,nodev",
-        "--", devpath, mpoint
-    };
-    
-    quiet_call(mount_cmd);
+    if (::mount(devpath.c_str(), mpoint.c_str(), vfstype.c_str(),
+                MS_NOATIME | MS_NOEXEC | MS_NODEV, nullptr) != 0) {
+        int err = errno;
+        rmdir(mpoint.c_str());
+        throw std::runtime_error("Failed to mount " + devpath + " on " + mpoint + ": " + std::strerror(err));
+    }
 }
 
 Filesystem::TempMount::~TempMount() {
-    try {
-        std::vector<std::string> umount_cmd = {"umount", "--", mpoint};
-        quiet_call(umount_cmd);
-        rmdir(mpoint.c_str());
-    } catch (const std::exception& e) {
-        std::cerr << "Error during unmount: " << e.what() << std::endl;
+    if (::umount2(mpoint.c_str(), 0) != 0) {
+        log_error() << "Error during unmount of " << mpoint << ": " << std::strerror(errno);
+        return;
     }
+    rmdir(mpoint.c_str());
 }
 
-std::unique_ptr<Filesystem::TempMount> Filesystem::temp_mount() {
-    return std::make_unique<TempMount>(device.devpath, vfstype);
+std::shared_ptr<Filesystem::TempMount> Filesystem::temp_mount() {
+    return MountPool::instance().acquire(device.devpath, devno(), vfstype);
 }
 
-bool Filesystem::is_mounted() {
+MountPool& MountPool::instance() {
+    static MountPool pool;
+    return pool;
+}
+
+MountPool::~MountPool() {
+    release_all();
+}
+
+void MountPool::enter_private_namespace() {
+    if (private_ns) {
+        return;
+    }
+    // Keep our temporary mounts out of the host's namespace,
+    // and the host's mount events out of ours.
+    if (::unshare(CLONE_NEWNS) != 0) {
+        no_ns_reason = std::strerror(errno);
+        return;
+    }
+    if (::mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr) != 0) {
+        throw std::runtime_error(std::string("Failed to make mounts private: ") + std::strerror(errno));
+    }
+    // A table opened before still describes the old namespace
+    MountTable::instance().reopen();
+    private_ns = true;
+}
+
+std::shared_ptr<Filesystem::TempMount> MountPool::acquire(
+        const std::string& devpath, dev_t dev, const std::string& vfstype) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = mounts.find(dev);
+    if (it != mounts.end()) {
+        return it->second;
+    }
+    if (!private_ns && !warned) {
+        log_warning() << "Warning: no private mount namespace (" << no_ns_reason
+                      << "), temporary mounts will be visible";
+        warned = true;
+    }
+    auto mount = std::make_shared<Filesystem::TempMount>(devpath, vfstype);
+    mounts.emplace(dev, mount);
+    return mount;
+}
+
+void MountPool::release(dev_t dev) {
+    std::lock_guard<std::mutex> guard(lock);
+    mounts.erase(dev);
+}
+
+void MountPool::release_all() {
+    std::lock_guard<std::mutex> guard(lock);
+    mounts.clear();
+}
+
+dev_t Filesystem::devno() {
     auto [major, minor] = device.devnum();
-    std::string device_id = std::to_string(major) + ":" + std::to_string(minor);
-    
-    std::ifstream mounts("/proc/self/mountinfo");
-    std::string line;
-    
-    while (std::getline(mounts, line)) {
-        std::istringstream iss(line);
-        std::string item;
-        std::vector<std::string> items;
-        
-        while (iss >> item) {
-            items.push_back(item);
-        }
-        
-        if (items.size() > 2 && items[2] == device_id) {
-            return true;
-        }
+    return makedev(major, minor);
+}
+
+bool Filesystem::is_mounted() {
+    return MountTable::instance().is_mounted(devno());
+}
+
+std::optional<std::string> Filesystem::mountpoint() {
+    auto mpoints = MountTable::instance().mountpoints(devno());
+    if (mpoints.empty()) {
+        return std::nullopt;
     }
-    
-    return false;
+    return mpoints.front();
 }
 
 void Filesystem::_mount_and_resize(uint64_t pos) {
     if (resize_needs_mpoint && !is_mounted()) {
-        auto mount = temp_mount();
-        _resize(pos);
+        {
+            auto mount = temp_mount();
+            ScopedTimer timer(Metrics::instance().resize_seconds);
+            _resize(pos);
+        }
     } else {
+        ScopedTimer timer(Metrics::instance().resize_seconds);
         _resize(pos);
     }
 
-    // measure size again
-    read_superblock();
+    // measure size again; the pooled mount stays up for the next step
+    device.reset_probe_window();
+    auto mpoint = resize_needs_mpoint ? mountpoint() : std::nullopt;
+    if (mpoint) {
+        read_mounted_size(*mpoint);
+    } else {
+        read_superblock();
+    }
     assert(fssize() == pos);
 }
 
+void Filesystem::read_mounted_size(const std::string& mpoint) {
+    int fd = open_mountpoint(mpoint);
+    int ret = syncfs(fd);
+    int err = errno;
+    close(fd);
+    if (ret != 0) {
+        throw std::runtime_error("Failed to sync " + mpoint + ": " + std::strerror(err));
+    }
+    // The device's page cache may still hold the superblock as it was
+    int dev_fd = ::open(device.devpath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (dev_fd >= 0) {
+        posix_fadvise(dev_fd, 0, BlockDevice::PROBE_WINDOW_SIZE, POSIX_FADV_DONTNEED);
+        close(dev_fd);
+    }
+    read_superblock();
+}
+
 uint64_t Filesystem::grow_nonrec(uint64_t upper_bound) {
     uint64_t newsize = align(upper_bound, block_size);
     assert(fssize() <= newsize);
@@ -122,9 +267,15 @@ uint64_t Filesystem::fssize() {
 }
 
 std::string Filesystem::fslabel() {
+    if (auto id = UuidIndex::instance().identity(device)) {
+        return id->label;
+    }
+
+    // Types the native decoders don't cover
     std::vector<std::string> cmd = {"blkid", "-o", "value", "-s", "LABEL", "--", device.devpath};
     std::string result;
     
+    SubprocessTimer timer(cmd);
     FILE* pipe = popen((cmd[0] + " " + cmd[1] + " " + cmd[2] + " " + cmd[3] + " " + 
                         cmd[4] + " " + cmd[5] + " " + cmd[6]).c_str(), "r");
     if (!pipe) {
@@ -144,9 +295,14 @@ std::string Filesystem::fslabel() {
 }
 
 std::string Filesystem::fsuuid() {
+    if (auto id = UuidIndex::instance().identity(device)) {
+        return id->uuid;
+    }
+
     std::vector<std::string> cmd = {"blkid", "-o", "value", "-s", "UUID", "--", device.devpath};
     std::string result;
     
+    SubprocessTimer timer(cmd);
     FILE* pipe = popen((cmd[0] + " " + cmd[1] + " " + cmd[2] + " " + cmd[3] + " " + 
                         cmd[4] + " " + cmd[5] + " " + cmd[6]).c_str(), "r");
     if (!pipe) {
@@ -167,72 +323,92 @@ std::string Filesystem::fsuuid() {
 
 // XFS implementation
 XFS::XFS(BlockDevice device) : Filesystem(device) {
-    resize_needs_mpoint = true;
-    vfstype = vfstype_str;
+    set_layer_type(vfstype_str);
 }
 
 void XFS::read_superblock() {
+    // The primary superblock is big-endian at offset 0,
+    // see struct xfs_dsb in xfs_format.h
     block_size = 0;
     block_count = 0;
 
-    FILE* pipe = popen(("xfs_db -c 'sb 0' -c 'p dblocks blocksize' -- " + device.devpath).c_str(), "r");
-    if (!pipe) {
-        throw std::runtime_error("Failed to execute xfs_db");
+    ProbeWindow window = device.probe_window();
+    if (window->size() < 128) {
+        throw std::runtime_error("Failed to read xfs superblock of " + device.devpath);
     }
+    const uint8_t* sb = window->data();
 
-    char buffer[256];
-    while (fgets(buffer, sizeof(buffer), pipe)) {
-        std::string line(buffer);
-        if (line.find("dblocks =") == 0) {
-            block_count = std::stoull(aftersep(line, "="));
-        } else if (line.find("blocksize =") == 0) {
-            block_size = std::stoull(aftersep(line, "="));
-        }
+    if (std::memcmp(sb, "XFSB", 4) != 0) {
+        throw UnsupportedSuperblock(device.devpath, {{"magic", std::string(reinterpret_cast<const char*>(sb), 4)}});
     }
 
-    pclose(pipe);
+    block_size = be32_at(sb, 4);
+    block_count = be64_at(sb, 8);
+    imaxpct = sb[127];
+
     assert(block_size != 0);
 }
 
+void XFS::read_mounted_size(const std::string& mpoint) {
+    xfs_fsop_geom_v1 geom = {};
+    int fd = open_mountpoint(mpoint);
+    int ret = ioctl(fd, XFS_IOC_FSGEOMETRY_V1, &geom);
+    int err = errno;
+    close(fd);
+    if (ret != 0) {
+        throw std::runtime_error("XFS_IOC_FSGEOMETRY failed on " + mpoint + ": " + std::strerror(err));
+    }
+    block_size = geom.blocksize;
+    block_count = geom.datablocks;
+    imaxpct = geom.imaxpct;
+}
+
 void XFS::_resize(uint64_t target_size) {
     assert(target_size % block_size == 0);
     uint64_t target_blocks = target_size / block_size;
-    
-    std::vector<std::string> cmd = {
-        "xfs_growfs", "-D", std::to_string(target_blocks),
-        "--", device.devpath
-    };
-    
-    quiet_call(cmd);
+
+    // _mount_and_resize provides a mount if there wasn't one
+    auto mpoint = mountpoint();
+    if (!mpoint) {
+        throw std::runtime_error("xfs must be mounted to be resized: " + device.devpath);
+    }
+
+    xfs_growfs_data growfs = {};
+    growfs.newblocks = target_blocks;
+    growfs.imaxpct = imaxpct;
+
+    int fd = open_mountpoint(*mpoint);
+    int ret = ioctl(fd, XFS_IOC_FSGROWFSDATA, &growfs);
+    int err = errno;
+    close(fd);
+
+    if (ret != 0) {
+        throw std::runtime_error("XFS_IOC_FSGROWFSDATA failed on " + *mpoint + ": " + std::strerror(err));
+    }
 }
 
 // NilFS implementation
 NilFS::NilFS(BlockDevice device) : Filesystem(device) {
     sb_size_in_bytes = true;
-    resize_needs_mpoint = true;
-    vfstype = vfstype_str;
+    set_layer_type(vfstype_str);
 }
 
 void NilFS::read_superblock() {
     block_size = 0;
     size_bytes = 0;
 
-    FILE* pipe = popen(("nilfs-tune -l -- " + device.devpath).c_str(), "r");
-    if (!pipe) {
-        throw std::runtime_error("Failed to execute nilfs-tune");
+    auto sb = decode_nilfs2(*device.probe_window());
+    if (!sb) {
+        throw UnsupportedSuperblock(device.devpath, {{"expected", "nilfs2"}});
     }
-
-    char buffer[256];
-    while (fgets(buffer, sizeof(buffer), pipe)) {
-        std::string line(buffer);
-        if (line.find("Block size:") == 0) {
-            block_size = std::stoull(aftersep(line, ":"));
-        } else if (line.find("Device size:") == 0) {
-            size_bytes = std::stoull(aftersep(line, ":"));
-        }
+    if (!sb->crc_ok) {
+        // The kernel would fall back to the secondary superblock;
+        // don't resize on a guess.
+        throw UnsupportedSuperblock(device.devpath, {{"crc", "mismatch"}});
     }
 
-    pclose(pipe);
+    block_size = sb->block_size;
+    size_bytes = sb->dev_size;
     assert(block_size != 0);
 }
 
@@ -250,9 +426,7 @@ void NilFS::_resize(uint64_t target_size) {
 // BtrFS implementation
 BtrFS::BtrFS(BlockDevice device) : Filesystem(device) {
     sb_size_in_bytes = true;
-    // We'll get the mpoint ourselves
-    resize_needs_mpoint = false;
-    vfstype = vfstype_str;
+    set_layer_type(vfstype_str);
 }
 
 void BtrFS::read_superblock() {
@@ -260,6 +434,7 @@ void BtrFS::read_superblock() {
     size_bytes = 0;
     devid = 0;
 
+    SubprocessTimer timer("btrfs-show-super -- " + device.devpath);
     FILE* pipe = popen(("btrfs-show-super -- " + device.devpath).c_str(), "r");
     if (!pipe) {
         throw std::runtime_error("Failed to execute btrfs-show-super");
@@ -284,47 +459,50 @@ void BtrFS::read_superblock() {
 void BtrFS::_resize(uint64_t target_size) {
     assert(target_size % block_size == 0);
     
+    // Reuse an existing (or pooled) mount where possible.
     // XXX The device is unavailable (EBUSY)
     // immediately after unmounting.
     // Bug introduced in Linux 3.0, fixed in 3.9.
     // Tracked down by Eric Sandeen in
     // http://comments.gmane.org/gmane.comp.file-systems.btrfs/23987
-    auto mount = temp_mount();
-    
-    std::vector<std::string> cmd = {
-        "btrfs", "filesystem", "resize",
-        std::to_string(devid) + ":" + std::to_string(target_size),
-        mount->path()
-    };
-    
-    quiet_call(cmd);
+    std::shared_ptr<TempMount> mount;
+    auto mpoint = mountpoint();
+    if (!mpoint) {
+        mount = temp_mount();
+        mpoint = mount->path();
+    }
+
+    btrfs_ioctl_vol_args args = {};
+    std::string spec = std::to_string(devid) + ":" + std::to_string(target_size);
+    assert(spec.size() <= BTRFS_PATH_NAME_MAX);
+    std::strncpy(args.name, spec.c_str(), BTRFS_PATH_NAME_MAX);
+
+    int fd = open_mountpoint(*mpoint);
+    int ret = ioctl(fd, BTRFS_IOC_RESIZE, &args);
+    int err = errno;
+    close(fd);
+
+    if (ret != 0) {
+        throw std::runtime_error("BTRFS_IOC_RESIZE " + spec + " failed on " + *mpoint + ": " + std::strerror(err));
+    }
 }
 
 // ReiserFS implementation
 ReiserFS::ReiserFS(BlockDevice device) : Filesystem(device) {
-    vfstype = vfstype_str;
+    set_layer_type(vfstype_str);
 }
 
 void ReiserFS::read_superblock() {
     block_size = 0;
     block_count = 0;
 
-    FILE* pipe = popen(("reiserfstune -- " + device.devpath).c_str(), "r");
-    if (!pipe) {
-        throw std::runtime_error("Failed to execute reiserfstune");
+    auto sb = decode_reiserfs(*device.probe_window());
+    if (!sb) {
+        throw UnsupportedSuperblock(device.devpath, {{"expected", "reiserfs"}});
     }
 
-    char buffer[256];
-    while (fgets(buffer, sizeof(buffer), pipe)) {
-        std::string line(buffer);
-        if (line.find("Blocksize:") == 0) {
-            block_size = std::stoull(aftersep(line, ":"));
-        } else if (line.find("Count of blocks on the device:") == 0) {
-            block_count = std::stoull(aftersep(line, ":"));
-        }
-    }
-
-    pclose(pipe);
+    block_size = sb->block_size;
+    block_count = sb->block_count;
     assert(block_size != 0);
 }
 
@@ -341,66 +519,90 @@ void ReiserFS::_resize(uint64_t target_size) {
 
 // ExtFS implementation
 ExtFS::ExtFS(BlockDevice device) : Filesystem(device) {
-    vfstype = vfstype_str;
+    set_layer_type(vfstype_str);
 }
 
 void ExtFS::read_superblock() {
+    // Decode the primary superblock directly rather than scraping
+    // tune2fs -l; the field layout is in e2fsprogs' ext2_fs.h
     block_size = 0;
     block_count = 0;
     state = "";
     mount_tm = 0;
     check_tm = 0;
 
-    FILE* pipe = popen(("tune2fs -l -- " + device.devpath).c_str(), "r");
-    if (!pipe) {
-        throw std::runtime_error("Failed to execute tune2fs");
+    ProbeWindow window = device.probe_window();
+    if (window->size() < 2048) {
+        throw std::runtime_error("Failed to read ext superblock of " + device.devpath);
     }
+    const uint8_t* sb = window->data() + 1024;
 
-    char buffer[256];
-    while (fgets(buffer, sizeof(buffer), pipe)) {
-        std::string line(buffer);
-        if (line.find("Block size:") == 0) {
-            block_size = std::stoull(aftersep(line, ":"));
-        } else if (line.find("Block count:") == 0) {
-            block_count = std::stoull(aftersep(line, ":"));
-        } else if (line.find("Filesystem state:") == 0) {
-            state = aftersep(line, ":");
-            // Trim leading whitespace
-            state.erase(0, state.find_first_not_of(" \t"));
-        } else if (line.find("Last mount time:") == 0) {
-            std::string date = aftersep(line, ":");
-            // Trim leading whitespace
-            date.erase(0, date.find_first_not_of(" \t"));
-            
-            if (date == "n/a") {
-                mount_tm = 0;
-            } else {
-                struct tm tm = {};
-                strptime(date.c_str(), "%a %b %d %H:%M:%S %Y", &tm);
-                mount_tm = mktime(&tm);
-            }
-        } else if (line.find("Last checked:") == 0) {
-            std::string date = aftersep(line, ":");
-            // Trim leading whitespace
-            date.erase(0, date.find_first_not_of(" \t"));
-            
-            struct tm tm = {};
-            strptime(date.c_str(), "%a %b %d %H:%M:%S %Y", &tm);
-            check_tm = mktime(&tm);
-        }
+    if (le16_at(sb, 0x38) != 0xEF53) {
+        throw UnsupportedSuperblock(device.devpath, {{"magic", std::to_string(le16_at(sb, 0x38))}});
     }
 
-    pclose(pipe);
+    block_size = 1024ULL << le32_at(sb, 0x18);
+    block_count = le32_at(sb, 0x04);
+    // INCOMPAT_64BIT
+    if (le32_at(sb, 0x60) & 0x80) {
+        block_count |= static_cast<uint64_t>(le32_at(sb, 0x150)) << 32;
+    }
+
+    // Same wording as tune2fs, _resize compares against "clean"
+    uint16_t s_state = le16_at(sb, 0x3A);
+    state = (s_state & 0x0001) ? "clean" : "not clean";
+    if (s_state & 0x0002) {
+        state += " with errors";
+    }
+
+    mount_tm = le32_at(sb, 0x2C);
+    check_tm = le32_at(sb, 0x40);
+
     assert(block_size != 0);
 }
 
+bool ExtFS::_resize_online(uint64_t target_blocks) {
+    auto mpoint = mountpoint();
+    if (!mpoint) {
+        return false;
+    }
+
+    int fd = open_mountpoint(*mpoint);
+
+    log_info() << "Growing " << device.devpath << " online to " << target_blocks << " blocks";
+    uint64_t new_blocks = target_blocks;
+    int ret = ioctl(fd, EXT4_IOC_RESIZE_FS, &new_blocks);
+    int err = errno;
+    close(fd);
+
+    if (ret != 0) {
+        // Not the ext4 driver, or a kernel without the ioctl;
+        // resize2fs knows the older online resize interface.
+        if (err == ENOTTY || err == EOPNOTSUPP) {
+            return false;
+        }
+        throw std::runtime_error("EXT4_IOC_RESIZE_FS failed on " + *mpoint + ": " + std::strerror(err));
+    }
+    return true;
+}
+
 void ExtFS::_resize(uint64_t target_size) {
     uint64_t block_count = target_size / block_size;
     assert(target_size % block_size == 0);
 
+    if (is_mounted()) {
+        // The kernel can grow a mounted ext4, but not shrink it
+        if (target_size < fssize()) {
+            throw CantShrink();
+        }
+        if (_resize_online(block_count)) {
+            return;
+        }
+    }
+
     // resize2fs requires that the filesystem was checked
     if (!is_mounted() && (state != "clean" || check_tm < mount_tm)) {
-        std::cout << "Checking the filesystem before resizing it" << std::endl;
+        log_info() << "Checking the filesystem before resizing it";
         // Can't use the -n flag, it is strictly read-only and won't
         // update check_tm in the superblock
         // XXX Without either of -n -p -y, e2fsck will require a
@@ -421,126 +623,72 @@ void ExtFS::_resize(uint64_t target_size) {
 
 // Swap implementation
 Swap::Swap(BlockDevice device) : Filesystem(device) {
-    vfstype = vfstype_str;
+    set_layer_type(vfstype_str);
 }
 
 bool Swap::is_mounted() {
-    // parse /proc/swaps, see tab_parse.c
-    throw std::runtime_error("Not implemented");
+    return MountTable::instance().is_active_swap(devno());
 }
 
 void Swap::read_superblock() {
-    // No need to do anything, UUID and LABEL are already
-    // exposed through blkid
-    int dev_fd = device.open_excl();
-    auto [big_endian_val, version_val, last_page] = __read_sb(dev_fd);
-    close(dev_fd);
-    
-    block_size = 4096;
-    block_count = last_page + 1;
-    big_endian = big_endian_val;
-    version = version_val;
+    header = decode_swap_header(*device.probe_window(), device.devpath);
+    block_size = header.page_size;
+    block_count = static_cast<uint64_t>(header.info.last_page) + 1;
 }
 
-std::tuple<bool, uint32_t, uint32_t> Swap::__read_sb(int dev_fd) {
-    // Assume 4k pages, bail otherwise
-    // XXX The SB checks should be done before calling the constructor
-    char magic_buf[10];
-    if (pread(dev_fd, magic_buf, 10, 4096 - 10) != 10) {
-        throw std::runtime_error("Failed to read swap magic");
-    }
-    
-    if (std::string(magic_buf, 10) != "SWAPSPACE2") {
-        // Might be suspend data
-        std::map<std::string, std::string> kwargs;
-        kwargs["magic"] = std::string(magic_buf, 10);
-        throw UnsupportedSuperblock(device.devpath, kwargs);
-    }
-    
-    uint32_t version, last_page;
-    char version_buf[8];
-    if (pread(dev_fd, version_buf, 8, 1024) != 8) {
-        throw std::runtime_error("Failed to read swap version");
+void Swap::_resize(uint64_t target_size) {
+    // using mkswap+swaplabel like GParted would drop some metadata
+    assert(target_size % block_size == 0);
+    uint64_t last_page = target_size / block_size - 1;
+    if (last_page > UINT32_MAX) {
+        throw std::runtime_error("Swap area too large for its page size: " + device.devpath);
     }
-    
-    // Try big endian first
-    version = (static_cast<uint32_t>(version_buf[0]) << 24) |
-              (static_cast<uint32_t>(version_buf[1]) << 16) |
-              (static_cast<uint32_t>(version_buf[2]) << 8) |
-              static_cast<uint32_t>(version_buf[3]);
-    
-    last_page = (static_cast<uint32_t>(version_buf[4]) << 24) |
-                (static_cast<uint32_t>(version_buf[5]) << 16) |
-                (static_cast<uint32_t>(version_buf[6]) << 8) |
-                static_cast<uint32_t>(version_buf[7]);
-    
-    bool big_endian = true;
-    
-    if (version != 1) {
-        uint32_t version0 = version;
-        // Try little endian
-        version = static_cast<uint32_t>(version_buf[3]) |
-                 (static_cast<uint32_t>(version_buf[2]) << 8) |
-                 (static_cast<uint32_t>(version_buf[1]) << 16) |
-                 (static_cast<uint32_t>(version_buf[0]) << 24);
-        
-        last_page = static_cast<uint32_t>(version_buf[7]) |
-                   (static_cast<uint32_t>(version_buf[6]) << 8) |
-                   (static_cast<uint32_t>(version_buf[5]) << 16) |
-                   (static_cast<uint32_t>(version_buf[4]) << 24);
-        
-        big_endian = false;
-        
-        if (version != 1) {
-            std::map<std::string, std::string> kwargs;
-            kwargs["version"] = std::to_string(std::min(version, version0));
-            throw UnsupportedSuperblock(device.devpath, kwargs);
+
+    // A live swap area has to be taken offline while its header changes
+    auto active = MountTable::instance().swap_entry(devno());
+    std::optional<ScopedTimer> offline;
+    if (active) {
+        offline.emplace(Metrics::instance().offline_seconds);
+        log_info() << "Deactivating swap on " << active->path;
+        if (::swapoff(active->path.c_str()) != 0) {
+            throw std::runtime_error("swapoff " + active->path + " failed: " + std::strerror(errno));
         }
     }
-    
-    if (!last_page) {
-        std::map<std::string, std::string> kwargs;
-        kwargs["last_page"] = "0";
-        throw UnsupportedSuperblock(device.devpath, kwargs);
+
+    std::exception_ptr failure;
+    try {
+        int dev_fd = ::open(device.devpath.c_str(), O_RDWR | O_EXCL);
+        if (dev_fd < 0) {
+            throw std::runtime_error("Failed to open " + device.devpath + " exclusively: " + std::strerror(errno));
+        }
+        try {
+            write_swap_last_page(dev_fd, header, static_cast<uint32_t>(last_page));
+        } catch (...) {
+            close(dev_fd);
+            throw;
+        }
+        close(dev_fd);
+        header.info.last_page = static_cast<uint32_t>(last_page);
+    } catch (...) {
+        failure = std::current_exception();
     }
-    
-    return {big_endian, version, last_page};
-}
 
-void Swap::_resize(uint64_t target_size) {
-    // using mkswap+swaplabel like GParted would drop some metadata
-    char buf[8];
-    
-    if (big_endian) {
-        buf[0] = (version >> 24) & 0xFF;
-        buf[1] = (version >> 16) & 0xFF;
-        buf[2] = (version >> 8) & 0xFF;
-        buf[3] = version & 0xFF;
-        
-        uint32_t last_page = target_size / block_size - 1;
-        buf[4] = (last_page >> 24) & 0xFF;
-        buf[5] = (last_page >> 16) & 0xFF;
-        buf[6] = (last_page >> 8) & 0xFF;
-        buf[7] = last_page & 0xFF;
-    } else {
-        buf[3] = (version >> 24) & 0xFF;
-        buf[2] = (version >> 16) & 0xFF;
-        buf[1] = (version >> 8) & 0xFF;
-        buf[0] = version & 0xFF;
-        
-        uint32_t last_page = target_size / block_size - 1;
-        buf[7] = (last_page >> 24) & 0xFF;
-        buf[6] = (last_page >> 16) & 0xFF;
-        buf[5] = (last_page >> 8) & 0xFF;
-        buf[4] = last_page & 0xFF;
+    // Reactivate even if the header couldn't be rewritten
+    if (active) {
+        int flags = 0;
+        if (active->priority >= 0) {
+            flags = SWAP_FLAG_PREFER | ((active->priority << SWAP_FLAG_PRIO_SHIFT) & SWAP_FLAG_PRIO_MASK);
+        }
+        log_info() << "Reactivating swap on " << active->path;
+        if (::swapon(active->path.c_str(), flags) != 0 && !failure) {
+            throw std::runtime_error("swapon " + active->path + " failed: " + std::strerror(errno));
+        }
+        offline.reset();
     }
-    
-    int dev_fd = device.open_excl();
-    if (pwrite(dev_fd, buf, 8, 1024) != 8) {
-        close(dev_fd);
-        throw std::runtime_error("Failed to write swap header");
+
+    if (failure) {
+        std::rethrow_exception(failure);
     }
-    close(dev_fd);
 }
 
 } // namespace blocks
@@ -3,13 +3,18 @@
 
 #include "blocks_types.h"
 #include "block_device.h"
+#include "swap_header.h"
 #include <string>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <ctime>
+#include <optional>
 
 namespace blocks {
 
+struct LayerType;
+
 class Filesystem : public BlockData {
 public:
     Filesystem(BlockDevice device);
@@ -31,8 +36,11 @@ public:
         std::string devpath;
     };
 
-    std::unique_ptr<TempMount> temp_mount();
+    // Pooled: repeated calls during a run share one mount
+    std::shared_ptr<TempMount> temp_mount();
     virtual bool is_mounted();
+    std::optional<std::string> mountpoint();
+    dev_t devno();
     
     void _mount_and_resize(uint64_t pos);
     virtual void _resize(uint64_t pos) = 0;
@@ -44,30 +52,44 @@ public:
     std::string fsuuid();
     
     virtual void read_superblock() = 0;
-    virtual bool can_shrink() const = 0;
+    // After a resize through a mount that stays up: flushes the
+    // filesystem and reads the superblock again, unless the mount can
+    // be asked directly
+    virtual void read_mounted_size(const std::string& mpoint);
+    // From the filesystem's LAYER_TYPES entry
+    bool can_shrink() const;
     
     uint64_t block_size;
     uint64_t block_count;
     uint64_t size_bytes;
     std::string vfstype;
+
+protected:
+    // Takes vfstype and the resize capabilities from LAYER_TYPES
+    void set_layer_type(const char* name);
+
+    const LayerType* layer = nullptr;
 };
 
 class XFS : public Filesystem {
 public:
     XFS(BlockDevice device);
     
-    bool can_shrink() const override { return false; }
     void read_superblock() override;
+    // The on-disk superblock may lag behind the log, ask the mount
+    void read_mounted_size(const std::string& mpoint) override;
     void _resize(uint64_t target_size) override;
     
     static constexpr const char* vfstype_str = "xfs";
+
+    // Kept across growfs, the kernel wants it restated
+    uint8_t imaxpct = 0;
 };
 
 class NilFS : public Filesystem {
 public:
     NilFS(BlockDevice device);
     
-    bool can_shrink() const override { return true; }
     void read_superblock() override;
     void _resize(uint64_t target_size) override;
     
@@ -78,7 +100,6 @@ class BtrFS : public Filesystem {
 public:
     BtrFS(BlockDevice device);
     
-    bool can_shrink() const override { return true; }
     void read_superblock() override;
     void _resize(uint64_t target_size) override;
     
@@ -91,7 +112,6 @@ class ReiserFS : public Filesystem {
 public:
     ReiserFS(BlockDevice device);
     
-    bool can_shrink() const override { return true; }
     void read_superblock() override;
     void _resize(uint64_t target_size) override;
     
@@ -102,7 +122,6 @@ class ExtFS : public Filesystem {
 public:
     ExtFS(BlockDevice device);
     
-    bool can_shrink() const override { return true; }
     void read_superblock() override;
     void _resize(uint64_t target_size) override;
     
@@ -111,25 +130,59 @@ public:
     std::string state;
     std::time_t mount_tm;
     std::time_t check_tm;
+
+private:
+    bool _resize_online(uint64_t target_blocks);
 };
 
 class Swap : public Filesystem {
 public:
     Swap(BlockDevice device);
     
-    bool can_shrink() const override { return true; }
     void read_superblock() override;
     void _resize(uint64_t target_size) override;
     
     static constexpr const char* vfstype_str = "swap";
     
+    // An active swap area
     bool is_mounted() override;
     
 private:
-    std::tuple<bool, uint32_t, uint32_t> __read_sb(int dev_fd);
-    
-    bool big_endian;
-    uint32_t version;
+    SwapHeader header;
+};
+
+// Private mounts shared by every resize step of a run, keyed by device,
+// so a multi-step resize mounts (and replays the journal) only once.
+// They go into the mount namespace of enter_private_namespace.
+class MountPool {
+public:
+    static MountPool& instance();
+
+    // Moves the calling thread into its own mount namespace. unshare
+    // only moves the caller, and MountTable reads the main thread's
+    // mountinfo, so this runs on the main thread before any other
+    // thread exists, the logger's renderer included; threads started
+    // later inherit the namespace. Without one (not root), temporary
+    // mounts are visible to the host.
+    void enter_private_namespace();
+
+    std::shared_ptr<Filesystem::TempMount> acquire(const std::string& devpath, dev_t dev, const std::string& vfstype);
+    // Unmount before anything that needs the device exclusively
+    void release(dev_t dev);
+    void release_all();
+
+    MountPool(const MountPool&) = delete;
+    MountPool& operator=(const MountPool&) = delete;
+
+private:
+    MountPool() = default;
+    ~MountPool();
+
+    std::mutex lock;
+    bool private_ns = false;
+    std::string no_ns_reason = "not entered";
+    bool warned = false;
+    std::unordered_map<dev_t, std::shared_ptr<Filesystem::TempMount>> mounts;
 };
 
 } // namespace blocks
@@ -0,0 +1,73 @@
+#include "host_paths.h"
+#include <unistd.h>
+#include <cstdlib>
+#include <filesystem>
+#include <sstream>
+
+namespace blocks {
+
+namespace {
+
+std::string env_or(const char* name, const char* fallback, bool& overridden) {
+    const char* value = std::getenv(name);
+    if (!value || !*value) {
+        return fallback;
+    }
+    overridden = true;
+    std::string root = value;
+    while (root.size() > 1 && root.back() == '/') {
+        root.pop_back();
+    }
+    return root;
+}
+
+} // namespace
+
+const HostPaths& HostPaths::instance() {
+    static HostPaths paths;
+    return paths;
+}
+
+HostPaths::HostPaths() {
+    sys = env_or("BLOCKS_SYSFS_ROOT", "/sys", fake);
+    proc = env_or("BLOCKS_PROC_ROOT", "/proc", fake);
+    dev = env_or("BLOCKS_DEV_ROOT", "/dev", fake);
+
+    bool tools_set = false;
+    tools = env_or("BLOCKS_TOOL_DIR", "", tools_set);
+    if (tools_set) {
+        // Every command line goes through popen or a pipeline in sh, so
+        // PATH is the one place that covers them all, children included
+        const char* path = std::getenv("PATH");
+        std::string new_path = tools + (path && *path ? ":" + std::string(path) : "");
+        setenv("PATH", new_path.c_str(), 1);
+    }
+}
+
+std::string sys_path(const std::string& relative) {
+    return HostPaths::instance().sys_root() + "/" + relative;
+}
+
+std::string proc_path(const std::string& relative) {
+    return HostPaths::instance().proc_root() + "/" + relative;
+}
+
+std::string dev_path(const std::string& relative) {
+    return HostPaths::instance().dev_root() + "/" + relative;
+}
+
+std::string find_tool(const std::string& name) {
+    std::string path = std::getenv("PATH") ? std::getenv("PATH") : "";
+    path += ":/usr/sbin:/sbin:/usr/bin:/bin";
+    std::istringstream dirs(path);
+    std::string dir;
+    while (std::getline(dirs, dir, ':')) {
+        std::string candidate = (dir.empty() ? "." : dir) + "/" + name;
+        if (access(candidate.c_str(), X_OK) == 0 && std::filesystem::is_regular_file(candidate)) {
+            return candidate;
+        }
+    }
+    return "";
+}
+
+} // namespace blocks
@@ -0,0 +1,53 @@
+#ifndef HOST_PATHS_H
+#define HOST_PATHS_H
+
+#include <string>
+
+namespace blocks {
+
+// Where blocks looks at the kernel's view of the system and finds the
+// tools it runs. The defaults are the real /sys, /proc and /dev; the
+// environment can point them at a fake tree so the orchestration runs
+// without root or real devices:
+//
+//   BLOCKS_SYSFS_ROOT  instead of /sys
+//   BLOCKS_PROC_ROOT   instead of /proc
+//   BLOCKS_DEV_ROOT    instead of /dev
+//   BLOCKS_TOOL_DIR    searched before PATH, e.g. tools/standin
+//
+// Under a fake /dev, devices may be plain image files; their numbers
+// come from <sysfs>/class/block/<name>/dev like any other device's.
+class HostPaths {
+public:
+    static const HostPaths& instance();
+
+    const std::string& sys_root() const { return sys; }
+    const std::string& proc_root() const { return proc; }
+    const std::string& dev_root() const { return dev; }
+    const std::string& tool_dir() const { return tools; }
+
+    // Any root moved away from the real one
+    bool is_fake() const { return fake; }
+
+private:
+    HostPaths();
+
+    std::string sys;
+    std::string proc;
+    std::string dev;
+    std::string tools;
+    bool fake = false;
+};
+
+// Paths relative to each root, e.g. sys_path("dev/block/8:1")
+std::string sys_path(const std::string& relative);
+std::string proc_path(const std::string& relative);
+std::string dev_path(const std::string& relative);
+
+// The executable name resolves to through PATH, then the usual sbin and
+// bin directories, without starting a shell; empty when there is none
+std::string find_tool(const std::string& name);
+
+} // namespace blocks
+
+#endif // HOST_PATHS_H
@@ -0,0 +1,59 @@
+#include "layer_types.h"
+#include <cstring>
+
+namespace blocks {
+
+bool signature_matches(const LayerType& type, const std::vector<uint8_t>& window) {
+    for (const Signature& sig : type.signatures) {
+        if (sig.magic.empty() || sig.offset + sig.magic.size() > window.size()) {
+            continue;
+        }
+        if (std::memcmp(window.data() + sig.offset, sig.magic.data(), sig.magic.size()) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+const LayerType* match_layer_type(const std::vector<uint8_t>& window, std::optional<FsIdentity>* identity) {
+    for (const LayerType& type : LAYER_TYPES) {
+        if (!signature_matches(type, window)) {
+            continue;
+        }
+        if (!type.identify) {
+            return &type;
+        }
+        // Short magics (ext, nilfs2) need the decoder to rule out chance matches
+        if (auto id = type.identify(window)) {
+            if (identity) {
+                *identity = std::move(id);
+            }
+            return &type;
+        }
+    }
+    return nullptr;
+}
+
+std::optional<FsIdentity> decode_identity(const std::vector<uint8_t>& window) {
+    std::optional<FsIdentity> identity;
+    match_layer_type(window, &identity);
+    return identity;
+}
+
+std::unique_ptr<Filesystem> make_filesystem(const std::string& type, BlockDevice device) {
+    const LayerType* layer = find_layer_type(type);
+    if (!layer || layer->kind != LayerKind::Filesystem) {
+        return nullptr;
+    }
+    Layer made = layer->make_layer(device);
+    return std::visit([](auto& data) -> std::unique_ptr<Filesystem> {
+        using T = std::decay_t<decltype(data)>;
+        if constexpr (std::is_base_of_v<Filesystem, T>) {
+            return std::make_unique<T>(std::move(data));
+        } else {
+            return nullptr;
+        }
+    }, made);
+}
+
+} // namespace blocks
@@ -0,0 +1,150 @@
+#ifndef LAYER_TYPES_H
+#define LAYER_TYPES_H
+
+#include "blocks_types.h"
+#include "block_stack.h"
+#include "filesystem.h"
+#include "superblock.h"
+#include <array>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace blocks {
+
+// Every superblock blocks knows, in the order they are probed.
+// Detection, the layer factories and the shrink/mount capabilities
+// all come from this one table; supporting a new filesystem means adding
+// an entry (and its Filesystem subclass), nothing else.
+
+enum class LayerKind {
+    Filesystem,
+    Luks,
+    BCache,
+    LvmPv,
+};
+
+// Magic bytes at a fixed offset from the start of the device
+struct Signature {
+    size_t offset = 0;
+    std::string_view magic;
+};
+
+constexpr size_t MAX_SIGNATURES = 4;
+constexpr size_t MAX_ALIASES = 2;
+
+using LayerFactory = Layer (*)(BlockDevice device);
+// Confirms a signature hit and reads the identity. The type it reports can
+// be more specific than the entry's name (ext2 and ext3 share ext4's entry).
+using IdentityDecoder = std::optional<FsIdentity> (*)(const std::vector<uint8_t>& window);
+
+struct LayerType {
+    std::string_view name;  // blkid's TYPE
+    std::array<std::string_view, MAX_ALIASES> aliases;
+    LayerKind kind;
+    // Any one of them; all fall inside BlockDevice::PROBE_WINDOW_SIZE
+    std::array<Signature, MAX_SIGNATURES> signatures;
+    IdentityDecoder identify;  // nullptr when the magic is enough
+    LayerFactory make_layer;  // nullptr for what blocks can't stack on
+    bool can_shrink;
+    bool resize_needs_mpoint;
+};
+
+template <class T>
+Layer make_layer_of(BlockDevice device) {
+    return Layer(std::in_place_type<T>, device);
+}
+
+inline constexpr LayerType LAYER_TYPES[] = {
+    {"crypto_LUKS", {}, LayerKind::Luks,
+     {{{0, "LUKS\xba\xbe"}}},
+     identify_luks, make_layer_of<LUKS>, false, false},
+    {"xfs", {}, LayerKind::Filesystem,
+     {{{0, "XFSB"}}},
+     identify_xfs, make_layer_of<XFS>, false, true},
+    // The label may sit in any of the first four sectors
+    {"LVM2_member", {}, LayerKind::LvmPv,
+     {{{24, "LVM2 001"}, {512 + 24, "LVM2 001"}, {1024 + 24, "LVM2 001"}, {1536 + 24, "LVM2 001"}}},
+     nullptr, nullptr, false, false},
+    {"bcache", {}, LayerKind::BCache,
+     {{{4096 + 24, "\xc6\x85\x73\xf6\x4e\x1a\x45\xca\x82\x65\xf5\x7f\x48\xba\x6d\x81"}}},
+     nullptr, make_layer_of<BCacheBacking>, false, false},
+    {"ext4", {"ext2", "ext3"}, LayerKind::Filesystem,
+     {{{1024 + 0x38, "\x53\xef"}}},
+     identify_ext, make_layer_of<ExtFS>, true, false},
+    {"nilfs2", {}, LayerKind::Filesystem,
+     {{{1024 + 0x06, "\x34\x34"}}},
+     identify_nilfs2, make_layer_of<NilFS>, true, true},
+    // BtrFS finds the mountpoint itself
+    {"btrfs", {}, LayerKind::Filesystem,
+     {{{64 * 1024 + 0x40, "_BHRfS_M"}}},
+     identify_btrfs, make_layer_of<BtrFS>, true, false},
+    {"reiserfs", {}, LayerKind::Filesystem,
+     {{{64 * 1024 + 52, "ReIsEr"}, {8 * 1024 + 52, "ReIsEr"}}},
+     identify_reiserfs, make_layer_of<ReiserFS>, true, false},
+    // The magic ends the first page, whatever size mkswap's page was
+    {"swap", {}, LayerKind::Filesystem,
+     {{{4096 - 10, "SWAPSPACE2"}, {8192 - 10, "SWAPSPACE2"}, {16384 - 10, "SWAPSPACE2"}, {65536 - 10, "SWAPSPACE2"}}},
+     identify_swap, make_layer_of<Swap>, true, false},
+};
+
+constexpr const LayerType* find_layer_type(std::string_view name) {
+    for (const LayerType& type : LAYER_TYPES) {
+        if (type.name == name) {
+            return &type;
+        }
+        for (const std::string_view& alias : type.aliases) {
+            if (!alias.empty() && alias == name) {
+                return &type;
+            }
+        }
+    }
+    return nullptr;
+}
+
+namespace detail {
+
+constexpr bool layer_types_consistent() {
+    for (const LayerType& type : LAYER_TYPES) {
+        if ((type.kind != LayerKind::LvmPv) != (type.make_layer != nullptr)) {
+            return false;
+        }
+        if (type.signatures[0].magic.empty()) {
+            return false;
+        }
+        for (const Signature& sig : type.signatures) {
+            if (sig.offset + sig.magic.size() > BlockDevice::PROBE_WINDOW_SIZE) {
+                return false;
+            }
+        }
+        if (find_layer_type(type.name) != &type) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace detail
+
+static_assert(detail::layer_types_consistent(),
+              "every stackable type needs a factory, a signature inside the probe window and a unique name");
+
+bool signature_matches(const LayerType& type, const std::vector<uint8_t>& window);
+
+// The first entry whose signature matches and whose decoder, if it has
+// one, agrees; one pass over the table on an already-read window.
+// identity is filled in when the entry has a decoder.
+const LayerType* match_layer_type(const std::vector<uint8_t>& window,
+                                  std::optional<FsIdentity>* identity = nullptr);
+
+// What blkid would report as TYPE, UUID and LABEL, for the table's
+// types that carry them
+std::optional<FsIdentity> decode_identity(const std::vector<uint8_t>& window);
+
+// The Filesystem for a blkid type; nullptr for anything else
+std::unique_ptr<Filesystem> make_filesystem(const std::string& type, BlockDevice device);
+
+} // namespace blocks
+
+#endif // LAYER_TYPES_H
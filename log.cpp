@@ -0,0 +1,331 @@
+#include "log.h"
+#include <nlohmann/json.hpp>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+namespace blocks {
+
+namespace {
+
+// How long a missed wakeup can delay output
+constexpr auto RENDER_INTERVAL = std::chrono::milliseconds(100);
+
+uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+uint32_t current_tid() {
+    thread_local uint32_t tid = static_cast<uint32_t>(syscall(SYS_gettid));
+    return tid;
+}
+
+const char* level_name(LogLevel level) {
+    switch (level) {
+        case LogLevel::Debug:
+            return "debug";
+        case LogLevel::Info:
+            return "info";
+        case LogLevel::Warning:
+            return "warning";
+        case LogLevel::Error:
+            return "error";
+    }
+    return "info";
+}
+
+int syslog_priority(LogLevel level) {
+    switch (level) {
+        case LogLevel::Debug:
+            return LOG_DEBUG;
+        case LogLevel::Info:
+            return LOG_INFO;
+        case LogLevel::Warning:
+            return LOG_WARNING;
+        case LogLevel::Error:
+            return LOG_ERR;
+    }
+    return LOG_INFO;
+}
+
+} // namespace
+
+LogFormat parse_log_format(const std::string& name) {
+    if (name == "terminal") {
+        return LogFormat::Terminal;
+    } else if (name == "json") {
+        return LogFormat::JsonLines;
+    } else if (name == "syslog") {
+        return LogFormat::Syslog;
+    }
+    throw std::invalid_argument("Log format must be terminal, json or syslog");
+}
+
+Logger& Logger::instance() {
+    // Never destroyed: static destructors may still log
+    static Logger* logger = new Logger();
+    return *logger;
+}
+
+Logger::Logger() {
+    pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+    std::atexit(at_exit);
+}
+
+void Logger::configure(LogFormat new_format, LogLevel new_min_level) {
+    flush();
+    if (new_format == LogFormat::Syslog && format != LogFormat::Syslog) {
+        openlog("blocks", LOG_PID, LOG_USER);
+    }
+    format = new_format;
+    min_level = new_min_level;
+}
+
+void Logger::log(LogLevel level, std::string_view text, bool end_line) {
+    if (!enabled(level)) {
+        return;
+    }
+
+    uint64_t time_ns = now_ns();
+    if (synchronous) {
+        std::lock_guard<std::mutex> guard(output_lock);
+        write_message(level, std::string(text), end_line, time_ns, current_tid());
+        std::fflush(stdout);
+        std::fflush(stderr);
+        return;
+    }
+
+    ensure_renderer();
+
+    // An empty message still makes a (blank) line
+    size_t offset = 0;
+    do {
+        LogRecord record;
+        record.time_ns = time_ns;
+        record.thread = current_tid();
+        record.level = level;
+        record.length = static_cast<uint16_t>(std::min(text.size() - offset, LogRecord::TEXT_SIZE));
+        std::memcpy(record.text, text.data() + offset, record.length);
+        offset += record.length;
+        record.continued = offset < text.size();
+        record.end_line = end_line;
+        push(record);
+    } while (offset < text.size());
+
+    if (renderer_idle.load(std::memory_order_relaxed) || level >= LogLevel::Warning) {
+        wake.notify_one();
+    }
+}
+
+void Logger::push(const LogRecord& record) {
+    if (ring.try_push(record)) {
+        return;
+    }
+    if (record.level < LogLevel::Warning) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    while (!ring.try_push(record)) {
+        wake.notify_one();
+        std::this_thread::yield();
+    }
+}
+
+void Logger::flush() {
+    if (!renderer_running.load(std::memory_order_acquire)) {
+        // Nothing is queued without a renderer
+        return;
+    }
+    size_t target = ring.pushed();
+    std::unique_lock<std::mutex> lock(renderer_lock);
+    wake.notify_one();
+    drained.wait(lock, [&] { return ring.popped() >= target || stopping; });
+}
+
+void Logger::ensure_renderer() {
+    if (renderer_running.load(std::memory_order_acquire)) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(renderer_lock);
+    if (!renderer) {
+        stopping = false;
+        renderer = new std::thread(&Logger::render_loop, this);
+        renderer_running.store(true, std::memory_order_release);
+    }
+}
+
+void Logger::render_loop() {
+    std::unique_lock<std::mutex> lock(renderer_lock);
+    while (true) {
+        lock.unlock();
+        drain();
+        lock.lock();
+        drained.notify_all();
+        if (stopping) {
+            break;
+        }
+        if (ring.popped() == ring.pushed()) {
+            renderer_idle.store(true, std::memory_order_relaxed);
+            wake.wait_for(lock, RENDER_INTERVAL);
+            renderer_idle.store(false, std::memory_order_relaxed);
+        }
+    }
+}
+
+size_t Logger::drain() {
+    std::lock_guard<std::mutex> guard(output_lock);
+    size_t count = 0;
+
+    uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+    if (lost) {
+        write_message(LogLevel::Warning, std::to_string(lost) + " log messages dropped, the log ring was full",
+                      true, now_ns(), current_tid());
+    }
+
+    LogRecord record;
+    while (ring.try_pop(record)) {
+        write_record(record);
+        ++count;
+    }
+    if (count || lost) {
+        std::fflush(stdout);
+        std::fflush(stderr);
+    }
+    return count;
+}
+
+void Logger::write_record(const LogRecord& record) {
+    if (!record.continued && !pending_messages.count(record.thread)) {
+        write_message(record.level, std::string(record.text, record.length), record.end_line,
+                      record.time_ns, record.thread);
+        return;
+    }
+    PendingText& message = pending_messages[record.thread];
+    message.text.append(record.text, record.length);
+    message.level = std::max(message.level, record.level);
+    if (record.continued) {
+        return;
+    }
+    PendingText whole = std::move(message);
+    pending_messages.erase(record.thread);
+    write_message(whole.level, whole.text, record.end_line, record.time_ns, record.thread);
+}
+
+void Logger::write_message(LogLevel level, const std::string& text, bool end_line, uint64_t time_ns,
+                           uint32_t thread) {
+    LogFormat current = format.load(std::memory_order_relaxed);
+    if (current == LogFormat::Terminal) {
+        FILE* out = level >= LogLevel::Warning ? stderr : stdout;
+        // Another thread's "Doing something..." is cut short rather than
+        // finished with this message
+        if (open_line_out && open_line_thread != thread) {
+            std::fputc('\n', open_line_out);
+            open_line_out = nullptr;
+        }
+        std::fwrite(text.data(), 1, text.size(), out);
+        // Messages carried over from std::cout << ... << "\n" already end the line
+        bool ends_itself = !text.empty() && text.back() == '\n';
+        if (end_line && !ends_itself) {
+            std::fputc('\n', out);
+        }
+        if (end_line || ends_itself) {
+            open_line_out = nullptr;
+        } else {
+            open_line_thread = thread;
+            open_line_out = out;
+        }
+        return;
+    }
+
+    // Whole lines only
+    PendingText& pending = pending_lines[thread];
+    pending.text += text;
+    pending.level = std::max(pending.level, level);
+    if (!end_line) {
+        return;
+    }
+    PendingText line = std::move(pending);
+    pending_lines.erase(thread);
+    while (!line.text.empty() && line.text.back() == '\n') {
+        line.text.pop_back();
+    }
+
+    if (current == LogFormat::Syslog) {
+        syslog(syslog_priority(line.level), "%s", line.text.c_str());
+        return;
+    }
+    nlohmann::json entry = {
+        {"time", static_cast<double>(time_ns) / 1e9},
+        {"level", level_name(line.level)},
+        {"thread", thread},
+        {"message", line.text},
+    };
+    std::string out = entry.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+    out += '\n';
+    std::fwrite(out.data(), 1, out.size(), stderr);
+}
+
+void Logger::atfork_prepare() {
+    Logger& logger = instance();
+    logger.renderer_lock.lock();
+    logger.output_lock.lock();
+}
+
+void Logger::atfork_parent() {
+    Logger& logger = instance();
+    logger.output_lock.unlock();
+    logger.renderer_lock.unlock();
+}
+
+void Logger::atfork_child() {
+    Logger& logger = instance();
+    // Only the forking thread exists here. The parent's renderer may
+    // have been waiting on these, so start them over rather than
+    // unlocking or signalling state that refers to a missing thread.
+    new (&logger.renderer_lock) std::mutex();
+    new (&logger.output_lock) std::mutex();
+    new (&logger.wake) std::condition_variable();
+    new (&logger.drained) std::condition_variable();
+    logger.renderer = nullptr;
+    logger.renderer_running = false;
+    logger.renderer_idle = false;
+    logger.stopping = false;
+    // What's queued is the parent's to write
+    logger.ring.reset();
+    logger.pending_messages.clear();
+    logger.pending_lines.clear();
+    logger.open_line_out = nullptr;
+    logger.dropped = 0;
+}
+
+void Logger::at_exit() {
+    Logger& logger = instance();
+    std::thread* thread = nullptr;
+    {
+        std::lock_guard<std::mutex> guard(logger.renderer_lock);
+        logger.stopping = true;
+        thread = logger.renderer;
+        logger.renderer = nullptr;
+    }
+    if (thread) {
+        logger.wake.notify_one();
+        thread->join();
+        delete thread;
+    }
+    logger.synchronous = true;
+    logger.renderer_running = false;
+    // Whatever was pushed while the renderer stopped
+    logger.drain();
+}
+
+} // namespace blocks
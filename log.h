@@ -0,0 +1,168 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include "mpsc_ring.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+namespace blocks {
+
+enum class LogLevel : uint8_t {
+    Debug,
+    Info,
+    Warning,
+    Error,
+};
+
+enum class LogFormat {
+    // Info and below on stdout, warnings and errors on stderr, as plain lines
+    Terminal,
+    // One JSON object per record on stderr, leaving stdout to results
+    JsonLines,
+    Syslog,
+};
+
+// "terminal", "json" or "syslog"; throws std::invalid_argument
+LogFormat parse_log_format(const std::string& name);
+
+// A fixed-size log record; longer messages take several, all but the
+// last marked continued. The renderer puts a thread's records back
+// together before writing, whatever other threads logged in between.
+struct LogRecord {
+    static constexpr size_t TEXT_SIZE = 494;
+
+    uint64_t time_ns;  // CLOCK_REALTIME
+    uint32_t thread;   // Kernel thread id
+    LogLevel level;
+    bool continued;    // More of this message in the thread's next record
+    bool end_line;     // False for log_progress, the next message finishes the line
+    uint16_t length;
+    char text[TEXT_SIZE];
+};
+static_assert(sizeof(LogRecord) == 512, "log record layout");
+
+// Producers format and push records into a lock-free ring; a renderer
+// thread writes them out in batches, so code in I/O loops never waits
+// on the terminal. When the ring is full, debug and info records are
+// dropped (and counted), warnings and errors wait for room.
+//
+// After fork() the child starts with an empty ring and its own renderer.
+// Records logged while the process exits are written synchronously.
+class Logger {
+public:
+    static Logger& instance();
+
+    void configure(LogFormat format, LogLevel min_level);
+    bool enabled(LogLevel level) const { return level >= min_level.load(std::memory_order_relaxed); }
+
+    // end_line=false continues the line with the next record,
+    // for "Doing something... ok"
+    void log(LogLevel level, std::string_view text, bool end_line = true);
+
+    // Wait until everything logged so far has been written
+    void flush();
+
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+private:
+    static constexpr size_t RING_CAPACITY = 1024;
+
+    Logger();
+
+    void push(const LogRecord& record);
+    void ensure_renderer();
+    void render_loop();
+    // Returns the number of records written
+    size_t drain();
+    void write_record(const LogRecord& record);
+    // A whole message; lines are only ever made of one thread's messages
+    void write_message(LogLevel level, const std::string& text, bool end_line, uint64_t time_ns, uint32_t thread);
+
+    static void atfork_prepare();
+    static void atfork_parent();
+    static void atfork_child();
+    static void at_exit();
+
+    MpscRing<LogRecord, RING_CAPACITY> ring;
+    std::atomic<LogFormat> format{LogFormat::Terminal};
+    std::atomic<LogLevel> min_level{LogLevel::Info};
+    std::atomic<uint64_t> dropped{0};
+
+    // Set once the process is exiting
+    std::atomic<bool> synchronous{false};
+
+    std::mutex renderer_lock;
+    std::condition_variable wake;
+    std::condition_variable drained;
+    // Leaked on purpose in a forked child, where the thread doesn't exist
+    std::thread* renderer = nullptr;
+    std::atomic<bool> renderer_running{false};
+    // Producers only signal a renderer that is waiting
+    std::atomic<bool> renderer_idle{false};
+    bool stopping = false;
+
+    // Held while writing, and across fork() so the child never
+    // inherits a half-written line or a locked stdio stream
+    std::mutex output_lock;
+    struct PendingText {
+        std::string text;
+        LogLevel level = LogLevel::Debug;
+    };
+    // By thread: records waiting for the rest of their message, and
+    // messages waiting for the rest of their line (JSON, syslog)
+    std::unordered_map<uint32_t, PendingText> pending_messages;
+    std::unordered_map<uint32_t, PendingText> pending_lines;
+    // The thread whose line is open on the terminal, and where
+    uint32_t open_line_thread = 0;
+    FILE* open_line_out = nullptr;
+};
+
+// Collects a message with <<, logs it when it goes out of scope
+class LogLine {
+public:
+    LogLine(LogLevel level, bool end_line = true)
+        : level(level), end_line(end_line), active(Logger::instance().enabled(level)) {}
+
+    ~LogLine() {
+        if (active) {
+            Logger::instance().log(level, stream.str(), end_line);
+        }
+    }
+
+    template <typename T>
+    LogLine& operator<<(const T& value) {
+        if (active) {
+            stream << value;
+        }
+        return *this;
+    }
+
+    LogLine(const LogLine&) = delete;
+    LogLine& operator=(const LogLine&) = delete;
+
+private:
+    LogLevel level;
+    bool end_line;
+    bool active;
+    std::ostringstream stream;
+};
+
+inline LogLine log_debug() { return LogLine(LogLevel::Debug); }
+inline LogLine log_info() { return LogLine(LogLevel::Info); }
+inline LogLine log_warning() { return LogLine(LogLevel::Warning); }
+inline LogLine log_error() { return LogLine(LogLevel::Error); }
+// Info without a line break, the next record finishes the line
+inline LogLine log_progress() { return LogLine(LogLevel::Info, false); }
+
+} // namespace blocks
+
+#endif // LOG_H
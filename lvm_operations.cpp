@@ -1,4 +1,6 @@
 #include "lvm_operations.h"
+#include "buffer_arena.h"
+#include "relocation.h"
 #include <iostream>
 #include <fstream>
 #include <filesystem>
@@ -182,6 +184,7 @@ namespace blocks {
         std::string lv_info_cmd = "lvm lvs --noheadings --rows --units=b --nosuffix "
                                   "-o vg_name,vg_uuid,lv_name,lv_uuid,lv_attr -- " + device.devpath;
 
+        SubprocessTimer timer(lv_info_cmd);
         FILE *pipe = popen(lv_info_cmd.c_str(), "r");
         if (!pipe) {
             throw std::runtime_error("Failed to execute LVM command");
@@ -232,7 +235,7 @@ namespace blocks {
         std::string tdname(temp_dir);
         std::string vgcfgname = tdname + "/vg.cfg";
 
-        std::cout << "Loading LVM metadata... " << std::flush;
+        log_progress() << "Loading LVM metadata... ";
 
         // Backup VG configuration
         std::vector<std::string> vgcfgbackup_cmd = {"lvm", "vgcfgbackup", "--file", vgcfgname, "--", vgname};
@@ -276,23 +279,23 @@ namespace blocks {
         vgcfg_backagain.close();
 
         if (debug) {
-            std::cout << "CHECK STABILITY" << std::endl;
+            log_debug() << "CHECK STABILITY";
             std::system(("git --no-pager diff --no-index --patience --color-words -- " +
                          vgcfgname + " " + vgcfgname + ".backagain").c_str());
 
             if (forward) {
-                std::cout << "CHECK CORRECTNESS (forward)" << std::endl;
+                log_debug() << "CHECK CORRECTNESS (forward)";
             } else {
-                std::cout << "CHECK CORRECTNESS (backward)" << std::endl;
+                log_debug() << "CHECK CORRECTNESS (backward)";
             }
             std::system(("git --no-pager diff --no-index --patience --color-words -- " +
                          vgcfgname + " " + vgcfgname + ".new").c_str());
         }
 
         if (forward) {
-            std::cout << "Rotating the second extent to be the first... " << std::flush;
+            log_progress() << "Rotating the second extent to be the first... ";
         } else {
-            std::cout << "Rotating the last extent to be the first... " << std::flush;
+            log_progress() << "Rotating the last extent to be the first... ";
         }
 
         // Restore the modified configuration
@@ -308,34 +311,29 @@ namespace blocks {
             quiet_call(lvchange_activate_cmd);
         }
 
-        std::cout << "ok" << std::endl;
+        log_info() << "ok";
 
         // Clean up temporary directory
         std::filesystem::remove_all(tdname);
     }
 
-    int cmd_to_lvm(const CommandArgs &args) {
-        BlockDevice device(args.device);
-        bool debug = args.debug;
-        CLIProgressHandler progress;
-
-        if (device.superblock_type() == "LVM2_member") {
-            std::cerr << "Already a physical volume, removing existing LVM metadata...\n";
-            std::vector<std::string> pvremove_cmd = {"pvremove", "-ff", "--", args.device};
-            quiet_call(pvremove_cmd);
-        }
-
-        LVMReq::require(progress);
+    uint64_t lvm_extent_size(const std::string& report, const std::string& target) {
+        std::string output = exec_command("lvm " + report + " --noheadings --rows --units=b --nosuffix "
+                                          "-o vg_extent_size -- " + target);
+        output.erase(0, output.find_first_not_of(" \n\r\t"));
+        output.erase(output.find_last_not_of(" \n\r\t") + 1);
+        return std::stoull(output);
+    }
 
-        std::string vgname;
-        uint64_t pe_size;
-        std::string join_name;
-        std::string join_uuid;
+    LvmLayout to_lvm_layout(const CommandArgs& args, BlockDevice& device) {
+        LvmLayout layout;
+        layout.pe_size = LVM_PE_SIZE;
 
         if (!args.join.empty()) {
             std::string vg_info_cmd = "lvm vgs --noheadings --rows --units=b --nosuffix "
-                                      "-o vg_name,vg_uuid,vg_extent_size -- " + args.join;
+                                      "-o vg_name,vg_extent_size -- " + args.join;
 
+            SubprocessTimer timer(vg_info_cmd);
             FILE *pipe = popen(vg_info_cmd.c_str(), "r");
             if (!pipe) {
                 throw std::runtime_error("Failed to execute LVM command");
@@ -348,39 +346,46 @@ namespace blocks {
             }
             pclose(pipe);
 
-            std::istringstream iss(vg_info);
-            std::string line;
-            std::getline(iss, line);
-
             std::string pe_size_str;
-            std::istringstream line_stream(line);
-            line_stream >> join_name >> join_uuid >> pe_size_str;
-
-            auto trim = [](std::string &s) {
-                s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](unsigned char ch) {
-                    return !std::isspace(ch);
-                }));
-            };
-
-            trim(join_name);
-            trim(join_uuid);
-            trim(pe_size_str);
+            std::istringstream iss(vg_info);
+            iss >> layout.join_name >> pe_size_str;
+            layout.pe_size = std::stoull(pe_size_str);
 
+            // Renamed by vgmerge
             uuid_t uuid;
             uuid_generate(uuid);
             char uuid_str[37];
             uuid_unparse_lower(uuid, uuid_str);
-            vgname = uuid_str;
-
-            pe_size = std::stoul(pe_size_str);
+            layout.vgname = uuid_str;
         } else if (!args.vgname.empty()) {
-            vgname = args.vgname;
-            pe_size = LVM_PE_SIZE;
+            layout.vgname = args.vgname;
         } else {
-            vgname = "vg." + std::filesystem::path(device.devpath).filename().string();
-            pe_size = LVM_PE_SIZE;
+            layout.vgname = "vg." + std::filesystem::path(device.devpath).filename().string();
         }
 
+        layout.pe_count = device.size() / layout.pe_size - 1;
+        layout.pe_newpos = layout.pe_count * layout.pe_size;
+        return layout;
+    }
+
+    int cmd_to_lvm(const CommandArgs &args) {
+        BlockDevice device(args.device);
+        bool debug = args.debug;
+        CLIProgressHandler progress;
+
+        if (device.superblock_type() == "LVM2_member") {
+            log_warning() << "Already a physical volume, removing existing LVM metadata...";
+            std::vector<std::string> pvremove_cmd = {"pvremove", "-ff", "--", args.device};
+            quiet_call(pvremove_cmd);
+        }
+
+        LVMReq::require(progress);
+
+        LvmLayout layout = to_lvm_layout(args, device);
+        std::string vgname = layout.vgname;
+        uint64_t pe_size = layout.pe_size;
+        const std::string& join_name = layout.join_name;
+
         assert(!vgname.empty());
         for (char c : vgname) {
             assert(ASCII_ALNUM_WHITELIST.find(c) != std::string::npos);
@@ -404,53 +409,52 @@ namespace blocks {
         }
 
         uint64_t pe_sectors = bytes_to_sector(pe_size);
-        uint64_t pe_count = device.size() / pe_size - 1;
-        uint64_t pe_newpos = pe_count * pe_size;
+        uint64_t pe_count = layout.pe_count;
+        uint64_t pe_newpos = layout.pe_newpos;
 
         assert(pe_size >= 4096);
         uint64_t ba_start = 2048;
         uint64_t ba_size = 2048;
 
         if (debug) {
-            std::cout << "pe " << pe_size << " pe_newpos " << pe_newpos
-                      << " devsize " << device.size() << std::endl;
+            log_debug() << "pe " << pe_size << " pe_newpos " << pe_newpos
+                      << " devsize " << device.size();
         }
 
         block_stack.read_superblocks();
+        block_stack.record_layer_sizes("before");
 
         // Single filesystem check with -y
-        std::cout << "Checking the filesystem before resizing it\n";
+        log_info() << "Checking the filesystem before resizing it";
         std::vector<std::string> fsck_cmd = {"e2fsck", "-f", "-y", "--", args.device};
         try {
             quiet_call(fsck_cmd);
         } catch (const std::exception& e) {
-            std::cerr << "Filesystem check failed: " << e.what() << "\n";
+            log_error() << "Filesystem check failed: " << e.what();
             throw std::runtime_error("Filesystem check failed, please repair manually with 'e2fsck -f " + args.device + "'");
         }
 
-        std::cout << "Will shrink the filesystem (ext4) by " << (device.size() - pe_newpos) << " bytes\n";
+        log_info() << "Will shrink the filesystem (ext4) by " << (device.size() - pe_newpos) << " bytes";
         block_stack.stack_reserve_end_area(pe_newpos, progress);
+        block_stack.record_layer_sizes("after");
 
         std::string fsuuid = block_stack.fsuuid();
+        // Until the volume group is active
+        std::optional<ScopedTimer> offline(std::in_place, Metrics::instance().offline_seconds);
         block_stack.deactivate();
 
         int dev_fd = device.open_excl();
         if (dev_fd < 0) {
-            std::cerr << "Failed to initially open physical device " << device.devpath << ": " << strerror(errno) << "\n";
+            log_error() << "Failed to initially open physical device " << device.devpath << ": " << strerror(errno);
             throw std::runtime_error("Failed to open physical device");
         }
-        std::cout << "Copying " << pe_size << " bytes from pos 0 to pos "
-                  << pe_newpos << "... " << std::flush;
-
-        std::vector<uint8_t> pe_data(pe_size);
-        ssize_t read_len = pread(dev_fd, pe_data.data(), pe_size, 0);
-        assert(read_len == static_cast<ssize_t>(pe_size));
-
-        ssize_t wr_len = pwrite(dev_fd, pe_data.data(), pe_size, pe_newpos);
-        assert(wr_len == static_cast<ssize_t>(pe_size));
-        std::cout << "ok" << std::endl;
+        log_info() << "Copying " << pe_size << " bytes from pos 0 to pos " << pe_newpos;
+        // The exclusive fd stays open meanwhile, so nothing mounts the device
+        CopyMethod method = copy_range(device.devpath, 0, device.devpath, pe_newpos, pe_size,
+                                       CopyOptions(), progress);
+        log_debug() << "Copied the first extent with " << copy_method_name(method);
 
-        std::cout << "Preparing LVM metadata... " << std::flush;
+        log_progress() << "Preparing LVM metadata... ";
 
         // Close dev_fd to release exclusive lock before dmsetup
         close(dev_fd);
@@ -458,14 +462,14 @@ namespace blocks {
         // Clean up stale rozeros and synthetic devices
         std::string dm_devices = exec_command("dmsetup ls | grep -E 'rozeros|synthetic' | awk '{print $1}'");
         if (!dm_devices.empty()) {
-            std::cout << "High-level cleanup of stale devices:\n" << dm_devices << "\n";
+            log_info() << "High-level cleanup of stale devices:\n" << dm_devices;
             std::istringstream iss(dm_devices);
             std::string dev;
             while (std::getline(iss, dev)) {
                 std::string remove_cmd = "dmsetup remove " + dev + " 2>/dev/null";
                 int status = system(remove_cmd.c_str());
                 if (status != 0) {
-                    std::cerr << "Failed to remove " << dev << ": Device or resource busy\n";
+                    log_error() << "Failed to remove " << dev << ": Device or resource busy";
                 }
             }
         }
@@ -473,11 +477,11 @@ namespace blocks {
         // Check and log device state
         std::string holders = exec_command("lsblk -o NAME -n -l " + args.device + " | grep -v " + args.device);
         if (!holders.empty()) {
-            std::cerr << "Warning: " << args.device << " has existing mappings:\n" << holders << "\n";
+            log_warning() << "Warning: " << args.device << " has existing mappings:\n" << holders;
         }
         std::string dm_table = exec_command("dmsetup table " + args.device + " 2>/dev/null");
         if (!dm_table.empty()) {
-            std::cerr << "Existing dmsetup table for " << args.device << ":\n" << dm_table << "\n";
+            log_warning() << "Existing dmsetup table for " << args.device << ":\n" << dm_table;
         }
 
         // Create rozeros device
@@ -493,7 +497,7 @@ namespace blocks {
 
         // Create synthetic device
         std::string synth_name = "synthetic-" + std::string(uuid_str);
-        std::string synth_full_name = "/dev/mapper/" + synth_name;
+        std::string synth_full_name = dev_path("mapper/" + synth_name);
         std::string synth_table = "0 " + std::to_string(bytes_to_sector(pe_size)) + " linear " + args.device + " 0\n" +
                                   std::to_string(bytes_to_sector(pe_size)) + " " +
                                   std::to_string(bytes_to_sector(device.size() - pe_size)) + " linear /dev/mapper/" + rozeros_name + " 0\n";
@@ -501,9 +505,9 @@ namespace blocks {
         std::vector<std::string> synth_cmd = {"dmsetup", "create", "--", synth_name};
         quiet_call(synth_cmd, synth_table);
 
-        std::cout << "Synthetic device full path: " << synth_full_name << "\n";
+        log_info() << "Synthetic device full path: " << synth_full_name;
         if (!std::filesystem::exists(synth_full_name)) {
-            std::cerr << "Synthetic device " << synth_full_name << " does not exist after creation\n";
+            log_error() << "Synthetic device " << synth_full_name << " does not exist after creation";
             throw std::runtime_error("Synthetic device creation failed");
         }
         SyntheticDevice synth_pv(synth_full_name);
@@ -575,7 +579,7 @@ namespace blocks {
         std::string lvm_config = "devices{filter=[\"a|^" + synth_full_name + "$|\",\"r|.*|\"]}activation{verify_udev_operations=1}";
         std::string lvm_cfg = "--config='" + lvm_config + "'";
 
-        std::cout << "LVM config: " << lvm_cfg << "\n";
+        log_info() << "LVM config: " << lvm_cfg;
 
         std::vector<std::string> pvcreate_cmd;
         pvcreate_cmd.push_back("lvm");
@@ -602,22 +606,23 @@ namespace blocks {
         quiet_call(pvcreate_cmd);
         quiet_call(vgcfgrestore_cmd);
 
-        std::cout << "ok" << std::endl;
+        log_info() << "ok";
 
         // Read metadata from synthetic device before removal
         int synth_fd = open(synth_full_name.c_str(), O_RDONLY);
         if (synth_fd < 0) {
-            std::cerr << "Failed to open synthetic device " << synth_full_name << " for reading: " << strerror(errno) << "\n";
+            log_error() << "Failed to open synthetic device " << synth_full_name << " for reading: " << strerror(errno);
             throw std::runtime_error("Failed to open synthetic device for metadata read");
         }
-        std::vector<uint8_t> metadata(pe_size);
+        IoBuffer metadata = BufferArena::instance().acquire(pe_size);
         ssize_t metadata_read = pread(synth_fd, metadata.data(), pe_size, 0);
         if (metadata_read != static_cast<ssize_t>(pe_size)) {
-            std::cerr << "Failed to read metadata from " << synth_full_name << ": expected " << pe_size
-                      << " bytes, read " << metadata_read << " bytes\n";
+            log_error() << "Failed to read metadata from " << synth_full_name << ": expected " << pe_size
+                      << " bytes, read " << metadata_read << " bytes";
             close(synth_fd);
             throw std::runtime_error("Failed to read metadata from synthetic device");
         }
+        Metrics::instance().bytes_read.add(pe_size);
         close(synth_fd);
 
         // Remove synthetic devices to release /dev/loop26p1
@@ -626,39 +631,40 @@ namespace blocks {
         quiet_call(remove_synth_cmd);
         quiet_call(remove_rozeros_cmd);
 
-        std::cout << "If the next stage is interrupted, it can be reverted with:\n"
+        log_info() << "If the next stage is interrupted, it can be reverted with:\n"
                   << "    dd if=" << device.devpath << " of=" << device.devpath
-                  << " bs=" << pe_size << " count=1 skip=" << pe_count << " conv=notrunc"
-                  << std::endl;
+                  << " bs=" << pe_size << " count=1 skip=" << pe_count << " conv=notrunc";
 
-        std::cout << "Installing LVM metadata... " << std::flush;
+        log_progress() << "Installing LVM metadata... ";
         dev_fd = device.open_excl();
         if (dev_fd < 0) {
-            std::cerr << "Failed to reopen physical device " << device.devpath << ": " << strerror(errno) << "\n";
+            log_error() << "Failed to reopen physical device " << device.devpath << ": " << strerror(errno);
             throw std::runtime_error("Failed to reopen physical device for metadata copy");
         }
-        std::cout << "Writing " << pe_size << " bytes of metadata to physical device at offset 0\n";
+        log_info() << "Writing " << pe_size << " bytes of metadata to physical device at offset 0";
         ssize_t metadata_written = pwrite(dev_fd, metadata.data(), pe_size, 0);
         if (metadata_written != static_cast<ssize_t>(pe_size)) {
-            std::cerr << "Failed to write metadata to " << device.devpath << ": expected " << pe_size
-                      << " bytes, wrote " << metadata_written << " bytes, errno: " << strerror(errno) << "\n";
+            log_error() << "Failed to write metadata to " << device.devpath << ": expected " << pe_size
+                      << " bytes, wrote " << metadata_written << " bytes, errno: " << strerror(errno);
             close(dev_fd);
             throw std::runtime_error("Failed to write metadata to physical device");
         }
-        std::cout << "ok" << std::endl;
+        Metrics::instance().bytes_written.add(pe_size);
+        log_info() << "ok";
         close(dev_fd);
 
-        std::cout << "Activating volume group " << vgname << "... " << std::flush;
+        log_progress() << "Activating volume group " << vgname << "... ";
         std::vector<std::string> vgchange_cmd = {"vgchange", "-ay", "--", vgname};
         try {
             quiet_call(vgchange_cmd);
-            std::cout << "ok" << std::endl;
+            offline.reset();
+            log_info() << "ok";
         } catch (const std::exception& e) {
-            std::cerr << "Failed to activate volume group " << vgname << ": " << e.what() << "\n";
+            log_error() << "Failed to activate volume group " << vgname << ": " << e.what();
             throw std::runtime_error("Volume group activation failed");
         }
 
-        std::cout << "LVM conversion successful!" << std::endl;
+        log_info() << "LVM conversion successful!";
 
         if (!args.join.empty()) {
             std::vector<std::string> vgmerge_cmd = {"lvm", "vgmerge", "--", join_name, vgname};
@@ -666,9 +672,9 @@ namespace blocks {
             vgname = join_name;
         }
 
-        std::cout << "Volume group name: " << vgname << "\n"
+        log_info() << "Volume group name: " << vgname << "\n"
                   << "Logical volume name: " << lvname << "\n"
-                  << "Filesystem uuid: " << fsuuid << "\n";
+                  << "Filesystem uuid: " << fsuuid;
 
         std::filesystem::remove(cfgf_path);
 
@@ -18,7 +18,26 @@ namespace blocks {
         bool debug = false;
         bool maintboot = false;
         bool resize_device = false;
+        // Print what the command would do, as JSON, and do nothing
+        bool plan = false;
         uint64_t newsize = 0;
+        // to-raid1: the second member, and resync limits in KiB/s,
+        // 0 for the kernel's defaults
+        std::string mirror;
+        uint64_t sync_speed_min = 0;
+        uint64_t sync_speed_max = 0;
+        // restripe: the target layout, and PVs to add to the VG first
+        uint32_t stripes = 0;
+        uint64_t stripe_size = 0;
+        std::vector<std::string> pvs;
+        // evacuate: threads copying an inactive LV, 0 to go by the devices
+        unsigned copy_threads = 0;
+        // maintboot-batch: run jobs on different devices at the same time
+        bool parallel = false;
+        // build-maintimage: where to write the image, and whether to
+        // compress it with zstd
+        std::string output;
+        bool zstd = false;
     };
 class Augeas {
 public:
@@ -47,6 +66,22 @@ void rotate_aug(Augeas& aug, bool forward, uint64_t size);
 // Rotate a logical volume by a single PE
 void rotate_lv(BlockDevice& device, uint64_t size, bool debug, bool forward);
 
+// The extent size lvm <report> (vgs, lvs) gives for target
+uint64_t lvm_extent_size(const std::string& report, const std::string& target);
+
+// Where to-lvm puts a device, decided the same way for the command and
+// its plan. The data's first extent moves to pe_newpos, past the
+// pe_count extents the LV will have.
+struct LvmLayout {
+    // When joining, a random name until the VG is merged into join_name
+    std::string vgname;
+    std::string join_name;
+    uint64_t pe_size = 0;
+    uint64_t pe_count = 0;
+    uint64_t pe_newpos = 0;
+};
+LvmLayout to_lvm_layout(const CommandArgs& args, BlockDevice& device);
+
 // Convert a device to LVM
 int cmd_to_lvm(const struct CommandArgs& args);
 
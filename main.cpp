@@ -6,16 +6,25 @@
 #include <fstream>
 #include <cstdlib>
 #include <getopt.h>
+#include <algorithm>
 #include <cassert>
 #include <memory>
 
 #include "blocks_types.h"
 #include "block_device.h"
 #include "block_stack.h"
+#include "filesystem.h"
 #include "lvm_operations.h"
 #include "bcache_operations.h"
 #include "resize_operations.h"
 #include "maintboot_operations.h"
+#include "plan.h"
+#include "raid_operations.h"
+#include "extent_migration.h"
+#include "maintimage.h"
+#include "buffer_arena.h"
+#include "probe_cache.h"
+#include <unistd.h>
 
 namespace blocks {
     void print_help() {
@@ -25,11 +34,24 @@ namespace blocks {
         std::cout << "  to-lvm, lvmify    Convert to LVM" << std::endl;
         std::cout << "  to-bcache         Convert to bcache" << std::endl;
         std::cout << "  resize            Resize a device or filesystem" << std::endl;
+        std::cout << "  to-raid1          Mirror a device onto another, in place" << std::endl;
+        std::cout << "  restripe          Stripe a logical volume over more PVs, online" << std::endl;
+        std::cout << "  evacuate          Move all extents off a physical volume, online" << std::endl;
         std::cout << "  rotate            Rotate LV contents to start at the second PE" << std::endl;
+        std::cout << "  maintboot-batch   Run the jobs of a JSON file in one maintenance boot" << std::endl;
+        std::cout << "  build-maintimage  Write an initramfs for maintenance boots" << std::endl;
         std::cout << "  maintboot-impl    Internal command for maintenance boot" << std::endl;
         std::cout << std::endl;
         std::cout << "Global options:" << std::endl;
         std::cout << "  --debug           Enable debug output" << std::endl;
+        std::cout << "  --log-format FMT  terminal (default), json (JSON lines on stderr) or syslog" << std::endl;
+        std::cout << "  --metrics-file F  Write counters and timings of the run to F, as JSON if it" << std::endl;
+        std::cout << "                    ends in .json, in Prometheus text format otherwise" << std::endl;
+        std::cout << "  --hugepages       Back large I/O buffers with hugepages" << std::endl;
+        std::cout << "  --probe-cache F   Keep probe results in F between runs, except for devices" << std::endl;
+        std::cout << "                    the run changed" << std::endl;
+        std::cout << "  --plan            Print the steps of to-lvm, to-bcache or resize as JSON," << std::endl;
+        std::cout << "                    without changing anything" << std::endl;
         std::cout << std::endl;
         std::cout << "Command options:" << std::endl;
         std::cout << "  to-lvm, lvmify:" << std::endl;
@@ -43,36 +65,35 @@ namespace blocks {
         std::cout << "  resize:" << std::endl;
         std::cout << "    --resize-device Resize the device, not just the contents" << std::endl;
         std::cout << "    SIZE            New size in byte units (bkmgtpe suffixes accepted)" << std::endl;
+        std::cout << std::endl;
+        std::cout << "  to-raid1:" << std::endl;
+        std::cout << "    --mirror DEV    Device to mirror onto; its contents are lost" << std::endl;
+        std::cout << "    --sync-speed-min RATE, --sync-speed-max RATE" << std::endl;
+        std::cout << "                    Resync throttling per second (bkmgtpe suffixes accepted)" << std::endl;
+        std::cout << std::endl;
+        std::cout << "  restripe LV [PV...]:" << std::endl;
+        std::cout << "    --stripes N     Number of stripes, 2 or more; needs N + 1 PVs" << std::endl;
+        std::cout << "    --stripe-size S Bytes per stripe, a power of two (default 64k)" << std::endl;
+        std::cout << "    PV...           Devices to add to the volume group and stripe over" << std::endl;
+        std::cout << "    --sync-speed-min, --sync-speed-max as for to-raid1" << std::endl;
+        std::cout << std::endl;
+        std::cout << "  maintboot-batch JOBFILE:" << std::endl;
+        std::cout << "    --parallel      Run jobs on different disks at the same time" << std::endl;
+        std::cout << std::endl;
+        std::cout << "  evacuate PV [DEST-PV...]:" << std::endl;
+        std::cout << "    DEST-PV...      Where to move extents (default: the VG's other PVs)" << std::endl;
+        std::cout << "    --sync-speed-min, --sync-speed-max as for to-raid1" << std::endl;
+        std::cout << "    --copy-threads N" << std::endl;
+        std::cout << "                    Threads copying an inactive LV (default: one per hardware" << std::endl;
+        std::cout << "                    queue of the device with the fewest; at most 8)" << std::endl;
+        std::cout << std::endl;
+        std::cout << "  build-maintimage [JOBFILE]:" << std::endl;
+        std::cout << "    JOBFILE         Only include what these jobs need (default: every" << std::endl;
+        std::cout << "                    filesystem's tools found on this host)" << std::endl;
+        std::cout << "    --output FILE   Where to write it (default " << MAINTIMAGE_FILE << ")" << std::endl;
+        std::cout << "    --zstd          Compress the image" << std::endl;
     }
 
-    uint64_t parse_size_arg(const std::string& size) {
-        static const std::regex SIZE_RE("^(\\d+)([bkmgtpe])?\\Z");
-        std::smatch match;
-
-        // Check if the size string matches the expected pattern
-        if (!std::regex_match(size, match, SIZE_RE)) {
-            throw std::invalid_argument(
-                    "Size must be a decimal integer and a one-character unit suffix (bkmgtpe)");
-        }
-
-        // Convert the matched number (match[1]) to uint64_t
-        uint64_t val = std::stoull(match[1].str());
-
-        // Get the unit as a string; use "b" if no unit is matched
-        std::string unit = match[2].matched ? match[2].str() : "b";
-
-        // Define units as a std::string to use the find method
-        std::string units = "bkmgtpe";
-        size_t pos = units.find(unit[0]);
-
-        // Check if the unit is valid
-        if (pos == std::string::npos) {
-            throw std::invalid_argument("Invalid unit");
-        }
-
-        // Calculate the size by multiplying by 1024^pos
-        return val * static_cast<uint64_t>(std::pow(1024, pos));
-    }
     int cmd_rotate(const CommandArgs& args) {
         BlockDevice device(args.device);
         bool debug = args.debug;
@@ -84,9 +105,10 @@ namespace blocks {
                 "-o", "vg_extent_size", "--", device.devpath
         };
 
+        SubprocessTimer timer(cmd);
         FILE* pipe = popen(cmd[0].c_str(), "r");
         if (!pipe) {
-            std::cerr << "Failed to execute command" << std::endl;
+            log_error() << "Failed to execute command";
             return 1;
         }
 
@@ -101,7 +123,7 @@ namespace blocks {
         uint64_t pe_size = std::stoull(pe_size_str);
 
         if (device.superblock_at(pe_size).empty()) {
-            std::cerr << "No superblock on the second PE, exiting" << std::endl;
+            log_error() << "No superblock on the second PE, exiting";
             return 1;
         }
 
@@ -109,11 +131,150 @@ namespace blocks {
         return 0;
     }
 
+    int run_command(CommandArgs& args, int argc, char* argv[]) {
+        if (args.command == "to-lvm" || args.command == "lvmify") {
+            if (optind >= argc) {
+                log_error() << "Missing device argument";
+                return 1;
+            }
+            args.device = argv[optind++];
+            if (args.plan) {
+                Logger::instance().flush();
+                std::cout << plan_to_lvm(args).to_json().dump(2) << std::endl;
+                return 0;
+            }
+            return cmd_to_lvm(args);
+        }
+        else if (args.command == "to-bcache") {
+            if (optind >= argc) {
+                log_error() << "Missing device argument";
+                return 1;
+            }
+            args.device = argv[optind++];
+
+            if (args.plan) {
+                Logger::instance().flush();
+                std::cout << plan_to_bcache(args).to_json().dump(2) << std::endl;
+                return 0;
+            }
+
+            return cmd_to_bcache(args);
+        }
+        else if (args.command == "resize") {
+            if (optind >= argc) {
+                log_error() << "Missing device argument";
+                return 1;
+            }
+            args.device = argv[optind++];
+
+            if (optind >= argc) {
+                log_error() << "Missing size argument";
+                return 1;
+            }
+
+            try {
+                args.newsize = parse_size_arg(argv[optind++]);
+            } catch (const std::invalid_argument& e) {
+                log_error() << e.what();
+                return 1;
+            }
+
+            ResizeArgs resize_args = {
+                    .device = args.device,
+                    .newsize = args.newsize,
+                    .resize_device = args.resize_device,
+                    .debug = args.debug
+            };
+
+            if (args.plan) {
+                Logger::instance().flush();
+                std::cout << plan_resize(resize_args).to_json().dump(2) << std::endl;
+                return 0;
+            }
+            return cmd_resize(resize_args);
+        }
+        else if (args.command == "to-raid1") {
+            if (optind >= argc) {
+                log_error() << "Missing device argument";
+                return 1;
+            }
+            args.device = argv[optind++];
+            return cmd_to_raid1(args);
+        }
+        else if (args.command == "restripe") {
+            if (optind >= argc) {
+                log_error() << "Missing device argument";
+                return 1;
+            }
+            args.device = argv[optind++];
+            while (optind < argc) {
+                args.pvs.push_back(argv[optind++]);
+            }
+            return cmd_restripe(args);
+        }
+        else if (args.command == "evacuate") {
+            if (optind >= argc) {
+                log_error() << "Missing device argument";
+                return 1;
+            }
+            args.device = argv[optind++];
+            while (optind < argc) {
+                args.pvs.push_back(argv[optind++]);
+            }
+            return cmd_evacuate(args);
+        }
+        else if (args.command == "rotate") {
+            if (optind >= argc) {
+                log_error() << "Missing device argument";
+                return 1;
+            }
+            args.device = argv[optind++];
+            return cmd_rotate(args);
+        }
+        else if (args.command == "maintboot-batch") {
+            if (optind >= argc) {
+                log_error() << "Missing job file argument";
+                return 1;
+            }
+            args.device = argv[optind++];
+            return cmd_maintboot_batch(args);
+        }
+        else if (args.command == "build-maintimage") {
+            if (optind < argc) {
+                args.device = argv[optind++];
+            }
+            return cmd_build_maintimage(args);
+        }
+        else if (args.command == "maintboot-impl") {
+            return cmd_maintboot_impl(argc, argv);
+        }
+        else {
+            log_error() << "Unknown command: " << args.command;
+            print_help();
+            return 1;
+        }
+
+        return 0;
+    }
+
     int main(int argc, char* argv[]) {
+        // /init of the maintenance image
+        if (getpid() == 1) {
+            maintimage_init();
+        }
+
+        // While this is the only thread, so every thread shares the namespace
+        try {
+            MountPool::instance().enter_private_namespace();
+        } catch (const std::exception& e) {
+            log_error() << e.what();
+            return 1;
+        }
+
         try {
             assert(true);
         } catch (const std::exception&) {
-            std::cerr << "Assertions need to be enabled" << std::endl;
+            log_error() << "Assertions need to be enabled";
             return 2;
         }
 
@@ -122,7 +283,13 @@ namespace blocks {
             return 0;
         }
 
+        // Before any tool runs, so a BLOCKS_TOOL_DIR override is on PATH
+        HostPaths::instance();
+
         CommandArgs args;
+        LogFormat log_format = LogFormat::Terminal;
+        std::string metrics_file;
+        std::string probe_cache;
         int option_index = 0;
         int c;
 
@@ -132,11 +299,25 @@ namespace blocks {
                 {"join", required_argument, 0, 'j'},
                 {"maintboot", no_argument, 0, 'm'},
                 {"resize-device", no_argument, 0, 'r'},
+                {"plan", no_argument, 0, 'p'},
+                {"log-format", required_argument, 0, 'l'},
+                {"metrics-file", required_argument, 0, 'M'},
+                {"mirror", required_argument, 0, 'R'},
+                {"sync-speed-min", required_argument, 0, 'n'},
+                {"sync-speed-max", required_argument, 0, 'x'},
+                {"stripes", required_argument, 0, 'S'},
+                {"stripe-size", required_argument, 0, 'z'},
+                {"parallel", no_argument, 0, 'P'},
+                {"output", required_argument, 0, 'o'},
+                {"zstd", no_argument, 0, 'Z'},
+                {"hugepages", no_argument, 0, 'H'},
+                {"probe-cache", required_argument, 0, 'C'},
+                {"copy-threads", required_argument, 0, 'T'},
                 {"help", no_argument, 0, 'h'},
                 {0, 0, 0, 0}
         };
 
-        while ((c = getopt_long(argc, argv, "dv:j:mrh", long_options, &option_index)) != -1) {
+        while ((c = getopt_long(argc, argv, "dv:j:mrpl:M:R:n:x:S:z:Po:ZHC:T:h", long_options, &option_index)) != -1) {
             switch (c) {
                 case 'd':
                     args.debug = true;
@@ -153,6 +334,76 @@ namespace blocks {
                 case 'r':
                     args.resize_device = true;
                     break;
+                case 'p':
+                    args.plan = true;
+                    break;
+                case 'l':
+                    try {
+                        log_format = parse_log_format(optarg);
+                    } catch (const std::invalid_argument& e) {
+                        log_error() << e.what();
+                        return 1;
+                    }
+                    break;
+                case 'M':
+                    metrics_file = optarg;
+                    break;
+                case 'R':
+                    args.mirror = optarg;
+                    break;
+                case 'n':
+                case 'x':
+                    try {
+                        // md and LVM both take KiB/s
+                        uint64_t kib = std::max<uint64_t>(1, parse_size_arg(optarg) / 1024);
+                        (c == 'n' ? args.sync_speed_min : args.sync_speed_max) = kib;
+                    } catch (const std::invalid_argument& e) {
+                        log_error() << e.what();
+                        return 1;
+                    }
+                    break;
+                case 'S': {
+                    // stoul takes "-1" and wraps it around
+                    std::string count = optarg;
+                    if (count.empty() || count.size() > 9 ||
+                        count.find_first_not_of("0123456789") != std::string::npos) {
+                        log_error() << "Invalid stripe count: " << optarg;
+                        return 1;
+                    }
+                    args.stripes = std::stoul(count);
+                    break;
+                }
+                case 'z':
+                    try {
+                        args.stripe_size = parse_size_arg(optarg);
+                    } catch (const std::invalid_argument& e) {
+                        log_error() << e.what();
+                        return 1;
+                    }
+                    break;
+                case 'P':
+                    args.parallel = true;
+                    break;
+                case 'o':
+                    args.output = optarg;
+                    break;
+                case 'Z':
+                    args.zstd = true;
+                    break;
+                case 'H':
+                    BufferArena::instance().set_hugepages(true);
+                    break;
+                case 'C':
+                    probe_cache = optarg;
+                    break;
+                case 'T':
+                    try {
+                        args.copy_threads = std::stoul(optarg);
+                    } catch (const std::exception&) {
+                        log_error() << "Invalid thread count: " << optarg;
+                        return 1;
+                    }
+                    break;
                 case 'h':
                     print_help();
                     return 0;
@@ -163,106 +414,57 @@ namespace blocks {
             }
         }
 
+        Logger::instance().configure(log_format, args.debug ? LogLevel::Debug : LogLevel::Info);
+
         if (optind >= argc) {
-            std::cerr << "Missing command" << std::endl;
+            log_error() << "Missing command";
             print_help();
             return 1;
         }
 
         args.command = argv[optind++];
 
-        if (args.command == "to-lvm" || args.command == "lvmify") {
-            if (optind >= argc) {
-                std::cerr << "Missing device argument" << std::endl;
-                return 1;
-            }
-            args.device = argv[optind++];
-            return cmd_to_lvm(args);
+        if (!probe_cache.empty()) {
+            ProbeCache::instance().load(probe_cache);
         }
-        else if (args.command == "to-bcache") {
-            if (optind >= argc) {
-                std::cerr << "Missing device argument" << std::endl;
-                return 1;
-            }
-            args.device = argv[optind++];
-
-            BlockDevice device(args.device);
-            CLIProgressHandler progress;
 
-            if (device.has_bcache_superblock()) {
-                std::cerr << "Device " << device.devpath << " already has a bcache super block." << std::endl;
-                return 1;
-            }
+        int status;
+        {
+            // Temporary mounts are shared by all steps of a command,
+            // unmount them once it is done
+            struct MountPoolRelease {
+                ~MountPoolRelease() { MountPool::instance().release_all(); }
+            } release_mounts;
 
-            BCacheReq::require(progress);
-
-            if (args.maintboot) {
-                return call_maintboot(device, "to-bcache", {
-                        {"debug", args.debug ? "true" : "false"},
-                        {"join", args.join}
-                });
-            }
-            else if (device.is_partition()) {
-                return part_to_bcache(device, args.debug, progress, args.join);
-            }
-            else if (device.is_lv()) {
-                return lv_to_bcache(device, args.debug, progress, args.join);
-            }
-            else if (device.superblock_type() == "crypto_LUKS") {
-                return luks_to_bcache(device, args.debug, progress, args.join);
-            }
-            else {
-                std::cerr << "Device " << device.devpath
-                          << " is not a partition, a logical volume, or a LUKS volume" << std::endl;
-                return 1;
+            try {
+                status = run_command(args, argc, argv);
+            } catch (const Bail&) {
+                // Reported by the progress handler; the stack has been
+                // unwound, so temporary devices are already released
+                status = Bail::EXIT_STATUS;
+            } catch (const std::exception& e) {
+                log_error() << e.what();
+                status = 1;
             }
         }
-        else if (args.command == "resize") {
-            if (optind >= argc) {
-                std::cerr << "Missing device argument" << std::endl;
-                return 1;
-            }
-            args.device = argv[optind++];
 
-            if (optind >= argc) {
-                std::cerr << "Missing size argument" << std::endl;
-                return 1;
-            }
+        // Only a plan is sure to have left every device as it was; after
+        // anything else, even a failure, save checks each one again
+        if (ProbeCache::instance().enabled()) {
+            ProbeCache::instance().save(!args.plan);
+        }
 
+        if (!metrics_file.empty()) {
             try {
-                args.newsize = parse_size_arg(argv[optind++]);
-            } catch (const std::invalid_argument& e) {
-                std::cerr << e.what() << std::endl;
-                return 1;
-            }
-
-            ResizeArgs resize_args = {
-                    .device = args.device,
-                    .newsize = args.newsize,
-                    .resize_device = args.resize_device,
-                    .debug = args.debug
-            };
-
-            return cmd_resize(resize_args);
-        }
-        else if (args.command == "rotate") {
-            if (optind >= argc) {
-                std::cerr << "Missing device argument" << std::endl;
-                return 1;
+                Metrics::instance().write_file(metrics_file, args.command, status);
+            } catch (const std::exception& e) {
+                log_error() << e.what();
+                if (status == 0) {
+                    status = 1;
+                }
             }
-            args.device = argv[optind++];
-            return cmd_rotate(args);
-        }
-        else if (args.command == "maintboot-impl") {
-            return cmd_maintboot_impl(argc, argv);
         }
-        else {
-            std::cerr << "Unknown command: " << args.command << std::endl;
-            print_help();
-            return 1;
-        }
-
-        return 0;
+        return status;
     }
 
     int script_main() {
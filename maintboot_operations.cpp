@@ -1,8 +1,24 @@
 #include "maintboot_operations.h"
+#include "daemon.h"
+#include "layer_types.h"
+#include "uuid_index.h"
 #include <cstdlib>
 #include <filesystem>
 #include <iostream>
 #include <sstream>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <numeric>
+#include <set>
+#include <thread>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <curl/curl.h>
 #include <nlohmann/json.hpp>
@@ -10,61 +26,154 @@
 
 namespace blocks {
 
-// Factory function to create the appropriate Filesystem instance
     std::unique_ptr<Filesystem> create_filesystem(BlockDevice& device) {
-        std::string fs_type = device.superblock_type(); // Assumes this method exists
-
-        if (fs_type == "ext2" || fs_type == "ext3" || fs_type == "ext4") {
-            return std::make_unique<ExtFS>(device);
-        } else if (fs_type == "xfs") {
-            return std::make_unique<XFS>(device);
-        } else if (fs_type == "btrfs") {
-            return std::make_unique<BtrFS>(device);
-        } else if (fs_type == "reiserfs") {
-            return std::make_unique<ReiserFS>(device);
-        } else if (fs_type == "nilfs2") {
-            return std::make_unique<NilFS>(device);
-        } else if (fs_type == "swap") {
-            return std::make_unique<Swap>(device);
-        } else {
+        std::string fs_type = device.superblock_type();
+        auto fs = make_filesystem(fs_type, device);
+        if (!fs) {
             throw std::runtime_error("Unsupported filesystem type: " + fs_type);
         }
+        return fs;
+    }
+
+    namespace {
+
+    // Options a job may carry, passed on to blocks as --name [value]
+    const std::set<std::string> JOB_OPTIONS = {"debug", "join", "vg-name", "resize-device", "size"};
+
+    void check_job(const MaintbootJob& job) {
+        if (job.command != "to-lvm" && job.command != "to-bcache" && job.command != "resize") {
+            throw std::runtime_error("Unsupported maintboot command: " + job.command);
+        }
+        for (const auto& [key, value] : job.args) {
+            if (!JOB_OPTIONS.count(key)) {
+                throw std::runtime_error("Unsupported option for " + job.command + ": " + key);
+            }
+        }
+        if (job.command == "resize" && !job.args.count("size")) {
+            throw std::runtime_error("A resize job needs a size");
+        }
+    }
+
+    std::string url_encode(const std::string& str) {
+        CURL* curl = curl_easy_init();
+        if (!curl) {
+            throw std::runtime_error("Failed to initialize curl");
+        }
+        char* encoded = curl_easy_escape(curl, str.c_str(), str.length());
+        std::string result(encoded);
+        curl_free(encoded);
+        curl_easy_cleanup(curl);
+        return result;
+    }
+
+    // The UUID of the filesystem mounted at path, empty if there is none
+    std::string mounted_fsuuid(const std::string& path) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            return "";
+        }
+        std::string devpath = dev_path("block/" + std::to_string(major(st.st_dev)) + ":" +
+                                       std::to_string(minor(st.st_dev)));
+        if (!std::filesystem::exists(devpath)) {
+            return "";
+        }
+        try {
+            BlockDevice device(devpath);
+            return create_filesystem(device)->fsuuid();
+        } catch (const std::exception&) {
+            return "";
+        }
     }
 
+    } // namespace
+
     int call_maintboot(BlockDevice device, const std::string& command,
                        const std::map<std::string, std::string>& args) {
-        // Use the factory function instead of direct instantiation
-        std::unique_ptr<Filesystem> fs = create_filesystem(device);
-        std::string fsuuid = fs->fsuuid();
+        MaintbootJob job{command, device.devpath, {}};
+        for (const auto& [key, value] : args) {
+            if (value != "false" && !value.empty()) {
+                job.args[key] = value;
+            }
+        }
+        return call_maintboot_batch({job}, false);
+    }
 
-        if (fsuuid.empty()) {
-            std::cerr << "Device " << device.devpath << " doesn't have a UUID" << std::endl;
+    int call_maintboot_batch(const std::vector<MaintbootJob>& jobs, bool parallel) {
+        if (jobs.empty()) {
+            log_error() << "No maintboot jobs";
             return 1;
         }
 
-        // Create a JSON object with the command and arguments
-        nlohmann::json json_args;
-        json_args["command"] = command;
-        json_args["device"] = fsuuid;
+        // Devices are found by filesystem UUID after the reboot
+        nlohmann::json json_jobs = nlohmann::json::array();
+        for (const auto& job : jobs) {
+            check_job(job);
+            BlockDevice device(job.device);
+            std::unique_ptr<Filesystem> fs = create_filesystem(device);
+            std::string fsuuid = fs->fsuuid();
 
-        // Add any additional arguments
-        for (const auto& [key, value] : args) {
-            json_args[key] = value;
+            if (fsuuid.empty()) {
+                log_error() << "Device " << device.devpath << " doesn't have a UUID";
+                return 1;
+            }
+
+            nlohmann::json json_job = {{"command", job.command}, {"device", fsuuid}};
+            for (const auto& [key, value] : job.args) {
+                json_job[key] = value;
+            }
+            json_jobs.push_back(json_job);
         }
 
-        // URL encode the JSON string
-        std::string json_str = json_args.dump();
+        // Create a JSON object with the jobs
+        nlohmann::json json_args;
+        json_args["jobs"] = json_jobs;
+        json_args["parallel"] = parallel;
+        std::string status_uuid = mounted_fsuuid("/boot");
+        if (status_uuid.empty()) {
+            status_uuid = mounted_fsuuid("/");
+        }
+        if (!status_uuid.empty()) {
+            json_args["status"] = status_uuid;
+        } else {
+            log_warning() << "No filesystem for " << MAINTBOOT_STATUS_FILE << ", results will only be logged";
+        }
 
-        CURL* curl = curl_easy_init();
-        if (!curl) {
-            std::cerr << "Failed to initialize curl" << std::endl;
+        // URL encode the JSON string
+        std::string encoded_args = url_encode(json_args.dump());
+        // Well under the kernel command line limit, with room for the rest
+        if (encoded_args.size() > 1536) {
+            log_error() << "Too many maintboot jobs for the kernel command line (" << encoded_args.size()
+                        << " bytes), split them over several boots";
             return 1;
         }
 
-        char* encoded = curl_easy_escape(curl, json_str.c_str(), json_str.length());
-        std::string encoded_args(encoded);
-        curl_free(encoded);
-        curl_easy_cleanup(curl);
+        // A prebuilt image only needs kexec, and boots the running kernel
+        struct utsname uts;
+        std::string release = uname(&uts) == 0 ? uts.release : "";
+        std::string kernel = release.empty() ? "" : "/boot/vmlinuz-" + release;
+        if (std::filesystem::exists(MAINTIMAGE_FILE)) {
+            // Its modules only load into the kernel they were built for
+            std::string image_release;
+            std::ifstream release_file(std::string(MAINTIMAGE_FILE) + MAINTIMAGE_RELEASE_SUFFIX);
+            std::getline(release_file, image_release);
+            if (image_release != release) {
+                log_warning() << MAINTIMAGE_FILE << " has the modules of "
+                              << (image_release.empty() ? "an unknown kernel" : image_release) << ", not of "
+                              << release << "; ignoring it, rerun build-maintimage to use it again";
+            } else if (!kernel.empty() && std::filesystem::exists(kernel)) {
+                try {
+                    quiet_call({"kexec", "--load", kernel, std::string("--initrd=") + MAINTIMAGE_FILE,
+                                "--reuse-cmdline", "--append=BLOCKS_ARGS=" + encoded_args});
+                    quiet_call({"systemctl", "kexec"});
+                    return 0;
+                } catch (const std::exception& e) {
+                    log_error() << "Failed to boot " << MAINTIMAGE_FILE << ": " << e.what();
+                    return 1;
+                }
+            } else {
+                log_warning() << "No kernel image at " << kernel << ", ignoring " << MAINTIMAGE_FILE;
+            }
+        }
 
         // Build the maintboot command
         std::vector<std::string> cmd = {
@@ -81,7 +190,7 @@ namespace blocks {
             quiet_call(cmd);
             return 0;
         } catch (const std::exception& e) {
-            std::cerr << "Failed to execute maintboot: " << e.what() << std::endl;
+            log_error() << "Failed to execute maintboot: " << e.what();
             return 1;
         }
     }
@@ -114,63 +223,330 @@ namespace blocks {
 
     void prepare_maintboot_environment() {
         // Wait for devices to come up (30s max)
-        std::vector<std::string> settle_cmd = {"udevadm", "settle", "--timeout=30"};
-        quiet_call(settle_cmd);
+        if (!find_tool("udevadm").empty()) {
+            std::vector<std::string> settle_cmd = {"udevadm", "settle", "--timeout=30"};
+            quiet_call(settle_cmd);
+        } else {
+            // No udev in the blocks image: wait for the kernel to stop
+            // adding block devices
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+            size_t count = SIZE_MAX;
+            int stable = 0;
+            while (stable < 4 && std::chrono::steady_clock::now() < deadline) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(500));
+                size_t now = 0;
+                std::error_code ec;
+                for (auto it = std::filesystem::directory_iterator(sys_path("class/block"), ec);
+                     !ec && it != std::filesystem::directory_iterator(); it.increment(ec)) {
+                    ++now;
+                }
+                stable = now == count ? stable + 1 : 0;
+                count = now;
+            }
+        }
 
         // Activate LVM volumes
         std::vector<std::string> lvm_cmd = {"lvm", "vgchange", "-ay"};
         quiet_call(lvm_cmd);
     }
 
+    namespace {
+
+    // Where each job stands, kept on the status filesystem as jobs finish
+    class BatchStatus {
+    public:
+        BatchStatus(const nlohmann::json& jobs, std::string status_uuid) : status_uuid(std::move(status_uuid)) {
+            doc["jobs"] = nlohmann::json::array();
+            for (const auto& job : jobs) {
+                doc["jobs"].push_back({{"command", job["command"]}, {"device", job["device"]}, {"state", "pending"}});
+            }
+            doc["finished"] = false;
+        }
+
+        void start(size_t index) {
+            std::lock_guard<std::mutex> guard(lock);
+            doc["jobs"][index]["state"] = "running";
+            ++running[doc["jobs"][index]["device"].get<std::string>()];
+        }
+
+        void finish(size_t index, const std::string& state, int exit_status, double seconds) {
+            std::lock_guard<std::mutex> guard(lock);
+            auto& job = doc["jobs"][index];
+            job["state"] = state;
+            job["exit_status"] = exit_status;
+            job["seconds"] = seconds;
+            if (state != "skipped") {
+                --running[job["device"].get<std::string>()];
+            }
+            // Not while a job has the status filesystem's device
+            if (!running[status_uuid]) {
+                write();
+            }
+        }
+
+        void finish_all() {
+            std::lock_guard<std::mutex> guard(lock);
+            doc["finished"] = true;
+            write();
+        }
+
+    private:
+        void write() {
+            if (status_uuid.empty()) {
+                return;
+            }
+            try {
+                BlockDevice device = BlockDevice::by_uuid(status_uuid);
+                std::unique_ptr<Filesystem> fs = create_filesystem(device);
+                {
+                    auto mount = fs->temp_mount();
+                    std::ofstream out(mount->path() + "/" + MAINTBOOT_STATUS_FILE);
+                    out << doc.dump(2) << std::endl;
+                    if (!out) {
+                        throw std::runtime_error("Failed to write " + std::string(MAINTBOOT_STATUS_FILE));
+                    }
+                }
+                // Unmounting flushes it, and frees the device for later jobs
+                MountPool::instance().release(fs->devno());
+            } catch (const std::exception& e) {
+                log_warning() << "Failed to record maintboot status: " << e.what();
+            }
+        }
+
+        std::mutex lock;
+        nlohmann::json doc;
+        std::string status_uuid;
+        std::map<std::string, int> running;
+    };
+
+    std::vector<std::string> job_command(const nlohmann::json& job, const std::string& devpath) {
+        std::string command = job["command"].get<std::string>();
+        std::vector<std::string> cmd = {"blocks", command, devpath};
+        if (command == "resize") {
+            cmd.push_back(job["size"].get<std::string>());
+        }
+        for (auto it = job.begin(); it != job.end(); ++it) {
+            if (it.key() == "command" || it.key() == "device" || it.key() == "size") {
+                continue;
+            }
+            std::string value = it.value().get<std::string>();
+            if (value == "true") {
+                cmd.push_back("--" + it.key());
+            } else if (!value.empty() && value != "false") {
+                cmd.push_back("--" + it.key());
+                cmd.push_back(value);
+            }
+        }
+        return cmd;
+    }
+
+    // Like quiet_call, but safe from several threads and returning the
+    // exit status instead of throwing
+    int run_job(const std::vector<std::string>& cmd) {
+        log_debug() << "Executing: " << join_cmd(cmd);
+        Logger::instance().flush();
+        SubprocessTimer timer(cmd);
+
+        std::vector<char*> argv;
+        for (const auto& arg : cmd) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        pid_t pid;
+        int err = posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ);
+        if (err != 0) {
+            log_error() << "Failed to run " << cmd[0] << ": " << std::strerror(err);
+            return 127;
+        }
+        int status;
+        while (waitpid(pid, &status, 0) < 0) {
+            if (errno != EINTR) {
+                return 127;
+            }
+        }
+        return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+
+    // Runs the jobs at the given indices in order, skipping those on a
+    // device where an earlier job failed
+    bool run_jobs(const nlohmann::json& jobs, const std::vector<size_t>& indices, BatchStatus& status) {
+        std::set<std::string> failed_devices;
+        for (size_t index : indices) {
+            const auto& job = jobs[index];
+            if (failed_devices.count(job["device"].get<std::string>())) {
+                log_warning() << "Job " << index + 1 << " skipped after a failure on its device";
+                status.finish(index, "skipped", 0, 0);
+                continue;
+            }
+            status.start(index);
+            auto start = std::chrono::steady_clock::now();
+            int exit_status;
+            try {
+                BlockDevice device = BlockDevice::by_uuid(job["device"].get<std::string>());
+                log_info() << "Job " << index + 1 << ": " << job["command"].get<std::string>() << " "
+                           << device.devpath;
+                auto [major_num, minor_num] = device.devnum();
+                exit_status = run_job(job_command(job, device.devpath));
+                // The job ran in a child, which changed the device behind
+                // our memos; without udev the index wouldn't notice
+                DeviceRegistry::instance().invalidate(makedev(major_num, minor_num));
+                UuidIndex::instance().invalidate();
+            } catch (const std::exception& e) {
+                log_error() << "Job " << index + 1 << ": " << e.what();
+                exit_status = 1;
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (exit_status == 0) {
+                status.finish(index, "ok", exit_status, elapsed.count());
+            } else {
+                failed_devices.insert(job["device"].get<std::string>());
+                status.finish(index, "failed", exit_status, elapsed.count());
+                log_error() << "Job " << index + 1 << " failed with status " << exit_status;
+            }
+        }
+        return failed_devices.empty();
+    }
+
+    // Jobs that touch a common disk share a group, run in file order:
+    // partitions of one disk share its partition table, which to-lvm and
+    // to-bcache rewrite, and a dm device ties together the disks under it
+    std::vector<std::vector<size_t>> job_groups(const nlohmann::json& jobs, bool parallel) {
+        std::vector<size_t> leader(jobs.size());
+        std::iota(leader.begin(), leader.end(), 0);
+        auto find = [&](size_t i) {
+            while (leader[i] != i) {
+                i = leader[i] = leader[leader[i]];
+            }
+            return i;
+        };
+
+        std::map<std::string, size_t> first_job;  // By disk
+        for (size_t i = 0; parallel && i < jobs.size(); ++i) {
+            std::string uuid = jobs[i]["device"].get<std::string>();
+            std::set<std::string> disks;
+            try {
+                disks = underlying_disks(BlockDevice::by_uuid(uuid).devpath);
+            } catch (const std::exception& e) {
+                // The job fails on its own later; keep it with its device
+                log_warning() << "Can't find the disks of " << uuid << ": " << e.what();
+                disks = {uuid};
+            }
+            for (const auto& disk : disks) {
+                auto [it, inserted] = first_job.emplace(disk, i);
+                if (!inserted) {
+                    leader[find(i)] = find(it->second);
+                }
+            }
+        }
+
+        std::vector<std::vector<size_t>> groups;
+        std::map<size_t, size_t> group_of;  // By leader
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            size_t key = parallel ? find(i) : 0;
+            if (!group_of.count(key)) {
+                group_of[key] = groups.size();
+                groups.emplace_back();
+            }
+            groups[group_of[key]].push_back(i);
+        }
+        return groups;
+    }
+
+    } // namespace
+
     int cmd_maintboot_impl(int argc, char* argv[]) {
         try {
             // Parse the BLOCKS_ARGS environment variable
             nlohmann::json args = parse_maintboot_args();
 
-            // Verify that the command is what we expect
-            if (args["command"] != "to-bcache") {
-                throw std::runtime_error("Unsupported command: " + args["command"].get<std::string>());
+            // A single command from older versions is a batch of one
+            nlohmann::json jobs = nlohmann::json::array();
+            if (args.contains("jobs")) {
+                jobs = args["jobs"];
+            } else {
+                nlohmann::json job = args;
+                job.erase("maintboot");
+                jobs.push_back(job);
+            }
+            bool parallel = args.value("parallel", false);
+            std::string status_uuid = args.value("status", "");
+
+            // Verify that the jobs are what we expect
+            for (const auto& job : jobs) {
+                MaintbootJob check{job["command"].get<std::string>(), job["device"].get<std::string>(), {}};
+                for (auto it = job.begin(); it != job.end(); ++it) {
+                    if (it.key() != "command" && it.key() != "device") {
+                        check.args[it.key()] = it.value().get<std::string>();
+                    }
+                }
+                check_job(check);
             }
 
             // Prepare the environment
             prepare_maintboot_environment();
 
-            // Get the device by UUID
-            std::string device_uuid = args["device"].get<std::string>();
-            BlockDevice device = BlockDevice::by_uuid(device_uuid);
-
-            // Create a map of arguments for the to-bcache command
-            std::map<std::string, std::string> bcache_args;
+            // Jobs on one device depend on each other; run them in order.
+            // In parallel mode each disk gets its own thread.
+            std::vector<std::vector<size_t>> groups = job_groups(jobs, parallel);
 
-            // Copy any additional arguments
-            for (auto it = args.begin(); it != args.end(); ++it) {
-                if (it.key() != "command" && it.key() != "device" && it.key() != "maintboot") {
-                    bcache_args[it.key()] = it.value().get<std::string>();
-                }
+            BatchStatus status(jobs, status_uuid);
+            std::atomic<bool> ok{true};
+            std::vector<std::thread> threads;
+            for (const auto& group : groups) {
+                threads.emplace_back([&, group]() {
+                    if (!run_jobs(jobs, group, status)) {
+                        ok = false;
+                    }
+                });
             }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            status.finish_all();
+            return ok ? 0 : 1;
+        } catch (const std::exception& e) {
+            log_error() << "Error in maintboot implementation: " << e.what();
+            return 1;
+        }
+    }
 
-            // Set maintboot to false to avoid recursion
-            bcache_args["maintboot"] = "false";
-
-            // Call the to-bcache command
-            std::vector<std::string> cmd = {"blocks", "to-bcache", device.devpath};
+    std::vector<MaintbootJob> read_maintboot_jobs(const std::string& path) {
+        std::ifstream in(path);
+        if (!in) {
+            throw std::runtime_error("Can't read " + path);
+        }
 
-            // Add any additional arguments
-            for (const auto& [key, value] : bcache_args) {
-                if (key == "join" && !value.empty()) {
-                    cmd.push_back("--join");
-                    cmd.push_back(value);
-                } else if (key == "debug" && value == "true") {
-                    cmd.push_back("--debug");
+        std::vector<MaintbootJob> jobs;
+        try {
+            for (const auto& entry : nlohmann::json::parse(in)) {
+                MaintbootJob job;
+                job.command = entry.at("command").get<std::string>();
+                job.device = entry.at("device").get<std::string>();
+                for (auto it = entry.begin(); it != entry.end(); ++it) {
+                    if (it.key() == "command" || it.key() == "device") {
+                        continue;
+                    }
+                    job.args[it.key()] = it.value().is_boolean() ? (it.value().get<bool>() ? "true" : "false")
+                                                                  : it.value().get<std::string>();
                 }
+                check_job(job);
+                jobs.push_back(job);
             }
+        } catch (const nlohmann::json::exception& e) {
+            throw std::runtime_error("Invalid job file " + path + ": " + e.what());
+        }
+        return jobs;
+    }
 
-            quiet_call(cmd);
-            return 0;
-        } catch (const std::exception& e) {
-            std::cerr << "Error in maintboot implementation: " << e.what() << std::endl;
+    int cmd_maintboot_batch(const CommandArgs& args) {
+        std::vector<MaintbootJob> jobs;
+        try {
+            jobs = read_maintboot_jobs(args.device);
+        } catch (const std::runtime_error& e) {
+            log_error() << e.what();
             return 1;
         }
+        return call_maintboot_batch(jobs, args.parallel);
     }
 
 } // namespace blocks
\ No newline at end of file
@@ -4,12 +4,25 @@
 #include "blocks_types.h"
 #include "block_device.h"
 #include "filesystem.h"
+#include "lvm_operations.h"
 #include <string>
 #include <map>
+#include <vector>
 #include <nlohmann/json.hpp>
 
 namespace blocks {
 
+/**
+ * One command for a maintenance boot to run
+ */
+struct MaintbootJob {
+    std::string command;  // to-lvm, to-bcache or resize
+    std::string device;   // A path when queued, the filesystem UUID in BLOCKS_ARGS
+    // Command options by long name ("join", "vg-name", "resize-device"),
+    // and "size" for resize; "true" stands for a flag
+    std::map<std::string, std::string> args;
+};
+
 /**
  * Call the maintenance boot system with the specified command and arguments
  * 
@@ -21,6 +34,50 @@ namespace blocks {
 int call_maintboot(BlockDevice device, const std::string& command, 
                   const std::map<std::string, std::string>& args = {});
 
+/**
+ * Run several jobs in a single maintenance boot
+ *
+ * Jobs on one device always run in order. With parallel, jobs on
+ * different devices run at the same time. Each job's outcome goes to
+ * MAINTBOOT_STATUS_FILE at the root of the /boot filesystem (or of /
+ * when /boot isn't separate), where it can be read after the reboot.
+ * When MAINTIMAGE_FILE exists (see build-maintimage) and was built for
+ * the running kernel, the host kexecs into it; otherwise maintboot
+ * builds a boot image from packages.
+ *
+ * @param jobs The jobs, in order
+ * @param parallel Whether jobs on different devices may overlap
+ * @return int Return code (0 for success, non-zero for failure)
+ */
+int call_maintboot_batch(const std::vector<MaintbootJob>& jobs, bool parallel);
+
+/**
+ * Read the jobs of a JSON file
+ *
+ * The file holds an array of objects with "command", "device" and the
+ * command's options, e.g. {"command": "resize", "device": "/dev/sdb1",
+ * "size": "20g"}.
+ *
+ * @param path The job file
+ * @return std::vector<MaintbootJob> The checked jobs, in order
+ */
+std::vector<MaintbootJob> read_maintboot_jobs(const std::string& path);
+
+/**
+ * Queue the jobs of a JSON file for one maintenance boot
+ *
+ * @param args args.device is the file; args.parallel as for call_maintboot_batch
+ * @return int Return code (0 for success, non-zero for failure)
+ */
+int cmd_maintboot_batch(const CommandArgs& args);
+
+constexpr const char* MAINTBOOT_STATUS_FILE = "blocks-maintboot-status.json";
+// Written by build-maintimage, booted with the running kernel
+constexpr const char* MAINTIMAGE_FILE = "/boot/blocks-maintimage.img";
+// Appended to the image's name: holds the kernel release its modules
+// are from, which has to be the running one
+constexpr const char* MAINTIMAGE_RELEASE_SUFFIX = ".release";
+
 /**
  * Implementation of the maintenance boot command
  * 
@@ -41,6 +98,9 @@ nlohmann::json parse_maintboot_args();
 
 /**
  * Wait for devices to come up and activate LVM volumes
+ *
+ * Without udev, as in the blocks maintenance image, waits until the set
+ * of block devices stops changing instead.
  */
 void prepare_maintboot_environment();
 
@@ -0,0 +1,613 @@
+#include "maintimage.h"
+#include "layer_types.h"
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mount.h>
+#include <sys/reboot.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#ifdef BLOCKS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// From linux/module.h, which older headers lack
+#ifndef MODULE_INIT_COMPRESSED_FILE
+#define MODULE_INIT_COMPRESSED_FILE 4
+#endif
+
+namespace blocks {
+
+namespace {
+
+constexpr const char* MODULE_LIST = "/etc/blocks-modules";
+
+std::string hex8(uint32_t value) {
+    char buf[9];
+    std::snprintf(buf, sizeof(buf), "%08X", value);
+    return buf;
+}
+
+void pad4(std::string& out) {
+    out.append((4 - out.size() % 4) % 4, '\0');
+}
+
+// Archive names are relative to the root
+std::string entry_name(const std::string& path) {
+    size_t start = path.find_first_not_of('/');
+    std::string name = start == std::string::npos ? "" : path.substr(start);
+    while (!name.empty() && name.back() == '/') {
+        name.pop_back();
+    }
+    if (name.empty()) {
+        throw std::invalid_argument("Invalid archive path: " + path);
+    }
+    return name;
+}
+
+} // namespace
+
+void CpioWriter::add_directory(const std::string& path, uint32_t mode) {
+    std::string name = entry_name(path);
+    if (!names.count(name)) {
+        add_parents(name);
+        add_entry(name, S_IFDIR | mode, "");
+    }
+}
+
+void CpioWriter::add_file(const std::string& path, const std::string& data, uint32_t mode) {
+    std::string name = entry_name(path);
+    add_parents(name);
+    add_entry(name, S_IFREG | mode, data);
+}
+
+void CpioWriter::add_symlink(const std::string& path, const std::string& target) {
+    std::string name = entry_name(path);
+    add_parents(name);
+    add_entry(name, S_IFLNK | 0777, target);
+}
+
+void CpioWriter::add_device(const std::string& path, uint32_t mode, unsigned major, unsigned minor) {
+    std::string name = entry_name(path);
+    add_parents(name);
+    add_entry(name, mode, "", major, minor);
+}
+
+bool CpioWriter::contains(const std::string& path) const {
+    return names.count(entry_name(path)) > 0;
+}
+
+std::string CpioWriter::finish() {
+    add_entry("TRAILER!!!", 0, "");
+    return std::move(archive);
+}
+
+void CpioWriter::add_parents(const std::string& name) {
+    size_t slash = name.rfind('/');
+    if (slash != std::string::npos) {
+        add_directory(name.substr(0, slash));
+    }
+}
+
+void CpioWriter::add_entry(const std::string& name, uint32_t mode, const std::string& data,
+                           unsigned rmajor, unsigned rminor) {
+    if (!names.insert(name).second && name != "TRAILER!!!") {
+        throw std::runtime_error("Duplicate archive entry: " + name);
+    }
+    if (data.size() > UINT32_MAX) {
+        throw std::runtime_error("Too large for cpio: " + name);
+    }
+    archive += "070701";
+    for (uint32_t field : {next_ino++, mode, 0u, 0u, S_ISDIR(mode) ? 2u : 1u, 0u,
+                           static_cast<uint32_t>(data.size()), 0u, 0u, rmajor, rminor,
+                           static_cast<uint32_t>(name.size() + 1), 0u}) {
+        archive += hex8(field);
+    }
+    archive += name;
+    archive += '\0';
+    pad4(archive);
+    archive += data;
+    pad4(archive);
+}
+
+namespace {
+
+std::string read_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Failed to read " + path);
+    }
+    std::ostringstream out;
+    out << in.rdbuf();
+    return out.str();
+}
+
+// What the dynamic loader needs to run an ELF file
+struct ElfDeps {
+    std::string interpreter;  // Empty for a static binary
+    std::vector<std::string> needed;
+};
+
+template <class T>
+T elf_read(const std::string& data, uint64_t offset, const std::string& path) {
+    if (offset > data.size() || data.size() - offset < sizeof(T)) {
+        throw std::runtime_error("Truncated ELF file: " + path);
+    }
+    T value;
+    std::memcpy(&value, data.data() + offset, sizeof(T));
+    return value;
+}
+
+// Native 64-bit ELF only, like the blocks binary that reads it
+ElfDeps elf_deps(const std::string& data, const std::string& path) {
+    auto ehdr = elf_read<Elf64_Ehdr>(data, 0, path);
+    if (std::memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0) {
+        throw std::runtime_error(path + " isn't an ELF file");
+    }
+    if (ehdr.e_ident[EI_CLASS] != ELFCLASS64 || ehdr.e_ident[EI_DATA] != ELFDATA2LSB) {
+        throw std::runtime_error(path + " isn't a 64-bit little-endian ELF file");
+    }
+
+    ElfDeps deps;
+    std::vector<Elf64_Phdr> loads;
+    const Elf64_Phdr* dynamic = nullptr;
+    std::vector<Elf64_Phdr> phdrs;
+    for (unsigned i = 0; i < ehdr.e_phnum; ++i) {
+        phdrs.push_back(elf_read<Elf64_Phdr>(data, ehdr.e_phoff + uint64_t(i) * ehdr.e_phentsize, path));
+    }
+    for (const auto& phdr : phdrs) {
+        if (phdr.p_type == PT_INTERP) {
+            if (phdr.p_offset > data.size() || data.size() - phdr.p_offset < phdr.p_filesz) {
+                throw std::runtime_error("Truncated ELF file: " + path);
+            }
+            deps.interpreter = std::string(data.c_str() + phdr.p_offset);
+        } else if (phdr.p_type == PT_LOAD) {
+            loads.push_back(phdr);
+        } else if (phdr.p_type == PT_DYNAMIC) {
+            dynamic = &phdr;
+        }
+    }
+    if (!dynamic) {
+        return deps;
+    }
+
+    // DT_STRTAB is an address; find it in the file through PT_LOAD
+    uint64_t strtab = 0;
+    std::vector<uint64_t> needed;
+    for (uint64_t off = dynamic->p_offset; off + sizeof(Elf64_Dyn) <= dynamic->p_offset + dynamic->p_filesz;
+         off += sizeof(Elf64_Dyn)) {
+        auto dyn = elf_read<Elf64_Dyn>(data, off, path);
+        if (dyn.d_tag == DT_NULL) {
+            break;
+        } else if (dyn.d_tag == DT_NEEDED) {
+            needed.push_back(dyn.d_un.d_val);
+        } else if (dyn.d_tag == DT_STRTAB) {
+            strtab = dyn.d_un.d_ptr;
+        }
+    }
+    uint64_t strtab_offset = UINT64_MAX;
+    for (const auto& load : loads) {
+        if (strtab >= load.p_vaddr && strtab < load.p_vaddr + load.p_filesz) {
+            strtab_offset = strtab - load.p_vaddr + load.p_offset;
+        }
+    }
+    if (!needed.empty() && strtab_offset >= data.size()) {
+        throw std::runtime_error("Can't find the string table of " + path);
+    }
+    for (uint64_t name : needed) {
+        if (name >= data.size() - strtab_offset) {
+            throw std::runtime_error("Truncated ELF file: " + path);
+        }
+        deps.needed.emplace_back(data.c_str() + strtab_offset + name);
+    }
+    return deps;
+}
+
+#if defined(__x86_64__)
+constexpr const char* MULTIARCH = "x86_64-linux-gnu";
+#elif defined(__aarch64__)
+constexpr const char* MULTIARCH = "aarch64-linux-gnu";
+#elif defined(__powerpc64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+constexpr const char* MULTIARCH = "powerpc64le-linux-gnu";
+#elif defined(__riscv) && __riscv_xlen == 64
+constexpr const char* MULTIARCH = "riscv64-linux-gnu";
+#else
+constexpr const char* MULTIARCH = "";
+#endif
+
+// Where the loader looks without an ld.so.cache; the libraries keep
+// their host paths in the image, so these are enough
+std::string find_library(const std::string& name) {
+    std::vector<std::string> dirs;
+    for (const char* dir : {"/lib", "/usr/lib"}) {
+        if (*MULTIARCH) {
+            dirs.push_back(std::string(dir) + "/" + MULTIARCH);
+        }
+    }
+    for (const char* dir : {"/lib64", "/usr/lib64", "/lib", "/usr/lib"}) {
+        dirs.push_back(dir);
+    }
+    for (const auto& dir : dirs) {
+        std::string path = dir + "/" + name;
+        if (std::filesystem::is_regular_file(path)) {
+            return path;
+        }
+    }
+    throw std::runtime_error("Can't find library " + name);
+}
+
+// Adds an ELF file's loader and libraries, recursively
+void add_elf_deps(CpioWriter& cpio, const std::string& data, const std::string& path) {
+    ElfDeps deps = elf_deps(data, path);
+    if (!deps.interpreter.empty() && !cpio.contains(deps.interpreter)) {
+        cpio.add_file(deps.interpreter, read_file(deps.interpreter));
+    }
+    for (const auto& lib : deps.needed) {
+        std::string lib_path = find_library(lib);
+        if (cpio.contains(lib_path)) {
+            continue;
+        }
+        std::string lib_data = read_file(lib_path);
+        cpio.add_file(lib_path, lib_data);
+        add_elf_deps(cpio, lib_data, lib_path);
+    }
+}
+
+// What each filesystem's resize and check steps run, and the module
+// the kernel may need to mount it
+struct FsRequirements {
+    std::vector<std::string> tools;
+    std::string module;
+};
+
+const std::map<std::string, FsRequirements> FS_REQUIREMENTS = {
+        {"ext4", {{"e2fsck", "resize2fs"}, "ext4"}},
+        {"xfs", {{}, "xfs"}},
+        {"btrfs", {{}, "btrfs"}},
+        {"nilfs2", {{"nilfs-resize"}, "nilfs2"}},
+        {"reiserfs", {{"resize_reiserfs"}, "reiserfs"}},
+        {"swap", {{}, ""}},
+};
+
+// popen needs a shell; blkid and LVM are used by every command, and
+// to-lvm checks for holders through lsblk, grep and awk
+const std::vector<std::string> BASE_TOOLS = {"sh", "blkid", "lvm", "dmsetup", "lsblk", "grep", "awk"};
+// LVM commands blocks runs by their own name
+const std::vector<std::string> LVM_ALIASES = {"vgchange", "pvremove"};
+
+// Module name to its path under /lib/modules/<release> and its
+// dependencies, from modules.dep; '-' and '_' are the same in names
+struct ModuleIndex {
+    std::map<std::string, std::pair<std::string, std::vector<std::string>>> modules;
+    std::set<std::string> builtin;
+
+    static std::string module_name(const std::string& path) {
+        std::string name = path.substr(path.rfind('/') + 1);
+        name = name.substr(0, name.find(".ko"));
+        std::replace(name.begin(), name.end(), '-', '_');
+        return name;
+    }
+
+    explicit ModuleIndex(const std::string& dir) {
+        std::ifstream dep(dir + "/modules.dep");
+        std::string line;
+        while (std::getline(dep, line)) {
+            size_t colon = line.find(':');
+            if (colon == std::string::npos) {
+                continue;
+            }
+            std::string path = line.substr(0, colon);
+            std::istringstream rest(line.substr(colon + 1));
+            std::vector<std::string> deps;
+            std::string dep_path;
+            while (rest >> dep_path) {
+                deps.push_back(dep_path);
+            }
+            modules[module_name(path)] = {path, deps};
+        }
+        std::ifstream builtin_list(dir + "/modules.builtin");
+        while (std::getline(builtin_list, line)) {
+            builtin.insert(module_name(line));
+        }
+    }
+
+    // Paths in the order they have to be loaded
+    void load_order(const std::string& name, std::vector<std::string>& order) const {
+        std::string key = module_name(name);
+        auto it = modules.find(key);
+        if (it == modules.end()) {
+            if (!builtin.count(key)) {
+                log_warning() << "No module " << name << " for this kernel, hoping it is built in";
+            }
+            return;
+        }
+        // modules.dep lists all dependencies, the last to load first
+        for (auto dep = it->second.second.rbegin(); dep != it->second.second.rend(); ++dep) {
+            if (std::find(order.begin(), order.end(), *dep) == order.end()) {
+                order.push_back(*dep);
+            }
+        }
+        if (std::find(order.begin(), order.end(), it->second.first) == order.end()) {
+            order.push_back(it->second.first);
+        }
+    }
+};
+
+std::string compress_zstd(const std::string& data) {
+#ifdef BLOCKS_HAVE_ZSTD
+    std::string out(ZSTD_compressBound(data.size()), '\0');
+    size_t size = ZSTD_compress(out.data(), out.size(), data.data(), data.size(), 19);
+    if (ZSTD_isError(size)) {
+        throw std::runtime_error(std::string("zstd compression failed: ") + ZSTD_getErrorName(size));
+    }
+    out.resize(size);
+    return out;
+#else
+    (void)data;
+    throw std::runtime_error("blocks was built without zstd support");
+#endif
+}
+
+} // namespace
+
+void build_maintimage(const MaintimageOptions& options, ProgressListener& progress) {
+    // Tools and modules to bring along
+    std::set<std::string> fs_types;
+    std::set<std::string> modules = {"dm-mod"};
+    std::vector<std::string> tools = BASE_TOOLS;
+    // Tools that may be missing on this host
+    std::set<std::string> optional_tools;
+    bool all_filesystems = options.jobs.empty();
+    if (options.jobs.empty()) {
+        tools.insert(tools.end(), {"make-bcache", "cryptsetup", "bcache-super-show"});
+        optional_tools.insert({"make-bcache", "cryptsetup", "bcache-super-show"});
+        modules.insert({"bcache", "dm-crypt"});
+    }
+    for (const auto& job : options.jobs) {
+        // Without activating, so locked LUKS volumes stay locked
+        BlockStack stack = get_block_stack(BlockDevice(job.device), progress, false);
+        for (Layer& layer : stack.wrappers()) {
+            if (std::holds_alternative<LUKS>(layer)) {
+                tools.push_back("cryptsetup");
+                modules.insert("dm-crypt");
+            } else if (std::holds_alternative<BCacheBacking>(layer)) {
+                tools.push_back("bcache-super-show");
+                modules.insert("bcache");
+            }
+        }
+        Layer& top = *stack.topmost();
+        if (as_container(top)) {
+            // A locked LUKS or inactive bcache layer hides the filesystem
+            if (std::holds_alternative<LUKS>(top)) {
+                tools.push_back("cryptsetup");
+                modules.insert("dm-crypt");
+            } else {
+                tools.push_back("bcache-super-show");
+                modules.insert("bcache");
+            }
+            log_warning() << "Can't see the filesystem under " << job.device
+                          << ", adding the tools of every filesystem";
+            all_filesystems = true;
+        } else {
+            BlockDevice& device = layer_data(top).device;
+            const LayerType* type = find_layer_type(device.superblock_type());
+            if (!type || !FS_REQUIREMENTS.count(std::string(type->name))) {
+                progress.bail("Unsupported filesystem on " + job.device + ": " + device.superblock_type(),
+                              UnsupportedSuperblock(device.devpath));
+            }
+            fs_types.insert(std::string(type->name));
+        }
+        if (job.command == "to-bcache") {
+            tools.push_back("make-bcache");
+            modules.insert("bcache");
+        }
+    }
+    if (all_filesystems) {
+        for (const auto& [type, reqs] : FS_REQUIREMENTS) {
+            if (!fs_types.count(type)) {
+                optional_tools.insert(reqs.tools.begin(), reqs.tools.end());
+            }
+            fs_types.insert(type);
+        }
+    }
+    for (const auto& type : fs_types) {
+        const FsRequirements& reqs = FS_REQUIREMENTS.at(type);
+        tools.insert(tools.end(), reqs.tools.begin(), reqs.tools.end());
+        if (!reqs.module.empty()) {
+            modules.insert(reqs.module);
+        }
+    }
+
+    CpioWriter cpio;
+    for (const char* dir : {"/bin", "/dev", "/proc", "/sys", "/run", "/tmp", "/etc"}) {
+        cpio.add_directory(dir);
+    }
+    // The kernel opens the console for init before /dev is mounted
+    cpio.add_device("/dev/console", S_IFCHR | 0600, 5, 1);
+    cpio.add_device("/dev/null", S_IFCHR | 0666, 1, 3);
+
+    std::string blocks = read_file(options.blocks_binary);
+    cpio.add_file("/bin/blocks", blocks);
+    cpio.add_symlink("/init", "bin/blocks");
+    if (!elf_deps(blocks, options.blocks_binary).interpreter.empty()) {
+        log_warning() << "blocks is dynamically linked, adding its libraries; "
+                      << "configure with -DBLOCKS_STATIC=ON for a self-contained binary";
+        add_elf_deps(cpio, blocks, options.blocks_binary);
+    }
+
+    for (const auto& tool : tools) {
+        if (cpio.contains("/bin/" + tool)) {
+            continue;
+        }
+        std::string path = find_tool(tool);
+        if (path.empty()) {
+            // Each job's tools are a must, the catch-all set isn't
+            if (!optional_tools.count(tool)) {
+                progress.bail("Command '" + tool + "' not found, it is needed in the maintenance image",
+                              MissingRequirement());
+            }
+            log_warning() << "No " << tool << " on this host, leaving it out";
+            continue;
+        }
+        std::string data = read_file(path);
+        cpio.add_file("/bin/" + tool, data);
+        add_elf_deps(cpio, data, path);
+        log_debug() << "Added " << path;
+    }
+    for (const auto& alias : LVM_ALIASES) {
+        cpio.add_symlink("/bin/" + alias, "lvm");
+    }
+
+    // Without udev LVM and dmsetup create the device nodes themselves
+    cpio.add_file("/etc/lvm/lvm.conf",
+                  "devices {\n    obtain_device_list_from_udev = 0\n}\n"
+                  "activation {\n    udev_sync = 0\n    udev_rules = 0\n}\n", 0644);
+
+    struct utsname uts;
+    if (uname(&uts) != 0) {
+        throw std::runtime_error(std::string("uname failed: ") + std::strerror(errno));
+    }
+    std::string module_dir = std::string("/lib/modules/") + uts.release;
+    ModuleIndex index(module_dir);
+    std::vector<std::string> order;
+    for (const auto& module : modules) {
+        index.load_order(module, order);
+    }
+    std::string module_list;
+    for (const auto& module : order) {
+        std::string path = module_dir + "/" + module;
+        cpio.add_file(path, read_file(path), 0644);
+        module_list += path + "\n";
+    }
+    cpio.add_file(MODULE_LIST, module_list, 0644);
+
+    std::string image = cpio.finish();
+    size_t raw_size = image.size();
+    if (options.zstd) {
+        image = compress_zstd(image);
+    }
+
+    // Never leave a half-written image where the next boot would use it
+    std::string tmp = options.output + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write(image.data(), image.size());
+        out.close();
+        if (!out) {
+            throw std::runtime_error("Failed to write " + tmp);
+        }
+    }
+    // What call_maintboot_batch checks against the running kernel
+    std::string release_file = options.output + MAINTIMAGE_RELEASE_SUFFIX;
+    {
+        std::ofstream out(release_file, std::ios::trunc);
+        out << uts.release << "\n";
+        out.close();
+        if (!out) {
+            throw std::runtime_error("Failed to write " + release_file);
+        }
+    }
+    std::filesystem::rename(tmp, options.output);
+    progress.notify("Wrote " + options.output + ": " + std::to_string(tools.size()) + " tools, " +
+                    std::to_string(order.size()) + " modules, " + std::to_string(image.size() / 1024) +
+                    " KiB" + (options.zstd ? " (" + std::to_string(raw_size / 1024) + " KiB uncompressed)" : ""));
+}
+
+int cmd_build_maintimage(const CommandArgs& args) {
+    CLIProgressHandler progress;
+    MaintimageOptions options;
+    if (!args.output.empty()) {
+        options.output = args.output;
+    }
+    options.zstd = args.zstd;
+    if (!args.device.empty()) {
+        options.jobs = read_maintboot_jobs(args.device);
+    }
+    build_maintimage(options, progress);
+    return 0;
+}
+
+namespace {
+
+void mount_api(const char* source, const char* target, const char* type) {
+    mkdir(target, 0755);
+    if (mount(source, target, type, MS_NOSUID | MS_NODEV | MS_NOEXEC, nullptr) != 0 && errno != EBUSY) {
+        log_warning() << "Failed to mount " << type << " on " << target << ": " << std::strerror(errno);
+    }
+}
+
+void load_modules() {
+    std::ifstream list(MODULE_LIST);
+    std::string path;
+    while (std::getline(list, path)) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            log_warning() << "Failed to open " << path << ": " << std::strerror(errno);
+            continue;
+        }
+        int flags = path.size() > 3 && path.compare(path.size() - 3, 3, ".ko") == 0
+                    ? 0 : MODULE_INIT_COMPRESSED_FILE;
+        if (syscall(SYS_finit_module, fd, "", flags) != 0 && errno != EEXIST) {
+            log_warning() << "Failed to load " << path << ": " << std::strerror(errno);
+        }
+        close(fd);
+    }
+}
+
+} // namespace
+
+void maintimage_init() {
+    mount_api("proc", "/proc", "proc");
+    mount_api("sysfs", "/sys", "sysfs");
+    mkdir("/dev", 0755);
+    if (mount("devtmpfs", "/dev", "devtmpfs", MS_NOSUID, "mode=0755") != 0 && errno != EBUSY) {
+        log_warning() << "Failed to mount /dev: " << std::strerror(errno);
+    }
+    mount_api("tmpfs", "/run", "tmpfs");
+    mkdir("/tmp", 01777);
+    mount("tmpfs", "/tmp", "tmpfs", MS_NOSUID | MS_NODEV, nullptr);
+
+    int console = open("/dev/console", O_RDWR);
+    if (console >= 0) {
+        for (int fd = 0; fd < 3; ++fd) {
+            dup2(console, fd);
+        }
+        if (console > 2) {
+            close(console);
+        }
+    }
+    setenv("PATH", "/bin", 1);
+    Logger::instance().configure(LogFormat::Terminal, LogLevel::Info);
+
+    load_modules();
+
+    int status;
+    try {
+        status = cmd_maintboot_impl(0, nullptr);
+    } catch (const std::exception& e) {
+        log_error() << e.what();
+        status = 1;
+    }
+    MountPool::instance().release_all();
+
+    // Results are in the status file; whatever happened, go back to the
+    // normal system. PID 1 must not exit.
+    log_info() << "Maintenance jobs finished with status " << status << ", rebooting";
+    Logger::instance().flush();
+    sync();
+    reboot(RB_AUTOBOOT);
+    for (;;) {
+        pause();
+    }
+}
+
+} // namespace blocks
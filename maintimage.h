@@ -0,0 +1,65 @@
+#ifndef MAINTIMAGE_H
+#define MAINTIMAGE_H
+
+#include "blocks_types.h"
+#include "lvm_operations.h"
+#include "maintboot_operations.h"
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace blocks {
+
+// Writes a cpio archive in the newc format, the one the kernel unpacks
+// as an initramfs. Entries are owned by root with a zero mtime, so the
+// same inputs give the same archive. Missing parent directories are
+// added on the way.
+class CpioWriter {
+public:
+    void add_directory(const std::string& path, uint32_t mode = 0755);
+    void add_file(const std::string& path, const std::string& data, uint32_t mode = 0755);
+    void add_symlink(const std::string& path, const std::string& target);
+    // mode includes the S_IFCHR or S_IFBLK bits
+    void add_device(const std::string& path, uint32_t mode, unsigned major, unsigned minor);
+    bool contains(const std::string& path) const;
+
+    // Appends the trailer and hands over the archive
+    std::string finish();
+
+private:
+    void add_parents(const std::string& name);
+    void add_entry(const std::string& name, uint32_t mode, const std::string& data,
+                   unsigned rmajor = 0, unsigned rminor = 0);
+
+    std::string archive;
+    std::set<std::string> names;
+    uint32_t next_ino = 1;
+};
+
+struct MaintimageOptions {
+    std::string output = MAINTIMAGE_FILE;
+    bool zstd = false;
+    // The blocks to put in the image; link it statically (BLOCKS_STATIC)
+    // or its libraries come along
+    std::string blocks_binary = "/proc/self/exe";
+    // Only what these need, or else every filesystem's tools that the
+    // host has
+    std::vector<MaintbootJob> jobs;
+};
+
+// Builds an initramfs for maintenance boots, without a package mirror:
+// blocks itself as /init, the few tools and kernel modules the jobs call
+// for, and the libraries those tools link to. No shell scripts, no
+// busybox; blocks mounts the API filesystems and runs the jobs.
+void build_maintimage(const MaintimageOptions& options, ProgressListener& progress);
+
+int cmd_build_maintimage(const CommandArgs& args);
+
+// blocks as PID 1 of the image: sets up /proc, /sys and /dev, loads the
+// modules, runs the BLOCKS_ARGS jobs and reboots. Never returns.
+[[noreturn]] void maintimage_init();
+
+} // namespace blocks
+
+#endif // MAINTIMAGE_H
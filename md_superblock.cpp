@@ -0,0 +1,126 @@
+#include "md_superblock.h"
+#include <uuid/uuid.h>
+#include <cstring>
+#include <ctime>
+
+namespace blocks {
+
+namespace {
+
+// Field offsets in struct mdp_superblock_1
+constexpr size_t MAGIC = 0;
+constexpr size_t MAJOR_VERSION = 4;
+constexpr size_t SET_UUID = 16;
+constexpr size_t SET_NAME = 32;
+constexpr size_t SET_NAME_SIZE = 32;
+constexpr size_t CTIME = 64;
+constexpr size_t LEVEL = 72;
+constexpr size_t SIZE = 80;
+constexpr size_t RAID_DISKS = 92;
+constexpr size_t DATA_OFFSET = 128;
+constexpr size_t DATA_SIZE = 136;
+constexpr size_t SUPER_OFFSET = 144;
+constexpr size_t DEV_NUMBER = 160;
+constexpr size_t DEVICE_UUID = 168;
+constexpr size_t UTIME = 192;
+constexpr size_t EVENTS = 200;
+constexpr size_t RESYNC_OFFSET = 208;
+constexpr size_t SB_CSUM = 216;
+constexpr size_t MAX_DEV = 220;
+constexpr size_t DEV_ROLES = 256;
+
+// Fits dev_roles in the 4KiB block
+constexpr uint32_t MAX_DEV_LIMIT = (MD_SB_AREA_SIZE - DEV_ROLES) / 2;
+
+void put_le16(std::vector<uint8_t>& buf, size_t offset, uint16_t value) {
+    for (size_t i = 0; i < 2; ++i) {
+        buf[offset + i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+}
+
+void put_le32(std::vector<uint8_t>& buf, size_t offset, uint32_t value) {
+    for (size_t i = 0; i < 4; ++i) {
+        buf[offset + i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+}
+
+void put_le64(std::vector<uint8_t>& buf, size_t offset, uint64_t value) {
+    for (size_t i = 0; i < 8; ++i) {
+        buf[offset + i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+}
+
+// calc_sb_1_csum in drivers/md/md.c
+uint32_t md_checksum(const std::vector<uint8_t>& buf, uint32_t max_dev) {
+    size_t size = DEV_ROLES + max_dev * 2;
+    uint64_t sum = 0;
+    size_t pos = 0;
+    for (; size - pos >= 4; pos += 4) {
+        sum += le32_at(buf.data(), pos);
+    }
+    if (size - pos == 2) {
+        sum += le16_at(buf.data(), pos);
+    }
+    return static_cast<uint32_t>((sum & 0xffffffff) + (sum >> 32));
+}
+
+} // namespace
+
+MdSuperblock raid1_sole_member(uint64_t device_size, uint64_t data_size, const std::string& name) {
+    MdSuperblock sb;
+    uuid_generate(sb.set_uuid.data());
+    uuid_generate(sb.device_uuid.data());
+    sb.set_name = name.substr(0, SET_NAME_SIZE);
+    sb.level = 1;
+    sb.raid_disks = 2;
+    sb.data_size = data_size;
+    sb.super_offset = md_v1_0_superblock_offset(device_size);
+    sb.dev_number = 0;
+    sb.dev_roles = {0, MD_DISK_ROLE_SPARE};
+    sb.ctime = static_cast<uint64_t>(std::time(nullptr));
+    sb.events = 1;
+    return sb;
+}
+
+std::vector<uint8_t> encode_md_superblock(const MdSuperblock& sb) {
+    if (sb.data_size % 512 != 0 || sb.super_offset % 512 != 0 || sb.data_size > sb.super_offset) {
+        throw std::invalid_argument("md data must be whole sectors ending before the superblock");
+    }
+    if (sb.dev_roles.size() > MAX_DEV_LIMIT || sb.dev_number >= sb.dev_roles.size()) {
+        throw std::invalid_argument("md device roles don't fit the superblock");
+    }
+
+    std::vector<uint8_t> buf(MD_SB_AREA_SIZE, 0);
+    auto max_dev = static_cast<uint32_t>(sb.dev_roles.size());
+
+    put_le32(buf, MAGIC, MD_SB_MAGIC);
+    put_le32(buf, MAJOR_VERSION, 1);
+    std::memcpy(buf.data() + SET_UUID, sb.set_uuid.data(), 16);
+    std::memcpy(buf.data() + SET_NAME, sb.set_name.data(), std::min(sb.set_name.size(), SET_NAME_SIZE));
+    // Seconds in the low 40 bits, microseconds above
+    put_le64(buf, CTIME, sb.ctime & 0xffffffffffULL);
+    put_le32(buf, LEVEL, sb.level);
+    put_le64(buf, SIZE, sb.data_size / 512);
+    put_le32(buf, RAID_DISKS, sb.raid_disks);
+    put_le64(buf, DATA_OFFSET, 0);
+    put_le64(buf, DATA_SIZE, sb.data_size / 512);
+    put_le64(buf, SUPER_OFFSET, sb.super_offset / 512);
+    put_le32(buf, DEV_NUMBER, sb.dev_number);
+    std::memcpy(buf.data() + DEVICE_UUID, sb.device_uuid.data(), 16);
+    put_le64(buf, UTIME, sb.ctime & 0xffffffffffULL);
+    put_le64(buf, EVENTS, sb.events);
+    // MaxSector: the members present are in sync
+    put_le64(buf, RESYNC_OFFSET, ~0ULL);
+    put_le32(buf, MAX_DEV, max_dev);
+    for (uint32_t i = 0; i < max_dev; ++i) {
+        put_le16(buf, DEV_ROLES + 2 * i, sb.dev_roles[i]);
+    }
+    put_le32(buf, SB_CSUM, md_checksum(buf, max_dev));
+    return buf;
+}
+
+bool has_md_magic(const std::vector<uint8_t>& window) {
+    return window.size() >= 4 && le32_at(window.data(), 0) == MD_SB_MAGIC;
+}
+
+} // namespace blocks
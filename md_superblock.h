@@ -0,0 +1,57 @@
+#ifndef MD_SUPERBLOCK_H
+#define MD_SUPERBLOCK_H
+
+#include "blocks_types.h"
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace blocks {
+
+// md metadata version 1.0 (struct mdp_superblock_1 in linux/raid/md_p.h),
+// which sits near the end of each member, so the data starts at sector 0
+// and a filesystem stays where it is.
+
+constexpr uint32_t MD_SB_MAGIC = 0xa92b4efc;
+// The kernel reads and writes one 4KiB block
+constexpr uint64_t MD_SB_AREA_SIZE = 4096;
+constexpr uint16_t MD_DISK_ROLE_SPARE = 0xffff;
+
+// Where the kernel looks for a 1.0 superblock on a member of that size,
+// in bytes: 8KiB from the end, rounded down to 4KiB
+constexpr uint64_t md_v1_0_superblock_offset(uint64_t device_size) {
+    uint64_t sectors = device_size / 512;
+    return ((sectors - 8 * 2) & ~static_cast<uint64_t>(4 * 2 - 1)) * 512;
+}
+
+struct MdSuperblock {
+    std::array<uint8_t, 16> set_uuid{};
+    std::string set_name;  // At most 32 bytes
+    std::array<uint8_t, 16> device_uuid{};
+    uint32_t level = 1;
+    uint32_t raid_disks = 2;
+    uint64_t data_size = 0;     // Bytes of data on each member, from sector 0
+    uint64_t super_offset = 0;  // Bytes
+    uint32_t dev_number = 0;
+    // Role of each device number; the others are left to md as spares
+    std::vector<uint16_t> dev_roles;
+    uint64_t ctime = 0;  // Seconds
+    uint64_t events = 1;
+};
+
+// A degraded raid1 with the device as its only member, in role 0, and
+// nothing to resync, since there is no other copy yet. A member that
+// mdadm --add brings in later is recovered from it.
+MdSuperblock raid1_sole_member(uint64_t device_size, uint64_t data_size, const std::string& name);
+
+// The MD_SB_AREA_SIZE bytes to write at super_offset, checksummed
+std::vector<uint8_t> encode_md_superblock(const MdSuperblock& sb);
+
+// Whether the window, read at a 1.0 superblock offset, starts with the
+// md magic
+bool has_md_magic(const std::vector<uint8_t>& window);
+
+} // namespace blocks
+
+#endif // MD_SUPERBLOCK_H
@@ -0,0 +1,260 @@
+#include "metrics.h"
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <sstream>
+#include <stdexcept>
+
+namespace blocks {
+
+namespace {
+
+std::string escape_label(const std::string& value) {
+    std::string out;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+std::string format_double(double value) {
+    std::ostringstream out;
+    out.precision(9);
+    out << value;
+    return out.str();
+}
+
+void write_histogram(std::ostringstream& out, const std::string& name, const std::string& labels,
+                     const Histogram& histogram) {
+    auto counts = histogram.cumulative_counts();
+    std::string sep = labels.empty() ? "" : ",";
+    for (size_t i = 0; i < Histogram::BOUNDS.size(); ++i) {
+        out << name << "_bucket{" << labels << sep << "le=\"" << format_double(Histogram::BOUNDS[i])
+            << "\"} " << counts[i] << "\n";
+    }
+    out << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << counts.back() << "\n";
+    std::string braces = labels.empty() ? "" : "{" + labels + "}";
+    out << name << "_sum" << braces << " " << format_double(histogram.sum_seconds()) << "\n";
+    out << name << "_count" << braces << " " << histogram.count() << "\n";
+}
+
+void write_header(std::ostringstream& out, const std::string& name, const char* type, const char* help) {
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " " << type << "\n";
+}
+
+nlohmann::json histogram_json(const Histogram& histogram) {
+    auto counts = histogram.cumulative_counts();
+    nlohmann::json buckets = nlohmann::json::array();
+    for (size_t i = 0; i < Histogram::BOUNDS.size(); ++i) {
+        buckets.push_back({{"le", Histogram::BOUNDS[i]}, {"count", counts[i]}});
+    }
+    buckets.push_back({{"le", "+Inf"}, {"count", counts.back()}});
+    return {{"count", histogram.count()}, {"sum_seconds", histogram.sum_seconds()}, {"buckets", buckets}};
+}
+
+std::string basename_of(const std::string& program) {
+    auto slash = program.rfind('/');
+    return slash == std::string::npos ? program : program.substr(slash + 1);
+}
+
+} // namespace
+
+void Histogram::observe(std::chrono::nanoseconds elapsed) {
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    size_t i = 0;
+    while (i < BOUNDS.size() && seconds > BOUNDS[i]) {
+        ++i;
+    }
+    buckets[i].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_ns.fetch_add(static_cast<uint64_t>(elapsed.count()), std::memory_order_relaxed);
+}
+
+std::array<uint64_t, Histogram::BOUNDS.size() + 1> Histogram::cumulative_counts() const {
+    std::array<uint64_t, BOUNDS.size() + 1> counts{};
+    uint64_t total = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        total += buckets[i].load(std::memory_order_relaxed);
+        counts[i] = total;
+    }
+    return counts;
+}
+
+double Histogram::sum_seconds() const {
+    return sum_ns.load(std::memory_order_relaxed) / 1e9;
+}
+
+MetricsFormat metrics_format_for(const std::string& path) {
+    return std::filesystem::path(path).extension() == ".json" ? MetricsFormat::Json : MetricsFormat::Prometheus;
+}
+
+Metrics& Metrics::instance() {
+    static Metrics metrics;
+    return metrics;
+}
+
+Metrics::Metrics() : started(std::chrono::steady_clock::now()) {}
+
+Histogram& Metrics::subprocess(const std::string& tool) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto& histogram = subprocesses[tool];
+    if (!histogram) {
+        histogram = std::make_unique<Histogram>();
+    }
+    return *histogram;
+}
+
+void Metrics::layer_size(size_t depth, const std::string& type, const std::string& phase, uint64_t bytes) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto& entry : layer_sizes) {
+        if (entry.depth == depth && entry.phase == phase) {
+            entry.type = type;
+            entry.bytes = bytes;
+            return;
+        }
+    }
+    layer_sizes.push_back({depth, type, phase, bytes});
+}
+
+std::string Metrics::to_prometheus(const std::string& command, int exit_status) const {
+    std::lock_guard<std::mutex> guard(lock);
+    std::ostringstream out;
+    std::string cmd_label = "command=\"" + escape_label(command) + "\"";
+    double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    write_header(out, "blocks_run_exit_status", "gauge", "Exit status of the last blocks run");
+    out << "blocks_run_exit_status{" << cmd_label << "} " << exit_status << "\n";
+    write_header(out, "blocks_run_duration_seconds", "gauge", "Wall time of the last blocks run");
+    out << "blocks_run_duration_seconds{" << cmd_label << "} " << format_double(duration) << "\n";
+    write_header(out, "blocks_run_timestamp_seconds", "gauge", "When the last blocks run finished");
+    out << "blocks_run_timestamp_seconds{" << cmd_label << "} " << std::time(nullptr) << "\n";
+
+    write_header(out, "blocks_bytes_read_total", "counter", "Bytes read from block devices");
+    out << "blocks_bytes_read_total " << bytes_read.value() << "\n";
+    write_header(out, "blocks_bytes_written_total", "counter", "Bytes written to block devices");
+    out << "blocks_bytes_written_total " << bytes_written.value() << "\n";
+    write_header(out, "blocks_bytes_verified_total", "counter", "Bytes read back and compared after writing");
+    out << "blocks_bytes_verified_total " << bytes_verified.value() << "\n";
+    write_header(out, "blocks_dm_transactions_total", "counter", "Device-mapper table changes");
+    out << "blocks_dm_transactions_total " << dm_transactions.value() << "\n";
+    write_header(out, "blocks_io_buffer_peak_bytes", "gauge", "Most memory held for I/O buffers at once");
+    out << "blocks_io_buffer_peak_bytes " << io_buffer_bytes.value() << "\n";
+
+    write_header(out, "blocks_subprocess_duration_seconds", "histogram", "External commands run, by tool");
+    for (const auto& [tool, histogram] : subprocesses) {
+        write_histogram(out, "blocks_subprocess_duration_seconds", "tool=\"" + escape_label(tool) + "\"", *histogram);
+    }
+    write_header(out, "blocks_fsck_duration_seconds", "histogram", "Filesystem checks");
+    write_histogram(out, "blocks_fsck_duration_seconds", "", fsck_seconds);
+    write_header(out, "blocks_resize_duration_seconds", "histogram", "Filesystem resizes");
+    write_histogram(out, "blocks_resize_duration_seconds", "", resize_seconds);
+    write_header(out, "blocks_offline_window_seconds", "histogram", "Time the stack was unmounted or inactive");
+    write_histogram(out, "blocks_offline_window_seconds", "", offline_seconds);
+
+    write_header(out, "blocks_layer_size_bytes", "gauge", "Size of each layer of the stack, outermost first");
+    for (const auto& entry : layer_sizes) {
+        out << "blocks_layer_size_bytes{depth=\"" << entry.depth << "\",type=\"" << escape_label(entry.type)
+            << "\",phase=\"" << entry.phase << "\"} " << entry.bytes << "\n";
+    }
+    return out.str();
+}
+
+nlohmann::json Metrics::to_json(const std::string& command, int exit_status) const {
+    std::lock_guard<std::mutex> guard(lock);
+    nlohmann::json subprocess_json = nlohmann::json::object();
+    for (const auto& [tool, histogram] : subprocesses) {
+        subprocess_json[tool] = histogram_json(*histogram);
+    }
+    nlohmann::json layers = nlohmann::json::array();
+    for (const auto& entry : layer_sizes) {
+        layers.push_back({{"depth", entry.depth}, {"type", entry.type}, {"phase", entry.phase}, {"bytes", entry.bytes}});
+    }
+    return {
+        {"command", command},
+        {"exit_status", exit_status},
+        {"duration_seconds", std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count()},
+        {"timestamp", std::time(nullptr)},
+        {"bytes_read", bytes_read.value()},
+        {"bytes_written", bytes_written.value()},
+        {"bytes_verified", bytes_verified.value()},
+        {"dm_transactions", dm_transactions.value()},
+        {"io_buffer_peak_bytes", io_buffer_bytes.value()},
+        {"subprocesses", subprocess_json},
+        {"fsck", histogram_json(fsck_seconds)},
+        {"resize", histogram_json(resize_seconds)},
+        {"offline_window", histogram_json(offline_seconds)},
+        {"layers", layers},
+    };
+}
+
+void Metrics::write_file(const std::string& path, const std::string& command, int exit_status) const {
+    std::string content = metrics_format_for(path) == MetricsFormat::Json
+                          ? to_json(command, exit_status).dump(2) + "\n"
+                          : to_prometheus(command, exit_status);
+
+    // Same directory, so the rename can't cross filesystems
+    std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+    FILE* file = std::fopen(tmp_path.c_str(), "w");
+    if (!file) {
+        throw std::runtime_error("Failed to create " + tmp_path + ": " + std::strerror(errno));
+    }
+    bool ok = std::fwrite(content.data(), 1, content.size(), file) == content.size();
+    ok = std::fflush(file) == 0 && ok;
+    ok = fsync(fileno(file)) == 0 && ok;
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        int err = errno;
+        std::remove(tmp_path.c_str());
+        throw std::runtime_error("Failed to write " + path + ": " + std::strerror(err));
+    }
+}
+
+SubprocessTimer::SubprocessTimer(const std::vector<std::string>& argv)
+    : start(std::chrono::steady_clock::now()) {
+    classify(argv.empty() ? "" : argv[0], argv.size() > 1 ? argv[1] : "");
+}
+
+SubprocessTimer::SubprocessTimer(const std::string& command_line)
+    : start(std::chrono::steady_clock::now()) {
+    std::istringstream words(command_line);
+    std::string program, verb;
+    words >> program >> verb;
+    classify(program, verb);
+}
+
+void SubprocessTimer::classify(const std::string& program, const std::string& verb) {
+    std::string name = basename_of(program);
+    if (name.empty()) {
+        return;
+    }
+    auto& metrics = Metrics::instance();
+    tool = &metrics.subprocess(name);
+    fsck = name == "e2fsck" || name == "xfs_repair" || name.rfind("fsck", 0) == 0;
+    if (name == "dmsetup" && (verb == "create" || verb == "load" || verb == "reload" ||
+                              verb == "suspend" || verb == "resume" || verb == "remove")) {
+        metrics.dm_transactions.add(1);
+    }
+}
+
+SubprocessTimer::~SubprocessTimer() {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    if (tool) {
+        tool->observe(elapsed);
+    }
+    if (fsck) {
+        Metrics::instance().fsck_seconds.observe(elapsed);
+    }
+}
+
+} // namespace blocks
@@ -0,0 +1,162 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+namespace blocks {
+
+// Counters and histograms for one run of a command, exported to a file
+// that node_exporter's textfile collector (or anything reading JSON)
+// picks up. Recording is a relaxed atomic add. Finding a per-tool
+// histogram takes a lock, once for each subprocess started, which is
+// nothing next to the fork and exec it times.
+
+class Counter {
+public:
+    void add(uint64_t n) { value_.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+// The highest value seen
+class Peak {
+public:
+    void update(uint64_t n) {
+        uint64_t seen = value_.load(std::memory_order_relaxed);
+        while (n > seen && !value_.compare_exchange_weak(seen, n, std::memory_order_relaxed)) {
+        }
+    }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+// Durations in seconds, with fixed buckets from 10ms to an hour
+class Histogram {
+public:
+    static constexpr std::array<double, 12> BOUNDS = {
+        0.01, 0.05, 0.1, 0.5, 1, 5, 10, 30, 60, 300, 900, 3600,
+    };
+
+    void observe(std::chrono::nanoseconds elapsed);
+
+    // Cumulative, one per bound and a last one for +Inf
+    std::array<uint64_t, BOUNDS.size() + 1> cumulative_counts() const;
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    double sum_seconds() const;
+
+private:
+    std::array<std::atomic<uint64_t>, BOUNDS.size() + 1> buckets{};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_ns{0};
+};
+
+enum class MetricsFormat {
+    Prometheus,
+    Json,
+};
+
+// .json files get JSON, anything else the Prometheus text format
+MetricsFormat metrics_format_for(const std::string& path);
+
+class Metrics {
+public:
+    static Metrics& instance();
+
+    Counter bytes_read;
+    Counter bytes_written;
+    // Read back and compared after writing
+    Counter bytes_verified;
+    // dmsetup create, load, reload, suspend, resume and remove
+    Counter dm_transactions;
+    // Memory mapped for I/O buffers at once, see BufferArena
+    Peak io_buffer_bytes;
+
+    Histogram fsck_seconds;
+    Histogram resize_seconds;
+    // From taking the stack offline (unmount, deactivate, swapoff)
+    // until it is usable again
+    Histogram offline_seconds;
+
+    // Keyed by the program's basename; takes the lock on every call
+    Histogram& subprocess(const std::string& tool);
+
+    // phase is "before" or "after"; depth counts from the outermost layer
+    void layer_size(size_t depth, const std::string& type, const std::string& phase, uint64_t bytes);
+
+    std::string to_prometheus(const std::string& command, int exit_status) const;
+    nlohmann::json to_json(const std::string& command, int exit_status) const;
+
+    // Writes a temporary file next to path and renames it over path,
+    // so a scraper never sees a partial file
+    void write_file(const std::string& path, const std::string& command, int exit_status) const;
+
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+private:
+    Metrics();
+
+    struct LayerSize {
+        size_t depth;
+        std::string type;
+        std::string phase;
+        uint64_t bytes;
+    };
+
+    std::chrono::steady_clock::time_point started;
+    mutable std::mutex lock;
+    std::map<std::string, std::unique_ptr<Histogram>> subprocesses;
+    std::vector<LayerSize> layer_sizes;
+};
+
+// Observes the time until it goes out of scope
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Histogram& histogram)
+        : histogram(histogram), start(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() { histogram.observe(std::chrono::steady_clock::now() - start); }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    Histogram& histogram;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Times one external command, named by its argv or its shell command
+// line. Filesystem checks also count as fsck time, and device-mapper
+// changes as DM transactions.
+class SubprocessTimer {
+public:
+    explicit SubprocessTimer(const std::vector<std::string>& argv);
+    explicit SubprocessTimer(const std::string& command_line);
+    ~SubprocessTimer();
+
+    SubprocessTimer(const SubprocessTimer&) = delete;
+    SubprocessTimer& operator=(const SubprocessTimer&) = delete;
+
+private:
+    void classify(const std::string& program, const std::string& verb);
+
+    Histogram* tool = nullptr;
+    bool fsck = false;
+    std::chrono::steady_clock::time_point start;
+};
+
+} // namespace blocks
+
+#endif // METRICS_H
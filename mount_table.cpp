@@ -0,0 +1,294 @@
+#include "mount_table.h"
+#include "host_paths.h"
+#include <charconv>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+namespace blocks {
+
+namespace {
+
+// Splits text into fields without copying; the views stay valid
+// as long as the buffer they were cut from.
+class Tokenizer {
+public:
+    Tokenizer(std::string_view text, const char* seps) : rest(text), seps(seps) {}
+
+    bool next(std::string_view& token) {
+        size_t start = rest.find_first_not_of(seps);
+        if (start == std::string_view::npos) {
+            rest = {};
+            return false;
+        }
+        rest.remove_prefix(start);
+        size_t end = rest.find_first_of(seps);
+        if (end == std::string_view::npos) {
+            end = rest.size();
+        }
+        token = rest.substr(0, end);
+        rest.remove_prefix(end);
+        return true;
+    }
+
+private:
+    std::string_view rest;
+    const char* seps;
+};
+
+void read_all(int fd, const char* name, std::string& buffer) {
+    buffer.clear();
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        throw std::runtime_error(std::string("Failed to rewind ") + name + ": " + std::strerror(errno));
+    }
+    char chunk[16384];
+    while (true) {
+        ssize_t len = ::read(fd, chunk, sizeof(chunk));
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("Failed to read ") + name + ": " + std::strerror(errno));
+        }
+        if (len == 0) {
+            break;
+        }
+        buffer.append(chunk, len);
+    }
+}
+
+std::optional<dev_t> parse_devnum(std::string_view field) {
+    size_t colon = field.find(':');
+    if (colon == std::string_view::npos) {
+        return std::nullopt;
+    }
+    unsigned int maj = 0, min = 0;
+    auto r1 = std::from_chars(field.data(), field.data() + colon, maj);
+    auto r2 = std::from_chars(field.data() + colon + 1, field.data() + field.size(), min);
+    if (r1.ec != std::errc() || r2.ec != std::errc()) {
+        return std::nullopt;
+    }
+    return makedev(maj, min);
+}
+
+std::optional<dev_t> block_rdev(const std::string& path) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0 || !S_ISBLK(st.st_mode)) {
+        return std::nullopt;
+    }
+    return st.st_rdev;
+}
+
+} // namespace
+
+std::string unescape_octal(std::string_view field) {
+    std::string result;
+    result.reserve(field.size());
+    for (size_t i = 0; i < field.size(); ++i) {
+        if (field[i] == '\\' && i + 3 < field.size() &&
+            field[i + 1] >= '0' && field[i + 1] <= '7' &&
+            field[i + 2] >= '0' && field[i + 2] <= '7' &&
+            field[i + 3] >= '0' && field[i + 3] <= '7') {
+            result += static_cast<char>(((field[i + 1] - '0') << 6) |
+                                        ((field[i + 2] - '0') << 3) |
+                                        (field[i + 3] - '0'));
+            i += 3;
+        } else {
+            result += field[i];
+        }
+    }
+    return result;
+}
+
+MountTable& MountTable::instance() {
+    static MountTable table;
+    return table;
+}
+
+MountTable::MountTable() {
+    open_files();
+    load_mountinfo();
+    load_swaps();
+}
+
+MountTable::~MountTable() {
+    close_files();
+}
+
+void MountTable::open_files() {
+    // Holding the fds open is what makes poll() work: the kernel
+    // flags POLLERR|POLLPRI on them once the table has changed
+    // since the last poll.
+    mountinfo_fd = ::open(proc_path("self/mountinfo").c_str(), O_RDONLY | O_CLOEXEC);
+    if (mountinfo_fd < 0) {
+        throw std::runtime_error("Failed to open " + proc_path("self/mountinfo") + ": " + std::strerror(errno));
+    }
+    // Kernels without swap support don't have /proc/swaps
+    swaps_fd = ::open(proc_path("swaps").c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+void MountTable::close_files() {
+    if (mountinfo_fd >= 0) {
+        close(mountinfo_fd);
+        mountinfo_fd = -1;
+    }
+    if (swaps_fd >= 0) {
+        close(swaps_fd);
+        swaps_fd = -1;
+    }
+}
+
+void MountTable::reopen() {
+    std::lock_guard<std::mutex> guard(lock);
+    close_files();
+    open_files();
+    load_mountinfo();
+    load_swaps();
+}
+
+void MountTable::refresh_if_changed(bool force) {
+    // Polling also consumes the change notification
+    struct pollfd fds[2] = {
+        {mountinfo_fd, POLLPRI, 0},
+        {swaps_fd, POLLPRI, 0},
+    };
+    int nfds = swaps_fd >= 0 ? 2 : 1;
+    poll(fds, nfds, 0);
+    if (force || (fds[0].revents & (POLLERR | POLLPRI))) {
+        load_mountinfo();
+    }
+    if (force || (nfds == 2 && (fds[1].revents & (POLLERR | POLLPRI)))) {
+        load_swaps();
+    }
+}
+
+void MountTable::refresh() {
+    std::lock_guard<std::mutex> guard(lock);
+    refresh_if_changed(true);
+}
+
+void MountTable::load_mountinfo() {
+    // 36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw,errors=continue
+    read_all(mountinfo_fd, "/proc/self/mountinfo", buffer);
+    mounts.clear();
+
+    Tokenizer lines(buffer, "\n");
+    std::string_view line;
+    while (lines.next(line)) {
+        Tokenizer fields(line, " ");
+        std::string_view field;
+        std::string_view devnum_field, mpoint_field, source_field;
+        bool past_separator = false;
+        int index = 0;
+        int after_separator = 0;
+
+        while (fields.next(field)) {
+            if (index == 2) {
+                devnum_field = field;
+            } else if (index == 4) {
+                mpoint_field = field;
+            } else if (index > 5 && !past_separator && field == "-") {
+                past_separator = true;
+            } else if (past_separator && ++after_separator == 2) {
+                source_field = field;
+                break;
+            }
+            ++index;
+        }
+
+        auto dev = parse_devnum(devnum_field);
+        if (!dev || mpoint_field.empty()) {
+            continue;
+        }
+
+        std::string mpoint = unescape_octal(mpoint_field);
+        mounts[*dev].push_back(mpoint);
+
+        // btrfs (and anything else with anonymous devnums)
+        // is found through the mount source instead
+        if (!source_field.empty() && source_field.front() == '/') {
+            auto rdev = block_rdev(unescape_octal(source_field));
+            if (rdev && *rdev != *dev) {
+                mounts[*rdev].push_back(mpoint);
+            }
+        }
+    }
+}
+
+void MountTable::load_swaps() {
+    // Filename  Type  Size  Used  Priority
+    swaps.clear();
+    if (swaps_fd < 0) {
+        return;
+    }
+    read_all(swaps_fd, "/proc/swaps", buffer);
+
+    Tokenizer lines(buffer, "\n");
+    std::string_view line;
+    bool header = true;
+    while (lines.next(line)) {
+        if (header) {
+            header = false;
+            continue;
+        }
+        Tokenizer fields(line, " \t");
+        std::string_view field;
+        std::string_view path_field, prio_field;
+        int index = 0;
+        while (fields.next(field)) {
+            if (index == 0) {
+                path_field = field;
+            } else if (index == 4) {
+                prio_field = field;
+            }
+            ++index;
+        }
+
+        SwapEntry entry;
+        entry.path = unescape_octal(path_field);
+        std::from_chars(prio_field.data(), prio_field.data() + prio_field.size(), entry.priority);
+
+        // Swap files aren't block devices and can't be in a stack
+        auto rdev = block_rdev(entry.path);
+        if (rdev) {
+            swaps[*rdev] = std::move(entry);
+        }
+    }
+}
+
+bool MountTable::is_mounted(dev_t dev) {
+    std::lock_guard<std::mutex> guard(lock);
+    refresh_if_changed();
+    return mounts.count(dev) != 0;
+}
+
+std::vector<std::string> MountTable::mountpoints(dev_t dev) {
+    std::lock_guard<std::mutex> guard(lock);
+    refresh_if_changed();
+    auto it = mounts.find(dev);
+    if (it == mounts.end()) {
+        return {};
+    }
+    return it->second;
+}
+
+bool MountTable::is_active_swap(dev_t dev) {
+    std::lock_guard<std::mutex> guard(lock);
+    refresh_if_changed();
+    return swaps.count(dev) != 0;
+}
+
+std::optional<SwapEntry> MountTable::swap_entry(dev_t dev) {
+    std::lock_guard<std::mutex> guard(lock);
+    refresh_if_changed();
+    auto it = swaps.find(dev);
+    if (it == swaps.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+} // namespace blocks
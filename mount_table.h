@@ -0,0 +1,65 @@
+#ifndef MOUNT_TABLE_H
+#define MOUNT_TABLE_H
+
+#include "blocks_types.h"
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace blocks {
+
+struct SwapEntry {
+    std::string path;
+    int priority = -1;
+};
+
+// Process-wide view of /proc/self/mountinfo and /proc/swaps.
+// Both files are parsed once and indexed by dev_t; they are only
+// parsed again after poll() reports that the kernel table changed.
+class MountTable {
+public:
+    static MountTable& instance();
+
+    bool is_mounted(dev_t dev);
+    std::vector<std::string> mountpoints(dev_t dev);
+
+    bool is_active_swap(dev_t dev);
+    std::optional<SwapEntry> swap_entry(dev_t dev);
+
+    // Drop the poll state and parse both files again
+    void refresh();
+    // After the process changed mount namespace
+    void reopen();
+
+    MountTable(const MountTable&) = delete;
+    MountTable& operator=(const MountTable&) = delete;
+
+private:
+    MountTable();
+    ~MountTable();
+
+    void open_files();
+    void close_files();
+    void refresh_if_changed(bool force = false);
+    void load_mountinfo();
+    void load_swaps();
+
+    std::mutex lock;
+    int mountinfo_fd = -1;
+    int swaps_fd = -1;
+    std::string buffer;
+
+    std::unordered_map<dev_t, std::vector<std::string>> mounts;
+    std::unordered_map<dev_t, SwapEntry> swaps;
+};
+
+// Undo the octal escaping of whitespace and backslashes
+// used by mountinfo and /proc/swaps
+std::string unescape_octal(std::string_view field);
+
+} // namespace blocks
+
+#endif // MOUNT_TABLE_H
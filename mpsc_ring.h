@@ -0,0 +1,91 @@
+#ifndef MPSC_RING_H
+#define MPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+
+namespace blocks {
+
+// Bounded lock-free queue of fixed-size records (Vyukov's design):
+// any number of producers, one consumer. Each slot carries a sequence
+// number that says whose turn it is, so producers only contend on the
+// enqueue counter and never wait for the consumer; a full ring makes
+// try_push fail instead.
+template <typename T, size_t Capacity>
+class MpscRing {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+    static_assert(std::is_trivially_copyable_v<T>, "records are copied in and out of slots");
+
+public:
+    MpscRing() : slots(new Slot[Capacity]) {
+        reset();
+    }
+
+    bool try_push(const T& value) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &slots[pos & (Capacity - 1)];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        slot->value = value;
+        slot->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only
+    bool try_pop(T& value) {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        Slot* slot = &slots[pos & (Capacity - 1)];
+        if (slot->seq.load(std::memory_order_acquire) != pos + 1) {
+            return false;
+        }
+        value = slot->value;
+        slot->seq.store(pos + Capacity, std::memory_order_release);
+        dequeue_pos.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Records pushed and popped so far
+    size_t pushed() const { return enqueue_pos.load(std::memory_order_acquire); }
+    size_t popped() const { return dequeue_pos.load(std::memory_order_acquire); }
+
+    // Only with no producer or consumer running, e.g. in a forked child
+    void reset() {
+        for (size_t i = 0; i < Capacity; ++i) {
+            slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+        enqueue_pos.store(0, std::memory_order_relaxed);
+        dequeue_pos.store(0, std::memory_order_relaxed);
+    }
+
+    MpscRing(const MpscRing&) = delete;
+    MpscRing& operator=(const MpscRing&) = delete;
+
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    alignas(64) std::atomic<size_t> enqueue_pos{0};
+    alignas(64) std::atomic<size_t> dequeue_pos{0};
+};
+
+} // namespace blocks
+
+#endif // MPSC_RING_H
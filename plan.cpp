@@ -0,0 +1,556 @@
+#include "plan.h"
+#include "bcache_operations.h"
+#include "container.h"
+#include "filesystem.h"
+#include "mount_table.h"
+#include "swap_header.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <sstream>
+
+namespace blocks {
+
+namespace {
+
+PlanStep make_step(PlanStep::Kind kind, std::string description, bool offline) {
+    PlanStep step;
+    step.kind = kind;
+    step.description = std::move(description);
+    step.offline = offline;
+    return step;
+}
+
+void add_step(Plan& plan, PlanStep step) {
+    if (step.offline) {
+        plan.offline_seconds += PLAN_SECONDS_PER_STEP;
+    }
+    if (step.kind == PlanStep::Kind::Read || step.kind == PlanStep::Kind::Write) {
+        if (step.kind == PlanStep::Kind::Write) {
+            plan.data_movement_bytes += step.length;
+        }
+        if (step.offline) {
+            plan.offline_seconds += step.length / PLAN_COPY_BYTES_PER_SEC;
+        }
+    }
+    plan.steps.push_back(std::move(step));
+}
+
+void infeasible(Plan& plan, const std::string& why) {
+    plan.feasible = false;
+    plan.notes.push_back("Would fail: " + why);
+}
+
+// What a temporary mount by _mount_and_resize would look like
+void plan_temp_mount(Plan& plan, Filesystem& fs) {
+    auto step = make_step(PlanStep::Kind::Syscall,
+                          "mount(2) " + fs.device.devpath + " (" + fs.vfstype +
+                          ") on a private temporary mountpoint", false);
+    step.devpath = fs.device.devpath;
+    add_step(plan, std::move(step));
+}
+
+// Mirrors the _resize of each filesystem type
+void plan_fs_resize(Plan& plan, Filesystem& fs, uint64_t target) {
+    uint64_t current = fs.fssize();
+    if (current == target) {
+        return;
+    }
+    bool shrink = target < current;
+    bool mounted = fs.is_mounted();
+    const std::string& devpath = fs.device.devpath;
+
+    if (shrink && !fs.can_shrink()) {
+        infeasible(plan, "can't shrink " + fs.vfstype + " on " + devpath);
+        return;
+    }
+
+    // Worst case, everything past the new end is in use and gets moved;
+    // swap pages past the end are simply dropped
+    uint64_t moved = shrink && !dynamic_cast<Swap*>(&fs) ? current - target : 0;
+    plan.data_movement_bytes += moved;
+
+    if (auto ext = dynamic_cast<ExtFS*>(&fs)) {
+        uint64_t blocks = target / fs.block_size;
+        if (mounted) {
+            if (shrink) {
+                infeasible(plan, "the kernel can't shrink a mounted ext4, unmount " + devpath);
+                return;
+            }
+            auto step = make_step(PlanStep::Kind::Ioctl,
+                                  "EXT4_IOC_RESIZE_FS to " + std::to_string(blocks) + " blocks", false);
+            step.devpath = fs.mountpoint().value_or(devpath);
+            add_step(plan, std::move(step));
+            plan.notes.push_back("Falls back to resize2fs if the kernel lacks online resize");
+            return;
+        }
+        if (ext->state != "clean" || ext->check_tm < ext->mount_tm) {
+            auto step = make_step(PlanStep::Kind::Command, "Check the filesystem before resizing it", true);
+            step.argv = {"e2fsck", "-f", "--", devpath};
+            add_step(plan, std::move(step));
+            plan.offline_seconds += current / PLAN_FSCK_BYTES_PER_SEC;
+        }
+        auto step = make_step(PlanStep::Kind::Command, "Resize the filesystem", true);
+        step.argv = {"resize2fs", "--", devpath, std::to_string(blocks)};
+        add_step(plan, std::move(step));
+        plan.offline_seconds += moved / PLAN_COPY_BYTES_PER_SEC;
+    } else if (dynamic_cast<XFS*>(&fs) || dynamic_cast<BtrFS*>(&fs)) {
+        if (!mounted) {
+            plan_temp_mount(plan, fs);
+        }
+        std::string request;
+        if (auto btrfs = dynamic_cast<BtrFS*>(&fs)) {
+            request = "BTRFS_IOC_RESIZE to " + std::to_string(btrfs->devid) + ":" + std::to_string(target);
+        } else {
+            request = "XFS_IOC_FSGROWFSDATA to " + std::to_string(target / fs.block_size) + " blocks";
+        }
+        auto step = make_step(PlanStep::Kind::Ioctl, request, false);
+        step.devpath = mounted ? fs.mountpoint().value_or(devpath) : devpath;
+        add_step(plan, std::move(step));
+    } else if (dynamic_cast<NilFS*>(&fs)) {
+        if (fs.resize_needs_mpoint && !mounted) {
+            plan_temp_mount(plan, fs);
+        }
+        auto step = make_step(PlanStep::Kind::Command, "Resize the filesystem", false);
+        step.argv = {"nilfs-resize", "--yes", "--", devpath, std::to_string(target)};
+        add_step(plan, std::move(step));
+    } else if (dynamic_cast<ReiserFS*>(&fs)) {
+        auto step = make_step(PlanStep::Kind::Command, "Resize the filesystem", shrink);
+        step.argv = {"resize_reiserfs", "-q", "-s", std::to_string(target), "--", devpath};
+        add_step(plan, std::move(step));
+        if (shrink) {
+            plan.offline_seconds += moved / PLAN_COPY_BYTES_PER_SEC;
+        }
+    } else if (dynamic_cast<Swap*>(&fs)) {
+        auto active = MountTable::instance().swap_entry(fs.devno());
+        if (active) {
+            add_step(plan, make_step(PlanStep::Kind::Syscall, "swapoff " + active->path, true));
+        }
+        auto step = make_step(PlanStep::Kind::Write,
+                              "Rewrite last_page in the swap header", true);
+        step.devpath = devpath;
+        step.offset = SWAP_HEADER_INFO_OFFSET;
+        step.length = sizeof(SwapHeaderInfo);
+        add_step(plan, std::move(step));
+        if (active) {
+            add_step(plan, make_step(PlanStep::Kind::Syscall, "swapon " + active->path, true));
+        }
+    } else {
+        infeasible(plan, "no resize support for " + fs.vfstype);
+    }
+}
+
+// Mirrors BlockStack::stack_resize, returns the new total data size
+uint64_t plan_stack_resize(Plan& plan, BlockStack& stack, uint64_t pos, bool shrink) {
+    Filesystem* fs = stack.filesystem();
+    uint64_t fs_target = 0;
+    if (fs) {
+        fs_target = align(pos - stack.overhead(), fs->block_size);
+        if (shrink && fs_target >= fs->fssize()) {
+            plan.notes.push_back("The filesystem (" + fs->vfstype + ") leaves enough room, no need to shrink it");
+        }
+    }
+
+    // Filesystem first when shrinking, outermost first when growing
+    auto positions = stack.iter_pos(pos);
+    if (shrink) {
+        std::reverse(positions.begin(), positions.end());
+    }
+
+    for (auto& [inner_pos, layer] : positions) {
+        if (Filesystem* fs_ptr = as_filesystem(*layer)) {
+            uint64_t target = align(inner_pos, fs_ptr->block_size);
+            if (shrink && target >= fs_ptr->fssize()) {
+                continue;
+            }
+            plan_fs_resize(plan, *fs_ptr, target);
+        } else if (auto luks = std::get_if<LUKS>(layer)) {
+            BlockDevice cleartext = luks->snoop_activated();
+            if (cleartext.devpath.empty()) {
+                continue;
+            }
+            auto step = make_step(PlanStep::Kind::Command, "Resize the LUKS mapping", false);
+            step.argv = {"cryptsetup", "resize", "--size=" + std::to_string(bytes_to_sector(inner_pos - luks->offset)),
+                         "--", cleartext.devpath};
+            add_step(plan, std::move(step));
+        } else if (auto bcache = std::get_if<BCacheBacking>(layer)) {
+            if (!shrink && bcache->is_activated()) {
+                auto step = make_step(PlanStep::Kind::Sysfs, "Write max to bcache/resize", false);
+                step.devpath = bcache->device.sysfspath() + "/bcache/resize";
+                add_step(plan, std::move(step));
+            }
+        }
+    }
+
+    return fs ? fs_target + stack.overhead() : pos;
+}
+
+// The layers with the sizes plan_stack_resize brings them to
+void plan_layers(Plan& plan, BlockStack& stack, uint64_t pos) {
+    for (auto& [inner_pos, stack_layer] : stack.iter_pos(pos)) {
+        BlockData& block_data = layer_data(*stack_layer);
+        PlanLayer layer;
+        layer.devpath = block_data.device.devpath;
+        layer.current_size = block_data.device.size();
+        layer.target_size = inner_pos;
+        uint64_t layer_pos = inner_pos;
+        std::visit(overloaded{
+                [&](Filesystem& fs) {
+                    layer.kind = fs.vfstype;
+                    layer.current_size = fs.fssize();
+                    layer.target_size = align(layer_pos, fs.block_size);
+                },
+                [&](LUKS& luks) {
+                    layer.kind = "luks";
+                    layer.offset = luks.offset;
+                },
+                [&](BCacheBacking& bcache) {
+                    layer.kind = "bcache";
+                    layer.offset = bcache.offset;
+                },
+        }, *stack_layer);
+        plan.layers.push_back(std::move(layer));
+    }
+
+    Layer* top = stack.topmost();
+    if (top && !as_filesystem(*top)) {
+        plan.notes.push_back("Stopped at the inactive " + plan.layers.back().kind + " layer on " +
+                             layer_data(*top).device.devpath + ", its contents would be probed after activation");
+    }
+}
+
+void plan_dev_resize(Plan& plan, BlockDevice& device, uint64_t newsize, bool shrink) {
+    newsize = align_up(newsize, 512);
+    if (device.is_partition()) {
+        auto step = make_step(PlanStep::Kind::PartitionTable,
+                              std::string(shrink ? "Shrink" : "Grow") + " the partition to " +
+                              std::to_string(newsize) + " bytes", false);
+        step.devpath = device.devpath;
+        add_step(plan, std::move(step));
+    } else if (device.is_lv()) {
+        auto step = make_step(PlanStep::Kind::Command,
+                              shrink ? "Shrink the logical volume" : "Grow the logical volume", false);
+        step.argv = shrink ? std::vector<std::string>{"lvm", "lvreduce", "-f"}
+                           : std::vector<std::string>{"lvm", "lvextend"};
+        step.argv.push_back("--size=" + std::to_string(newsize) + "b");
+        step.argv.push_back("--");
+        step.argv.push_back(device.devpath);
+        add_step(plan, std::move(step));
+    } else {
+        infeasible(plan, "only partitions and LVs can be resized");
+    }
+}
+
+void plan_deactivate(Plan& plan, BlockStack& stack) {
+    LayerRange wrappers = stack.wrappers();
+    for (auto it = std::make_reverse_iterator(wrappers.end()); it != std::make_reverse_iterator(wrappers.begin()); ++it) {
+        if (auto luks = std::get_if<LUKS>(&*it)) {
+            BlockDevice cleartext = luks->snoop_activated();
+            auto step = make_step(PlanStep::Kind::Command, "Deactivate the LUKS mapping", true);
+            step.argv = {"cryptsetup", "remove", "--", cleartext.devpath};
+            add_step(plan, std::move(step));
+        } else if (auto bcache = std::get_if<BCacheBacking>(&*it)) {
+            auto step = make_step(PlanStep::Kind::Sysfs, "Write stop to bcache/stop", true);
+            step.devpath = bcache->device.sysfspath() + "/bcache/stop";
+            add_step(plan, std::move(step));
+        }
+    }
+}
+
+// The devices make_bcache_sb formats through, see synth_device
+void plan_make_bcache_sb(Plan& plan, uint64_t bsb_size, uint64_t data_size, const std::string& join) {
+    auto rozeros = make_step(PlanStep::Kind::DmCreate, "Read-only error target standing in for the data", true);
+    rozeros.dm_table = "0 " + std::to_string(bytes_to_sector(data_size)) + " error";
+    add_step(plan, std::move(rozeros));
+
+    auto synth = make_step(PlanStep::Kind::DmCreate, "Synthetic device with a writable header", true);
+    synth.dm_table = "0 " + std::to_string(bytes_to_sector(bsb_size)) + " linear <loop device> 0\n" +
+                     std::to_string(bytes_to_sector(bsb_size)) + " " +
+                     std::to_string(bytes_to_sector(data_size)) + " linear <rozeros> 0";
+    add_step(plan, std::move(synth));
+
+    auto step = make_step(PlanStep::Kind::Command, "Format the bcache superblock", true);
+    step.argv = {"make-bcache", "--bdev", "--data_offset", std::to_string(bytes_to_sector(bsb_size))};
+    if (!join.empty()) {
+        step.argv.insert(step.argv.begin() + 1, "--cset-uuid");
+        step.argv.insert(step.argv.begin() + 2, join);
+    }
+    step.argv.push_back("<synthetic device>");
+    add_step(plan, std::move(step));
+}
+
+} // namespace
+
+void Plan::command_step(std::vector<std::string> argv, std::string description, bool offline) {
+    auto step = make_step(PlanStep::Kind::Command, std::move(description), offline);
+    step.argv = std::move(argv);
+    add_step(*this, std::move(step));
+}
+
+void Plan::io_step(PlanStep::Kind kind, const std::string& devpath, uint64_t offset, uint64_t length,
+                   std::string description, bool offline) {
+    auto step = make_step(kind, std::move(description), offline);
+    step.devpath = devpath;
+    step.offset = offset;
+    step.length = length;
+    add_step(*this, std::move(step));
+}
+
+const char* plan_step_kind_name(PlanStep::Kind kind) {
+    switch (kind) {
+        case PlanStep::Kind::Command: return "command";
+        case PlanStep::Kind::Ioctl: return "ioctl";
+        case PlanStep::Kind::Syscall: return "syscall";
+        case PlanStep::Kind::Sysfs: return "sysfs";
+        case PlanStep::Kind::DmCreate: return "dm-create";
+        case PlanStep::Kind::Read: return "read";
+        case PlanStep::Kind::Write: return "write";
+        case PlanStep::Kind::PartitionTable: return "partition-table";
+    }
+    return "unknown";
+}
+
+nlohmann::json Plan::to_json() const {
+    nlohmann::json result;
+    result["command"] = command;
+    result["device"] = device;
+    result["device_size"] = device_size;
+    result["feasible"] = feasible;
+
+    result["layers"] = nlohmann::json::array();
+    for (const auto& layer : layers) {
+        result["layers"].push_back({
+            {"kind", layer.kind},
+            {"devpath", layer.devpath},
+            {"offset", layer.offset},
+            {"current_size", layer.current_size},
+            {"target_size", layer.target_size}
+        });
+    }
+
+    result["steps"] = nlohmann::json::array();
+    for (const auto& step : steps) {
+        nlohmann::json entry = {
+            {"kind", plan_step_kind_name(step.kind)},
+            {"description", step.description},
+            {"offline", step.offline}
+        };
+        if (!step.argv.empty()) {
+            entry["argv"] = step.argv;
+        }
+        if (!step.devpath.empty()) {
+            entry["devpath"] = step.devpath;
+        }
+        if (step.kind == PlanStep::Kind::Read || step.kind == PlanStep::Kind::Write) {
+            entry["offset"] = step.offset;
+            entry["length"] = step.length;
+        }
+        if (!step.dm_table.empty()) {
+            entry["dm_table"] = step.dm_table;
+        }
+        result["steps"].push_back(std::move(entry));
+    }
+
+    result["estimates"] = {
+        {"data_movement_bytes", data_movement_bytes},
+        {"offline_seconds", offline_seconds}
+    };
+    result["notes"] = notes;
+    return result;
+}
+
+Plan plan_resize(const ResizeArgs& args) {
+    BlockDevice device(args.device);
+    CLIProgressHandler progress;
+
+    Plan plan;
+    plan.command = "resize";
+    plan.device = device.devpath;
+    plan.device_size = device.size();
+
+    BlockStack block_stack = get_block_stack(device, progress, false);
+
+    uint64_t newsize = args.newsize;
+    DeviceResize device_step = device_resize(device, newsize, args.resize_device);
+    if (device_step == DeviceResize::Grow) {
+        plan_dev_resize(plan, device, newsize, false);
+        newsize = align_up(newsize, 512);
+        plan.notes.push_back("The device may be rounded up further for partition alignment or LVM extents");
+    }
+
+    block_stack.read_superblocks();
+    plan_layers(plan, block_stack, newsize);
+    if (!block_stack.filesystem()) {
+        return plan;
+    }
+
+    bool shrink = newsize < block_stack.total_data_size();
+    uint64_t tds = plan_stack_resize(plan, block_stack, newsize, shrink);
+
+    if (device_step == DeviceResize::Shrink) {
+        if (shrink_deactivates(device)) {
+            plan_deactivate(plan, block_stack);
+        }
+        plan_dev_resize(plan, device, tds, true);
+    }
+    return plan;
+}
+
+Plan plan_to_lvm(const CommandArgs& args) {
+    BlockDevice device(args.device);
+    CLIProgressHandler progress;
+
+    Plan plan;
+    plan.command = "to-lvm";
+    plan.device = device.devpath;
+    plan.device_size = device.size();
+
+    if (device.superblock_type() == "LVM2_member") {
+        plan.command_step({"pvremove", "-ff", "--", args.device}, "Remove the existing LVM metadata", true);
+    }
+
+    LvmLayout layout = to_lvm_layout(args, device);
+    std::string vgname = args.join.empty() ? layout.vgname : "<random uuid>";
+    uint64_t pe_size = layout.pe_size;
+    uint64_t pe_count = layout.pe_count;
+    uint64_t pe_newpos = layout.pe_newpos;
+
+    BlockStack block_stack = get_block_stack(device, progress, false);
+
+    block_stack.read_superblocks();
+    plan_layers(plan, block_stack, pe_newpos);
+    Filesystem* fs = block_stack.filesystem();
+    if (!fs) {
+        return plan;
+    }
+
+    plan.command_step({"e2fsck", "-f", "-y", "--", args.device}, "Check the filesystem before resizing it", true);
+    plan.offline_seconds += fs->fssize() / PLAN_FSCK_BYTES_PER_SEC;
+
+    plan_stack_resize(plan, block_stack, pe_newpos, true);
+    plan_deactivate(plan, block_stack);
+
+    plan.io_step(PlanStep::Kind::Read, device.devpath, 0, pe_size, "Read the first extent", true);
+    plan.io_step(PlanStep::Kind::Write, device.devpath, pe_newpos, pe_size,
+                 "Copy the first extent to the end", true);
+
+    auto rozeros = make_step(PlanStep::Kind::DmCreate, "Read-only error target standing in for the data", true);
+    rozeros.dm_table = "0 " + std::to_string(bytes_to_sector(device.size() - pe_size)) + " error";
+    add_step(plan, std::move(rozeros));
+
+    auto synth = make_step(PlanStep::Kind::DmCreate, "Synthetic PV over the first extent", true);
+    synth.dm_table = "0 " + std::to_string(bytes_to_sector(pe_size)) + " linear " + args.device + " 0\n" +
+                     std::to_string(bytes_to_sector(pe_size)) + " " +
+                     std::to_string(bytes_to_sector(device.size() - pe_size)) + " linear <rozeros> 0";
+    add_step(plan, std::move(synth));
+
+    plan.command_step({"lvm", "pvcreate", "--restorefile", "<vgcfg>", "--uuid", "<pv uuid>", "--zero", "y",
+                       "--", "<synthetic device>"}, "Create the PV on the synthetic device", true);
+    plan.command_step({"lvm", "vgcfgrestore", "--file", "<vgcfg>", "--", vgname},
+                      "Write the VG metadata, the LV starts on extent " + std::to_string(pe_count - 1), true);
+    plan.io_step(PlanStep::Kind::Read, "<synthetic device>", 0, pe_size, "Read back the LVM metadata", true);
+    plan.command_step({"dmsetup", "remove", "<synthetic>"}, "Remove the synthetic PV", true);
+    plan.command_step({"dmsetup", "remove", "<rozeros>"}, "Remove the error target", true);
+    plan.io_step(PlanStep::Kind::Write, device.devpath, 0, pe_size, "Install the LVM metadata", true);
+    plan.command_step({"vgchange", "-ay", "--", vgname}, "Activate the volume group", false);
+
+    if (!args.join.empty()) {
+        plan.command_step({"lvm", "vgmerge", "--", layout.join_name, vgname}, "Merge into " + layout.join_name, false);
+    }
+    return plan;
+}
+
+Plan plan_to_bcache(const CommandArgs& args) {
+    BlockDevice device(args.device);
+    CLIProgressHandler progress;
+
+    Plan plan;
+    plan.command = "to-bcache";
+    plan.device = device.devpath;
+    plan.device_size = device.size();
+
+    BCacheConversion conversion = bcache_conversion(device);
+    if (conversion == BCacheConversion::AlreadyBCache) {
+        infeasible(plan, "device already has a bcache super block");
+        return plan;
+    }
+
+    if (conversion == BCacheConversion::Partition) {
+        uint64_t bsb_size = PART_BSB_SIZE;
+        auto [ptable, part_start] = device.ptable_context();
+        uint64_t part_start1 = part_start - bsb_size;
+
+        auto reserve = make_step(PlanStep::Kind::PartitionTable,
+                                 "Reserve " + std::to_string(bsb_size) + " bytes before the partition", true);
+        reserve.devpath = device.devpath;
+        add_step(plan, std::move(reserve));
+
+        plan_make_bcache_sb(plan, bsb_size, device.size(), args.join);
+        plan.io_step(PlanStep::Kind::Write, "<partition table device>", part_start1, bsb_size,
+                     "Copy the bcache superblock before the partition", true);
+
+        auto shift = make_step(PlanStep::Kind::PartitionTable,
+                               "Shift the partition to start at " + std::to_string(part_start1), true);
+        shift.devpath = device.devpath;
+        add_step(plan, std::move(shift));
+    } else if (conversion == BCacheConversion::LogicalVolume) {
+        uint64_t pe_size = lvm_extent_size("lvs", device.devpath);
+        uint64_t data_size = device.size() - pe_size;
+
+        BlockStack block_stack = get_block_stack(device, progress, false);
+        block_stack.read_superblocks();
+        plan_layers(plan, block_stack, data_size);
+        if (!block_stack.filesystem()) {
+            return plan;
+        }
+        plan_stack_resize(plan, block_stack, data_size, true);
+        plan_deactivate(plan, block_stack);
+
+        plan_make_bcache_sb(plan, pe_size, data_size, args.join);
+        plan.io_step(PlanStep::Kind::Write, device.devpath, data_size, pe_size,
+                     "Copy the bcache superblock to the last extent", true);
+        plan.command_step({"lvm", "lvchange", "-an", "--", "<vg>/<lv>"}, "Deactivate the LV", true);
+        plan.command_step({"lvm", "vgcfgbackup", "--file", "<vgcfg>", "--", "<vg>"}, "Load the LVM metadata", true);
+        plan.command_step({"lvm", "lvchange", "--refresh", "--", "<vg>/<lv>"},
+                          "Rotate the last extent to be the first", true);
+    } else if (conversion == BCacheConversion::LUKS) {
+        LUKS luks(device);
+        luks.read_superblock();
+        int fd = ::open(device.devpath.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open " + device.devpath + ": " + std::strerror(errno));
+        }
+        try {
+            luks.read_superblock_ll(fd);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+
+        uint64_t shift_by = LUKS_BSB_SIZE;
+        if (!luks_has_room_for_bsb(luks)) {
+            infeasible(plan, "no room between the LUKS superblock and its payload");
+            return plan;
+        }
+        if (!luks.snoop_activated().devpath.empty()) {
+            auto step = make_step(PlanStep::Kind::Command, "Deactivate the LUKS mapping", true);
+            step.argv = {"cryptsetup", "remove", "--", luks.snoop_activated().devpath};
+            add_step(plan, std::move(step));
+        }
+
+        plan_make_bcache_sb(plan, shift_by, device.size() - shift_by, args.join);
+        plan.io_step(PlanStep::Kind::Read, device.devpath, 0, luks.sb_end, "Read the LUKS superblock", true);
+        plan.io_step(PlanStep::Kind::Write, device.devpath, shift_by, luks.sb_end,
+                     "Shift the LUKS superblock, with its payload offset edited", true);
+        plan.io_step(PlanStep::Kind::Write, device.devpath, 0, shift_by, "Copy the bcache superblock", true);
+        plan.notes.push_back("Shifting the LUKS superblock is not atomic");
+    } else {
+        infeasible(plan, "not a partition, a logical volume, or a LUKS volume");
+    }
+    return plan;
+}
+
+} // namespace blocks
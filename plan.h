@@ -0,0 +1,78 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include "blocks_types.h"
+#include "block_device.h"
+#include "block_stack.h"
+#include "lvm_operations.h"
+#include "resize_operations.h"
+#include <nlohmann/json.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace blocks {
+
+// Dry runs: what a conversion or resize would do, computed from the same
+// read-only queries the command itself makes. Nothing is written, mounted,
+// activated or run beyond probes (blkid, lvs, sysfs).
+
+// A layer of the block stack and the size it would be brought to
+struct PlanLayer {
+    std::string kind;       // "luks", "bcache", or the filesystem type
+    std::string devpath;
+    uint64_t offset = 0;    // Where the inner layer starts, for containers
+    uint64_t current_size = 0;
+    uint64_t target_size = 0;
+};
+
+// One step, in execution order
+struct PlanStep {
+    enum class Kind { Command, Ioctl, Syscall, Sysfs, DmCreate, Read, Write, PartitionTable };
+
+    Kind kind;
+    std::string description;
+    std::vector<std::string> argv;  // Command
+    std::string devpath;            // Read, Write, Ioctl, Sysfs
+    uint64_t offset = 0;            // Read, Write
+    uint64_t length = 0;            // Read, Write
+    std::string dm_table;           // DmCreate
+    bool offline = false;           // Needs the stack deactivated or unmounted
+};
+
+struct Plan {
+    std::string command;
+    std::string device;
+    uint64_t device_size = 0;
+    // False when the command would bail, the notes say why
+    bool feasible = true;
+
+    std::vector<PlanLayer> layers;
+    std::vector<PlanStep> steps;
+    std::vector<std::string> notes;
+
+    // Estimates, from the sizes involved and the rates below
+    uint64_t data_movement_bytes = 0;
+    double offline_seconds = 0;
+
+    void command_step(std::vector<std::string> argv, std::string description, bool offline);
+    void io_step(PlanStep::Kind kind, const std::string& devpath, uint64_t offset, uint64_t length,
+                 std::string description, bool offline);
+
+    nlohmann::json to_json() const;
+};
+
+// Rough rates for the estimates; real numbers depend on the hardware
+constexpr double PLAN_COPY_BYTES_PER_SEC = 200.0 * 1024 * 1024;
+constexpr double PLAN_FSCK_BYTES_PER_SEC = 1024.0 * 1024 * 1024;
+constexpr double PLAN_SECONDS_PER_STEP = 0.05;
+
+Plan plan_resize(const ResizeArgs& args);
+Plan plan_to_lvm(const CommandArgs& args);
+Plan plan_to_bcache(const CommandArgs& args);
+
+const char* plan_step_kind_name(PlanStep::Kind kind);
+
+} // namespace blocks
+
+#endif // PLAN_H
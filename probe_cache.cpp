@@ -0,0 +1,258 @@
+#include "probe_cache.h"
+#include "metrics.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+namespace blocks {
+
+namespace {
+
+constexpr int CACHE_VERSION = 1;
+constexpr size_t SECTOR_SIZE = 512;
+
+// What restore re-reads: the size and the first sector's hash
+struct Fingerprint {
+    uint64_t size = 0;
+    uint64_t first_sector = 0;
+};
+
+std::optional<Fingerprint> fingerprint(const std::string& devpath) {
+    int fd = ::open(devpath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+    // Block devices and image files alike
+    off_t size = lseek(fd, 0, SEEK_END);
+    uint8_t sector[SECTOR_SIZE];
+    ssize_t len = pread(fd, sector, sizeof(sector), 0);
+    ::close(fd);
+    if (size < 0 || len < 0) {
+        return std::nullopt;
+    }
+    Metrics::instance().bytes_read.add(len);
+    return Fingerprint{static_cast<uint64_t>(size), fnv1a_64(sector, len)};
+}
+
+// Hashes are kept as hex, JSON numbers lose precision past 2^53
+std::string hex64(uint64_t value) {
+    char buf[17];
+    std::snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(value));
+    return buf;
+}
+
+// The window as it is on the device now, not as the run first read it
+std::optional<uint64_t> current_window_hash(const std::string& devpath) {
+    int fd = ::open(devpath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+    std::vector<uint8_t> window(BlockDevice::PROBE_WINDOW_SIZE);
+    size_t filled = 0;
+    while (filled < window.size()) {
+        ssize_t len = pread(fd, window.data() + filled, window.size() - filled, filled);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            break;
+        }
+        filled += len;
+    }
+    ::close(fd);
+    Metrics::instance().bytes_read.add(filled);
+    return fnv1a_64(window.data(), filled);
+}
+
+uint64_t parse_hex64(const nlohmann::json& value) {
+    return std::stoull(value.get<std::string>(), nullptr, 16);
+}
+
+// "maj:min@seq" keys name a device that is gone once its diskseq moved on
+bool key_still_valid(const std::string& key) {
+    if (key.rfind("file:", 0) == 0) {
+        return true;
+    }
+    size_t at = key.find('@');
+    if (at == std::string::npos) {
+        return std::filesystem::exists(sys_path("dev/block/" + key));
+    }
+    std::string sysdir = sys_path("dev/block/" + key.substr(0, at));
+    std::ifstream diskseq(sysdir + "/diskseq");
+    if (!diskseq) {
+        diskseq.open(sysdir + "/../diskseq");
+    }
+    std::string seq;
+    return std::getline(diskseq, seq) && seq == key.substr(at + 1);
+}
+
+} // namespace
+
+uint64_t fnv1a_64(const uint8_t* data, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+ProbeCache& ProbeCache::instance() {
+    static ProbeCache cache;
+    return cache;
+}
+
+void ProbeCache::load(const std::string& cache_path) {
+    std::lock_guard<std::mutex> guard(lock);
+    path = cache_path;
+    entries = nlohmann::json::object();
+
+    std::ifstream in(path);
+    if (!in) {
+        return;
+    }
+    try {
+        nlohmann::json doc = nlohmann::json::parse(in);
+        if (doc.value("version", 0) == CACHE_VERSION && doc.contains("devices") && doc["devices"].is_object()) {
+            entries = doc["devices"];
+        }
+    } catch (const nlohmann::json::exception& e) {
+        log_debug() << "Ignoring probe cache " << path << ": " << e.what();
+    }
+}
+
+void ProbeCache::restore(const std::string& key, DeviceState& state) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (path.empty() || !entries.contains(key)) {
+        return;
+    }
+    try {
+        const nlohmann::json& entry = entries[key];
+        std::optional<Fingerprint> now = fingerprint(state.devpath);
+        if (!now || now->size != entry.at("size").get<uint64_t>() ||
+            now->first_sector != parse_hex64(entry.at("first_sector"))) {
+            log_debug() << "Probe cache entry for " << state.devpath << " is stale";
+            entries.erase(key);
+            return;
+        }
+        for (const auto& [name, value] : entry.at("strings").items()) {
+            state.memoized_strings[name] = value.get<std::string>();
+        }
+        for (const auto& [name, value] : entry.at("uint64").items()) {
+            state.memoized_uint64[name] = value.get<uint64_t>();
+        }
+        for (const auto& [name, value] : entry.at("bools").items()) {
+            state.memoized_bools[name] = value.get<bool>();
+        }
+        state.window_hash = parse_hex64(entry.at("window"));
+        log_debug() << "Probe cache hit for " << state.devpath;
+    } catch (const std::exception& e) {
+        log_debug() << "Ignoring probe cache entry for " << state.devpath << ": " << e.what();
+        entries.erase(key);
+    }
+}
+
+void ProbeCache::save(bool devices_changed) {
+    // Copied out: the reads below must not hold the lock, and a new
+    // registry state would take it again through restore
+    std::string cache_path;
+    nlohmann::json previous;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (path.empty()) {
+            return;
+        }
+        cache_path = path;
+        previous = entries;
+    }
+
+    nlohmann::json devices = nlohmann::json::object();
+    for (const auto& [key, entry] : previous.items()) {
+        if (key_still_valid(key)) {
+            devices[key] = entry;
+        }
+    }
+
+    for (const auto& state : DeviceRegistry::instance().states_snapshot()) {
+        std::lock_guard<std::recursive_mutex> state_guard(state->lock);
+        if (state->key.empty() || !std::filesystem::exists(state->devpath) ||
+            (state->memoized_strings.empty() && state->memoized_uint64.empty() && state->memoized_bools.empty())) {
+            continue;
+        }
+        try {
+            std::optional<Fingerprint> now = fingerprint(state->devpath);
+            if (!now) {
+                continue;
+            }
+            // The window the results came from, if the run read one;
+            // the registry isn't asked, it would make new states
+            std::optional<uint64_t> window_hash;
+            auto window = state->memoized_buffers.find("probe_window");
+            if (window != state->memoized_buffers.end()) {
+                window_hash = fnv1a_64(window->second->data(), window->second->size());
+            } else if (state->window_hash) {
+                // Restored and not checked yet
+                window_hash = state->window_hash;
+            }
+            std::optional<uint64_t> window_now;
+            if (!window_hash || devices_changed) {
+                window_now = current_window_hash(state->devpath);
+            }
+            if (!window_hash) {
+                window_hash = window_now;
+            }
+            if (!window_hash) {
+                continue;
+            }
+            if (devices_changed) {
+                auto size = state->memoized_uint64.find("size");
+                if (window_now != window_hash ||
+                    (size != state->memoized_uint64.end() && size->second != now->size)) {
+                    log_debug() << "Not caching " << state->devpath << ", it changed during the run";
+                    devices.erase(state->key);
+                    continue;
+                }
+            }
+            // A dm table isn't in the device's data, the checks above
+            // can't tell it went stale
+            auto strings = state->memoized_strings;
+            strings.erase("dm_table");
+            devices[state->key] = {
+                    {"size", now->size},
+                    {"first_sector", hex64(now->first_sector)},
+                    {"window", hex64(*window_hash)},
+                    {"strings", strings},
+                    {"uint64", state->memoized_uint64},
+                    {"bools", state->memoized_bools},
+            };
+        } catch (const std::exception& e) {
+            log_debug() << "Not caching " << state->devpath << ": " << e.what();
+        }
+    }
+
+    // Same as the metrics file: a reader never sees a partial file
+    std::string tmp = cache_path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << nlohmann::json{{"version", CACHE_VERSION}, {"devices", devices}}.dump() << "\n";
+        if (!out) {
+            log_warning() << "Failed to write probe cache " << tmp;
+            return;
+        }
+    }
+    if (std::rename(tmp.c_str(), cache_path.c_str()) != 0) {
+        log_warning() << "Failed to replace probe cache " << cache_path << ": " << std::strerror(errno);
+    }
+}
+
+void ProbeCache::forget(const std::string& key) {
+    std::lock_guard<std::mutex> guard(lock);
+    entries.erase(key);
+}
+
+} // namespace blocks
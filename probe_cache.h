@@ -0,0 +1,57 @@
+#ifndef PROBE_CACHE_H
+#define PROBE_CACHE_H
+
+#include "block_device.h"
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <nlohmann/json.hpp>
+
+namespace blocks {
+
+// 64-bit FNV-1a, stable across builds
+uint64_t fnv1a_64(const uint8_t* data, size_t len);
+
+// BlockDevice probe results kept between runs in a file (--probe-cache),
+// so a run on a quiescent host doesn't start cold. Entries are keyed like
+// DeviceRegistry's states, by dev_t and diskseq (or an image file's
+// inode), and hold the device's size and hashes of its first sector and
+// probe window. A new state takes an entry's results after re-reading
+// only the size and the first sector; the window hash is checked when
+// the run reads the window anyway, and drops the results on a mismatch.
+// Changes behind blocks' back that leave the first sector, the size and
+// the diskseq alone aren't noticed until then.
+class ProbeCache {
+public:
+    static ProbeCache& instance();
+
+    // A missing or unreadable file just starts an empty cache
+    void load(const std::string& path);
+    bool enabled() const { return !path.empty(); }
+
+    // Fills a new state's memos from a still-valid entry
+    void restore(const std::string& key, DeviceState& state);
+
+    // Writes the states the registry holds, and the entries this run
+    // didn't touch whose device still exists. After a run that may have
+    // changed devices, a state is only kept if its device still reads
+    // back the size and probe window its results came from.
+    void save(bool devices_changed);
+    // Drops a device the run changed, e.g. on DeviceRegistry::invalidate
+    void forget(const std::string& key);
+
+    ProbeCache(const ProbeCache&) = delete;
+    ProbeCache& operator=(const ProbeCache&) = delete;
+
+private:
+    ProbeCache() = default;
+
+    std::string path;
+    std::mutex lock;
+    nlohmann::json entries = nlohmann::json::object();
+};
+
+} // namespace blocks
+
+#endif // PROBE_CACHE_H
@@ -0,0 +1,400 @@
+#include "raid_operations.h"
+#include "block_stack.h"
+#include "md_superblock.h"
+#include "host_paths.h"
+#include "metrics.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace blocks {
+
+namespace {
+
+// The md set name: the device's name, without what mdadm won't take
+std::string md_name_for(const BlockDevice& device) {
+    std::string name = std::filesystem::path(device.devpath).filename().string();
+    for (auto& c : name) {
+        if (!std::isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_') {
+            c = '_';
+        }
+    }
+    return "blocks-" + name;
+}
+
+std::vector<uint8_t> read_at(const std::string& devpath, uint64_t offset, size_t size) {
+    int fd = open(devpath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open " + devpath + ": " + std::strerror(errno));
+    }
+    std::vector<uint8_t> buf(size);
+    ssize_t len = pread(fd, buf.data(), size, offset);
+    int err = errno;
+    close(fd);
+    if (len < 0) {
+        throw std::runtime_error("Failed to read " + devpath + ": " + std::strerror(err));
+    }
+    buf.resize(len);
+    Metrics::instance().bytes_read.add(len);
+    return buf;
+}
+
+void write_sysfs(const std::string& path, uint64_t value) {
+    std::ofstream out(path);
+    if (!out) {
+        throw std::runtime_error("Failed to open " + path);
+    }
+    out << value << std::endl;
+    if (!out) {
+        throw std::runtime_error("Failed to write " + path);
+    }
+}
+
+// The VG and LV names of a logical volume
+std::pair<std::string, std::string> lv_names(const BlockDevice& device, ProgressListener& progress) {
+    std::istringstream lv_info(exec_command(
+            "lvm lvs --noheadings -o vg_name,lv_name -- " + device.devpath));
+    std::string vgname, lvname;
+    lv_info >> vgname >> lvname;
+    if (lvname.empty()) {
+        progress.bail("Can't find the volume group of " + device.devpath,
+                      std::runtime_error("No LV information"));
+    }
+    return {vgname, lvname};
+}
+
+// Makes devpath a PV of vgname, unless it already is one
+void add_to_vg(const std::string& vgname, const std::string& devpath, ProgressListener& progress) {
+    // An orphan PV lists its name alone, a device that isn't a PV nothing
+    std::istringstream pv_info(exec_command(
+            "lvm pvs --noheadings -o pv_name,vg_name -- " + devpath + " 2>/dev/null"));
+    std::string pv_name, pv_vgname;
+    pv_info >> pv_name >> pv_vgname;
+    if (!pv_vgname.empty() && pv_vgname != vgname) {
+        progress.bail(devpath + " belongs to another volume group, " + pv_vgname,
+                      std::runtime_error("PV in use"));
+    }
+
+    if (pv_name.empty()) {
+        log_progress() << "Preparing " << devpath << " as a physical volume... ";
+        quiet_call({"lvm", "pvcreate", "--", devpath});
+        log_info() << "ok";
+    }
+    if (pv_vgname.empty()) {
+        quiet_call({"lvm", "vgextend", "--", vgname, devpath});
+    }
+}
+
+// Applies --sync-speed-min/max to a raid LV
+void set_recovery_rates(const std::string& lv, const CommandArgs& args) {
+    std::vector<std::string> rates = {"lvm", "lvchange"};
+    if (args.sync_speed_min) {
+        rates.insert(rates.end(), {"--minrecoveryrate", std::to_string(args.sync_speed_min) + "k"});
+    }
+    if (args.sync_speed_max) {
+        rates.insert(rates.end(), {"--maxrecoveryrate", std::to_string(args.sync_speed_max) + "k"});
+    }
+    if (rates.size() > 2) {
+        rates.insert(rates.end(), {"--", lv});
+        quiet_call(rates);
+    }
+}
+
+struct LvLayout {
+    std::string segtype;
+    uint32_t data_stripes = 0;
+    uint64_t stripe_size = 0;   // Bytes, 0 when linear
+    double sync_percent = 100;  // Only meaningful for raid
+    std::string sync_action;    // idle, resync, recover, reshape...
+};
+
+// One row per segment; a restripe needs them all alike
+LvLayout lv_layout(const std::string& lv, ProgressListener& progress) {
+    std::istringstream rows(exec_command(
+            "lvm lvs --noheadings --units=b --nosuffix --separator : "
+            "-o segtype,data_stripes,stripe_size,sync_percent,raid_sync_action -- " + lv));
+    std::string line;
+    std::string first;
+    LvLayout layout;
+    while (std::getline(rows, line)) {
+        auto fields = split_fields(line, ':');
+        if (fields.size() < 5) {
+            continue;
+        }
+        std::string shape = fields[0] + ":" + fields[1] + ":" + fields[2];
+        if (first.empty()) {
+            first = shape;
+            layout.segtype = fields[0];
+            layout.data_stripes = fields[1].empty() ? 1 : std::stoul(fields[1]);
+            layout.stripe_size = fields[2].empty() ? 0 : std::stoull(fields[2]);
+            layout.sync_percent = fields[3].empty() ? 100 : std::stod(fields[3]);
+            layout.sync_action = fields[4];
+        } else if (shape != first) {
+            progress.bail(lv + " has segments of different layouts, can't restripe it",
+                          std::runtime_error("Mixed segments"));
+        }
+    }
+    if (first.empty()) {
+        progress.bail("Can't read the layout of " + lv, std::runtime_error("No LV information"));
+    }
+    return layout;
+}
+
+// Polls until the raid LV is in sync and no longer reshaping. md keeps
+// going if we're interrupted; the next run waits here again.
+void wait_for_sync(const std::string& lv, ProgressListener& progress) {
+    int reported = -1;
+    for (;;) {
+        LvLayout layout = lv_layout(lv, progress);
+        bool busy = layout.sync_action != "idle" && !layout.sync_action.empty();
+        if (layout.sync_percent >= 100 && !busy) {
+            return;
+        }
+        int decile = static_cast<int>(layout.sync_percent / 10);
+        if (decile != reported) {
+            reported = decile;
+            progress.notify(lv + ": " + (layout.sync_action.empty() ? "sync" : layout.sync_action) + " " +
+                            std::to_string(static_cast<int>(layout.sync_percent)) + "%");
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+    }
+}
+
+// PVs of the VG that LVM may still allocate extents on
+unsigned allocatable_pvs(const std::string& vgname) {
+    // pv_attr starts with 'a' for an allocatable PV
+    std::istringstream rows(exec_command(
+            "lvm pvs --noheadings --units=b --nosuffix --separator : "
+            "-o pv_attr,pv_free -S vg_name=" + vgname));
+    unsigned count = 0;
+    for (std::string line; std::getline(rows, line);) {
+        auto fields = split_fields(line, ':');
+        if (fields.size() >= 2 && !fields[0].empty() && fields[0][0] == 'a' &&
+            !fields[1].empty() && std::stoull(fields[1]) > 0) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+void lvconvert(const std::string& lv, const std::vector<std::string>& options, const std::vector<std::string>& pvs,
+               const std::string& step) {
+    log_progress() << step << "... ";
+    std::vector<std::string> cmd = {"lvm", "lvconvert", "-y"};
+    cmd.insert(cmd.end(), options.begin(), options.end());
+    cmd.insert(cmd.end(), {"--", lv});
+    cmd.insert(cmd.end(), pvs.begin(), pvs.end());
+    quiet_call(cmd);
+    log_info() << "ok";
+}
+
+} // namespace
+
+int lv_to_raid1(BlockDevice device, BlockDevice mirror, const CommandArgs& args, ProgressListener& progress) {
+    auto [vgname, lvname] = lv_names(device, progress);
+    std::string lv = vgname + "/" + lvname;
+    add_to_vg(vgname, mirror.devpath, progress);
+
+    lvconvert(lv, {"--type", "raid1", "-m", "1"}, {mirror.devpath}, "Converting " + lv + " to raid1");
+    set_recovery_rates(lv, args);
+
+    log_info() << "Resyncing onto " << mirror.devpath << ", see lvs -o +sync_percent " << vgname;
+    return 0;
+}
+
+int dev_to_md_raid1(BlockDevice device, BlockDevice mirror, const CommandArgs& args, ProgressListener& progress) {
+    uint64_t super_offset = md_v1_0_superblock_offset(device.size());
+    // The data ends where the superblock starts
+    uint64_t data_size = super_offset;
+
+    if (md_v1_0_superblock_offset(mirror.size()) < data_size) {
+        progress.bail("Mirror " + mirror.devpath + " is smaller than " + device.devpath,
+                      std::runtime_error("Mirror too small"));
+    }
+    if (has_md_magic(read_at(device.devpath, super_offset, MD_SB_AREA_SIZE))) {
+        progress.bail("Device " + device.devpath + " already has an md superblock",
+                      std::runtime_error("Existing md member"));
+    }
+
+    std::string name = md_name_for(device);
+    std::string md_devpath = dev_path("md/" + name);
+    auto sb = raid1_sole_member(device.size(), data_size, name);
+    auto sb_bytes = encode_md_superblock(sb);
+
+    BlockStack block_stack = get_block_stack(device, progress);
+    block_stack.read_superblocks();
+    block_stack.record_layer_sizes("before");
+    block_stack.stack_reserve_end_area(data_size, progress);
+    block_stack.record_layer_sizes("after");
+    {
+        // The data comes back through the md device
+        ScopedTimer offline(Metrics::instance().offline_seconds);
+        block_stack.deactivate();
+
+        {
+            auto fd = device.open_excl_ctx();
+            log_progress() << "Writing the md superblock... ";
+            if (pwrite(fd, sb_bytes.data(), sb_bytes.size(), super_offset)
+                    != static_cast<ssize_t>(sb_bytes.size())) {
+                throw std::runtime_error("Failed to write the md superblock to " + device.devpath);
+            }
+            if (fsync(fd) != 0) {
+                throw std::runtime_error("Failed to sync " + device.devpath);
+            }
+            Metrics::instance().bytes_written.add(sb_bytes.size());
+            log_info() << "ok";
+        }
+
+        log_progress() << "Assembling " << md_devpath << "... ";
+        quiet_call({"mdadm", "--assemble", md_devpath, "--run", "--", device.devpath});
+        log_info() << "ok";
+    }
+
+    // Before the mirror is added, so the resync starts throttled
+    BlockDevice md_device(md_devpath);
+    if (args.sync_speed_min) {
+        write_sysfs(md_device.sysfspath() + "/md/sync_speed_min", args.sync_speed_min);
+    }
+    if (args.sync_speed_max) {
+        write_sysfs(md_device.sysfspath() + "/md/sync_speed_max", args.sync_speed_max);
+    }
+
+    log_progress() << "Adding " << mirror.devpath << " to the mirror... ";
+    quiet_call({"mdadm", "--manage", md_devpath, "--add", "--", mirror.devpath});
+    log_info() << "ok";
+
+    log_info() << "Use " << md_devpath << " from now on; the resync shows in " << proc_path("mdstat");
+    return 0;
+}
+
+int cmd_to_raid1(const CommandArgs& args) {
+    BlockDevice device(args.device);
+    CLIProgressHandler progress;
+
+    if (args.mirror.empty()) {
+        log_error() << "Missing --mirror device";
+        return 1;
+    }
+    BlockDevice mirror(args.mirror);
+    if (mirror.devnum() == device.devnum()) {
+        log_error() << "Device " << device.devpath << " can't mirror itself";
+        return 1;
+    }
+    if (args.sync_speed_min && args.sync_speed_max && args.sync_speed_min > args.sync_speed_max) {
+        log_error() << "--sync-speed-min is above --sync-speed-max";
+        return 1;
+    }
+
+    // Whatever is on the mirror gets overwritten, make sure nothing uses it
+    {
+        auto fd = mirror.open_excl_ctx();
+    }
+
+    if (device.is_lv()) {
+        LVMReq::require(progress);
+        return lv_to_raid1(device, mirror, args, progress);
+    }
+    MdadmReq::require(progress);
+    return dev_to_md_raid1(device, mirror, args, progress);
+}
+
+int cmd_restripe(const CommandArgs& args) {
+    BlockDevice device(args.device);
+    CLIProgressHandler progress;
+
+    if (!device.is_lv()) {
+        log_error() << "Device " << device.devpath << " is not a logical volume";
+        return 1;
+    }
+    if (args.stripes < 2) {
+        log_error() << "--stripes must be 2 or more";
+        return 1;
+    }
+    // LVM's default
+    uint64_t stripe_size = args.stripe_size ? args.stripe_size : 64 * 1024;
+    if (stripe_size < 4096 || (stripe_size & (stripe_size - 1))) {
+        log_error() << "--stripe-size must be a power of two, 4KiB or more";
+        return 1;
+    }
+    std::string stripes = std::to_string(args.stripes);
+    std::string stripe_kib = std::to_string(stripe_size / 1024) + "k";
+
+    LVMReq::require(progress);
+    auto [vgname, lvname] = lv_names(device, progress);
+    std::string lv = vgname + "/" + lvname;
+    for (const auto& pv : args.pvs) {
+        add_to_vg(vgname, pv, progress);
+    }
+
+    // raid5_n with N data stripes has N + 1 images, each on its own PV,
+    // and the reshape needs free space on all of them. Check before the
+    // first conversion rather than fail halfway, at the reshape.
+    LvLayout start = lv_layout(lv, progress);
+    bool restriped = start.data_stripes == args.stripes && start.stripe_size == stripe_size;
+    if (start.segtype == "linear" ||
+        (start.segtype == "striped" && start.data_stripes <= args.stripes && !restriped)) {
+        unsigned pvs = allocatable_pvs(vgname);
+        if (pvs < args.stripes + 1) {
+            progress.bail("Restriping to " + stripes + " stripes goes through raid5_n, which needs " +
+                          std::to_string(args.stripes + 1) + " PVs with free space in " + vgname + "; it has " +
+                          std::to_string(pvs), std::runtime_error("Not enough PVs"));
+        }
+    }
+
+    // Each pass makes one step towards striped, with the copy in between
+    // done by dm-raid; the LV stays usable throughout.
+    // linear -> raid1 -> raid5_n -> reshaped raid5_n -> striped
+    // striped -> raid5_n -> reshaped raid5_n -> striped
+    for (;;) {
+        LvLayout layout = lv_layout(lv, progress);
+        bool shaped = layout.data_stripes == args.stripes && layout.stripe_size == stripe_size;
+        log_debug() << lv << ": " << layout.segtype << ", " << layout.data_stripes << " stripes of "
+                    << layout.stripe_size << " bytes";
+
+        if (layout.segtype == "striped" && shaped) {
+            break;
+        } else if (layout.segtype == "raid1" || layout.segtype == "raid5_n") {
+            // Whatever the last run left going has to finish first
+            set_recovery_rates(lv, args);
+            wait_for_sync(lv, progress);
+        }
+
+        if (layout.segtype == "linear") {
+            lvconvert(lv, {"--type", "raid1", "-m", "1"}, args.pvs, "Mirroring " + lv);
+        } else if (layout.segtype == "striped") {
+            if (layout.data_stripes > args.stripes) {
+                progress.bail(lv + " has " + std::to_string(layout.data_stripes) +
+                              " stripes; restripe only adds stripes", std::runtime_error("Fewer stripes"));
+            }
+            lvconvert(lv, {"--type", "raid5_n"}, args.pvs, "Adding parity to " + lv);
+        } else if (layout.segtype == "raid1") {
+            lvconvert(lv, {"--type", "raid5_n"}, {}, "Taking " + lv + " over to raid5_n");
+        } else if (layout.segtype == "raid5_n" && !shaped) {
+            if (layout.data_stripes > args.stripes) {
+                progress.bail(lv + " has " + std::to_string(layout.data_stripes) +
+                              " stripes; restripe only adds stripes", std::runtime_error("Fewer stripes"));
+            }
+            lvconvert(lv, {"--stripes", stripes, "--stripesize", stripe_kib}, args.pvs,
+                      "Reshaping " + lv + " to " + stripes + " stripes");
+        } else if (layout.segtype == "raid5_n") {
+            lvconvert(lv, {"--type", "striped"}, {}, "Dropping the parity of " + lv);
+        } else {
+            progress.bail(lv + " is " + layout.segtype + ", restripe handles linear, striped and its own "
+                          "intermediate raid1 and raid5_n layouts", std::runtime_error("Unsupported layout"));
+        }
+    }
+
+    device.reset_size();
+    log_info() << lv << " is striped over " << args.stripes << " PVs, "
+               << stripe_size / 1024 << "KiB per stripe";
+    return 0;
+}
+
+} // namespace blocks
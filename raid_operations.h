@@ -0,0 +1,28 @@
+#ifndef RAID_OPERATIONS_H
+#define RAID_OPERATIONS_H
+
+#include "blocks_types.h"
+#include "block_device.h"
+#include "lvm_operations.h"
+#include <string>
+
+namespace blocks {
+
+// Mirror a logical volume onto another device with LVM raid1
+int lv_to_raid1(BlockDevice device, BlockDevice mirror, const CommandArgs& args, ProgressListener& progress);
+
+// Turn a device into a degraded md raid1 with a 1.0 superblock at its
+// end, then add the mirror so md copies the data over
+int dev_to_md_raid1(BlockDevice device, BlockDevice mirror, const CommandArgs& args, ProgressListener& progress);
+
+// Command handler for raid1 conversion
+int cmd_to_raid1(const CommandArgs& args);
+
+// Take an LV to args.stripes stripes of args.stripe_size, online, through
+// LVM's raid takeover and reshape. Each step is LVM's own; run again after
+// an interruption, it picks up from the LV's current layout.
+int cmd_restripe(const CommandArgs& args);
+
+} // namespace blocks
+
+#endif // RAID_OPERATIONS_H
@@ -0,0 +1,513 @@
+#include "relocation.h"
+#include "block_device.h"
+#include "buffer_arena.h"
+#include "host_paths.h"
+#include "metrics.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace blocks {
+
+namespace {
+
+// Enough for the logical block size of any device we handle
+constexpr uint64_t DIRECT_ALIGN = 4096;
+
+struct FdCloser {
+    int fd;
+    ~FdCloser() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+// Opens with O_DIRECT if asked and supported (tmpfs isn't), else buffered
+int open_for_copy(const std::string& path, int flags, bool direct) {
+    if (direct) {
+        int fd = open(path.c_str(), flags | O_DIRECT | O_CLOEXEC);
+        if (fd >= 0 || errno != EINVAL) {
+            if (fd < 0) {
+                throw std::runtime_error("Failed to open " + path + ": " + std::strerror(errno));
+            }
+            return fd;
+        }
+    }
+    int fd = open(path.c_str(), flags | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open " + path + ": " + std::strerror(errno));
+    }
+    return fd;
+}
+
+// Spaces out chunks so that all workers together stay under a rate
+class Throttle {
+public:
+    explicit Throttle(uint64_t rate) : rate(rate), next(std::chrono::steady_clock::now()) {}
+
+    void take(uint64_t bytes) {
+        if (!rate) {
+            return;
+        }
+        std::chrono::steady_clock::time_point start;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            start = std::max(std::chrono::steady_clock::now(), next);
+            next = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(static_cast<double>(bytes) / rate));
+        }
+        std::this_thread::sleep_until(start);
+    }
+
+private:
+    uint64_t rate;
+    std::mutex mutex;
+    std::chrono::steady_clock::time_point next;
+};
+
+void read_fully(int fd, uint8_t* buf, uint64_t len, uint64_t offset, const std::string& path) {
+    uint64_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("Failed to read " + path + " at " + std::to_string(offset + done) + ": " +
+                                     (n < 0 ? std::strerror(errno) : "end of device"));
+        }
+        done += n;
+    }
+}
+
+void write_fully(int fd, const uint8_t* buf, uint64_t len, uint64_t offset, const std::string& path) {
+    uint64_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("Failed to write " + path + " at " + std::to_string(offset + done) + ": " +
+                                     (n < 0 ? std::strerror(errno) : "end of device"));
+        }
+        done += n;
+    }
+}
+
+// Whether a kernel method failed because it doesn't apply to these
+// files, rather than on an I/O error
+bool unsupported(int err) {
+    return err == EINVAL || err == EXDEV || err == EOPNOTSUPP || err == ENOSYS || err == EBADF;
+}
+
+// A worker's pipe for splice
+struct Pipe {
+    int fds[2] = {-1, -1};
+
+    Pipe() {
+        if (pipe2(fds, O_CLOEXEC) != 0) {
+            throw std::runtime_error(std::string("Failed to create a pipe: ") + std::strerror(errno));
+        }
+    }
+    ~Pipe() {
+        for (int fd : fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+    // Fewer round trips with a larger pipe; the default is 64KiB
+    void grow(uint64_t size) {
+        fcntl(fds[1], F_SETPIPE_SZ, static_cast<int>(std::min<uint64_t>(size, 1024 * 1024)));
+    }
+};
+
+// Returns false, having copied nothing, if the method doesn't work on
+// these files
+bool copy_chunk_file_range(int src_fd, uint64_t src_off, int dst_fd, uint64_t dst_off, uint64_t len,
+                           const std::string& src, const std::string& dst) {
+    uint64_t done = 0;
+    while (done < len) {
+        loff_t in = src_off + done;
+        loff_t out = dst_off + done;
+        ssize_t n = copy_file_range(src_fd, &in, dst_fd, &out, len - done, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && done == 0 && unsupported(errno)) {
+            return false;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("Failed to copy " + src + " at " + std::to_string(src_off + done) + " to " +
+                                     dst + ": " + (n < 0 ? std::strerror(errno) : "end of device"));
+        }
+        done += n;
+    }
+    return true;
+}
+
+bool copy_chunk_splice(Pipe& pipe, int src_fd, uint64_t src_off, int dst_fd, uint64_t dst_off, uint64_t len,
+                       const std::string& src, const std::string& dst) {
+    uint64_t done = 0;
+    while (done < len) {
+        loff_t in = src_off + done;
+        ssize_t filled = splice(src_fd, &in, pipe.fds[1], nullptr, len - done, SPLICE_F_MOVE);
+        if (filled < 0 && errno == EINTR) {
+            continue;
+        }
+        if (filled < 0 && done == 0 && unsupported(errno)) {
+            return false;
+        }
+        if (filled <= 0) {
+            throw std::runtime_error("Failed to read " + src + " at " + std::to_string(src_off + done) + ": " +
+                                     (filled < 0 ? std::strerror(errno) : "end of device"));
+        }
+        // Drain the pipe completely, it must be empty for the next read
+        ssize_t drained = 0;
+        while (drained < filled) {
+            loff_t out = dst_off + done + drained;
+            ssize_t n = splice(pipe.fds[0], nullptr, dst_fd, &out, filled - drained, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                throw std::runtime_error("Failed to write " + dst + " at " + std::to_string(dst_off + done + drained) +
+                                         ": " + (n < 0 ? std::strerror(errno) : "end of device"));
+            }
+            drained += n;
+        }
+        done += filled;
+    }
+    return true;
+}
+
+// A worker's chunks, by index
+struct WorkQueue {
+    std::mutex mutex;
+    std::deque<uint64_t> chunks;
+};
+
+// blk-mq lists a device's hardware queues under mq/; a partition has its
+// disk's, and a device-mapper device is held to the fewest of its slaves'
+unsigned sysfs_hw_queues(const std::filesystem::path& dir, int depth) {
+    std::error_code ec;
+    if (std::filesystem::exists(dir / "partition", ec)) {
+        return sysfs_hw_queues(std::filesystem::canonical(dir, ec).parent_path(), depth);
+    }
+    unsigned queues = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(dir / "mq", ec)) {
+        if (entry.is_directory(ec)) {
+            ++queues;
+        }
+    }
+    if (queues || depth > 8) {
+        return queues;
+    }
+    unsigned fewest = 0;
+    for (const auto& slave : std::filesystem::directory_iterator(dir / "slaves", ec)) {
+        unsigned n = sysfs_hw_queues(slave.path(), depth + 1);
+        if (n && (!fewest || n < fewest)) {
+            fewest = n;
+        }
+    }
+    return fewest;
+}
+
+} // namespace
+
+const char* copy_method_name(CopyMethod method) {
+    switch (method) {
+        case CopyMethod::Auto:
+            return "auto";
+        case CopyMethod::CopyFileRange:
+            return "copy_file_range";
+        case CopyMethod::Splice:
+            return "splice";
+        case CopyMethod::Buffered:
+            return "buffered";
+    }
+    return "unknown";
+}
+
+
+unsigned device_hw_queues(const std::string& devpath) {
+    struct stat st;
+    if (::stat(devpath.c_str(), &st) != 0 || (!S_ISBLK(st.st_mode) && !HostPaths::instance().is_fake())) {
+        return 0;
+    }
+    try {
+        return sysfs_hw_queues(BlockDevice(devpath).sysfspath(), 0);
+    } catch (const std::exception& e) {
+        log_debug() << "No queue count for " << devpath << ": " << e.what();
+        return 0;
+    }
+}
+
+CopyMethod copy_range(const std::string& src, uint64_t src_offset,
+                      const std::string& dst, uint64_t dst_offset,
+                      uint64_t len, const CopyOptions& options, ProgressListener& progress) {
+    bool overlap = src == dst && src_offset < dst_offset + len && dst_offset < src_offset + len;
+    uint64_t shift = dst_offset > src_offset ? dst_offset - src_offset : src_offset - dst_offset;
+    if (!len || (src == dst && !shift)) {
+        return options.method;
+    }
+
+    unsigned threads = options.threads;
+    if (!threads) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+        for (const auto& path : {src, dst}) {
+            unsigned queues = device_hw_queues(path);
+            if (queues) {
+                threads = std::min(threads, queues);
+            }
+        }
+    }
+    threads = std::min(threads, CopyOptions::MAX_THREADS);
+
+    uint64_t chunk_size = std::max<uint64_t>(options.chunk_size, DIRECT_ALIGN);
+    if (overlap) {
+        // A chunk must be no longer than the shift, else it would overwrite
+        // its own source; shorter still so a wave has work for every thread
+        chunk_size = std::min(chunk_size, std::max<uint64_t>(1, shift / threads));
+        if (chunk_size >= DIRECT_ALIGN) {
+            chunk_size -= chunk_size % DIRECT_ALIGN;
+        } else if (chunk_size >= 512) {
+            chunk_size -= chunk_size % 512;
+        }
+    }
+    uint64_t chunks = (len + chunk_size - 1) / chunk_size;
+    threads = static_cast<unsigned>(std::max<uint64_t>(1, std::min<uint64_t>(threads, chunks)));
+
+    // Overlapping ranges go in waves, from the end when shifting right and
+    // from the start when shifting left. A chunk only overwrites the source
+    // of chunks at least a shift further along, which belong to earlier
+    // waves, so the chunks of a wave are independent of each other and a
+    // wave only starts once the previous one is done.
+    bool backwards = overlap && dst_offset > src_offset;
+    uint64_t per_wave = overlap ? std::max<uint64_t>(1, shift / chunk_size) : chunks;
+    auto chunk_at = [&](uint64_t step) { return backwards ? chunks - 1 - step : step; };
+
+    // The kernel methods go through the page cache
+    FdCloser src_fd{open_for_copy(src, O_RDONLY, false)};
+    FdCloser dst_fd{open_for_copy(dst, O_WRONLY, false)};
+
+    // Settle the method on the first chunk
+    std::vector<CopyMethod> candidates;
+    if (options.method == CopyMethod::Auto) {
+        candidates = {CopyMethod::CopyFileRange, CopyMethod::Splice, CopyMethod::Buffered};
+    } else {
+        candidates = {options.method};
+    }
+    CopyMethod method = CopyMethod::Buffered;
+    uint64_t first_pos = chunk_at(0) * chunk_size;
+    uint64_t first = std::min(chunk_size, len - first_pos);
+    bool first_done = false;
+    for (CopyMethod candidate : candidates) {
+        method = candidate;
+        if (candidate == CopyMethod::CopyFileRange) {
+            first_done = copy_chunk_file_range(src_fd.fd, src_offset + first_pos, dst_fd.fd, dst_offset + first_pos,
+                                               first, src, dst);
+        } else if (candidate == CopyMethod::Splice) {
+            Pipe pipe;
+            pipe.grow(first);
+            first_done = copy_chunk_splice(pipe, src_fd.fd, src_offset + first_pos, dst_fd.fd, dst_offset + first_pos,
+                                           first, src, dst);
+        } else {
+            break;
+        }
+        if (first_done) {
+            break;
+        }
+        if (options.method != CopyMethod::Auto) {
+            throw std::runtime_error(std::string(copy_method_name(candidate)) + " doesn't work from " + src +
+                                     " to " + dst);
+        }
+    }
+    log_debug() << "Copying " << src << " to " << dst << " with " << copy_method_name(method) << " on "
+                << threads << " threads" << (overlap ? ", " + std::to_string(per_wave) + " chunks per wave" : "");
+    if (first_done) {
+        Metrics::instance().bytes_read.add(first);
+        Metrics::instance().bytes_written.add(first);
+    }
+
+    bool direct = method == CopyMethod::Buffered &&
+                  src_offset % DIRECT_ALIGN == 0 && dst_offset % DIRECT_ALIGN == 0 &&
+                  len % DIRECT_ALIGN == 0 && chunk_size % DIRECT_ALIGN == 0;
+    FdCloser src_direct{direct ? open_for_copy(src, O_RDONLY, true) : -1};
+    FdCloser dst_direct{direct ? open_for_copy(dst, O_WRONLY, true) : -1};
+    int src_io = direct ? src_direct.fd : src_fd.fd;
+    int dst_io = direct ? dst_direct.fd : dst_fd.fd;
+    bool kernel = method != CopyMethod::Buffered;
+
+    Throttle throttle(options.max_rate);
+    std::vector<WorkQueue> queues(threads);
+    std::atomic<uint64_t> copied{first_done ? first : 0};
+    std::atomic<bool> failed{false};
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    uint64_t wave = 0;
+    uint64_t pending = 0;
+    bool stop = false;
+
+    // Each worker starts on a run of neighbouring chunks in its own queue,
+    // and once that is empty takes from the far end of the others'
+    auto take = [&](unsigned self, uint64_t& chunk) {
+        for (unsigned k = 0; k < threads; ++k) {
+            WorkQueue& queue = queues[(self + k) % threads];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.chunks.empty()) {
+                if (k == 0) {
+                    chunk = queue.chunks.front();
+                    queue.chunks.pop_front();
+                } else {
+                    chunk = queue.chunks.back();
+                    queue.chunks.pop_back();
+                }
+                return true;
+            }
+        }
+        return false;
+    };
+
+    auto worker = [&](unsigned self) {
+        try {
+            IoBuffer buf;
+            std::unique_ptr<Pipe> pipe;
+            if (method == CopyMethod::Splice) {
+                pipe = std::make_unique<Pipe>();
+                pipe->grow(chunk_size);
+            } else if (!kernel) {
+                buf = BufferArena::instance().acquire(chunk_size);
+            }
+
+            uint64_t seen = 0;
+            for (;;) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    work_cv.wait(lock, [&] { return stop || wave != seen; });
+                    if (stop) {
+                        break;
+                    }
+                    seen = wave;
+                }
+                uint64_t i;
+                while (!failed && take(self, i)) {
+                    uint64_t pos = i * chunk_size;
+                    uint64_t size = std::min(chunk_size, len - pos);
+                    throttle.take(size);
+                    if (method == CopyMethod::CopyFileRange) {
+                        if (!copy_chunk_file_range(src_io, src_offset + pos, dst_io, dst_offset + pos, size, src,
+                                                   dst)) {
+                            throw std::runtime_error("copy_file_range stopped working from " + src + " to " + dst);
+                        }
+                    } else if (method == CopyMethod::Splice) {
+                        if (!copy_chunk_splice(*pipe, src_io, src_offset + pos, dst_io, dst_offset + pos, size, src,
+                                               dst)) {
+                            throw std::runtime_error("splice stopped working from " + src + " to " + dst);
+                        }
+                    } else {
+                        read_fully(src_io, buf.data(), size, src_offset + pos, src);
+                        write_fully(dst_io, buf.data(), size, dst_offset + pos, dst);
+                    }
+                    if (kernel) {
+                        // Keep the move from filling the page cache: the
+                        // source pages are done with, and the destination
+                        // ones get written back early so fsync finds less
+                        posix_fadvise(src_io, src_offset + pos, size, POSIX_FADV_DONTNEED);
+                        sync_file_range(dst_io, dst_offset + pos, size, SYNC_FILE_RANGE_WRITE);
+                    }
+                    Metrics::instance().bytes_read.add(size);
+                    Metrics::instance().bytes_written.add(size);
+                    copied += size;
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (--pending == 0) {
+                        done_cv.notify_one();
+                    }
+                }
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+            failed = true;
+            done_cv.notify_one();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 0; i < threads; ++i) {
+        pool.emplace_back(worker, i);
+    }
+
+    // Listeners aren't thread-safe, report from here
+    uint64_t reported = 0;
+    for (uint64_t begin = 0; begin < chunks && !failed; begin += per_wave) {
+        uint64_t from = begin == 0 && first_done ? 1 : begin;
+        uint64_t end = std::min(begin + per_wave, chunks);
+        if (from == end) {
+            continue;
+        }
+        // Counted before any chunk is queued, a worker still looking at
+        // the queues may take one right away
+        std::unique_lock<std::mutex> lock(mutex);
+        pending = end - from;
+        for (unsigned t = 0; t < threads; ++t) {
+            std::lock_guard<std::mutex> lock(queues[t].mutex);
+            for (uint64_t step = from + (end - from) * t / threads; step < from + (end - from) * (t + 1) / threads;
+                 ++step) {
+                queues[t].chunks.push_back(chunk_at(step));
+            }
+        }
+        ++wave;
+        work_cv.notify_all();
+        while (pending && !failed) {
+            done_cv.wait_for(lock, std::chrono::milliseconds(500));
+            uint64_t decile = copied * 10 / len;
+            if (decile > reported && decile < 10 && !failed) {
+                reported = decile;
+                progress.notify("Copied " + std::to_string(decile * 10) + "%");
+            }
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+        work_cv.notify_all();
+    }
+    for (auto& thread : pool) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    if (fsync(dst_io) != 0) {
+        throw std::runtime_error("Failed to sync " + dst + ": " + std::strerror(errno));
+    }
+    if (kernel) {
+        posix_fadvise(dst_io, dst_offset, len, POSIX_FADV_DONTNEED);
+    }
+    return method;
+}
+
+} // namespace blocks
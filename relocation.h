@@ -0,0 +1,58 @@
+#ifndef RELOCATION_H
+#define RELOCATION_H
+
+#include "blocks_types.h"
+#include <cstdint>
+#include <string>
+
+namespace blocks {
+
+// How copy_range moves the data. The kernel ones never bring it into
+// user memory: copy_file_range works between regular files (and may
+// share their extents), splice between anything, through a pipe.
+enum class CopyMethod {
+    Auto,  // The first of the others that works for the two files
+    CopyFileRange,
+    Splice,
+    Buffered,  // read and write, through O_DIRECT where aligned
+};
+
+const char* copy_method_name(CopyMethod method);
+
+struct CopyOptions {
+    // Worker threads, 0 for one per hardware queue of whichever of the
+    // two devices has the fewest (see device_hw_queues), or per CPU if
+    // fewer, up to MAX_THREADS
+    unsigned threads = 0;
+    // Bytes per second over all workers, 0 for no limit
+    uint64_t max_rate = 0;
+    // What a worker reads and writes at once
+    uint64_t chunk_size = 1024 * 1024;
+    // Anything but Auto fails rather than fall back
+    CopyMethod method = CopyMethod::Auto;
+
+    static constexpr unsigned MAX_THREADS = 8;
+};
+
+// The device's blk-mq hardware queues, from sysfs; 0 for a file or a
+// device that doesn't say
+unsigned device_hw_queues(const std::string& devpath);
+
+// Copies len bytes from src at src_offset to dst at dst_offset, chunk by
+// chunk on a pool of threads, then syncs dst. Each thread has a queue of
+// neighbouring chunks and takes from the others' once it runs dry. src
+// and dst may be the same device, and the ranges may overlap: the copy
+// then runs from the end when moving up and from the start when moving
+// down, in waves of chunks no longer than the shift, each wave waiting
+// for the one before. The first chunk settles the method. The kernel
+// methods drop the pages they went through from the page cache, and the
+// buffered one uses O_DIRECT when the offsets and length allow it, so a
+// large move doesn't push everything else out of the cache. Reports
+// progress every 10%; returns the method used.
+CopyMethod copy_range(const std::string& src, uint64_t src_offset,
+                const std::string& dst, uint64_t dst_offset,
+                uint64_t len, const CopyOptions& options, ProgressListener& progress);
+
+} // namespace blocks
+
+#endif // RELOCATION_H
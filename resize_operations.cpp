@@ -1,19 +1,61 @@
 #include "resize_operations.h"
 #include <iostream>
 #include <regex>
+#include <cmath>
 #include <complex>
 
 namespace blocks {
 
+uint64_t parse_size_arg(const std::string& size) {
+    // regex_match anchors both ends (std::regex has no \Z)
+    static const std::regex SIZE_RE("(\\d+)([bkmgtpe])?");
+    std::smatch match;
+
+    // Check if the size string matches the expected pattern
+    if (!std::regex_match(size, match, SIZE_RE)) {
+        throw std::invalid_argument(
+                "Size must be a decimal integer and a one-character unit suffix (bkmgtpe)");
+    }
+
+    // Convert the matched number (match[1]) to uint64_t
+    uint64_t val = std::stoull(match[1].str());
+
+    // Get the unit as a string; use "b" if no unit is matched
+    std::string unit = match[2].matched ? match[2].str() : "b";
+
+    // Define units as a std::string to use the find method
+    std::string units = "bkmgtpe";
+    size_t pos = units.find(unit[0]);
+
+    // Check if the unit is valid
+    if (pos == std::string::npos) {
+        throw std::invalid_argument("Invalid unit");
+    }
+
+    // Calculate the size by multiplying by 1024^pos
+    return val * static_cast<uint64_t>(std::pow(1024, pos));
+}
+
+DeviceResize device_resize(BlockDevice& device, uint64_t newsize, bool resize_device) {
+    if (!resize_device || newsize == device.size()) {
+        return DeviceResize::None;
+    }
+    return newsize > device.size() ? DeviceResize::Grow : DeviceResize::Shrink;
+}
+
+bool shrink_deactivates(BlockDevice& device) {
+    return device.is_partition();
+}
+
 int cmd_resize(const std::string& device_path, uint64_t newsize, bool resize_device, bool debug) {
     BlockDevice device(device_path);
     CLIProgressHandler progress;
 
     BlockStack block_stack = get_block_stack(device, progress);
 
-    int64_t device_delta = static_cast<int64_t>(newsize) - static_cast<int64_t>(device.size());
+    DeviceResize device_step = device_resize(device, newsize, resize_device);
 
-    if (device_delta > 0 && resize_device) {
+    if (device_step == DeviceResize::Grow) {
         device.dev_resize(newsize, false);
         // May have been rounded up for the sake of partition alignment
         // LVM rounds up as well (and its LV metadata uses PE units)
@@ -21,15 +63,19 @@ int cmd_resize(const std::string& device_path, uint64_t newsize, bool resize_dev
     }
 
     block_stack.read_superblocks();
+    block_stack.record_layer_sizes("before");
     assert(block_stack.total_data_size() <= device.size());
     int64_t data_delta = static_cast<int64_t>(newsize) - static_cast<int64_t>(block_stack.total_data_size());
     block_stack.stack_resize(newsize, data_delta < 0, progress);
 
-    if (device_delta < 0 && resize_device) {
+    block_stack.record_layer_sizes("after");
+
+    if (device_step == DeviceResize::Shrink) {
         uint64_t tds = block_stack.total_data_size();
-        // LVM should be able to reload in-use devices,
-        // but the kernel's partition handling can't.
-        if (device.is_partition()) {
+        block_stack.release_mounts();
+        std::optional<ScopedTimer> offline;
+        if (shrink_deactivates(device)) {
+            offline.emplace(Metrics::instance().offline_seconds);
             block_stack.deactivate();
         }
         device.dev_resize(tds, true);
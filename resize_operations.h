@@ -18,6 +18,19 @@ namespace blocks {
  */
 uint64_t parse_size_arg(const std::string& size);
 
+/**
+ * What a resize does to the device itself, for the command and its plan:
+ * grow it before growing the contents, or shrink it after shrinking them
+ */
+enum class DeviceResize { None, Grow, Shrink };
+DeviceResize device_resize(BlockDevice& device, uint64_t newsize, bool resize_device);
+
+/**
+ * Whether the contents are deactivated before shrinking the device; LVM
+ * reloads an LV in use, the kernel can't reload a partition that is
+ */
+bool shrink_deactivates(BlockDevice& device);
+
 /**
  * Resize a block device or filesystem
  * 
@@ -0,0 +1,212 @@
+#include "superblock.h"
+#include "swap_header.h"
+#include <cstdio>
+#include <cstring>
+
+namespace blocks {
+
+namespace {
+
+constexpr size_t NILFS_SB_OFFSET = 1024;
+constexpr size_t NILFS_SB_SUM_OFFSET = 0x10;
+constexpr size_t NILFS_SB_MIN_BYTES = 0x100;
+
+// 3.6 puts the superblock at 64k, the 3.5 layout at 8k
+constexpr size_t REISERFS_SB_OFFSETS[] = {64 * 1024, 8 * 1024};
+constexpr size_t REISERFS_SB_V1_SIZE = 76;
+constexpr size_t REISERFS_SB_V2_LABEL_END = 116;
+
+constexpr size_t EXT_SB_OFFSET = 1024;
+constexpr size_t BTRFS_SB_OFFSET = 64 * 1024;
+constexpr size_t LUKS_UUID_OFFSET = 168;
+constexpr size_t LUKS_UUID_LEN = 40;
+
+bool in_window(const std::vector<uint8_t>& window, size_t off, size_t len) {
+    return off + len <= window.size();
+}
+
+std::string fixed_string(const uint8_t* buf, size_t max_len) {
+    const char* str = reinterpret_cast<const char*>(buf);
+    return std::string(str, strnlen(str, max_len));
+}
+
+} // namespace
+
+std::string format_uuid(const uint8_t* bytes) {
+    static const uint8_t nil[16] = {};
+    if (std::memcmp(bytes, nil, sizeof(nil)) == 0) {
+        return "";
+    }
+    char buf[37];
+    std::snprintf(buf, sizeof(buf),
+                  "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+                  bytes[0], bytes[1], bytes[2], bytes[3], bytes[4], bytes[5], bytes[6], bytes[7],
+                  bytes[8], bytes[9], bytes[10], bytes[11], bytes[12], bytes[13], bytes[14], bytes[15]);
+    return buf;
+}
+
+uint32_t crc32_le(uint32_t crc, const uint8_t* buf, size_t len) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? (c >> 1) ^ 0xEDB88320U : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    for (size_t i = 0; i < len; ++i) {
+        crc = table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+std::optional<NilfsSuperblock> decode_nilfs2(const std::vector<uint8_t>& window) {
+    // struct nilfs_super_block, linux/nilfs2_ondisk.h
+    if (!in_window(window, NILFS_SB_OFFSET, NILFS_SB_MIN_BYTES)) {
+        return std::nullopt;
+    }
+    const uint8_t* sb = window.data() + NILFS_SB_OFFSET;
+    if (le16_at(sb, 0x06) != 0x3434) {
+        return std::nullopt;
+    }
+
+    NilfsSuperblock result;
+    result.block_size = 1ULL << (le32_at(sb, 0x14) + 10);
+    result.dev_size = le64_at(sb, 0x20);
+
+    // The checksum covers s_bytes bytes, with s_sum itself as zeroes
+    uint16_t bytes = le16_at(sb, 0x08);
+    result.crc_ok = false;
+    if (bytes >= NILFS_SB_SUM_OFFSET + 4 && in_window(window, NILFS_SB_OFFSET, bytes)) {
+        static const uint8_t zeroes[4] = {};
+        uint32_t crc = crc32_le(le32_at(sb, 0x0C), sb, NILFS_SB_SUM_OFFSET);
+        crc = crc32_le(crc, zeroes, sizeof(zeroes));
+        crc = crc32_le(crc, sb + NILFS_SB_SUM_OFFSET + 4, bytes - NILFS_SB_SUM_OFFSET - 4);
+        result.crc_ok = crc == le32_at(sb, NILFS_SB_SUM_OFFSET);
+    }
+    return result;
+}
+
+std::optional<ReiserfsSuperblock> decode_reiserfs(const std::vector<uint8_t>& window) {
+    // struct reiserfs_super_block_v1, reiserfsprogs' reiserfs_fs.h
+    for (size_t off : REISERFS_SB_OFFSETS) {
+        if (!in_window(window, off, REISERFS_SB_V1_SIZE)) {
+            continue;
+        }
+        const uint8_t* sb = window.data() + off;
+        const char* magic = reinterpret_cast<const char*>(sb + 52);
+        std::string magic_str(magic, strnlen(magic, 10));
+        if (magic_str != "ReIsErFs" && magic_str != "ReIsEr2Fs" && magic_str != "ReIsEr3Fs") {
+            continue;
+        }
+
+        ReiserfsSuperblock result;
+        result.block_count = le32_at(sb, 0);
+        result.block_size = le16_at(sb, 44);
+        result.magic = magic_str;
+        result.offset = off;
+        return result;
+    }
+    return std::nullopt;
+}
+
+std::optional<FsIdentity> identify_ext(const std::vector<uint8_t>& window) {
+    // struct ext2_super_block, e2fsprogs' ext2_fs.h
+    if (!in_window(window, EXT_SB_OFFSET, 1024)) {
+        return std::nullopt;
+    }
+    const uint8_t* sb = window.data() + EXT_SB_OFFSET;
+    if (le16_at(sb, 0x38) != 0xEF53) {
+        return std::nullopt;
+    }
+
+    // Same classification as blkid: anything ext3 doesn't know makes it ext4
+    constexpr uint32_t EXT3_INCOMPAT = 0x0002 | 0x0004 | 0x0010;  // filetype, recover, meta_bg
+    constexpr uint32_t EXT3_RO_COMPAT = 0x0001 | 0x0002 | 0x0004;  // sparse_super, large_file, btree_dir
+    uint32_t compat = le32_at(sb, 0x5C);
+    uint32_t incompat = le32_at(sb, 0x60);
+    uint32_t ro_compat = le32_at(sb, 0x64);
+
+    FsIdentity id;
+    if (incompat & 0x0008) {
+        id.type = "jbd";
+    } else if ((incompat & ~EXT3_INCOMPAT) || (ro_compat & ~EXT3_RO_COMPAT)) {
+        id.type = "ext4";
+    } else if (compat & 0x0004) {
+        id.type = "ext3";
+    } else {
+        id.type = "ext2";
+    }
+    id.uuid = format_uuid(sb + 0x68);
+    id.label = fixed_string(sb + 0x78, 16);
+    return id;
+}
+
+std::optional<FsIdentity> identify_xfs(const std::vector<uint8_t>& window) {
+    // struct xfs_dsb
+    if (!in_window(window, 0, 120) || std::memcmp(window.data(), "XFSB", 4) != 0) {
+        return std::nullopt;
+    }
+    return FsIdentity{"xfs", format_uuid(window.data() + 32), fixed_string(window.data() + 108, 12)};
+}
+
+std::optional<FsIdentity> identify_btrfs(const std::vector<uint8_t>& window) {
+    // struct btrfs_super_block
+    if (!in_window(window, BTRFS_SB_OFFSET, 0x12b + 256)) {
+        return std::nullopt;
+    }
+    const uint8_t* sb = window.data() + BTRFS_SB_OFFSET;
+    if (std::memcmp(sb + 0x40, "_BHRfS_M", 8) != 0) {
+        return std::nullopt;
+    }
+    return FsIdentity{"btrfs", format_uuid(sb + 0x20), fixed_string(sb + 0x12b, 256)};
+}
+
+std::optional<FsIdentity> identify_luks(const std::vector<uint8_t>& window) {
+    // LUKS1 and LUKS2 keep the uuid, as text, at the same offset
+    static const uint8_t LUKS_MAGIC[] = {'L', 'U', 'K', 'S', 0xba, 0xbe};
+    if (!in_window(window, 0, LUKS_UUID_OFFSET + LUKS_UUID_LEN) ||
+        std::memcmp(window.data(), LUKS_MAGIC, sizeof(LUKS_MAGIC)) != 0) {
+        return std::nullopt;
+    }
+    return FsIdentity{"crypto_LUKS", fixed_string(window.data() + LUKS_UUID_OFFSET, LUKS_UUID_LEN), ""};
+}
+
+std::optional<FsIdentity> identify_nilfs2(const std::vector<uint8_t>& window) {
+    auto sb = decode_nilfs2(window);
+    // blkid wants a good checksum too, a two-byte magic is weak
+    if (!sb || !sb->crc_ok) {
+        return std::nullopt;
+    }
+    const uint8_t* raw = window.data() + NILFS_SB_OFFSET;
+    return FsIdentity{"nilfs2", format_uuid(raw + 0x98), fixed_string(raw + 0xA8, 80)};
+}
+
+std::optional<FsIdentity> identify_reiserfs(const std::vector<uint8_t>& window) {
+    auto sb = decode_reiserfs(window);
+    if (!sb) {
+        return std::nullopt;
+    }
+    FsIdentity id{"reiserfs", "", ""};
+    // The 3.5 layout has neither
+    const uint8_t* raw = window.data() + sb->offset;
+    if (sb->magic != "ReIsErFs" && in_window(window, sb->offset, REISERFS_SB_V2_LABEL_END)) {
+        id.uuid = format_uuid(raw + 84);
+        id.label = fixed_string(raw + 100, 16);
+    }
+    return id;
+}
+
+std::optional<FsIdentity> identify_swap(const std::vector<uint8_t>& window) {
+    try {
+        SwapHeader header = decode_swap_header(window, "");
+        return FsIdentity{"swap", format_uuid(header.uuid().data()), header.label()};
+    } catch (const UnsupportedSuperblock&) {
+        return std::nullopt;
+    }
+}
+
+} // namespace blocks
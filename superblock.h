@@ -0,0 +1,58 @@
+#ifndef SUPERBLOCK_H
+#define SUPERBLOCK_H
+
+#include "blocks_types.h"
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace blocks {
+
+// In-process superblock decoders.
+// Each one works on a device's probe window (see BlockDevice::probe_window)
+// and returns nullopt when its magic isn't there.
+
+struct NilfsSuperblock {
+    uint64_t block_size;
+    uint64_t dev_size;
+    bool crc_ok;
+};
+
+struct ReiserfsSuperblock {
+    uint64_t block_size;
+    uint64_t block_count;
+    // "ReIsErFs" (3.5 layout), "ReIsEr2Fs" (3.6), "ReIsEr3Fs" (non-standard journal)
+    std::string magic;
+    size_t offset;
+};
+
+// What blkid would report as TYPE, UUID and LABEL
+struct FsIdentity {
+    std::string type;
+    std::string uuid;   // Lowercase, dashed; empty when unset
+    std::string label;
+};
+
+std::optional<NilfsSuperblock> decode_nilfs2(const std::vector<uint8_t>& window);
+std::optional<ReiserfsSuperblock> decode_reiserfs(const std::vector<uint8_t>& window);
+
+// Identity decoders, see LAYER_TYPES; nullopt when the superblock
+// isn't valid after all
+std::optional<FsIdentity> identify_ext(const std::vector<uint8_t>& window);
+std::optional<FsIdentity> identify_xfs(const std::vector<uint8_t>& window);
+std::optional<FsIdentity> identify_btrfs(const std::vector<uint8_t>& window);
+std::optional<FsIdentity> identify_nilfs2(const std::vector<uint8_t>& window);
+std::optional<FsIdentity> identify_reiserfs(const std::vector<uint8_t>& window);
+std::optional<FsIdentity> identify_swap(const std::vector<uint8_t>& window);
+std::optional<FsIdentity> identify_luks(const std::vector<uint8_t>& window);
+
+// 16 raw bytes as 8-4-4-4-12 hex; empty for the nil UUID
+std::string format_uuid(const uint8_t* bytes);
+
+// The kernel's crc32_le: reflected, no pre- or post-inversion
+uint32_t crc32_le(uint32_t crc, const uint8_t* buf, size_t len);
+
+} // namespace blocks
+
+#endif // SUPERBLOCK_H
@@ -0,0 +1,98 @@
+#include "swap_header.h"
+#include "metrics.h"
+#include <byteswap.h>
+#include <cstring>
+#include <unistd.h>
+
+namespace blocks {
+
+namespace {
+
+constexpr const char SWAP_MAGIC[] = "SWAPSPACE2";
+constexpr size_t SWAP_MAGIC_LEN = 10;
+
+void swap_info_bytes(SwapHeaderInfo& info) {
+    info.version = bswap_32(info.version);
+    info.last_page = bswap_32(info.last_page);
+    info.nr_badpages = bswap_32(info.nr_badpages);
+    for (auto& page : info.badpages) {
+        page = bswap_32(page);
+    }
+}
+
+} // namespace
+
+std::string SwapHeader::label() const {
+    return std::string(info.sws_volume, strnlen(info.sws_volume, sizeof(info.sws_volume)));
+}
+
+std::array<uint8_t, 16> SwapHeader::uuid() const {
+    std::array<uint8_t, 16> result;
+    std::memcpy(result.data(), info.sws_uuid, result.size());
+    return result;
+}
+
+SwapHeader decode_swap_header(const std::vector<uint8_t>& window, const std::string& devpath) {
+    SwapHeader header;
+
+    for (uint32_t page_size : SWAP_PAGE_SIZES) {
+        if (window.size() < page_size) {
+            break;
+        }
+        const char* magic = reinterpret_cast<const char*>(window.data()) + page_size - SWAP_MAGIC_LEN;
+        if (std::memcmp(magic, SWAP_MAGIC, SWAP_MAGIC_LEN) == 0) {
+            header.page_size = page_size;
+            break;
+        }
+    }
+
+    if (!header.page_size) {
+        // Might be suspend data
+        std::string magic;
+        if (window.size() >= 4096) {
+            magic.assign(reinterpret_cast<const char*>(window.data()) + 4096 - SWAP_MAGIC_LEN, SWAP_MAGIC_LEN);
+        }
+        throw UnsupportedSuperblock(devpath, {{"magic", magic}});
+    }
+
+    std::memcpy(&header.info, window.data() + SWAP_HEADER_INFO_OFFSET, sizeof(header.info));
+
+    // Version 1 is the only one; it tells us the byte order.
+    if (header.info.version != 1) {
+        uint32_t version0 = header.info.version;
+        swap_info_bytes(header.info);
+        if (header.info.version != 1) {
+            throw UnsupportedSuperblock(devpath, {{"version", std::to_string(std::min(version0, header.info.version))}});
+        }
+        header.big_endian = __BYTE_ORDER == __LITTLE_ENDIAN;
+    } else {
+        header.big_endian = __BYTE_ORDER == __BIG_ENDIAN;
+    }
+
+    if (!header.info.last_page) {
+        throw UnsupportedSuperblock(devpath, {{"last_page", "0"}});
+    }
+
+    return header;
+}
+
+void write_swap_last_page(int fd, const SwapHeader& header, uint32_t last_page) {
+    SwapHeaderInfo info = header.info;
+    info.last_page = last_page;
+
+    bool host_big_endian = __BYTE_ORDER == __BIG_ENDIAN;
+    if (header.big_endian != host_big_endian) {
+        swap_info_bytes(info);
+    }
+
+    ssize_t written = pwrite(fd, &info, sizeof(info), SWAP_HEADER_INFO_OFFSET);
+    if (written != static_cast<ssize_t>(sizeof(info))) {
+        throw std::runtime_error(std::string("Failed to write swap header: ") + std::strerror(errno));
+    }
+    Metrics::instance().bytes_written.add(sizeof(info));
+    if (fdatasync(fd) != 0) {
+        throw std::runtime_error(std::string("Failed to flush swap header: ") + std::strerror(errno));
+    }
+}
+
+} // namespace blocks
@@ -0,0 +1,57 @@
+#ifndef SWAP_HEADER_H
+#define SWAP_HEADER_H
+
+#include "blocks_types.h"
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace blocks {
+
+// The info part of union swap_header (linux/swap.h), which sits at
+// offset 1024 of the first page, in the byte order of the kernel that
+// ran mkswap. The magic takes the last 10 bytes of the first page.
+struct SwapHeaderInfo {
+    uint32_t version;
+    uint32_t last_page;
+    uint32_t nr_badpages;
+    uint8_t sws_uuid[16];
+    char sws_volume[16];
+    uint32_t padding[117];
+    uint32_t badpages[1];
+};
+static_assert(sizeof(SwapHeaderInfo) == 516, "swap header layout");
+
+constexpr uint64_t SWAP_HEADER_INFO_OFFSET = 1024;
+
+struct SwapHeader {
+    // Where the magic was found, also the unit of last_page
+    uint32_t page_size = 0;
+    bool big_endian = false;
+    // Host byte order
+    SwapHeaderInfo info = {};
+
+    std::string label() const;
+    std::array<uint8_t, 16> uuid() const;
+
+    // Size of the swap area in bytes
+    uint64_t area_size() const { return (static_cast<uint64_t>(info.last_page) + 1) * page_size; }
+};
+
+// The page sizes mkswap may have used: 4k (x86), 8k (sparc64, alpha,
+// some MIPS), 16k and 64k (ppc64, arm64)
+constexpr uint32_t SWAP_PAGE_SIZES[] = {4096, 8192, 16384, 65536};
+
+// Decode from the start of the device; throws UnsupportedSuperblock
+// for suspend images, unknown versions and empty areas.
+SwapHeader decode_swap_header(const std::vector<uint8_t>& window, const std::string& devpath);
+
+// Rewrite last_page in place, keeping the uuid, label and bad page
+// list. One pwrite of the header info, then a flush.
+void write_swap_last_page(int fd, const SwapHeader& header, uint32_t last_page);
+
+} // namespace blocks
+
+#endif // SWAP_HEADER_H
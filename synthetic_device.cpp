@@ -2,6 +2,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <cstring>
@@ -23,8 +24,8 @@ namespace blocks {
 
         assert(data.size() == writable_hdr_size + writable_end_size);
 
-        std::vector<uint8_t> start_data(data.begin(), data.begin() + writable_hdr_size);
-        std::vector<uint8_t> end_data(data.begin() + writable_hdr_size, data.end());
+        const uint8_t* start_data = data.data();
+        const uint8_t* end_data = data.data() + writable_hdr_size;
 
         uint64_t wrend_offset = writable_hdr_size + rz_size + shift_by;
         uint64_t size = writable_hdr_size + rz_size + writable_end_size;
@@ -47,40 +48,43 @@ namespace blocks {
             }
         }
 
-        std::cout << "Writing " << writable_hdr_size << " bytes to physical device at offset " << shift_by << "\n";
-        ssize_t written = pwrite(dev_fd, start_data.data(), writable_hdr_size, shift_by);
+        log_info() << "Writing " << writable_hdr_size << " bytes to physical device at offset " << shift_by;
+        ssize_t written = pwrite(dev_fd, start_data, writable_hdr_size, shift_by);
         if (written != static_cast<ssize_t>(writable_hdr_size)) {
-            std::cerr << "Failed to write to physical device: expected " << writable_hdr_size
-                      << " bytes, wrote " << written << " bytes, errno: " << strerror(errno) << "\n";
+            log_error() << "Failed to write to physical device: expected " << writable_hdr_size
+                      << " bytes, wrote " << written << " bytes, errno: " << strerror(errno);
             throw std::runtime_error("Write to physical device failed");
         }
+        Metrics::instance().bytes_written.add(writable_hdr_size);
 
-        std::vector<uint8_t> read_back(writable_hdr_size);
+        IoBuffer read_back = BufferArena::instance().acquire(std::max(writable_hdr_size, writable_end_size));
         ssize_t read_bytes = pread(dev_fd, read_back.data(), writable_hdr_size, shift_by);
         if (read_bytes != static_cast<ssize_t>(writable_hdr_size)) {
-            std::cerr << "Failed to read back from physical device: expected " << writable_hdr_size
-                      << " bytes, read " << read_bytes << " bytes\n";
+            log_error() << "Failed to read back from physical device: expected " << writable_hdr_size
+                      << " bytes, read " << read_bytes << " bytes";
             throw std::runtime_error("Read back from physical device failed");
         }
-        assert(memcmp(start_data.data(), read_back.data(), writable_hdr_size) == 0);
+        assert(memcmp(start_data, read_back.data(), writable_hdr_size) == 0);
+        Metrics::instance().bytes_verified.add(writable_hdr_size);
 
         if (writable_end_size != 0) {
-            std::cout << "Writing " << writable_end_size << " bytes to physical device at offset " << wrend_offset << "\n";
-            written = pwrite(dev_fd, end_data.data(), writable_end_size, wrend_offset);
+            log_info() << "Writing " << writable_end_size << " bytes to physical device at offset " << wrend_offset;
+            written = pwrite(dev_fd, end_data, writable_end_size, wrend_offset);
             if (written != static_cast<ssize_t>(writable_end_size)) {
-                std::cerr << "Failed to write end data to physical device: expected " << writable_end_size
-                          << " bytes, wrote " << written << " bytes, errno: " << strerror(errno) << "\n";
+                log_error() << "Failed to write end data to physical device: expected " << writable_end_size
+                          << " bytes, wrote " << written << " bytes, errno: " << strerror(errno);
                 throw std::runtime_error("Write end data to physical device failed");
             }
+            Metrics::instance().bytes_written.add(writable_end_size);
 
-            read_back.resize(writable_end_size);
             read_bytes = pread(dev_fd, read_back.data(), writable_end_size, wrend_offset);
             if (read_bytes != static_cast<ssize_t>(writable_end_size)) {
-                std::cerr << "Failed to read back end data: expected " << writable_end_size
-                          << " bytes, read " << read_bytes << " bytes\n";
+                log_error() << "Failed to read back end data: expected " << writable_end_size
+                          << " bytes, read " << read_bytes << " bytes";
                 throw std::runtime_error("Read back end data failed");
             }
-            assert(memcmp(end_data.data(), read_back.data(), writable_end_size) == 0);
+            assert(memcmp(end_data, read_back.data(), writable_end_size) == 0);
+            Metrics::instance().bytes_verified.add(writable_end_size);
         }
     }
 
@@ -118,6 +122,7 @@ namespace blocks {
 
         // Set up loopback device
         std::string cmd_output;
+        SubprocessTimer timer("losetup -f --show -- " + temp_file_path);
         FILE *pipe = popen(("losetup -f --show -- " + temp_file_path).c_str(), "r");
         if (!pipe) {
             unlink(temp_file_path.c_str());
@@ -156,7 +161,7 @@ namespace blocks {
         uuid_generate(uuid);
         uuid_unparse(uuid, uuid_str);
         synth_devname = "synthetic-" + std::string(uuid_str);
-        synth_devpath = "/dev/mapper/" + synth_devname;
+        synth_devpath = dev_path("mapper/" + synth_devname);
 
         // Calculate sectors
         uint64_t writable_sectors = bytes_to_sector(writable_hdr_size);
@@ -202,12 +207,7 @@ namespace blocks {
             try {
                 quiet_call(losetup_cmd);
             } catch (const std::exception &e) {
-                std::cerr << "Warning: Failed to detach loopback device: " << e.what() << std::endl;
-            }
-
-            // Remove the temporary file
-            if (unlink(temp_file_path.c_str()) != 0) {
-                std::cerr << "Warning: Failed to remove temporary file: " << temp_file_path << std::endl;
+                log_warning() << "Warning: Failed to detach loopback device: " << e.what();
             }
         };
 
@@ -228,14 +228,29 @@ namespace blocks {
             exit_callback = nullptr;
         }
 
+        if (temp_file_path.empty()) {
+            return;
+        }
+
         // Read the data from the temporary file before it's deleted
         if (device && std::filesystem::exists(temp_file_path)) {
             std::ifstream file(temp_file_path, std::ios::binary);
             if (file) {
-                device->data.resize(device->writable_hdr_size + device->writable_end_size);
+                device->data = BufferArena::instance().acquire(device->writable_hdr_size + device->writable_end_size);
                 file.read(reinterpret_cast<char *>(device->data.data()), device->data.size());
             }
         }
+
+        // Remove the temporary file
+        if (unlink(temp_file_path.c_str()) != 0) {
+            log_warning() << "Warning: Failed to remove temporary file: " << temp_file_path;
+        }
+        temp_file_path.clear();
+    }
+
+    std::unique_ptr<SyntheticDevice> SyntheticDeviceContext::release() {
+        cleanup();
+        return std::move(device);
     }
 
     SyntheticDevice *SyntheticDeviceContext::operator->() {
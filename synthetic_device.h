@@ -3,6 +3,7 @@
 
 #include "blocks_types.h"
 #include "block_device.h"
+#include "buffer_arena.h"
 #include <memory>
 #include <string>
 #include <functional>
@@ -21,7 +22,8 @@ public:
         bool other_device = false
     );
     
-    std::vector<uint8_t> data;
+    // The writable parts, header then end, once the context is gone
+    IoBuffer data;
     uint64_t writable_hdr_size;
     uint64_t rz_size;
     uint64_t writable_end_size;
@@ -34,6 +36,9 @@ public:
     
     SyntheticDevice* operator->();
     SyntheticDevice& operator*();
+
+    // Tears the devices down and hands over the device with its data
+    std::unique_ptr<SyntheticDevice> release();
     
 private:
     std::unique_ptr<SyntheticDevice> device;
@@ -0,0 +1,208 @@
+// relocate_segment_text and splice_table rewrite the metadata and the
+// tables of LVs in use; a wrong line there loses data, so check both on
+// input captured from vgcfgbackup and dmsetup table.
+
+#include "extent_migration.h"
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+template <typename F>
+void check_throws(F fn, const std::string& what) {
+    try {
+        fn();
+    } catch (const std::exception&) {
+        return;
+    }
+    check(false, what + " should have thrown");
+}
+
+// vgcfgbackup of a VG with two PVs; home has two segments on pv0
+const std::string VGCFG = R"(# Generated by LVM2 version 2.03.16(2) (2022-05-18): Fri Oct 16 09:12:44 2026
+
+contents = "Text Format Volume Group"
+version = 1
+
+description = "vgcfgbackup --file /tmp/blocks.Xq3f1z/vg.cfg -- vg0"
+
+creation_host = "host"	# Linux host 6.1.0-13-amd64 #1 SMP PREEMPT_DYNAMIC x86_64
+creation_time = 1792145564	# Fri Oct 16 09:12:44 2026
+
+vg0 {
+	id = "Hx1kCd-q0wE-7cVR-Yz3T-2Hsj-nWbD-0cWl9K"
+	seqno = 7
+	format = "lvm2"			# informational
+	status = ["RESIZEABLE", "READ", "WRITE"]
+	flags = []
+	extent_size = 8192		# 4 Megabytes
+	max_lv = 0
+	max_pv = 0
+	metadata_copies = 0
+
+	physical_volumes {
+
+		pv0 {
+			id = "5dVnGh-uJ2r-cX0P-Wq1b-Rk8L-MfYt-Ae3oQz"
+			device = "/dev/sdb"	# Hint only
+
+			status = ["ALLOCATABLE"]
+			flags = []
+			dev_size = 2097152	# 1024 Megabytes
+			pe_start = 2048
+			pe_count = 255	# 1020 Megabytes
+		}
+
+		pv1 {
+			id = "tP4mWs-Lk9e-Bn2Q-Zr7v-Hc1X-Dj6u-Yf0aEi"
+			device = "/dev/sdc"	# Hint only
+
+			status = ["ALLOCATABLE"]
+			flags = []
+			dev_size = 2097152	# 1024 Megabytes
+			pe_start = 2048
+			pe_count = 255	# 1020 Megabytes
+		}
+	}
+
+	logical_volumes {
+
+		root {
+			id = "K2fYcn-Pq8s-Lm3D-Vx0w-Tz5R-Bh7e-Ua9dJg"
+			status = ["READ", "WRITE", "VISIBLE"]
+			flags = []
+			creation_time = 1792140000	# 2026-10-16 07:40:00 +0000
+			creation_host = "host"
+			segment_count = 1
+
+			segment1 {
+				start_extent = 0
+				extent_count = 25	# 100 Megabytes
+
+				type = "striped"
+				stripe_count = 1	# linear
+
+				stripes = [
+					"pv0", 0
+				]
+			}
+		}
+
+		home {
+			id = "Wm0sXe-Ry4c-Gk7N-Hp2q-Zd8v-Lb1t-Oa5fQx"
+			status = ["READ", "WRITE", "VISIBLE"]
+			flags = []
+			creation_time = 1792140100	# 2026-10-16 07:41:40 +0000
+			creation_host = "host"
+			segment_count = 2
+
+			segment1 {
+				start_extent = 0
+				extent_count = 50	# 200 Megabytes
+
+				type = "striped"
+				stripe_count = 1	# linear
+
+				stripes = [
+					"pv0", 25
+				]
+			}
+			segment2 {
+				start_extent = 50
+				extent_count = 10	# 40 Megabytes
+
+				type = "striped"
+				stripe_count = 1	# linear
+
+				stripes = [
+					"pv0", 100
+				]
+			}
+		}
+	}
+
+}
+)";
+
+const std::string PV0 = "5dVnGh-uJ2r-cX0P-Wq1b-Rk8L-MfYt-Ae3oQz";
+const std::string PV1 = "tP4mWs-Lk9e-Bn2Q-Zr7v-Hc1X-Dj6u-Yf0aEi";
+
+std::string replaced(std::string text, const std::string& from, const std::string& to) {
+    auto pos = text.find(from);
+    if (pos == std::string::npos) {
+        throw std::logic_error("test input lacks " + from);
+    }
+    return text.replace(pos, from.size(), to);
+}
+
+void test_relocate_segment_text() {
+    blocks::ExtentRange segment2{"vg0", "home", 50, 10, "/dev/sdb", 100};
+    std::string expected = replaced(replaced(VGCFG, "\tseqno = 7", "\tseqno = 8"),
+                                    "\t\t\t\t\t\"pv0\", 100", "\t\t\t\t\t\"pv1\", 3");
+    check(blocks::relocate_segment_text(VGCFG, segment2, PV0, PV1, 3) == expected,
+          "second segment of home moves to pv1, seqno bumped, nothing else changes");
+
+    blocks::ExtentRange root{"vg0", "root", 0, 25, "/dev/sdb", 0};
+    expected = replaced(replaced(VGCFG, "\tseqno = 7", "\tseqno = 8"),
+                        "\t\t\t\t\t\"pv0\", 0\n", "\t\t\t\t\t\"pv1\", 0\n");
+    check(blocks::relocate_segment_text(VGCFG, root, PV0, PV1, 0) == expected,
+          "root moves to pv1 without touching home's stripes");
+
+    blocks::ExtentRange wrong_pe{"vg0", "home", 50, 10, "/dev/sdb", 99};
+    check_throws([&] { blocks::relocate_segment_text(VGCFG, wrong_pe, PV0, PV1, 3); },
+                 "a segment that isn't where the caller thinks");
+    blocks::ExtentRange partial{"vg0", "home", 0, 20, "/dev/sdb", 25};
+    check_throws([&] { blocks::relocate_segment_text(VGCFG, partial, PV0, PV1, 3); },
+                 "part of a segment");
+    blocks::ExtentRange missing{"vg0", "var", 0, 10, "/dev/sdb", 0};
+    check_throws([&] { blocks::relocate_segment_text(VGCFG, missing, PV0, PV1, 3); }, "an unknown LV");
+    check_throws([&] { blocks::relocate_segment_text(VGCFG, segment2, PV0, "no-such-pv", 3); },
+                 "a PV outside the VG");
+}
+
+void test_splice_table() {
+    // dmsetup table of home: 200MiB then 40MiB, in sectors
+    const std::string table = "0 409600 linear 8:16 206848\n"
+                              "409600 81920 linear 8:16 821248\n";
+    const std::string raid = "linear /dev/mapper/migrate-1 0";
+
+    check(blocks::splice_table(table, 409600, 81920, raid) ==
+                  "0 409600 linear 8:16 206848\n"
+                  "409600 81920 " + raid + "\n",
+          "a whole line is replaced");
+    check(blocks::splice_table(table, 0, 409600, raid) ==
+                  "0 409600 " + raid + "\n"
+                  "409600 81920 linear 8:16 821248\n",
+          "the first line is replaced, the second kept");
+    check(blocks::splice_table(table, 8192, 16384, raid) ==
+                  "0 8192 linear 8:16 206848\n"
+                  "8192 16384 " + raid + "\n"
+                  "24576 385024 linear 8:16 231424\n"
+                  "409600 81920 linear 8:16 821248\n",
+          "the middle of a line, with the offset of the rest moved along");
+    check_throws([&] { blocks::splice_table(table, 409000, 8192, raid); }, "a range across two lines");
+    check_throws([&] { blocks::splice_table("0 409600 striped 2 128 8:16 0 8:32 0\n", 0, 8192, raid); },
+                 "a range that isn't linear");
+}
+
+} // namespace
+
+int main() {
+    test_relocate_segment_text();
+    test_splice_table();
+    if (failures) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
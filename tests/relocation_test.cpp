@@ -0,0 +1,135 @@
+// copy_range moves overlapping ranges of one device in waves, from the end
+// when shifting up and from the start when shifting down; a wave in the
+// wrong order overwrites source data before it is read. Check every
+// method and a few thread counts against memmove on a temporary image.
+
+#include "relocation.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+class QuietProgress : public blocks::ProgressListener {
+public:
+    void notify(const std::string&) override {}
+    void bail(const std::string& msg, const std::exception&) override {
+        throw std::runtime_error(msg);
+    }
+};
+
+constexpr uint64_t IMAGE_SIZE = 4 * 1024 * 1024;
+
+// Distinct contents at every offset, so a chunk in the wrong place shows
+std::vector<char> pattern() {
+    std::vector<char> data(IMAGE_SIZE);
+    uint32_t state = 0x12345678;
+    for (auto& byte : data) {
+        state = state * 1664525 + 1013904223;
+        byte = static_cast<char>(state >> 24);
+    }
+    return data;
+}
+
+void write_image(const std::string& path, const std::vector<char>& data) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0 || pwrite(fd, data.data(), data.size(), 0) != static_cast<ssize_t>(data.size())) {
+        throw std::runtime_error("Failed to write " + path);
+    }
+    close(fd);
+}
+
+std::vector<char> read_image(const std::string& path) {
+    std::vector<char> data(IMAGE_SIZE);
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || pread(fd, data.data(), data.size(), 0) != static_cast<ssize_t>(data.size())) {
+        throw std::runtime_error("Failed to read " + path);
+    }
+    close(fd);
+    return data;
+}
+
+void test_overlapping_moves(const std::string& image) {
+    const std::vector<char> original = pattern();
+    // Shifts below the length, chunk-aligned and not, a few
+    // sectors up to most of the range
+    const uint64_t shifts[] = {4096, 65536, 70001, 1024 * 1024 + 512, 3 * 512 * 1024 + 4096};
+    const uint64_t len = 2 * 1024 * 1024;
+    const uint64_t base = 12288;
+
+    for (blocks::CopyMethod method :
+         {blocks::CopyMethod::CopyFileRange, blocks::CopyMethod::Splice, blocks::CopyMethod::Buffered}) {
+        for (unsigned threads : {1u, 3u, 8u}) {
+            for (uint64_t shift : shifts) {
+                for (bool up : {true, false}) {
+                    uint64_t src = up ? base : base + shift;
+                    uint64_t dst = up ? base + shift : base;
+                    std::string what = std::string(blocks::copy_method_name(method)) + ", " +
+                                       std::to_string(threads) + " threads, " + (up ? "up" : "down") + " by " +
+                                       std::to_string(shift);
+
+                    write_image(image, original);
+                    std::vector<char> expected = original;
+                    std::memmove(expected.data() + dst, expected.data() + src, len);
+
+                    blocks::CopyOptions options;
+                    options.method = method;
+                    options.threads = threads;
+                    options.chunk_size = 64 * 1024;
+                    QuietProgress progress;
+                    try {
+                        blocks::copy_range(image, src, image, dst, len, options, progress);
+                    } catch (const std::exception& e) {
+                        // Not every filesystem under the temp dir has
+                        // every method; what a method copies must be right
+                        if (std::string(e.what()).find("doesn't work") != std::string::npos) {
+                            std::cerr << "skipped " << what << ": " << e.what() << std::endl;
+                            goto next_method;
+                        }
+                        check(false, what + ": " + e.what());
+                        continue;
+                    }
+                    check(read_image(image) == expected, what);
+                }
+            }
+        }
+    next_method:;
+    }
+}
+
+} // namespace
+
+int main() {
+    char dir[] = "/tmp/relocation_test.XXXXXX";
+    if (!mkdtemp(dir)) {
+        std::cerr << "Failed to create a temporary directory" << std::endl;
+        return 1;
+    }
+    std::string image = std::string(dir) + "/image";
+    try {
+        test_overlapping_moves(image);
+    } catch (const std::exception& e) {
+        check(false, e.what());
+    }
+    std::filesystem::remove_all(dir);
+    if (failures) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
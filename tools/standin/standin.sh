@@ -0,0 +1,85 @@
+# Shared by the stand-in tools; sourced, not run.
+#
+# The stand-ins emulate the part of each tool's behaviour blocks relies
+# on, against image files, deterministically and without root. Every
+# call is appended to $BLOCKS_STANDIN_LOG when it is set, one line per
+# process, so a run's process count is `wc -l` of that file. State that
+# real tools keep in the kernel (dm tables, loop devices) lives under
+# $BLOCKS_STANDIN_STATE, by default <dev root>/.standin.
+
+standin_name=$(basename "$0")
+dev_root=${BLOCKS_DEV_ROOT:-/dev}
+state_dir=${BLOCKS_STANDIN_STATE:-$dev_root/.standin}
+
+if [ -n "$BLOCKS_STANDIN_LOG" ]; then
+    printf '%s %s\n' "$standin_name" "$*" >> "$BLOCKS_STANDIN_LOG"
+fi
+
+die() {
+    echo "$standin_name: $*" >&2
+    exit 1
+}
+
+# Hex digits of LEN bytes at OFFSET
+read_hex() {
+    od -An -tx1 -v -j "$2" -N "$3" "$1" 2>/dev/null | tr -d ' \n'
+}
+
+# LEN bytes at OFFSET as text, NULs dropped
+read_str() {
+    dd if="$1" bs=1 skip="$2" count="$3" 2>/dev/null | tr -d '\000'
+}
+
+read_le32() {
+    h=$(read_hex "$1" "$2" 4)
+    [ ${#h} -eq 8 ] || { echo 0; return; }
+    echo $((0x$(echo "$h" | sed 's/\(..\)\(..\)\(..\)\(..\)/\4\3\2\1/')))
+}
+
+read_be32() {
+    h=$(read_hex "$1" "$2" 4)
+    [ ${#h} -eq 8 ] || { echo 0; return; }
+    echo $((0x$h))
+}
+
+read_le64() {
+    h=$(read_hex "$1" "$2" 8)
+    [ ${#h} -eq 16 ] || { echo 0; return; }
+    echo $((0x$(echo "$h" | sed 's/\(..\)\(..\)\(..\)\(..\)\(..\)\(..\)\(..\)\(..\)/\8\7\6\5\4\3\2\1/')))
+}
+
+# Writes VALUE as 8 little-endian bytes at OFFSET
+write_le64() {
+    v=$3
+    bytes=""
+    i=0
+    while [ $i -lt 8 ]; do
+        bytes="$bytes\\$(printf '%03o' $((v & 255)))"
+        v=$((v >> 8))
+        i=$((i + 1))
+    done
+    printf "$bytes" | dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null
+}
+
+# Writes hex digits as bytes at OFFSET (octal escapes, dash's printf
+# has no \x)
+write_hex() {
+    bytes=""
+    for pair in $(echo "$3" | sed 's/\(..\)/\1 /g'); do
+        bytes="$bytes\\$(printf '%03o' $((0x$pair)))"
+    done
+    printf "$bytes" | dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null
+}
+
+format_uuid() {
+    echo "$1" | sed 's/^\(........\)\(....\)\(....\)\(....\)\(............\)$/\1-\2-\3-\4-\5/'
+}
+
+file_size() {
+    wc -c < "$1" | tr -d ' '
+}
+
+# Device-mapper names may be given as a name, /dev/mapper/NAME or /dev/dm-N
+dm_name() {
+    basename "$1"
+}
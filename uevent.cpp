@@ -0,0 +1,223 @@
+#include "uevent.h"
+#include "log.h"
+#include <linux/netlink.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <cstring>
+#include <vector>
+
+namespace blocks {
+
+namespace {
+
+// The kernel's multicast group; udevd rebroadcasts on group 2
+constexpr uint32_t UEVENT_KERNEL_GROUP = 1;
+constexpr int UEVENT_RCVBUF = 4 * 1024 * 1024;
+// UEVENT_BUFFER_SIZE in the kernel is 2048
+constexpr size_t UEVENT_MAX_SIZE = 8192;
+
+} // namespace
+
+std::optional<Uevent> parse_uevent(const char* buf, size_t len) {
+    const char* end = buf + len;
+    const char* header_end = static_cast<const char*>(std::memchr(buf, '\0', len));
+    if (!header_end) {
+        return std::nullopt;
+    }
+    std::string header(buf, header_end);
+    size_t at = header.find('@');
+    if (at == std::string::npos || at == 0) {
+        return std::nullopt;
+    }
+
+    Uevent event;
+    unsigned int maj = 0, min = 0;
+    bool has_major = false, has_minor = false;
+
+    for (const char* p = header_end + 1; p < end;) {
+        const char* next = static_cast<const char*>(std::memchr(p, '\0', end - p));
+        if (!next) {
+            next = end;
+        }
+        std::string entry(p, next);
+        p = next + 1;
+
+        size_t eq = entry.find('=');
+        if (eq == std::string::npos) {
+            continue;
+        }
+        std::string key = entry.substr(0, eq);
+        std::string value = entry.substr(eq + 1);
+
+        if (key == "ACTION") {
+            event.action = value;
+        } else if (key == "DEVPATH") {
+            event.devpath = value;
+        } else if (key == "SUBSYSTEM") {
+            event.subsystem = value;
+        } else if (key == "DEVNAME") {
+            event.devname = value;
+        } else if (key == "DEVTYPE") {
+            event.devtype = value;
+        } else if (key == "SEQNUM") {
+            event.seqnum = std::strtoull(value.c_str(), nullptr, 10);
+        } else if (key == "MAJOR") {
+            maj = std::strtoul(value.c_str(), nullptr, 10);
+            has_major = true;
+        } else if (key == "MINOR") {
+            min = std::strtoul(value.c_str(), nullptr, 10);
+            has_minor = true;
+        } else {
+            event.env[key] = value;
+        }
+    }
+
+    // The header repeats ACTION and DEVPATH
+    if (event.action.empty()) {
+        event.action = header.substr(0, at);
+    }
+    if (event.devpath.empty()) {
+        event.devpath = header.substr(at + 1);
+    }
+    if (has_major && has_minor) {
+        event.dev = makedev(maj, min);
+    }
+    return event;
+}
+
+UeventListener::UeventListener() {
+    sock = ::socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (sock < 0) {
+        throw std::runtime_error(std::string("Failed to open the uevent socket: ") + std::strerror(errno));
+    }
+
+    // Bursts (a whole disk's partitions, an LVM activation) can be large
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &UEVENT_RCVBUF, sizeof(UEVENT_RCVBUF)) != 0) {
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &UEVENT_RCVBUF, sizeof(UEVENT_RCVBUF));
+    }
+
+    sockaddr_nl addr = {};
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = UEVENT_KERNEL_GROUP;
+    if (::bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        int err = errno;
+        close(sock);
+        throw std::runtime_error(std::string("Failed to bind the uevent socket: ") + std::strerror(err));
+    }
+
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd < 0) {
+        int err = errno;
+        close(sock);
+        throw std::runtime_error(std::string("eventfd failed: ") + std::strerror(err));
+    }
+}
+
+UeventListener::~UeventListener() {
+    stop();
+    close(wake_fd);
+    close(sock);
+}
+
+int UeventListener::subscribe(Callback callback) {
+    std::lock_guard<std::mutex> guard(lock);
+    int id = next_id++;
+    subscribers[id] = std::move(callback);
+    return id;
+}
+
+void UeventListener::unsubscribe(int id) {
+    std::lock_guard<std::mutex> guard(lock);
+    subscribers.erase(id);
+}
+
+void UeventListener::start() {
+    if (running.exchange(true)) {
+        return;
+    }
+    thread = std::thread([this] {
+        pollfd fds[2] = {{sock, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+        while (running) {
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                log_error() << "uevent poll failed: " << std::strerror(errno);
+                break;
+            }
+            if (fds[1].revents) {
+                break;
+            }
+            dispatch_pending();
+        }
+    });
+}
+
+void UeventListener::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    uint64_t one = 1;
+    if (::write(wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        log_error() << "Failed to wake the uevent thread";
+    }
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void UeventListener::dispatch_pending() {
+    while (receive_one()) {
+    }
+}
+
+bool UeventListener::receive_one() {
+    std::vector<char> buf(UEVENT_MAX_SIZE);
+    sockaddr_nl src = {};
+    iovec iov = {buf.data(), buf.size()};
+    msghdr msg = {};
+    msg.msg_name = &src;
+    msg.msg_namelen = sizeof(src);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    ssize_t len = recvmsg(sock, &msg, 0);
+    if (len < 0) {
+        if (errno == ENOBUFS) {
+            Uevent overflow;
+            overflow.overflow = true;
+            dispatch(overflow);
+            return true;
+        }
+        if (errno == EINTR) {
+            return true;
+        }
+        // EAGAIN: nothing queued
+        return false;
+    }
+
+    // Only the kernel speaks on group 1, but anyone may unicast to us
+    if (src.nl_pid != 0 || (msg.msg_flags & MSG_TRUNC)) {
+        return true;
+    }
+    if (auto event = parse_uevent(buf.data(), len)) {
+        dispatch(*event);
+    }
+    return true;
+}
+
+void UeventListener::dispatch(const Uevent& event) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto& [id, callback] : subscribers) {
+        try {
+            callback(event);
+        } catch (const std::exception& e) {
+            log_error() << "uevent subscriber failed: " << e.what();
+        }
+    }
+}
+
+} // namespace blocks
@@ -0,0 +1,83 @@
+#ifndef UEVENT_H
+#define UEVENT_H
+
+#include "blocks_types.h"
+#include <sys/types.h>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+namespace blocks {
+
+// A kernel uevent, as broadcast on NETLINK_KOBJECT_UEVENT
+struct Uevent {
+    std::string action;     // add, remove, change, move, online, offline, bind, unbind
+    std::string devpath;    // Under /sys
+    std::string subsystem;
+    std::string devname;    // Kernel name, e.g. sda1 or dm-3
+    std::string devtype;    // disk or partition, for block devices
+    dev_t dev = 0;
+    uint64_t seqnum = 0;
+    std::map<std::string, std::string> env;
+
+    // Events were dropped (the socket buffer overflowed); everything
+    // derived from device state has to be considered stale
+    bool overflow = false;
+
+    bool is_block() const { return subsystem == "block"; }
+    // Capacity changed, sent by set_capacity_and_notify
+    bool is_resize() const { return action == "change" && env.count("RESIZE") && env.at("RESIZE") == "1"; }
+    bool is_dm() const { return env.count("DM_NAME") || devname.rfind("dm-", 0) == 0; }
+};
+
+// Parse "ACTION@DEVPATH\0KEY=VALUE\0..."; nullopt for anything else,
+// such as the libudev-formatted messages udevd rebroadcasts
+std::optional<Uevent> parse_uevent(const char* buf, size_t len);
+
+// Listens for kernel uevents without libudev and hands them to
+// subscribers, from a background thread or from dispatch_pending().
+class UeventListener {
+public:
+    using Callback = std::function<void(const Uevent&)>;
+
+    UeventListener();
+    ~UeventListener();
+
+    int subscribe(Callback callback);
+    void unsubscribe(int id);
+
+    // Dispatch from a background thread until stop()
+    void start();
+    void stop();
+
+    // Dispatch whatever is queued without blocking, for single-threaded callers
+    void dispatch_pending();
+
+    int fd() const { return sock; }
+
+    UeventListener(const UeventListener&) = delete;
+    UeventListener& operator=(const UeventListener&) = delete;
+
+private:
+    // false when nothing was queued
+    bool receive_one();
+    void dispatch(const Uevent& event);
+
+    int sock = -1;
+    int wake_fd = -1;
+    std::thread thread;
+    std::atomic<bool> running{false};
+
+    std::mutex lock;
+    std::map<int, Callback> subscribers;
+    int next_id = 0;
+};
+
+} // namespace blocks
+
+#endif // UEVENT_H
@@ -0,0 +1,107 @@
+#include "uuid_index.h"
+#include "block_device.h"
+#include "layer_types.h"
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+
+namespace blocks {
+
+namespace {
+
+std::string normalize_uuid(std::string uuid) {
+    std::transform(uuid.begin(), uuid.end(), uuid.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    return uuid;
+}
+
+bool has_sectors(const std::filesystem::path& sysdir) {
+    // Empty drives and unattached loop devices can't be read
+    std::ifstream size_file(sysdir / "size");
+    uint64_t sectors = 0;
+    return size_file >> sectors && sectors > 0;
+}
+
+} // namespace
+
+UuidIndex& UuidIndex::instance() {
+    static UuidIndex index;
+    return index;
+}
+
+std::optional<FsIdentity> UuidIndex::identity(BlockDevice& device) {
+    return decode_identity(*device.probe_window());
+}
+
+std::optional<std::string> UuidIndex::find(const std::string& uuid) {
+    std::string key = normalize_uuid(uuid);
+    if (auto devpath = find_by_symlink(key)) {
+        return devpath;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    bool fresh = !built;
+    if (fresh) {
+        build();
+    }
+    auto it = devices.find(key);
+    if (it == devices.end() && !fresh) {
+        // Devices may have appeared since the index was built
+        build();
+        it = devices.find(key);
+    }
+    if (it == devices.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+void UuidIndex::invalidate() {
+    std::lock_guard<std::mutex> guard(lock);
+    built = false;
+    devices.clear();
+}
+
+std::optional<std::string> UuidIndex::find_by_symlink(const std::string& uuid) {
+    std::error_code ec;
+    auto target = std::filesystem::canonical(dev_path("disk/by-uuid/" + uuid), ec);
+    if (ec) {
+        return std::nullopt;
+    }
+
+    // udev may lag behind a mkfs, or be gone altogether
+    try {
+        BlockDevice device(target.string());
+        auto id = identity(device);
+        if (id && id->uuid == uuid) {
+            return target.string();
+        }
+    } catch (const std::exception&) {
+    }
+    return std::nullopt;
+}
+
+void UuidIndex::build() {
+    devices.clear();
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(sys_path("class/block"), ec)) {
+        std::string devpath = dev_path(entry.path().filename().string());
+        if (!has_sectors(entry.path()) || !std::filesystem::exists(devpath)) {
+            continue;
+        }
+        try {
+            BlockDevice device(devpath);
+            auto id = identity(device);
+            // Duplicates (snapshots, clones) resolve to the first one seen
+            if (id && !id->uuid.empty()) {
+                devices.emplace(id->uuid, devpath);
+            }
+        } catch (const std::exception&) {
+            // Unreadable, e.g. a read-only medium that went away
+        }
+    }
+    built = true;
+}
+
+} // namespace blocks
@@ -0,0 +1,49 @@
+#ifndef UUID_INDEX_H
+#define UUID_INDEX_H
+
+#include "blocks_types.h"
+#include "superblock.h"
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+namespace blocks {
+
+class BlockDevice;
+
+// UUID to device, from the in-process superblock decoders rather than
+// blkid. /dev/disk/by-uuid is tried first when udev maintains it, and
+// only trusted once the device's own superblock agrees. Otherwise every
+// block device's probe window is read once and indexed, and later
+// lookups are map hits.
+class UuidIndex {
+public:
+    static UuidIndex& instance();
+
+    // Device path carrying that filesystem, swap or LUKS uuid
+    std::optional<std::string> find(const std::string& uuid);
+
+    // nullopt when none of the decoders recognise the device
+    std::optional<FsIdentity> identity(BlockDevice& device);
+
+    // After devices come, go or get reformatted
+    void invalidate();
+
+    UuidIndex(const UuidIndex&) = delete;
+    UuidIndex& operator=(const UuidIndex&) = delete;
+
+private:
+    UuidIndex() = default;
+
+    std::optional<std::string> find_by_symlink(const std::string& uuid);
+    void build();
+
+    std::mutex lock;
+    bool built = false;
+    std::unordered_map<std::string, std::string> devices;  // uuid -> devpath
+};
+
+} // namespace blocks
+
+#endif // UUID_INDEX_H